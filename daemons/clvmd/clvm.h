@@ -24,6 +24,11 @@
 
 #include "configure.h"
 
+/* Sent around the cluster in CLVMD_CMD_VERSION */
+#define CLVMD_MAJOR_VERSION 0
+#define CLVMD_MINOR_VERSION 2
+#define CLVMD_PATCH_VERSION 1
+
 struct clvm_header {
 	uint8_t  cmd;	        /* See below */
 	uint8_t  flags;	        /* See below */
@@ -46,6 +51,9 @@ struct clvm_header {
 #define CLVMD_FLAG_LOCAL        1	/* Only do this on the local node */
 #define CLVMD_FLAG_SYSTEMLV     2	/* Data in system LV under my node name */
 #define CLVMD_FLAG_NODEERRS     4       /* Reply has errors in node-specific portion */
+#define CLVMD_FLAG_LEASE        8	/* LOCK_QUERY: tell the asking node when
+					   the answer changes (see lock-cache.h).
+					   Set on a reply if the node will. */
 
 /* Name of the local socket to communicate between lvm and clvmd */
 static const char CLVMD_SOCKNAME[]= DEFAULT_RUN_DIR "/clvmd.sock";
@@ -56,6 +64,9 @@ static const char CLVMD_SOCKNAME[]= DEFAULT_RUN_DIR "/clvmd.sock";
 #define CLVMD_CMD_GOAWAY   3	/* Die if received this - we are running 
 				   an incompatible version */
 #define CLVMD_CMD_TEST     4	/* Just for mucking about */
+#define CLVMD_CMD_LOCK_CHANGED 5	/* The sender's lock on the resource
+					   in args changed since it last
+					   answered a LOCK_QUERY with a lease */
 
 #define CLVMD_CMD_LOCK              30
 #define CLVMD_CMD_UNLOCK            31
@@ -64,6 +75,14 @@ static const char CLVMD_SOCKNAME[]= DEFAULT_RUN_DIR "/clvmd.sock";
 #define CLVMD_CMD_LOCK_LV           50
 #define CLVMD_CMD_LOCK_VG           51
 #define CLVMD_CMD_LOCK_QUERY	    52
+#define CLVMD_CMD_LOCK_LVS	    53	/* Several LOCK_LV requests at once */
+
+/*
+ * LOCK_LVS arguments are LOCK_LV arguments (two flag bytes and the
+ * resource name) repeated, kept within the smallest cluster message.
+ * Each node replies with one decimal status per resource.
+ */
+#define CLVMD_MAX_LOCK_LVS_ARGS	    1024
 
 /* Misc functions */
 #define CLVMD_CMD_REFRESH	    40
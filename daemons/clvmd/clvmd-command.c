@@ -67,6 +67,20 @@ extern debug_t debug;
 extern struct cluster_ops *clops;
 static int restart_clvmd(void);
 
+/*
+ * LOCK_LVS carries LOCK_LV arguments back to back.  Return the length
+ * of the entry at args, or 0 at the end or if it is truncated.
+ */
+static int lock_lvs_entry_len(const char *args, int arglen)
+{
+	const char *nul;
+
+	if (arglen < 3 || !(nul = memchr(args + 2, 0, arglen - 2)))
+		return 0;
+
+	return nul - args + 1;
+}
+
 /* This is where all the real work happens:
    NOTE: client will be NULL when this is executed on a remote node */
 int do_command(struct local_client *client, struct clvm_header *msg, int msglen,
@@ -80,6 +94,7 @@ int do_command(struct local_client *client, struct clvm_header *msg, int msglen,
 	struct utsname nodeinfo;
 	unsigned char lock_cmd;
 	unsigned char lock_flags;
+	int len, lv_status;
 
 	/* Do the command */
 	switch (msg->cmd) {
@@ -127,6 +142,28 @@ int do_command(struct local_client *client, struct clvm_header *msg, int msglen,
 		}
 		break;
 
+	case CLVMD_CMD_LOCK_LVS:
+		/* One status per LV, a failure does not stop the rest */
+		*retlen = 0;
+		for (; (len = lock_lvs_entry_len(args, arglen));
+		     args += len, arglen -= len) {
+			lock_cmd = args[0] & (LCK_NONBLOCK | LCK_HOLD | LCK_SCOPE_MASK | LCK_TYPE_MASK);
+			lock_flags = args[1];
+			lockname = &args[2];
+			lv_status = do_lock_lv(lock_cmd, lock_flags, lockname);
+			if (*retlen + 16 > buflen) {
+				status = E2BIG;
+				break;
+			}
+			*retlen += dm_snprintf(*buf + *retlen, buflen - *retlen,
+					       "%s%d", *retlen ? " " : "",
+					       lv_status);
+		}
+		if (status || !*retlen)
+			break;
+		(*retlen)++;
+		return 0;
+
 	case CLVMD_CMD_LOCK_QUERY:
 		lockname = &args[2];
 		if (buflen < 3)
@@ -245,8 +282,11 @@ int do_pre_command(struct local_client *client)
 	unsigned char lock_cmd;
 	unsigned char lock_flags;
 	char *args = header->node + strlen(header->node) + 1;
+	int arglen = client->bits.localsock.cmd_len -
+		sizeof(struct clvm_header) - strlen(header->node);
 	int lockid;
 	int status = 0;
+	int len;
 	char *lockname;
 
 	switch (header->cmd) {
@@ -270,6 +310,16 @@ int do_pre_command(struct local_client *client)
 		status = pre_lock_lv(lock_cmd, lock_flags, lockname);
 		break;
 
+	case CLVMD_CMD_LOCK_LVS:
+		if (!lock_lvs_entry_len(args, arglen)) {
+			status = EINVAL;
+			break;
+		}
+		for (; !status && (len = lock_lvs_entry_len(args, arglen));
+		     args += len, arglen -= len)
+			status = pre_lock_lv(args[0], args[1], &args[2]);
+		break;
+
 	case CLVMD_CMD_REFRESH:
 	case CLVMD_CMD_GET_CLUSTERNAME:
 	case CLVMD_CMD_SET_DEBUG:
@@ -295,6 +345,11 @@ int do_post_command(struct local_client *client)
 	unsigned char lock_cmd;
 	unsigned char lock_flags;
 	char *args = header->node + strlen(header->node) + 1;
+	/* Not header->arglen: sending the command to the cluster
+	   byteswapped the header in place */
+	int arglen = client->bits.localsock.cmd_len -
+		sizeof(struct clvm_header) - strlen(header->node);
+	int len, lv_status;
 	char *lockname;
 
 	switch (header->cmd) {
@@ -316,6 +371,13 @@ int do_post_command(struct local_client *client)
 		lockname = &args[2];
 		status = post_lock_lv(lock_cmd, lock_flags, lockname);
 		break;
+
+	case CLVMD_CMD_LOCK_LVS:
+		for (; (len = lock_lvs_entry_len(args, arglen));
+		     args += len, arglen -= len)
+			if ((lv_status = post_lock_lv(args[0], args[1], &args[2])))
+				status = lv_status;
+		break;
 	}
 	return status;
 }
@@ -24,9 +24,12 @@
 #include "clvmd-comms.h"
 #include "clvm.h"
 #include "clvmd.h"
+#include "lock-cache.h"
+#include "locking.h"
 #include "lvm-functions.h"
 #include "lvm-version.h"
 #include "refresh_clvmd.h"
+#include "uuid.h"
 
 #ifdef HAVE_COROSYNC_CONFDB_H
 #include <corosync/confdb.h>
@@ -37,6 +40,7 @@
 #include <signal.h>
 #include <stddef.h>
 #include <syslog.h>
+#include <sys/epoll.h>
 #include <sys/un.h>
 #include <sys/utsname.h>
 
@@ -48,6 +52,8 @@
 #endif
 
 #define MAX_RETRIES 4
+#define MAX_EVENTS 64		/* fds handled per epoll_wait() */
+#define LVM_WORKERS 8		/* Threads running LVM commands */
 
 #define ISLOCAL_CSID(c) (memcmp(c, our_csid, max_csid_len) == 0)
 
@@ -55,6 +61,31 @@
    the cluster_socket details */
 static struct local_client local_client_head;
 
+/* Every fd on the list above is registered with epoll_fd and indexed
+   by fd in client_hash, so a reused fd is never mistaken for its
+   previous client */
+static int epoll_fd = -1;
+static struct dm_hash_table *client_hash;
+static int local_listening = 1;	/* Local sockets are in the epoll set */
+static int removed_clients;	/* Some clients are flagged removeme */
+
+/* Events returned by the current epoll_wait(), so that a client
+   removed while they are being dispatched is not touched again */
+static struct epoll_event *pending_events;
+static int num_pending_events;
+
+/* Requests out on other nodes, indexed by XID so that a reply goes
+   straight to its client.  Broadcasts are also kept in a heap ordered
+   by deadline, so the main loop sleeps until the next one expires
+   instead of rescanning every client.  Replies may complete a request
+   on an LVM worker, hence the lock. */
+static pthread_mutex_t request_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct dm_hash_table *request_hash;
+static struct local_client **timer_heap;
+static int timer_heap_len;
+static int timer_heap_size;
+static int request_timeout;	/* Seconds */
+
 static unsigned short global_xid = 0;	/* Last transaction ID issued */
 
 struct cluster_ops *clops = NULL;
@@ -81,12 +112,24 @@ struct lvm_startup_params {
 	char **argv;
 };
 
+/*
+ * LVM work is spread over several threads by resource name, so a slow
+ * command on one VG does not hold up lock traffic for the others.
+ * Work for one resource always goes to the same worker and so stays
+ * in order.  The workers share the LVM context, which lvm-functions.c
+ * serialises.
+ */
+struct lvm_worker {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct dm_list cmd_head;
+};
+
 debug_t debug;
-static pthread_t lvm_thread;
-static pthread_mutex_t lvm_thread_mutex;
-static pthread_cond_t lvm_thread_cond;
+static struct lvm_worker lvm_workers[LVM_WORKERS];
 static pthread_mutex_t lvm_start_mutex;
-static struct dm_list lvm_cmd_head;
+static pthread_mutex_t lvm_queued_mutex;	/* Protects client lvm_queued */
 static volatile sig_atomic_t quit = 0;
 static volatile sig_atomic_t reread_config = 0;
 static int child_pipe[2];
@@ -125,7 +168,9 @@ static int process_reply(const struct clvm_header *msg, int msglen,
 static int open_local_sock(void);
 static void close_local_sock(int local_socket);
 static int check_local_clvmd(void);
-static struct local_client *find_client(int clientid);
+static void untrack_request(struct local_client *client);
+static int watch_client(struct local_client *client);
+static void unwatch_client(struct local_client *client);
 static void main_loop(int local_sock, int cmd_timeout);
 static void be_daemon(int start_timeout);
 static int check_all_clvmds_running(struct local_client *client);
@@ -133,6 +178,9 @@ static int local_rendezvous_callback(struct local_client *thisfd, char *buf,
 				     int len, const char *csid,
 				     struct local_client **new_client);
 static void lvm_thread_fn(void *) __attribute__ ((noreturn));
+static void *lvm_worker_fn(void *) __attribute__ ((noreturn));
+static void lvm_worker_loop(struct lvm_worker *worker) __attribute__ ((noreturn));
+static void lvm_work_done(struct local_client *client);
 static int add_to_lvmqueue(struct local_client *client, struct clvm_header *msg,
 			   int msglen, const char *csid);
 static int distribute_command(struct local_client *thisfd);
@@ -243,6 +291,9 @@ static const char *decode_cmd(unsigned char cmdl)
 	case CLVMD_CMD_LOCK_LV:
 		command = "LOCK_LV";
 		break;
+	case CLVMD_CMD_LOCK_LVS:
+		command = "LOCK_LVS";
+		break;
 	case CLVMD_CMD_REFRESH:
 		command = "REFRESH";
 		break;
@@ -264,6 +315,9 @@ static const char *decode_cmd(unsigned char cmdl)
 	case CLVMD_CMD_GOAWAY:
 		command = "GOAWAY";
 		break;
+	case CLVMD_CMD_LOCK_CHANGED:
+		command = "LOCK_CHANGED";
+		break;
 	case CLVMD_CMD_LOCK:
 		command = "LOCK";
 		break;
@@ -324,6 +378,7 @@ int main(int argc, char *argv[])
 	int debug_opt = 0;
 	int clusterwide_opt = 0;
 	mode_t old_mask;
+	int i;
 
 	/* Deal with command-line arguments */
 	opterr = 0;
@@ -447,7 +502,8 @@ int main(int argc, char *argv[])
 
 	/* Set up signal handlers, USR1 is for cluster change notifications (in cman)
 	   USR2 causes child threads to exit.
-	   HUP causes gulm version to re-read nodes list from CCS.
+	   HUP causes gulm version to re-read nodes list from CCS, and
+	   logs lock statistics.
 	   PIPE should be ignored */
 	signal(SIGUSR2, sigusr2_handler);
 	signal(SIGHUP,  sighup_handler);
@@ -461,12 +517,25 @@ int main(int argc, char *argv[])
 	sigprocmask(SIG_BLOCK, &ss, NULL);
 
 	/* Initialise the LVM thread variables */
-	dm_list_init(&lvm_cmd_head);
-	pthread_mutex_init(&lvm_thread_mutex, NULL);
-	pthread_cond_init(&lvm_thread_cond, NULL);
+	for (i = 0; i < LVM_WORKERS; i++) {
+		dm_list_init(&lvm_workers[i].cmd_head);
+		pthread_mutex_init(&lvm_workers[i].mutex, NULL);
+		pthread_cond_init(&lvm_workers[i].cond, NULL);
+	}
 	pthread_mutex_init(&lvm_start_mutex, NULL);
+	pthread_mutex_init(&lvm_queued_mutex, NULL);
 	init_lvhash();
 
+	/* The cluster interface may add its fds while starting up */
+	if ((epoll_fd = epoll_create(MAX_EVENTS)) < 0 ||
+	    !(client_hash = dm_hash_create(128)) ||
+	    !(request_hash = dm_hash_create(128))) {
+		child_init_signal_and_exit(DFAIL_MALLOC);
+		/* NOTREACHED */
+	}
+	if (fcntl(epoll_fd, F_SETFD, 1))
+		DEBUGLOG("setting CLOEXEC on epoll fd failed: %s\n", strerror(errno));
+
 	/* Start the cluster interface */
 	if (cluster_iface == IF_AUTO)
 		cluster_iface = get_cluster_type();
@@ -528,11 +597,16 @@ int main(int argc, char *argv[])
 	/* Save our CSID */
 	uname(&nodeinfo);
 	clops->get_our_csid(our_csid);
+	init_lock_cache(max_csid_len);
 
 	/* Initialise the FD list head */
 	local_client_head.fd = clops->get_main_cluster_fd();
 	local_client_head.type = CLUSTER_MAIN_SOCK;
 	local_client_head.callback = clops->cluster_fd_callback;
+	if (watch_client(&local_client_head)) {
+		child_init_signal_and_exit(DFAIL_INIT);
+		/* NOTREACHED */
+	}
 
 	/* Add the local socket to the list */
 	newfd = malloc(sizeof(struct local_client));
@@ -545,8 +619,10 @@ int main(int argc, char *argv[])
 	newfd->removeme = 0;
 	newfd->type = LOCAL_RENDEZVOUS;
 	newfd->callback = local_rendezvous_callback;
-	newfd->next = local_client_head.next;
-	local_client_head.next = newfd;
+	if (add_client(newfd)) {
+		child_init_signal_and_exit(DFAIL_INIT);
+		/* NOTREACHED */
+	}
 
 	/* This needs to be started after cluster initialisation
 	   as it may need to take out locks */
@@ -556,8 +632,11 @@ int main(int argc, char *argv[])
 	pthread_mutex_lock(&lvm_start_mutex);
 	lvm_params.using_gulm = using_gulm;
 	lvm_params.argv = argv;
-	pthread_create(&lvm_thread, NULL, (lvm_pthread_fn_t*)lvm_thread_fn,
-			(void *)&lvm_params);
+	pthread_create(&lvm_workers[0].thread, NULL,
+		       (lvm_pthread_fn_t*)lvm_thread_fn, (void *)&lvm_params);
+	for (i = 1; i < LVM_WORKERS; i++)
+		pthread_create(&lvm_workers[i].thread, NULL, lvm_worker_fn,
+			       &lvm_workers[i]);
 
 	/* Tell the rest of the cluster our version number */
 	/* CMAN can do this immediately, gulm needs to wait until
@@ -578,6 +657,7 @@ int main(int argc, char *argv[])
 
 	close_local_sock(local_sock);
 	destroy_lvm();
+	destroy_lock_cache();
 
 	return 0;
 }
@@ -633,6 +713,7 @@ static int local_rendezvous_callback(struct local_client *thisfd, char *buf,
 		newfd->bits.localsock.cmd = NULL;
 		newfd->bits.localsock.in_progress = FALSE;
 		newfd->bits.localsock.sent_out = FALSE;
+		newfd->bits.localsock.timer = -1;
 		newfd->bits.localsock.threadid = 0;
 		newfd->bits.localsock.finished = 0;
 		newfd->bits.localsock.pipe_client = NULL;
@@ -668,7 +749,9 @@ static int local_pipe_callback(struct local_client *thisfd, char *buf,
 	if (len <= 0) {
 		int jstat;
 		void *ret = &status;
-		close(thisfd->fd);
+
+		unwatch_client(thisfd);
+		safe_close(&(thisfd->fd));
 
 		/* Clear out the cross-link */
 		if (thisfd->bits.pipe.client != NULL)
@@ -771,10 +854,302 @@ static void request_timed_out(struct local_client *client)
 	}
 }
 
+/* Local sockets are only in the epoll set while the cluster is quorate */
+static int is_listening(struct local_client *client)
+{
+	return local_listening ||
+		(client->type != LOCAL_RENDEZVOUS && client->type != LOCAL_SOCK);
+}
+
+/* Register a client's fd with epoll and index it in client_hash */
+static int watch_client(struct local_client *client)
+{
+	struct epoll_event ev;
+
+	if (!dm_hash_insert_binary(client_hash, (const char *) &client->fd,
+				   sizeof(client->fd), client)) {
+		log_error("Unable to index fd %d\n", client->fd);
+		return -1;
+	}
+
+	if (!is_listening(client))
+		return 0;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = client;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->fd, &ev)) {
+		log_error("Unable to watch fd %d: %s\n", client->fd,
+			  strerror(errno));
+		dm_hash_remove_binary(client_hash, (const char *) &client->fd,
+				      sizeof(client->fd));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Must be called before the client's fd is closed */
+static void unwatch_client(struct local_client *client)
+{
+	int i;
+
+	/* The fd may already have been reused by a newer client */
+	if (client->fd < 0 ||
+	    dm_hash_lookup_binary(client_hash, (const char *) &client->fd,
+				  sizeof(client->fd)) != client)
+		return;
+
+	if (is_listening(client) &&
+	    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, NULL) &&
+	    errno != EBADF && errno != ENOENT)
+		DEBUGLOG("Unable to unwatch fd %d: %s\n", client->fd,
+			 strerror(errno));
+
+	dm_hash_remove_binary(client_hash, (const char *) &client->fd,
+			      sizeof(client->fd));
+
+	for (i = 0; i < num_pending_events; i++)
+		if (pending_events[i].data.ptr == client)
+			pending_events[i].data.ptr = NULL;
+}
+
+/* if the cluster is not quorate then don't listen for new requests */
+static void set_local_listening(int listening)
+{
+	struct local_client *thisfd;
+	struct epoll_event ev;
+
+	DEBUGLOG("%s listening on local sockets\n",
+		 listening ? "Resuming" : "Suspending");
+
+	for (thisfd = local_client_head.next; thisfd; thisfd = thisfd->next) {
+		if (thisfd->removeme ||
+		    (thisfd->type != LOCAL_RENDEZVOUS &&
+		     thisfd->type != LOCAL_SOCK))
+			continue;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = thisfd;
+		if (epoll_ctl(epoll_fd, listening ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+			      thisfd->fd, &ev))
+			DEBUGLOG("Unable to %s fd %d: %s\n",
+				 listening ? "watch" : "unwatch", thisfd->fd,
+				 strerror(errno));
+	}
+
+	local_listening = listening;
+}
+
+/* Flag a client for removal by the main loop, which unlinks it and
+   queues its cleanup.  The caller may close the fd after this. */
+void remove_client(struct local_client *client)
+{
+	unwatch_client(client);
+	client->removeme = 1;
+	removed_clients = 1;
+}
+
+static void sweep_removed_clients(void)
+{
+	struct local_client *lastfd = &local_client_head;
+	struct local_client *free_fd;
+
+	removed_clients = 0;
+	while ((free_fd = lastfd->next)) {
+		if (!free_fd->removeme) {
+			lastfd = free_fd;
+			continue;
+		}
+
+		DEBUGLOG("removeme set for fd %d\n", free_fd->fd);
+		lastfd->next = free_fd->next;
+
+		if (free_fd->type == LOCAL_SOCK)
+			untrack_request(free_fd);
+
+		/* Queue cleanup, this also frees the client struct */
+		add_to_lvmqueue(free_fd, NULL, 0, NULL);
+	}
+}
+
+static int64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Timer heap helpers, called with request_mutex held */
+static void timer_set(int i, struct local_client *client)
+{
+	timer_heap[i] = client;
+	client->bits.localsock.timer = i;
+}
+
+static void timer_sift(int i)
+{
+	struct local_client *client = timer_heap[i];
+	int64_t deadline = client->bits.localsock.deadline;
+	int child;
+
+	while (i && timer_heap[(i - 1) / 2]->bits.localsock.deadline > deadline) {
+		timer_set(i, timer_heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+
+	while ((child = 2 * i + 1) < timer_heap_len) {
+		if (child + 1 < timer_heap_len &&
+		    timer_heap[child + 1]->bits.localsock.deadline <
+		    timer_heap[child]->bits.localsock.deadline)
+			child++;
+		if (timer_heap[child]->bits.localsock.deadline >= deadline)
+			break;
+		timer_set(i, timer_heap[child]);
+		i = child;
+	}
+
+	timer_set(i, client);
+}
+
+static int timer_add(struct local_client *client)
+{
+	struct local_client **heap;
+	int size;
+
+	if (timer_heap_len == timer_heap_size) {
+		size = timer_heap_size ? timer_heap_size * 2 : 64;
+		if (!(heap = realloc(timer_heap, size * sizeof(*heap))))
+			return 0;
+		timer_heap = heap;
+		timer_heap_size = size;
+	}
+
+	timer_set(timer_heap_len++, client);
+	timer_sift(timer_heap_len - 1);
+
+	return 1;
+}
+
+static void timer_del(struct local_client *client)
+{
+	int i = client->bits.localsock.timer;
+
+	if (i < 0)
+		return;
+
+	client->bits.localsock.timer = -1;
+	if (i != --timer_heap_len) {
+		timer_set(i, timer_heap[timer_heap_len]);
+		timer_sift(i);
+	}
+}
+
+/* Index a request sent to other nodes by its XID, and if timed start
+   the clock on its replies */
+static void track_request(struct local_client *client, int timed)
+{
+	pthread_mutex_lock(&request_mutex);
+
+	if (!dm_hash_insert_binary(request_hash, (const char *) &client->xid,
+				   sizeof(client->xid), client))
+		log_error("Unable to track request %d: replies will be lost",
+			  client->xid);
+
+	timer_del(client);
+	if (timed) {
+		client->bits.localsock.deadline = now_ms() +
+			(int64_t) request_timeout * 1000;
+		if (!timer_add(client))
+			log_error("Unable to time request %d", client->xid);
+	}
+
+	pthread_mutex_unlock(&request_mutex);
+}
+
+/* The request is complete or abandoned: drop later replies */
+static void untrack_request(struct local_client *client)
+{
+	pthread_mutex_lock(&request_mutex);
+
+	if (dm_hash_lookup_binary(request_hash, (const char *) &client->xid,
+				  sizeof(client->xid)) == client)
+		dm_hash_remove_binary(request_hash, (const char *) &client->xid,
+				      sizeof(client->xid));
+	timer_del(client);
+
+	pthread_mutex_unlock(&request_mutex);
+}
+
+static struct local_client *find_request(unsigned short xid)
+{
+	struct local_client *client;
+
+	pthread_mutex_lock(&request_mutex);
+	client = dm_hash_lookup_binary(request_hash, (const char *) &xid,
+				       sizeof(xid));
+	pthread_mutex_unlock(&request_mutex);
+
+	return client;
+}
+
+/* Milliseconds until the next request times out, at most max_wait */
+static int next_timeout(int max_wait)
+{
+	int64_t wait = max_wait;
+
+	pthread_mutex_lock(&request_mutex);
+	if (timer_heap_len) {
+		wait = timer_heap[0]->bits.localsock.deadline - now_ms();
+		if (wait < 0)
+			wait = 0;
+		else if (wait > max_wait)
+			wait = max_wait;
+	}
+	pthread_mutex_unlock(&request_mutex);
+
+	return (int) wait;
+}
+
+/* Pad out the replies of requests that have waited too long */
+static void expire_requests(void)
+{
+	struct local_client *client;
+	int64_t now = now_ms();
+
+	for (;;) {
+		pthread_mutex_lock(&request_mutex);
+		if (!timer_heap_len ||
+		    timer_heap[0]->bits.localsock.deadline > now) {
+			pthread_mutex_unlock(&request_mutex);
+			break;
+		}
+		client = timer_heap[0];
+		timer_del(client);
+		pthread_mutex_unlock(&request_mutex);
+
+		if (client->removeme)
+			continue;
+
+		/* Send timed out message + replies we already have */
+		DEBUGLOG("Request %d timed-out\n", client->xid);
+
+		client->bits.localsock.all_success = 0;
+
+		request_timed_out(client);
+	}
+}
+
 /* This is where the real work happens */
 static void main_loop(int local_sock, int cmd_timeout)
 {
+	struct epoll_event events[MAX_EVENTS];
+
 	DEBUGLOG("Using timeout of %d seconds\n", cmd_timeout);
+	request_timeout = cmd_timeout;
 
 	sigset_t ss;
 	sigemptyset(&ss);
@@ -783,28 +1158,24 @@ static void main_loop(int local_sock, int cmd_timeout)
 	pthread_sigmask(SIG_UNBLOCK, &ss, NULL);
 	/* Main loop */
 	while (!quit) {
-		fd_set in;
-		int select_status;
+		int epoll_status;
+		int i;
 		struct local_client *thisfd;
-		struct timeval tv = { cmd_timeout, 0 };
-		int quorate = clops->is_quorate();
-
-		/* Wait on the cluster FD and all local sockets/pipes */
-		local_client_head.fd = clops->get_main_cluster_fd();
-		FD_ZERO(&in);
-		for (thisfd = &local_client_head; thisfd != NULL;
-		     thisfd = thisfd->next) {
-
-			if (thisfd->removeme)
-				continue;
-
-			/* if the cluster is not quorate then don't listen for new requests */
-			if ((thisfd->type != LOCAL_RENDEZVOUS &&
-			     thisfd->type != LOCAL_SOCK) || quorate)
-				FD_SET(thisfd->fd, &in);
+		int cluster_fd = clops->get_main_cluster_fd();
+
+		/* Follow the cluster FD if the cluster interface replaced it */
+		if (local_client_head.fd != cluster_fd) {
+			unwatch_client(&local_client_head);
+			local_client_head.fd = cluster_fd;
+			if (watch_client(&local_client_head))
+				goto closedown;
 		}
 
-		select_status = select(FD_SETSIZE, &in, NULL, NULL, &tv);
+		if (!clops->is_quorate() != !local_listening)
+			set_local_listening(!local_listening);
+
+		epoll_status = epoll_wait(epoll_fd, events, MAX_EVENTS,
+					  next_timeout(cmd_timeout * 1000));
 
 		if (reread_config) {
 			int saved_errno = errno;
@@ -812,107 +1183,74 @@ static void main_loop(int local_sock, int cmd_timeout)
 			reread_config = 0;
 			if (clops->reread_config)
 				clops->reread_config();
+			dump_lock_stats();
 			errno = saved_errno;
 		}
 
-		if (select_status > 0) {
-			struct local_client *lastfd = NULL;
+		if (epoll_status > 0) {
 			char csid[MAX_CSID_LEN];
 			char buf[max_cluster_message];
 
-			for (thisfd = &local_client_head; thisfd != NULL;
-			     thisfd = thisfd->next) {
+			pending_events = events;
+			num_pending_events = epoll_status;
 
-				if (thisfd->removeme) {
-					struct local_client *free_fd;
-					lastfd->next = thisfd->next;
-					free_fd = thisfd;
-					thisfd = lastfd;
+			for (i = 0; i < epoll_status; i++) {
+				struct local_client *newfd = NULL;
+				int ret;
 
-					DEBUGLOG("removeme set for fd %d\n", free_fd->fd);
-
-					/* Queue cleanup, this also frees the client struct */
-					add_to_lvmqueue(free_fd, NULL, 0, NULL);
-					break;
-				}
+				/* Removed by an earlier callback */
+				if (!(thisfd = events[i].data.ptr))
+					continue;
 
-				if (FD_ISSET(thisfd->fd, &in)) {
-					struct local_client *newfd = NULL;
-					int ret;
-
-					/* Do callback */
-					ret =
-					    thisfd->callback(thisfd, buf,
-							     sizeof(buf), csid,
-							     &newfd);
-					/* Ignore EAGAIN */
-					if (ret < 0 && (errno == EAGAIN ||
-							errno == EINTR)) continue;
-
-					/* Got error or EOF: Remove it from the list safely */
-					if (ret <= 0) {
-						struct local_client *free_fd;
-						int type = thisfd->type;
-
-						/* If the cluster socket shuts down, so do we */
-						if (type == CLUSTER_MAIN_SOCK ||
-						    type == CLUSTER_INTERNAL)
-							goto closedown;
-
-						DEBUGLOG("ret == %d, errno = %d. removing client\n",
-							 ret, errno);
-						lastfd->next = thisfd->next;
-						free_fd = thisfd;
-						thisfd = lastfd;
-						safe_close(&(free_fd->fd));
-
-						/* Queue cleanup, this also frees the client struct */
-						add_to_lvmqueue(free_fd, NULL, 0, NULL);
-						break;
+				/* Do callback */
+				ret =
+				    thisfd->callback(thisfd, buf,
+						     sizeof(buf), csid,
+						     &newfd);
+				/* Ignore EAGAIN */
+				if (ret < 0 && (errno == EAGAIN ||
+						errno == EINTR)) continue;
+
+				/* Got error or EOF: Remove it from the list safely */
+				if (ret <= 0) {
+					int type = thisfd->type;
+
+					/* If the cluster socket shuts down, so do we */
+					if (type == CLUSTER_MAIN_SOCK ||
+					    type == CLUSTER_INTERNAL) {
+						num_pending_events = 0;
+						goto closedown;
 					}
 
-					/* New client...simply add it to the list */
-					if (newfd) {
-						newfd->next = thisfd->next;
-						thisfd->next = newfd;
-						break;
-					}
+					DEBUGLOG("ret == %d, errno = %d. removing client\n",
+						 ret, errno);
+					remove_client(thisfd);
+					safe_close(&(thisfd->fd));
+					continue;
 				}
-				lastfd = thisfd;
-			}
-		}
 
-		/* Select timed out. Check for clients that have been waiting too long for a response */
-		if (select_status == 0) {
-			time_t the_time = time(NULL);
-
-			for (thisfd = &local_client_head; thisfd != NULL;
-			     thisfd = thisfd->next) {
-				if (thisfd->type == LOCAL_SOCK
-				    && thisfd->bits.localsock.sent_out
-				    && thisfd->bits.localsock.sent_time +
-				    cmd_timeout < the_time
-				    && thisfd->bits.localsock.
-				    expected_replies !=
-				    thisfd->bits.localsock.num_replies) {
-					/* Send timed out message + replies we already have */
-					DEBUGLOG
-					    ("Request timed-out (send: %ld, now: %ld)\n",
-					     thisfd->bits.localsock.sent_time,
-					     the_time);
-
-					thisfd->bits.localsock.all_success = 0;
-
-					request_timed_out(thisfd);
+				/* New client...simply add it to the list */
+				if (newfd && add_client(newfd)) {
+					safe_close(&(newfd->fd));
+					newfd->removeme = 1;
+					removed_clients = 1;
 				}
 			}
+
+			num_pending_events = 0;
 		}
-		if (select_status < 0) {
+
+		if (removed_clients)
+			sweep_removed_clients();
+
+		expire_requests();
+
+		if (epoll_status < 0) {
 			if (errno == EINTR)
 				continue;
 
 #ifdef DEBUG
-			perror("select error");
+			perror("epoll_wait error");
 			exit(-1);
 #endif
 		}
@@ -1083,6 +1421,7 @@ static int read_from_local_sock(struct local_client *thisfd)
 				struct local_client *lastfd = NULL;
 				struct local_client *free_fd = NULL;
 
+				unwatch_client(thisfd->bits.localsock.pipe_client);
 				close(thisfd->bits.localsock.pipe_client->fd);	/* Close pipe */
 				close(thisfd->bits.localsock.pipe);
 
@@ -1113,6 +1452,7 @@ static int read_from_local_sock(struct local_client *thisfd)
 			thisfd->bits.localsock.pipe_client->bits.pipe.client =
 			    NULL;
 
+		unwatch_client(thisfd);
 		safe_close(&(thisfd->fd));
 		return 0;
 	} else {
@@ -1262,10 +1602,23 @@ static int read_from_local_sock(struct local_client *thisfd)
 		newfd->removeme = 0;
 		newfd->type = THREAD_PIPE;
 		newfd->callback = local_pipe_callback;
-		newfd->next = thisfd->next;
 		newfd->bits.pipe.client = thisfd;
 		newfd->bits.pipe.threadid = 0;
-		thisfd->next = newfd;
+		if (add_client(newfd)) {
+			struct clvm_header reply;
+			close(comms_pipe[0]);
+			close(comms_pipe[1]);
+			free(newfd);
+
+			reply.cmd = CLVMD_CMD_REPLY;
+			reply.status = ENOMEM;
+			reply.arglen = 0;
+			reply.flags = 0;
+			send_message(&reply, sizeof(reply), our_csid,
+				     thisfd->fd,
+				     "Error sending ENOMEM reply to local user");
+			return len;
+		}
 
 		/* Store a cross link to the pipe */
 		thisfd->bits.localsock.pipe_client = newfd;
@@ -1287,16 +1640,77 @@ static int read_from_local_sock(struct local_client *thisfd)
 }
 
 /* Add a file descriptor from the cluster or comms interface to
-   our list of FDs for select
+   our list of FDs for epoll
 */
 int add_client(struct local_client *new_client)
 {
+	if (watch_client(new_client))
+		return -1;
+
+	new_client->lvm_queued = 0;
+	new_client->lvm_cleanup = 0;
 	new_client->next = local_client_head.next;
 	local_client_head.next = new_client;
 
 	return 0;
 }
 
+/*
+ * Answer a cluster-wide LOCK_QUERY from the cache while every other
+ * node's lease on its answer holds.  Otherwise ask for leases this time.
+ */
+static int query_from_cache(struct local_client *thisfd)
+{
+	struct clvm_header *inheader =
+	    (struct clvm_header *) thisfd->bits.localsock.cmd;
+	char *resource = inheader->args + 2;
+	const char *type;
+	int mode;
+
+	if (!lock_cache_lookup(resource, clops->get_num_nodes(), &mode)) {
+		count_lock_op(QUERY_REMOTE);
+		inheader->flags |= CLVMD_FLAG_LEASE;
+		thisfd->bits.localsock.leases = 0;
+		thisfd->bits.localsock.lease_mode = LCK_NULL;
+		thisfd->bits.localsock.lease_epoch = lock_cache_epoch();
+		return 0;
+	}
+
+	count_lock_op(QUERY_LOCAL);
+	DEBUGLOG("Answering lock query for %s from cache\n", resource);
+
+	/* Our own lock is always up to date */
+	type = do_lock_query(resource);
+	if (mode > (type ? lock_mode_from_name(type) : LCK_NULL))
+		type = lock_mode_name(mode);
+
+	thisfd->bits.localsock.expected_replies = 1;
+	thisfd->bits.localsock.num_replies = 0;
+	thisfd->bits.localsock.in_progress = TRUE;
+	add_reply_to_list(thisfd, 0, our_csid, type,
+			  type ? strlen(type) + 1 : 0);
+
+	return 1;
+}
+
+/* Every other node leased us its answer to a LOCK_QUERY: keep it */
+static void cache_query_reply(struct local_client *client)
+{
+	struct clvm_header *header =
+	    (struct clvm_header *) client->bits.localsock.cmd;
+
+	if (!header || header->cmd != CLVMD_CMD_LOCK_QUERY ||
+	    !(header->flags & CLVMD_FLAG_LEASE) ||
+	    client->bits.localsock.leases !=
+	    client->bits.localsock.expected_replies - 1)
+		return;
+
+	lock_cache_insert(header->args + 2,
+			  client->bits.localsock.expected_replies,
+			  client->bits.localsock.lease_mode,
+			  client->bits.localsock.lease_epoch);
+}
+
 /* Called when the pre-command has completed successfully - we
    now execute the real command on all the requested nodes */
 static int distribute_command(struct local_client *thisfd)
@@ -1312,12 +1726,16 @@ static int distribute_command(struct local_client *thisfd)
 	if (!(inheader->flags & CLVMD_FLAG_LOCAL)) {
 		/* if node is empty then do it on the whole cluster */
 		if (inheader->node[0] == '\0') {
+			if (inheader->cmd == CLVMD_CMD_LOCK_QUERY &&
+			    query_from_cache(thisfd))
+				return 0;
+
 			thisfd->bits.localsock.expected_replies =
 			    clops->get_num_nodes();
 			thisfd->bits.localsock.num_replies = 0;
-			thisfd->bits.localsock.sent_time = time(NULL);
 			thisfd->bits.localsock.in_progress = TRUE;
 			thisfd->bits.localsock.sent_out = TRUE;
+			track_request(thisfd, 1);
 
 			/* Do it here first */
 			add_to_lvmqueue(thisfd, inheader, len, NULL);
@@ -1347,6 +1765,7 @@ static int distribute_command(struct local_client *thisfd)
 					DEBUGLOG("Sending message to single node: %s\n",
 						 inheader->node);
 					inheader->xid = thisfd->xid;
+					track_request(thisfd, 0);
 					send_message(inheader, len,
 						     csid, -1,
 						     "Error forwarding message to cluster node");
@@ -1423,12 +1842,19 @@ static void process_remote_command(struct clvm_header *msg, int msglen, int fd,
 		} else {
 			clops->add_up_node(csid);
 		}
+
+		/* A restarted clvmd has forgotten the leases it gave us */
+		lock_cache_invalidate(NULL);
 		return;
 	}
 
 	/* Allocate a default reply buffer */
 	replyargs = malloc(max_cluster_message - sizeof(struct clvm_header));
 
+	/* Promise to tell the asking node when the answer changes */
+	if (msg->cmd == CLVMD_CMD_LOCK_QUERY && (msg->flags & CLVMD_FLAG_LEASE))
+		lock_lease_grant(msg->args + 2, csid);
+
 	if (replyargs != NULL) {
 		/* Run the command */
 		status =
@@ -1456,7 +1882,8 @@ static void process_remote_command(struct clvm_header *msg, int msglen, int fd,
 			agghead->xid = msg->xid;
 			agghead->cmd = CLVMD_CMD_REPLY;
 			agghead->status = status;
-			agghead->flags = 0;
+			agghead->flags = (msg->cmd == CLVMD_CMD_LOCK_QUERY && !status) ?
+					 (msg->flags & CLVMD_FLAG_LEASE) : 0;
 			agghead->clientid = msg->clientid;
 			agghead->arglen = replylen;
 			agghead->node[0] = '\0';
@@ -1531,6 +1958,9 @@ static void add_reply_to_list(struct local_client *client, int status,
 	/* If we have the whole lot then do the post-process */
 	if (++client->bits.localsock.num_replies ==
 	    client->bits.localsock.expected_replies) {
+		untrack_request(client);
+		cache_query_reply(client);
+
 		/* Post-process the command */
 		if (client->bits.localsock.threadid) {
 			pthread_mutex_lock(&client->bits.localsock.mutex);
@@ -1674,27 +2104,29 @@ static int process_local_command(struct clvm_header *msg, int msglen,
 
 static int process_reply(const struct clvm_header *msg, int msglen, const char *csid)
 {
-	struct local_client *client = NULL;
+	struct local_client *client;
 
-	client = find_client(msg->clientid);
-	if (!client) {
-		DEBUGLOG("Got message for unknown client 0x%x\n",
-			 msg->clientid);
-		log_error("Got message for unknown client 0x%x\n",
-			  msg->clientid);
-		return -1;
-	}
+	/* Gather replies together for the request they answer */
+	client = find_request(msg->xid);
+	if (client && client->fd == (int) ntohl(msg->clientid)) {
+		if (msg->status)
+			client->bits.localsock.all_success = 0;
 
-	if (msg->status)
-		client->bits.localsock.all_success = 0;
+		/* The node will tell us when its lock changes */
+		if ((msg->flags & CLVMD_FLAG_LEASE) &&
+		    (!msg->arglen || !msg->args[msg->arglen - 1])) {
+			int mode = lock_mode_from_name(msg->arglen ? msg->args : "");
+
+			client->bits.localsock.leases++;
+			if (mode > client->bits.localsock.lease_mode)
+				client->bits.localsock.lease_mode = mode;
+		}
 
-	/* Gather replies together for this client id */
-	if (msg->xid == client->xid) {
 		add_reply_to_list(client, msg->status, csid, msg->args,
 				  msg->arglen);
 	} else {
-		DEBUGLOG("Discarding reply with old XID %d, current = %d\n",
-			 msg->xid, client->xid);
+		DEBUGLOG("Discarding reply with old XID %d for client 0x%x\n",
+			 msg->xid, msg->clientid);
 	}
 	return 0;
 }
@@ -1772,6 +2204,7 @@ static void send_local_reply(struct local_client *client, int status, int fd)
 	free(replybuf);
 
 	/* Reset comms variables */
+	untrack_request(client);
 	client->bits.localsock.replies = NULL;
 	client->bits.localsock.expected_replies = 0;
 	client->bits.localsock.in_progress = FALSE;
@@ -1819,6 +2252,28 @@ static void send_version_message()
 			     "Error Sending version number");
 }
 
+/* Tell a node that cached our answer to a LOCK_QUERY that it changed */
+void send_lock_changed(const char *resource, const char *csid)
+{
+	int len = strlen(resource) + 1;
+	struct clvm_header *msg;
+
+	if (!(msg = malloc(sizeof(struct clvm_header) + len))) {
+		log_error("Unable to allocate lock change notification\n");
+		return;
+	}
+
+	memset(msg, 0, sizeof(*msg));
+	msg->cmd = CLVMD_CMD_LOCK_CHANGED;
+	msg->arglen = len;
+	memcpy(msg->args, resource, len);
+
+	DEBUGLOG("Breaking lease on %s\n", resource);
+	send_message(msg, sizeof(struct clvm_header) + len, csid, -1,
+		     "Error sending lock change notification");
+	free(msg);
+}
+
 /* Send a message to either a local client or another server */
 static int send_message(void *buf, int msglen, const char *csid, int fd,
 			const char *errtext)
@@ -1894,15 +2349,46 @@ static int process_work_item(struct lvm_thread_cmd *cmd)
 		process_remote_command(cmd->msg, cmd->msglen, cmd->client->fd,
 				       cmd->csid);
 	}
+
+	lvm_work_done(cmd->client);
 	return 0;
 }
 
+static void lvm_worker_loop(struct lvm_worker *worker)
+{
+	struct dm_list *cmdl, *tmp;
+
+	/* Now wait for some actual work */
+	for (;;) {
+		DEBUGLOG("LVM thread waiting for work\n");
+
+		pthread_mutex_lock(&worker->mutex);
+		if (dm_list_empty(&worker->cmd_head))
+			pthread_cond_wait(&worker->cond, &worker->mutex);
+
+		dm_list_iterate_safe(cmdl, tmp, &worker->cmd_head) {
+			struct lvm_thread_cmd *cmd;
+
+			cmd =
+			    dm_list_struct_base(cmdl, struct lvm_thread_cmd, list);
+			dm_list_del(&cmd->list);
+			pthread_mutex_unlock(&worker->mutex);
+
+			process_work_item(cmd);
+			free(cmd->msg);
+			free(cmd);
+
+			pthread_mutex_lock(&worker->mutex);
+		}
+		pthread_mutex_unlock(&worker->mutex);
+	}
+}
+
 /*
- * Routine that runs in the "LVM thread".
+ * Routine that runs in the "LVM thread", which is also the first worker.
  */
 static void lvm_thread_fn(void *arg)
 {
-	struct dm_list *cmdl, *tmp;
 	sigset_t ss;
 	struct lvm_startup_params *lvm_params = arg;
 
@@ -1920,29 +2406,79 @@ static void lvm_thread_fn(void *arg)
 	/* Allow others to get moving */
 	pthread_mutex_unlock(&lvm_start_mutex);
 
-	/* Now wait for some actual work */
-	for (;;) {
-		DEBUGLOG("LVM thread waiting for work\n");
+	lvm_worker_loop(&lvm_workers[0]);
+}
 
-		pthread_mutex_lock(&lvm_thread_mutex);
-		if (dm_list_empty(&lvm_cmd_head))
-			pthread_cond_wait(&lvm_thread_cond, &lvm_thread_mutex);
+/* The other workers start once the LVM thread has set up liblvm */
+static void *lvm_worker_fn(void *arg)
+{
+	sigset_t ss;
 
-		dm_list_iterate_safe(cmdl, tmp, &lvm_cmd_head) {
-			struct lvm_thread_cmd *cmd;
+	sigemptyset(&ss);
+	sigaddset(&ss, SIGUSR1);
+	sigaddset(&ss, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &ss, NULL);
 
-			cmd =
-			    dm_list_struct_base(cmdl, struct lvm_thread_cmd, list);
-			dm_list_del(&cmd->list);
-			pthread_mutex_unlock(&lvm_thread_mutex);
+	pthread_mutex_lock(&lvm_start_mutex);
+	pthread_mutex_unlock(&lvm_start_mutex);
 
-			process_work_item(cmd);
-			free(cmd->msg);
-			free(cmd);
+	lvm_worker_loop(arg);
+}
 
-			pthread_mutex_lock(&lvm_thread_mutex);
-		}
-		pthread_mutex_unlock(&lvm_thread_mutex);
+/*
+ * Pick the worker for a command.  LV lock resources start with the
+ * VG uuid, so all the LVs in a VG share a worker.  Commands without
+ * a resource go to the LVM thread.
+ */
+static struct lvm_worker *lvm_worker_for(const struct clvm_header *msg,
+					 int msglen)
+{
+	const char *node = (const char *) msg + offsetof(struct clvm_header, node);
+	const char *resource, *end = (const char *) msg + msglen;
+	unsigned hash = 0;
+	size_t len;
+
+	switch (msg->cmd) {
+	case CLVMD_CMD_LOCK_LV:
+	case CLVMD_CMD_LOCK_LVS:
+	case CLVMD_CMD_LOCK_VG:
+	case CLVMD_CMD_LOCK_QUERY:
+	case CLVMD_CMD_VG_BACKUP:
+		break;
+	default:
+		return &lvm_workers[0];
+	}
+
+	/* Arguments are two flag bytes then the resource name.
+	   A LOCK_LVS batch goes where its first LV would. */
+	resource = node + strnlen(node, end - node) + 3;
+	if (resource >= end)
+		return &lvm_workers[0];
+
+	len = strnlen(resource, end - resource);
+	if ((msg->cmd == CLVMD_CMD_LOCK_LV ||
+	     msg->cmd == CLVMD_CMD_LOCK_LVS) && len > ID_LEN)
+		len = ID_LEN;
+
+	while (len--)
+		hash = hash * 31 + (unsigned char) *resource++;
+
+	return &lvm_workers[hash % LVM_WORKERS];
+}
+
+/* Run a client's deferred cleanup once its last work item is done */
+static void lvm_work_done(struct local_client *client)
+{
+	int cleanup;
+
+	pthread_mutex_lock(&lvm_queued_mutex);
+	cleanup = !--client->lvm_queued && client->lvm_cleanup;
+	pthread_mutex_unlock(&lvm_queued_mutex);
+
+	if (cleanup) {
+		DEBUGLOG("lvm_work_done: free fd %d\n", client->fd);
+		cmd_client_cleanup(client);
+		free(client);
 	}
 }
 
@@ -1951,6 +2487,7 @@ static int add_to_lvmqueue(struct local_client *client, struct clvm_header *msg,
 			   int msglen, const char *csid)
 {
 	struct lvm_thread_cmd *cmd;
+	struct lvm_worker *worker = &lvm_workers[0];
 
 	cmd = malloc(sizeof(struct lvm_thread_cmd));
 	if (!cmd)
@@ -1982,10 +2519,27 @@ static int add_to_lvmqueue(struct local_client *client, struct clvm_header *msg,
 	DEBUGLOG
 	    ("add_to_lvmqueue: cmd=%p. client=%p, msg=%p, len=%d, csid=%p, xid=%d\n",
 	     cmd, client, msg, msglen, csid, cmd->xid);
-	pthread_mutex_lock(&lvm_thread_mutex);
-	dm_list_add(&lvm_cmd_head, &cmd->list);
-	pthread_cond_signal(&lvm_thread_cond);
-	pthread_mutex_unlock(&lvm_thread_mutex);
+
+	/* Commands for the client may still be queued on other workers */
+	pthread_mutex_lock(&lvm_queued_mutex);
+	if (!cmd->msg && client->lvm_queued) {
+		DEBUGLOG("add_to_lvmqueue: deferring free of fd %d\n", client->fd);
+		client->lvm_cleanup = 1;
+		pthread_mutex_unlock(&lvm_queued_mutex);
+		free(cmd);
+		return 0;
+	}
+	if (cmd->msg)
+		client->lvm_queued++;
+	pthread_mutex_unlock(&lvm_queued_mutex);
+
+	if (cmd->msg)
+		worker = lvm_worker_for(cmd->msg, msglen);
+
+	pthread_mutex_lock(&worker->mutex);
+	dm_list_add(&worker->cmd_head, &cmd->list);
+	pthread_cond_signal(&worker->cond);
+	pthread_mutex_unlock(&worker->mutex);
 
 	return 0;
 }
@@ -2080,7 +2634,11 @@ void process_message(struct local_client *client, const char *buf, int len,
 	ntoh_clvm(inheader);	/* Byteswap fields */
 	if (inheader->cmd == CLVMD_CMD_REPLY)
 		process_reply(inheader, len, csid);
-	else
+	else if (inheader->cmd == CLVMD_CMD_LOCK_CHANGED) {
+		/* Not queued, so a reply behind it cannot refill the cache first */
+		if (inheader->arglen && !buf[len - 1])
+			lock_cache_invalidate(inheader->args);
+	} else
 		add_to_lvmqueue(client, inheader, len, csid);
 }
 
@@ -2102,18 +2660,6 @@ static int check_all_clvmds_running(struct local_client *client)
 	return clops->cluster_do_node_callback(client, check_all_callback);
 }
 
-/* Return a local_client struct given a client ID.
-   client IDs are in network byte order */
-static struct local_client *find_client(int clientid)
-{
-	struct local_client *thisfd;
-	for (thisfd = &local_client_head; thisfd != NULL; thisfd = thisfd->next) {
-		if (thisfd->fd == ntohl(clientid))
-			return thisfd;
-	}
-	return NULL;
-}
-
 /* Byte-swapping routines for the header so we
    work in a heterogeneous environment */
 static void hton_clvm(struct clvm_header *hdr)
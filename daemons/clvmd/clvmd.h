@@ -16,10 +16,6 @@
 #ifndef _CLVMD_H
 #define _CLVMD_H
 
-#define CLVMD_MAJOR_VERSION 0
-#define CLVMD_MINOR_VERSION 2
-#define CLVMD_PATCH_VERSION 1
-
 /* Default time (in seconds) we will wait for all remote commands to execute
    before declaring them dead */
 #define DEFAULT_CMD_TIMEOUT 60
@@ -42,7 +38,8 @@ struct localsock_bits {
 	struct node_reply *replies;
 	int num_replies;
 	int expected_replies;
-	time_t sent_time;	/* So we can check for timeouts */
+	int64_t deadline;	/* Monotonic ms when replies are overdue */
+	int timer;		/* Index in the timer heap, -1 if untimed */
 	int in_progress;	/* Only execute one cmd at a time per client */
 	int sent_out;		/* Flag to indicate that a command was sent
 				   to remote nodes */
@@ -53,6 +50,9 @@ struct localsock_bits {
 	int finished;		/* Flag to tell subthread to exit */
 	int all_success;	/* Set to 0 if any node (or the pre_command)
 				   failed */
+	int leases;		/* LOCK_QUERY replies that came with a lease */
+	int lease_mode;		/* Strongest lock mode among them */
+	unsigned lease_epoch;	/* lock_cache_epoch() when the query went out */
 	struct local_client *pipe_client;
 	pthread_t threadid;
 	enum { PRE_COMMAND, POST_COMMAND, QUIT } state;
@@ -87,6 +87,8 @@ struct local_client {
 	unsigned short xid;
 	fd_callback_t callback;
 	uint8_t removeme;
+	uint8_t lvm_cleanup;	/* Free when lvm_queued drops to zero */
+	int lvm_queued;		/* Work items queued for the LVM workers */
 
 	union {
 		struct localsock_bits localsock;
@@ -110,10 +112,12 @@ extern int do_pre_command(struct local_client *client);
 extern int do_post_command(struct local_client *client);
 extern void cmd_client_cleanup(struct local_client *client);
 extern int add_client(struct local_client *new_client);
+extern void remove_client(struct local_client *client);
 
 extern void clvmd_cluster_init_completed(void);
 extern void process_message(struct local_client *client, const char *buf,
 			    int len, const char *csid);
+extern void send_lock_changed(const char *resource, const char *csid);
 extern void debuglog(const char *fmt, ... )
   __attribute__ ((format(printf, 1, 2)));
 
@@ -0,0 +1,342 @@
+/*
+ * Copyright (C) 2010 Red Hat, Inc. All rights reserved.
+ *
+ * This file is part of LVM2.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v.2.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Drive many concurrent clients through a running clvmd (e.g. one
+ * started with "-I singlenode") and report request throughput and
+ * latency.  Each client keeps one request in flight, alternately
+ * taking and releasing a VG lock spread over a number of VG names,
+ * so every connection stays busy for the whole run.  Optional
+ * refresh clients keep the daemon busy in liblvm meanwhile, to show
+ * how much slow work holds up lock traffic for other VGs.
+ * With -l, lock clients instead deactivate that many (nonexistent)
+ * LVs per request, as one LOCK_LVS batch when there is more than one.
+ * With -a, lock requests go to every node of the cluster rather than
+ * being run locally, so their replies are gathered and timed as any
+ * other cluster-wide command is.
+ *
+ * Usage: clvmd_bench [-c clients] [-n requests] [-v vgs] [-r refreshers]
+ *		      [-l lvs] [-x] [-a]
+ */
+#include "clvmd-common.h"
+
+#include "clvm.h"
+#include "locking.h"
+
+#include <poll.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+
+#define BENCH_VG_FMT "V_clvmdbench%d"
+#define BENCH_LV_FMT "%032d%032d"	/* Looks like VG and LV uuids */
+
+struct bench_client {
+	int fd;
+	int refresh;		/* Sends CLVMD_CMD_REFRESH instead */
+	int vg;
+	int locked;
+	int sent;		/* Requests completed or in flight */
+	int got;		/* Bytes of the current reply read so far */
+	struct timespec start;
+	char reply[PIPE_BUF];
+};
+
+static int _exclusive;
+static int _all_nodes;
+static int _lvs;
+static int _failures;
+
+static double _elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int _connect(void)
+{
+	struct sockaddr_un sockaddr;
+	int fd;
+
+	if ((fd = socket(PF_UNIX, SOCK_STREAM, 0)) < 0) {
+		fprintf(stderr, "Local socket creation failed: %s\n",
+			strerror(errno));
+		return -1;
+	}
+
+	memset(&sockaddr, 0, sizeof(sockaddr));
+	memcpy(sockaddr.sun_path, CLVMD_SOCKNAME, sizeof(CLVMD_SOCKNAME));
+	sockaddr.sun_family = AF_UNIX;
+
+	if (connect(fd, (struct sockaddr *) &sockaddr, sizeof(sockaddr))) {
+		fprintf(stderr, "connect() failed on local socket: %s\n",
+			strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Lock the client's VG if it is unlocked and vice versa */
+static int _send_request(struct bench_client *bc)
+{
+	char outbuf[sizeof(struct clvm_header) + CLVMD_MAX_LOCK_LVS_ARGS];
+	struct clvm_header *head = (struct clvm_header *) outbuf;
+	char *args = head->node + 1;
+	int i, len, msglen;
+
+	memset(outbuf, 0, sizeof(outbuf));
+	if (bc->refresh) {
+		head->cmd = CLVMD_CMD_REFRESH;
+		head->flags = CLVMD_FLAG_LOCAL;
+		msglen = sizeof(struct clvm_header);
+		goto send;
+	}
+
+	if (_lvs) {
+		head->cmd = (_lvs > 1) ? CLVMD_CMD_LOCK_LVS : CLVMD_CMD_LOCK_LV;
+		head->flags = _all_nodes ? 0 : CLVMD_FLAG_LOCAL;
+		for (i = len = 0; i < _lvs; i++) {
+			args[len] = LCK_LV_DEACTIVATE;
+			args[len + 1] = LCK_CLUSTER_VG;
+			len += dm_snprintf(args + len + 2,
+					   sizeof(outbuf) - sizeof(*head) - len - 2,
+					   BENCH_LV_FMT, bc->vg, i) + 3;
+		}
+		head->arglen = len;
+		msglen = sizeof(struct clvm_header) + len;
+		goto send;
+	}
+
+	len = dm_snprintf(args + 2, sizeof(outbuf) - sizeof(*head) - 2,
+			  BENCH_VG_FMT, bc->vg) + 3;
+
+	head->cmd = CLVMD_CMD_LOCK_VG;
+	head->flags = _all_nodes ? 0 : CLVMD_FLAG_LOCAL;
+	head->arglen = len;
+	args[0] = bc->locked ? LCK_VG_UNLOCK :
+		  _exclusive ? LCK_VG_WRITE : LCK_VG_READ;
+	args[1] = 0;
+	msglen = sizeof(struct clvm_header) + len;
+
+send:
+	clock_gettime(CLOCK_MONOTONIC, &bc->start);
+	if (write(bc->fd, outbuf, msglen) != msglen) {
+		fprintf(stderr, "Error writing data to clvmd: %s\n",
+			strerror(errno));
+		return 0;
+	}
+
+	bc->got = 0;
+	bc->sent++;
+
+	return 1;
+}
+
+/* Returns 1 once the whole reply is in, 0 if more is to come, -1 on error */
+static int _read_reply(struct bench_client *bc)
+{
+	struct clvm_header *head = (struct clvm_header *) bc->reply;
+	size_t want = sizeof(*head);
+	int len;
+
+	if (bc->got >= (int) sizeof(*head))
+		want += head->arglen;
+
+	if (want > sizeof(bc->reply)) {
+		fprintf(stderr, "Reply of %u bytes is too large\n",
+			head->arglen);
+		return -1;
+	}
+
+	if ((len = read(bc->fd, bc->reply + bc->got, want - bc->got)) <= 0) {
+		if (len < 0 && errno == EINTR)
+			return 0;
+		fprintf(stderr, "Error reading data from clvmd: %s\n",
+			len ? strerror(errno) : "EOF");
+		return -1;
+	}
+
+	bc->got += len;
+	if (bc->got < (int) sizeof(*head) ||
+	    bc->got < (int) (sizeof(*head) + head->arglen))
+		return 0;
+
+	if (head->status && !_failures++) {
+		if (bc->refresh)
+			fprintf(stderr, "Refresh failed: %s\n",
+				strerror(head->status));
+		else if (_lvs)
+			fprintf(stderr, "Deactivation of %d LVs failed: %s\n",
+				_lvs, strerror(head->status));
+		else
+			fprintf(stderr, "%s of " BENCH_VG_FMT " failed: %s\n",
+				bc->locked ? "Unlock" : "Lock", bc->vg,
+				strerror(head->status));
+	}
+
+	/* Keep the client's lock sequence consistent regardless */
+	if (!bc->refresh && !_lvs)
+		bc->locked = !bc->locked;
+
+	return 1;
+}
+
+static int _cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv)
+{
+	int clients = 100, requests = 100, vgs = 16, refreshers = 0;
+	int c, i, done = 0, refreshes = 0, total, active, nfds;
+	struct bench_client *bc;
+	struct pollfd *pfd;
+	struct timespec start;
+	double secs, *latency, refresh_secs = 0;
+
+	while ((c = getopt(argc, argv, "c:n:v:r:l:xa")) != -1) {
+		switch (c) {
+		case 'c':
+			clients = atoi(optarg);
+			break;
+		case 'n':
+			requests = atoi(optarg);
+			break;
+		case 'v':
+			vgs = atoi(optarg);
+			break;
+		case 'r':
+			refreshers = atoi(optarg);
+			break;
+		case 'l':
+			_lvs = atoi(optarg);
+			break;
+		case 'x':
+			_exclusive = 1;
+			break;
+		case 'a':
+			_all_nodes = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-c clients] [-n requests] "
+				"[-v vgs] [-r refreshers] [-l lvs] [-x] [-a]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	if ((clients < 1) || (requests < 1) || (vgs < 1) || (refreshers < 0) ||
+	    (_lvs < 0) || (_lvs * 67 > CLVMD_MAX_LOCK_LVS_ARGS)) {
+		fprintf(stderr, "Invalid arguments\n");
+		return 1;
+	}
+
+	/* Always finish with the lock released */
+	requests += requests & 1;
+	total = clients * requests;
+	nfds = clients + refreshers;
+
+	if (!(bc = calloc(nfds, sizeof(*bc))) ||
+	    !(pfd = calloc(nfds, sizeof(*pfd))) ||
+	    !(latency = calloc(total, sizeof(*latency)))) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nfds; i++) {
+		if ((bc[i].fd = _connect()) < 0)
+			return 1;
+		bc[i].refresh = (i >= clients);
+		bc[i].vg = i % vgs;
+		pfd[i].fd = bc[i].fd;
+		pfd[i].events = POLLIN;
+	}
+	printf("connected %d clients: %.3fs\n", nfds, _elapsed(&start));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nfds; i++)
+		if (!_send_request(&bc[i]))
+			return 1;
+
+	/* Refresh clients keep going until the lock clients are done */
+	for (active = nfds; active; ) {
+		if (poll(pfd, nfds, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "poll failed: %s\n", strerror(errno));
+			return 1;
+		}
+
+		for (i = 0; i < nfds; i++) {
+			if (!pfd[i].revents)
+				continue;
+
+			switch (_read_reply(&bc[i])) {
+			case -1:
+				return 1;
+			case 0:
+				continue;
+			}
+
+			if (bc[i].refresh) {
+				refresh_secs += _elapsed(&bc[i].start);
+				refreshes++;
+			} else
+				latency[done++] = _elapsed(&bc[i].start);
+
+			if (bc[i].refresh ? done < total : bc[i].sent < requests) {
+				if (!_send_request(&bc[i]))
+					return 1;
+			} else {
+				/* Negative fds are ignored by poll() */
+				pfd[i].fd = -1;
+				active--;
+			}
+		}
+	}
+	secs = _elapsed(&start);
+
+	qsort(latency, done, sizeof(*latency), _cmp_double);
+	printf("completed %d requests over %d VGs (%d failed): %.3fs, "
+	       "%.0f requests/s\n", done, vgs, _failures, secs,
+	       secs > 0 ? done / secs : 0);
+	if (_lvs)
+		printf("%.0f LVs/s\n", secs > 0 ? done * _lvs / secs : 0);
+	printf("latency ms: p50 %.3f  p99 %.3f  max %.3f\n",
+	       latency[done / 2] * 1e3, latency[done * 99 / 100] * 1e3,
+	       latency[done - 1] * 1e3);
+	if (refreshes)
+		printf("completed %d refreshes: mean %.3f ms\n", refreshes,
+		       refresh_secs * 1e3 / refreshes);
+
+	for (i = 0; i < nfds; i++)
+		close(bc[i].fd);
+
+	free(latency);
+	free(pfd);
+	free(bc);
+
+	return _failures ? 1 : 0;
+}
@@ -0,0 +1,310 @@
+/*
+ * Copyright (C) 2010 Red Hat, Inc. All rights reserved.
+ *
+ * This file is part of LVM2.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU Lesser General Public License v.2.1.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Node-local cache of LOCK_QUERY answers, the leases that keep other
+ * nodes' caches honest, and counts of where lock operations were served.
+ */
+
+#include "clvmd-common.h"
+
+#include <pthread.h>
+
+#include "clvm.h"
+#include "clvmd-comms.h"
+#include "clvmd.h"
+#include "lock-cache.h"
+#include "locking.h"
+
+struct cached_lock {
+	int nodes;		/* Cluster size when the answer was cached */
+	int mode;		/* Strongest mode held on any other node */
+};
+
+/* Nodes to tell when our lock on the resource changes */
+struct lease_list {
+	struct dm_list list;
+	struct dm_list holders;
+	char resource[0];
+};
+
+struct lease_holder {
+	struct dm_list list;
+	char csid[MAX_CSID_LEN];
+};
+
+static unsigned _csid_len;
+
+static pthread_mutex_t _cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dm_hash_table *_cache;
+static unsigned _epoch;		/* Bumped by every invalidation */
+
+static pthread_mutex_t _lease_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dm_hash_table *_leases;
+
+static pthread_mutex_t _stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long _ops[LOCK_OP_TYPES];
+
+void init_lock_cache(unsigned csid_len)
+{
+	_csid_len = csid_len;
+	_cache = dm_hash_create(100);
+	_leases = dm_hash_create(100);
+}
+
+static void _free_lease_list(struct lease_list *ll)
+{
+	struct lease_holder *lh, *tmp;
+
+	dm_list_iterate_items_safe(lh, tmp, &ll->holders)
+		free(lh);
+	free(ll);
+}
+
+void destroy_lock_cache(void)
+{
+	struct dm_hash_node *v;
+
+	pthread_mutex_lock(&_cache_lock);
+	if (_cache) {
+		dm_hash_iterate(v, _cache)
+			free(dm_hash_get_data(_cache, v));
+		dm_hash_destroy(_cache);
+		_cache = NULL;
+	}
+	pthread_mutex_unlock(&_cache_lock);
+
+	pthread_mutex_lock(&_lease_lock);
+	if (_leases) {
+		dm_hash_iterate(v, _leases)
+			_free_lease_list(dm_hash_get_data(_leases, v));
+		dm_hash_destroy(_leases);
+		_leases = NULL;
+	}
+	pthread_mutex_unlock(&_lease_lock);
+}
+
+unsigned lock_cache_epoch(void)
+{
+	unsigned epoch;
+
+	pthread_mutex_lock(&_cache_lock);
+	epoch = _epoch;
+	pthread_mutex_unlock(&_cache_lock);
+
+	return epoch;
+}
+
+int lock_cache_lookup(const char *resource, int nodes, int *mode)
+{
+	struct cached_lock *cl;
+	int r = 0;
+
+	pthread_mutex_lock(&_cache_lock);
+	if (_cache && (cl = dm_hash_lookup(_cache, resource))) {
+		if (cl->nodes == nodes) {
+			*mode = cl->mode;
+			r = 1;
+		} else {
+			/* Someone joined or left: their locks are unknown */
+			dm_hash_remove(_cache, resource);
+			free(cl);
+		}
+	}
+	pthread_mutex_unlock(&_cache_lock);
+
+	return r;
+}
+
+/* Only if nothing was invalidated since the query went out */
+void lock_cache_insert(const char *resource, int nodes, int mode,
+		       unsigned epoch)
+{
+	struct cached_lock *cl;
+
+	pthread_mutex_lock(&_cache_lock);
+	if (!_cache || epoch != _epoch)
+		goto out;
+
+	if (!(cl = dm_hash_lookup(_cache, resource))) {
+		if (!(cl = malloc(sizeof(*cl))))
+			goto out;
+		if (!dm_hash_insert(_cache, resource, cl)) {
+			free(cl);
+			goto out;
+		}
+	}
+
+	cl->nodes = nodes;
+	cl->mode = mode;
+	DEBUGLOG("Caching lock query for %s: mode %d on %d nodes\n",
+		 resource, mode, nodes);
+out:
+	pthread_mutex_unlock(&_cache_lock);
+}
+
+void lock_cache_invalidate(const char *resource)
+{
+	struct dm_hash_node *v;
+	struct cached_lock *cl;
+
+	pthread_mutex_lock(&_cache_lock);
+	_epoch++;
+	if (!_cache)
+		goto out;
+
+	if (!resource) {
+		dm_hash_iterate(v, _cache)
+			free(dm_hash_get_data(_cache, v));
+		dm_hash_wipe(_cache);
+	} else if ((cl = dm_hash_lookup(_cache, resource))) {
+		DEBUGLOG("Lock on %s changed remotely\n", resource);
+		dm_hash_remove(_cache, resource);
+		free(cl);
+	}
+out:
+	pthread_mutex_unlock(&_cache_lock);
+}
+
+/*
+ * Must be called before reading our lock mode to answer the query, so a
+ * change racing with the answer either shows in it or breaks the lease.
+ */
+void lock_lease_grant(const char *resource, const char *csid)
+{
+	struct lease_list *ll;
+	struct lease_holder *lh;
+	size_t len = strlen(resource) + 1;
+
+	pthread_mutex_lock(&_lease_lock);
+	if (!_leases)
+		goto out;
+
+	if (!(ll = dm_hash_lookup(_leases, resource))) {
+		if (!(ll = malloc(sizeof(*ll) + len)))
+			goto out;
+		memcpy(ll->resource, resource, len);
+		dm_list_init(&ll->holders);
+		if (!dm_hash_insert(_leases, resource, ll)) {
+			free(ll);
+			goto out;
+		}
+	}
+
+	dm_list_iterate_items(lh, &ll->holders)
+		if (!memcmp(lh->csid, csid, _csid_len))
+			goto out;
+
+	if (!(lh = malloc(sizeof(*lh))))
+		goto out;
+	memcpy(lh->csid, csid, _csid_len);
+	dm_list_add(&ll->holders, &lh->list);
+out:
+	pthread_mutex_unlock(&_lease_lock);
+}
+
+/* Our lock changed: tell the nodes that cached it, who can ask again */
+void lock_lease_break(const char *resource)
+{
+	struct dm_list broken;
+	struct dm_hash_node *v;
+	struct lease_list *ll, *tmp;
+	struct lease_holder *lh;
+
+	dm_list_init(&broken);
+
+	pthread_mutex_lock(&_lease_lock);
+	if (!_leases)
+		goto unlock;
+
+	if (!resource) {
+		dm_hash_iterate(v, _leases) {
+			ll = dm_hash_get_data(_leases, v);
+			dm_list_add(&broken, &ll->list);
+		}
+		dm_hash_wipe(_leases);
+	} else if ((ll = dm_hash_lookup(_leases, resource))) {
+		dm_hash_remove(_leases, resource);
+		dm_list_add(&broken, &ll->list);
+	}
+unlock:
+	pthread_mutex_unlock(&_lease_lock);
+
+	dm_list_iterate_items_safe(ll, tmp, &broken) {
+		dm_list_iterate_items(lh, &ll->holders)
+			send_lock_changed(ll->resource, lh->csid);
+		_free_lease_list(ll);
+	}
+}
+
+const char *lock_mode_name(int mode)
+{
+	switch (mode) {
+		case LCK_NULL: return "NL";
+		case LCK_READ: return "CR";
+		case LCK_PREAD:return "PR";
+		case LCK_WRITE:return "PW";
+		case LCK_EXCL: return "EX";
+	}
+
+	return NULL;
+}
+
+/* Unknown or empty names mean no lock */
+int lock_mode_from_name(const char *name)
+{
+	int mode;
+
+	for (mode = LCK_EXCL; mode > LCK_NULL; mode--)
+		if (lock_mode_name(mode) && !strcmp(name, lock_mode_name(mode)))
+			break;
+
+	return mode;
+}
+
+void count_lock_op(lock_op_t op)
+{
+	pthread_mutex_lock(&_stats_lock);
+	_ops[op]++;
+	pthread_mutex_unlock(&_stats_lock);
+}
+
+void dump_lock_stats(void)
+{
+	unsigned long long ops[LOCK_OP_TYPES];
+	struct dm_hash_node *v;
+	unsigned cached = 0, leases = 0;
+
+	pthread_mutex_lock(&_stats_lock);
+	memcpy(ops, _ops, sizeof(ops));
+	pthread_mutex_unlock(&_stats_lock);
+
+	pthread_mutex_lock(&_cache_lock);
+	if (_cache)
+		dm_hash_iterate(v, _cache)
+			cached++;
+	pthread_mutex_unlock(&_cache_lock);
+
+	pthread_mutex_lock(&_lease_lock);
+	if (_leases)
+		dm_hash_iterate(v, _leases)
+			leases++;
+	pthread_mutex_unlock(&_lease_lock);
+
+	DEBUGLOG("LV lock operations: %llu served locally, %llu by the "
+		 "lock manager\n", ops[LOCK_OP_LOCAL], ops[LOCK_OP_REMOTE]);
+	DEBUGLOG("Lock queries: %llu answered from cache, %llu sent to the "
+		 "cluster; %u cached, leases out on %u\n",
+		 ops[QUERY_LOCAL], ops[QUERY_REMOTE], cached, leases);
+}
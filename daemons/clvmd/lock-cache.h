@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2010 Red Hat, Inc. All rights reserved.
+ *
+ * This file is part of LVM2.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU Lesser General Public License v.2.1.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _CLVMD_LOCK_CACHE_H
+#define _CLVMD_LOCK_CACHE_H
+
+/*
+ * What this node knows of other nodes' LV locks, so that LOCK_QUERY
+ * need not go round the whole cluster every time.
+ *
+ * A node answering a query that carries CLVMD_FLAG_LEASE takes a lease
+ * out for the asking node and sends it CLVMD_CMD_LOCK_CHANGED the next
+ * time its own lock on that resource changes.  The asking node keeps the
+ * strongest mode the other nodes reported for as long as all of their
+ * leases hold and the number of nodes stays the same.
+ */
+
+void init_lock_cache(unsigned csid_len);
+void destroy_lock_cache(void);
+
+/* Asking side */
+unsigned lock_cache_epoch(void);
+int lock_cache_lookup(const char *resource, int nodes, int *mode);
+void lock_cache_insert(const char *resource, int nodes, int mode,
+		       unsigned epoch);
+void lock_cache_invalidate(const char *resource);	/* NULL for all */
+
+/* Answering side */
+void lock_lease_grant(const char *resource, const char *csid);
+void lock_lease_break(const char *resource);		/* NULL for all */
+
+/* Lock mode names as LOCK_QUERY replies give them */
+const char *lock_mode_name(int mode);
+int lock_mode_from_name(const char *name);
+
+/* Where a lock operation was satisfied, for the statistics */
+typedef enum {
+	LOCK_OP_LOCAL,		/* Lock already held in a sufficient mode */
+	LOCK_OP_REMOTE,		/* Went to the lock manager */
+	QUERY_LOCAL,		/* Answered from the cache */
+	QUERY_REMOTE,		/* Asked every node */
+	LOCK_OP_TYPES
+} lock_op_t;
+
+void count_lock_op(lock_op_t op);
+void dump_lock_stats(void);
+
+#endif
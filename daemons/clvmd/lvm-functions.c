@@ -22,6 +22,7 @@
 #include "clvmd-comms.h"
 #include "clvmd.h"
 #include "lvm-functions.h"
+#include "lock-cache.h"
 
 /* LVM2 headers */
 #include "toolcontext.h"
@@ -30,6 +31,8 @@
 #include "activate.h"
 #include "archiver.h"
 #include "memlock.h"
+#include "metadata.h"
+#include "lvm-string.h"
 
 #include <syslog.h>
 
@@ -44,6 +47,21 @@ struct lv_info {
 	int lock_mode;
 };
 
+/*
+ * lvmcache updates from VG locks that arrived while another worker was
+ * inside liblvm.  They are applied in order by whoever next holds
+ * lvm_lock, before it looks at the cache, so VG lock requests don't
+ * wait behind a slow activation.
+ */
+struct vg_cache_update {
+	struct dm_list list;
+	uint32_t lock_cmd;
+	char vgname[0];
+};
+
+static struct dm_list vg_cache_updates;
+static pthread_mutex_t vg_cache_lock;
+
 static const char *decode_full_locking_cmd(uint32_t cmdl)
 {
 	static char buf[128];
@@ -200,6 +218,8 @@ void init_lvhash()
 	lv_hash = dm_hash_create(100);
 	pthread_mutex_init(&lv_hash_lock, NULL);
 	pthread_mutex_init(&lvm_lock, NULL);
+	dm_list_init(&vg_cache_updates);
+	pthread_mutex_init(&vg_cache_lock, NULL);
 }
 
 /* Called at shutdown to tidy the lockspace */
@@ -210,6 +230,9 @@ void destroy_lvhash()
 	char *resource;
 	int status;
 
+	/* Our locks are about to go: nobody may keep a cached answer */
+	lock_lease_break(NULL);
+
 	pthread_mutex_lock(&lv_hash_lock);
 
 	dm_hash_iterate(v, lv_hash) {
@@ -228,6 +251,50 @@ void destroy_lvhash()
 	pthread_mutex_unlock(&lv_hash_lock);
 }
 
+/* Must be called with lvm_lock held */
+static void update_vg_cache(uint32_t lock_cmd, const char *vgname)
+{
+	switch (lock_cmd) {
+		case LCK_VG_COMMIT:
+			DEBUGLOG("vg_commit notification for VG %s\n", vgname);
+			lvmcache_commit_metadata(vgname);
+			break;
+		case LCK_VG_REVERT:
+			DEBUGLOG("vg_revert notification for VG %s\n", vgname);
+			lvmcache_drop_metadata(vgname, 1);
+			break;
+		case LCK_VG_DROP_CACHE:
+		default:
+			DEBUGLOG("Invalidating cached metadata for VG %s\n", vgname);
+			lvmcache_drop_metadata(vgname, 0);
+	}
+}
+
+static void apply_vg_cache_updates(void)
+{
+	struct vg_cache_update *vcu, *tmp;
+
+	pthread_mutex_lock(&vg_cache_lock);
+	dm_list_iterate_items_safe(vcu, tmp, &vg_cache_updates) {
+		update_vg_cache(vcu->lock_cmd, vcu->vgname);
+		dm_list_del(&vcu->list);
+		free(vcu);
+	}
+	pthread_mutex_unlock(&vg_cache_lock);
+}
+
+static void lock_lvm(void)
+{
+	pthread_mutex_lock(&lvm_lock);
+	apply_vg_cache_updates();
+}
+
+static void unlock_lvm(void)
+{
+	apply_vg_cache_updates();
+	pthread_mutex_unlock(&lvm_lock);
+}
+
 /* Gets a real lock and keeps the info in the hash table */
 static int hold_lock(char *resource, int mode, int flags)
 {
@@ -242,9 +309,23 @@ static int hold_lock(char *resource, int mode, int flags)
 
 	if (lvi && lvi->lock_mode == mode) {
 		DEBUGLOG("hold_lock, lock mode %d already held\n", mode);
+		count_lock_op(LOCK_OP_LOCAL);
 		return 0;
 	}
 
+	/*
+	 * PW is only taken around a suspend.  EX already keeps every
+	 * other node out, and converting down to PW would let them
+	 * activate the LV meanwhile and leave it shared after resume.
+	 */
+	if (lvi && lvi->lock_mode == LCK_EXCL && mode == LCK_WRITE) {
+		DEBUGLOG("hold_lock, EX already held covers PW\n");
+		count_lock_op(LOCK_OP_LOCAL);
+		return 0;
+	}
+
+	count_lock_op(LOCK_OP_REMOTE);
+
 	/* Only allow explicit conversions */
 	if (lvi && !(flags & LCKF_CONVERT)) {
 		errno = EBUSY;
@@ -255,8 +336,10 @@ static int hold_lock(char *resource, int mode, int flags)
 		status =
 		    sync_lock(resource, mode, flags, &lvi->lock_id);
 		saved_errno = errno;
-		if (!status)
+		if (!status) {
 			lvi->lock_mode = mode;
+			lock_lease_break(resource);
+		}
 
 		if (status) {
 			DEBUGLOG("hold_lock. convert to %d failed: %s\n", mode,
@@ -275,8 +358,10 @@ static int hold_lock(char *resource, int mode, int flags)
 			free(lvi);
 			DEBUGLOG("hold_lock. lock at %d failed: %s\n", mode,
 				 strerror(errno));
-		} else
+		} else {
 			insert_info(resource, lvi);
+			lock_lease_break(resource);
+		}
 
 		errno = saved_errno;
 	}
@@ -295,11 +380,13 @@ static int hold_unlock(char *resource)
 		return 0;
 	}
 
+	count_lock_op(LOCK_OP_REMOTE);
 	status = sync_unlock(resource, lvi->lock_id);
 	saved_errno = errno;
 	if (!status) {
 		remove_info(resource);
 		free(lvi);
+		lock_lease_break(resource);
 	} else {
 		DEBUGLOG("hold_unlock. unlock failed(%d): %s\n", status,
 			 strerror(errno));
@@ -328,6 +415,7 @@ static int do_activate_lv(char *resource, unsigned char lock_flags, int mode)
 	oldmode = get_current_lock(resource);
 	if (oldmode == mode && (lock_flags & LCK_CLUSTER_VG)) {
 		DEBUGLOG("do_activate_lv, lock already held at %d\n", oldmode);
+		count_lock_op(LOCK_OP_LOCAL);
 		return 0;	/* Nothing to do */
 	}
 
@@ -457,16 +545,10 @@ static int do_deactivate_lv(char *resource, unsigned char lock_flags)
 const char *do_lock_query(char *resource)
 {
 	int mode;
-	const char *type = NULL;
+	const char *type;
 
 	mode = get_current_lock(resource);
-	switch (mode) {
-		case LCK_NULL: type = "NL"; break;
-		case LCK_READ: type = "CR"; break;
-		case LCK_PREAD:type = "PR"; break;
-		case LCK_WRITE:type = "PW"; break;
-		case LCK_EXCL: type = "EX"; break;
-	}
+	type = lock_mode_name(mode);
 
 	DEBUGLOG("do_lock_query: resource '%s', mode %i (%s)\n", resource, mode, type ?: "?");
 
@@ -490,7 +572,7 @@ int do_lock_lv(unsigned char command, unsigned char lock_flags, char *resource)
 		}
 	}
 
-	pthread_mutex_lock(&lvm_lock);
+	lock_lvm();
 	if (lock_flags & LCK_MIRROR_NOSYNC_MODE)
 		init_mirror_in_sync(1);
 
@@ -539,7 +621,7 @@ int do_lock_lv(unsigned char command, unsigned char lock_flags, char *resource)
 
 	/* clean the pool for another command */
 	dm_pool_empty(cmd->mem);
-	pthread_mutex_unlock(&lvm_lock);
+	unlock_lvm();
 
 	DEBUGLOG("Command return is %d, memlock is %d\n", status, memlock());
 	return status;
@@ -585,9 +667,9 @@ int post_lock_lv(unsigned char command, unsigned char lock_flags,
 		if (oldmode == LCK_WRITE) {
 			struct lvinfo lvi;
 
-			pthread_mutex_lock(&lvm_lock);
+			lock_lvm();
 			status = lv_info_by_lvid(cmd, resource, origin_only, &lvi, 0, 0);
-			pthread_mutex_unlock(&lvm_lock);
+			unlock_lvm();
 			if (!status)
 				return EIO;
 
@@ -616,10 +698,10 @@ int do_refresh_cache()
 	DEBUGLOG("Refreshing context\n");
 	log_notice("Refreshing context");
 
-	pthread_mutex_lock(&lvm_lock);
+	lock_lvm();
 
 	if (!refresh_toolcontext(cmd)) {
-		pthread_mutex_unlock(&lvm_lock);
+		unlock_lvm();
 		return -1;
 	}
 
@@ -628,7 +710,7 @@ int do_refresh_cache()
 	lvmcache_label_scan(cmd, 2);
 	dm_pool_empty(cmd->mem);
 
-	pthread_mutex_unlock(&lvm_lock);
+	unlock_lvm();
 
 	return 0;
 }
@@ -680,6 +762,7 @@ void do_lock_vg(unsigned char command, unsigned char lock_flags, char *resource)
 {
 	uint32_t lock_cmd = command;
 	char *vgname = resource + 2;
+	struct vg_cache_update *vcu;
 
 	lock_cmd &= (LCK_SCOPE_MASK | LCK_TYPE_MASK | LCK_HOLD);
 
@@ -698,22 +781,26 @@ void do_lock_vg(unsigned char command, unsigned char lock_flags, char *resource)
 		return;
 	}
 
-	pthread_mutex_lock(&lvm_lock);
-	switch (lock_cmd) {
-		case LCK_VG_COMMIT:
-			DEBUGLOG("vg_commit notification for VG %s\n", vgname);
-			lvmcache_commit_metadata(vgname);
-			break;
-		case LCK_VG_REVERT:
-			DEBUGLOG("vg_revert notification for VG %s\n", vgname);
-			lvmcache_drop_metadata(vgname, 1);
-			break;
-		case LCK_VG_DROP_CACHE:
-		default:
-			DEBUGLOG("Invalidating cached metadata for VG %s\n", vgname);
-			lvmcache_drop_metadata(vgname, 0);
+	if (!pthread_mutex_trylock(&lvm_lock)) {
+		apply_vg_cache_updates();
+		update_vg_cache(lock_cmd, vgname);
+		pthread_mutex_unlock(&lvm_lock);
+		return;
 	}
-	pthread_mutex_unlock(&lvm_lock);
+
+	/* Busy: leave it for the current holder of lvm_lock */
+	if (!(vcu = malloc(sizeof(*vcu) + strlen(vgname) + 1))) {
+		lock_lvm();
+		update_vg_cache(lock_cmd, vgname);
+		unlock_lvm();
+		return;
+	}
+
+	vcu->lock_cmd = lock_cmd;
+	strcpy(vcu->vgname, vgname);
+	pthread_mutex_lock(&vg_cache_lock);
+	dm_list_add(&vg_cache_updates, &vcu->list);
+	pthread_mutex_unlock(&vg_cache_lock);
 }
 
 /*
@@ -739,63 +826,117 @@ static int was_ex_lock(char *uuid, char **argv)
 	return 0;
 }
 
+static int lvid_cmp(const void *a, const void *b)
+{
+	return strcmp(a, b);
+}
+
 /*
  * Ideally, clvmd should be started before any LVs are active
  * but this may not be the case...
  * I suppose this also comes in handy if clvmd crashes, not that it would!
+ *
+ * Active LVs are found from the UUIDs of the device-mapper devices, so
+ * only VGs with something active need their metadata read.
  */
 static void *get_initial_state(char **argv)
 {
+	struct dm_task *dmt, *info_dmt;
+	struct dm_names *names;
+	struct dm_info info;
+	struct volume_group *vg = NULL;
+	struct lv_list *lvl;
+	const char *uuid;
+	char (*lvids)[2 * ID_LEN + 1] = NULL;
+	char vgid[ID_LEN];
+	void *new_lvids;
+	unsigned next = 0, count = 0, alloced = 0, i;
 	int lock_mode;
-	char lv[64], vg[64], flags[25], vg_flags[25];
-	char uuid[65];
-	char line[255];
-	FILE *lvs =
-	    popen
-	    (LVM_PATH " lvs  --config 'log{command_names=0 prefix=\"\"}' --nolocking --noheadings -o vg_uuid,lv_uuid,lv_attr,vg_attr",
-	     "r");
 
-	if (!lvs)
+	if (!(dmt = dm_task_create(DM_DEVICE_LIST)))
 		return NULL;
 
-	while (fgets(line, sizeof(line), lvs)) {
-	        if (sscanf(line, "%s %s %s %s\n", vg, lv, flags, vg_flags) == 4) {
-
-			/* States: s:suspended a:active S:dropped snapshot I:invalid snapshot */
-		        if (strlen(vg) == 38 &&                         /* is is a valid UUID ? */
-			    (flags[4] == 'a' || flags[4] == 's') &&	/* is it active or suspended? */
-			    vg_flags[5] == 'c') {			/* is it clustered ? */
-				/* Convert hyphen-separated UUIDs into one */
-				memcpy(&uuid[0], &vg[0], 6);
-				memcpy(&uuid[6], &vg[7], 4);
-				memcpy(&uuid[10], &vg[12], 4);
-				memcpy(&uuid[14], &vg[17], 4);
-				memcpy(&uuid[18], &vg[22], 4);
-				memcpy(&uuid[22], &vg[27], 4);
-				memcpy(&uuid[26], &vg[32], 6);
-				memcpy(&uuid[32], &lv[0], 6);
-				memcpy(&uuid[38], &lv[7], 4);
-				memcpy(&uuid[42], &lv[12], 4);
-				memcpy(&uuid[46], &lv[17], 4);
-				memcpy(&uuid[50], &lv[22], 4);
-				memcpy(&uuid[54], &lv[27], 4);
-				memcpy(&uuid[58], &lv[32], 6);
-				uuid[64] = '\0';
-
-				lock_mode = LCK_READ;
-
-				/* Look for this lock in the list of EX locks
-				   we were passed on the command-line */
-				if (was_ex_lock(uuid, argv))
-					lock_mode = LCK_EXCL;
-
-				DEBUGLOG("getting initial lock for %s\n", uuid);
-				hold_lock(uuid, lock_mode, LCKF_NOQUEUE);
+	if (!dm_task_run(dmt) || !(names = dm_task_get_names(dmt))) {
+		DEBUGLOG("Failed to list device-mapper devices\n");
+		goto out;
+	}
+
+	/* Collect the UUIDs of active or suspended top-level LV devices */
+	if (names->dev)
+		do {
+			names = (struct dm_names *)((char *) names + next);
+			next = names->next;
+
+			if (!(info_dmt = dm_task_create(DM_DEVICE_INFO)))
+				goto out;
+
+			if (!dm_task_set_name(info_dmt, names->name) ||
+			    !dm_task_run(info_dmt) ||
+			    !dm_task_get_info(info_dmt, &info) ||
+			    !info.exists || !(info.live_table || info.suspended) ||
+			    !(uuid = dm_task_get_uuid(info_dmt)) ||
+			    strncmp(uuid, UUID_PREFIX, sizeof(UUID_PREFIX) - 1) ||
+			    strlen(uuid) != sizeof(UUID_PREFIX) - 1 + 2 * ID_LEN) {
+				dm_task_destroy(info_dmt);
+				continue;
 			}
+
+			if (count == alloced) {
+				alloced = alloced ? alloced * 2 : 64;
+				if (!(new_lvids = realloc(lvids, alloced * sizeof(*lvids)))) {
+					dm_task_destroy(info_dmt);
+					goto out;
+				}
+				lvids = new_lvids;
+			}
+			strcpy(lvids[count++], uuid + sizeof(UUID_PREFIX) - 1);
+			dm_task_destroy(info_dmt);
+		} while (next);
+
+	/* Group the LVs by VG so each VG is read once */
+	qsort(lvids, count, sizeof(*lvids), lvid_cmp);
+
+	for (i = 0; i < count; i++) {
+		if (!i || strncmp(lvids[i], vgid, ID_LEN)) {
+			memcpy(vgid, lvids[i], ID_LEN);
+			if (vg)
+				free_vg(vg);
+			vg = vg_read_by_vgid(cmd, vgid, 0);
 		}
+
+		/*
+		 * Only visible LVs in clustered VGs, as lvs would list them.
+		 * A device whose LV is not in the metadata is skipped alone.
+		 */
+		if (!vg || (vg->status & EXPORTED_VG) || !vg_is_clustered(vg) ||
+		    !(lvl = find_lv_in_vg_by_lvid(vg, (const union lvid *) lvids[i])) ||
+		    !lv_is_visible(lvl->lv))
+			lvids[i][0] = '\0';
 	}
-	if (fclose(lvs))
-		DEBUGLOG("lvs fclose failed: %s\n", strerror(errno));
+
+	if (vg)
+		free_vg(vg);
+	dm_pool_empty(cmd->mem);
+
+	/* Now take the locks together */
+	for (i = 0; i < count; i++) {
+		if (!lvids[i][0])
+			continue;
+
+		lock_mode = LCK_READ;
+
+		/* Look for this lock in the list of EX locks
+		   we were passed on the command-line */
+		if (was_ex_lock(lvids[i], argv))
+			lock_mode = LCK_EXCL;
+
+		DEBUGLOG("getting initial lock for %s\n", lvids[i]);
+		hold_lock(lvids[i], lock_mode, LCKF_NOQUEUE);
+	}
+
+out:
+	free(lvids);
+	dm_task_destroy(dmt);
 	return NULL;
 }
 
@@ -854,7 +995,7 @@ void lvm_do_backup(const char *vgname)
 
 	DEBUGLOG("Triggering backup of VG metadata for %s.\n", vgname);
 
-	pthread_mutex_lock(&lvm_lock);
+	lock_lvm();
 
 	vg = vg_read_internal(cmd, vgname, NULL /*vgid*/, 1, &consistent);
 
@@ -866,7 +1007,7 @@ void lvm_do_backup(const char *vgname)
 	free_vg(vg);
 	dm_pool_empty(cmd->mem);
 
-	pthread_mutex_unlock(&lvm_lock);
+	unlock_lvm();
 }
 
 struct dm_hash_node *get_next_excl_lock(struct dm_hash_node *v, char **name)
@@ -18,6 +18,7 @@
  * There is a listening TCP socket which accepts new connections in the
  * normal way.
  * It can also make outgoing connnections to the other clvmd nodes.
+ * Messages are framed, queued and buffered by tcp-transport.c.
  */
 
 #include "clvmd-common.h"
@@ -41,6 +42,7 @@
 #include "clvmd-comms.h"
 #include "clvmd.h"
 #include "clvmd-gulm.h"
+#include "tcp-transport.h"
 
 #define DEFAULT_TCP_PORT 21064
 
@@ -48,6 +50,9 @@ static int listen_fd = -1;
 static int tcp_port;
 struct dm_hash_table *sock_hash;
 
+/* Senders look up sockets from the LVM threads too */
+static pthread_mutex_t sock_hash_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static int get_our_ip_address(char *addr, int *family);
 static int read_from_tcpsock(struct local_client *fd, char *buf, int len, char *csid,
 			     struct local_client **new_client);
@@ -107,11 +112,17 @@ void tcp_remove_client(const char *c_csid)
        the hash table so we don't try to use it for sending any more */
     for (i = 0; i < 2; i++)
     {
+	pthread_mutex_lock(&sock_hash_lock);
 	client = dm_hash_lookup_binary(sock_hash, csid, GULM_MAX_CSID_LEN);
 	if (client)
-	{
 	    dm_hash_remove_binary(sock_hash, csid, GULM_MAX_CSID_LEN);
-	    client->removeme = 1;
+	pthread_mutex_unlock(&sock_hash_lock);
+
+	if (client)
+	{
+	    remove_client(client);
+	    tcp_conn_put(client->bits.net.private);
+	    client->bits.net.private = NULL;
 	    close(client->fd);
 	}
 	/* Look for a mangled one too, on the 2nd iteration. */
@@ -139,10 +150,18 @@ int alloc_client(int fd, const char *c_csid, struct local_client **new_client)
     client->fd = fd;
     client->type = CLUSTER_DATA_SOCK;
     client->callback = read_from_tcpsock;
+    client->bits.net.private = tcp_conn_create(fd);
+    if (!client->bits.net.private)
+    {
+	DEBUGLOG("malloc failed\n");
+	free(client);
+	return -1;
+    }
     if (new_client)
 	*new_client = client;
 
     /* Add to our list of node sockets */
+    pthread_mutex_lock(&sock_hash_lock);
     if (dm_hash_lookup_binary(sock_hash, csid, GULM_MAX_CSID_LEN))
     {
 	DEBUGLOG("alloc_client mangling CSID for second connection\n");
@@ -161,12 +180,15 @@ int alloc_client(int fd, const char *c_csid, struct local_client **new_client)
 	    DEBUGLOG("Multiple incoming connections from node\n");
             syslog(LOG_ERR, " Bogus incoming connection from %d.%d.%d.%d\n", csid[0],csid[1],csid[2],csid[3]);
 
+	    pthread_mutex_unlock(&sock_hash_lock);
+	    tcp_conn_put(client->bits.net.private);
 	    free(client);
             errno = ECONNREFUSED;
             return -1;
         }
     }
     dm_hash_insert_binary(sock_hash, csid, GULM_MAX_CSID_LEN, client);
+    pthread_mutex_unlock(&sock_hash_lock);
 
     return 0;
 }
@@ -227,34 +249,14 @@ int cluster_fd_gulm_callback(struct local_client *fd, char *buf, int len, const
     return newfd;
 }
 
-/* Try to get at least 'len' bytes from the socket */
-static int really_read(int fd, char *buf, int len)
-{
-	int got, offset;
-
-	got = offset = 0;
-
-	do {
-		got = read(fd, buf+offset, len-offset);
-		DEBUGLOG("really_read. got %d bytes\n", got);
-		offset += got;
-	} while (got > 0 && offset < len);
-
-	if (got < 0)
-		return got;
-	else
-		return offset;
-}
-
-
 static int read_from_tcpsock(struct local_client *client, char *buf, int len, char *csid,
 			     struct local_client **new_client)
 {
     struct sockaddr_in6 addr;
     socklen_t slen = sizeof(addr);
-    struct clvm_header *header = (struct clvm_header *)buf;
+    struct tcp_conn *conn = client->bits.net.private;
     int status;
-    uint32_t arglen;
+    int msglen = 0;
 
     DEBUGLOG("read_from_tcpsock fd %d\n", client->fd);
     *new_client = NULL;
@@ -263,25 +265,21 @@ static int read_from_tcpsock(struct local_client *client, char *buf, int len, ch
     getpeername(client->fd, (struct sockaddr *)&addr, &slen);
     memcpy(csid, &addr.sin6_addr, GULM_MAX_CSID_LEN);
 
-    /* Read just the header first, then get the rest if there is any.
-     * Stream sockets, sigh.
-     */
-    status = really_read(client->fd, buf, sizeof(struct clvm_header));
+    /* Take whatever has arrived in one go, then pass on every
+       complete message in it. Stream sockets, sigh. */
+    status = tcp_conn_fill(conn);
     if (status > 0)
     {
-	    int status2;
-
-	    arglen = ntohl(header->arglen);
-
-	    /* Get the rest */
-	    if (arglen && arglen < GULM_MAX_CLUSTER_MESSAGE)
-	    {
-		    status2 = really_read(client->fd, buf+status, arglen);
-		    if (status2 > 0)
-			    status += status2;
-		    else
-			    status = status2;
-	    }
+	gulm_add_up_node(csid);
+
+	while ((msglen = tcp_conn_next_frame(conn, buf, len)) > 0)
+	    process_message(client, buf, msglen, csid);
+
+	if (msglen < 0)
+	{
+	    syslog(LOG_ERR, "Bad message from %s: %m", print_csid(csid));
+	    status = -1;
+	}
     }
 
     DEBUGLOG("read_from_tcpsock, status = %d(errno = %d)\n", status, errno);
@@ -299,16 +297,17 @@ static int read_from_tcpsock(struct local_client *client, char *buf, int len, ch
 	/* If the csid was mangled, then make sure we remove the right entry */
 	if (client->bits.net.flags)
 	    remcsid[0] ^= 0x80;
-	dm_hash_remove_binary(sock_hash, remcsid, GULM_MAX_CSID_LEN);
+	pthread_mutex_lock(&sock_hash_lock);
+	if (dm_hash_lookup_binary(sock_hash, remcsid, GULM_MAX_CSID_LEN) == client)
+	    dm_hash_remove_binary(sock_hash, remcsid, GULM_MAX_CSID_LEN);
+	pthread_mutex_unlock(&sock_hash_lock);
+
+	tcp_conn_put(conn);
+	client->bits.net.private = NULL;
 
 	/* Tell cluster manager layer */
 	add_down_node(remcsid);
     }
-    else {
-	    gulm_add_up_node(csid);
-	    /* Send it back to clvmd */
-	    process_message(client, buf, status, csid);
-    }
     return status;
 }
 
@@ -367,6 +366,7 @@ static int tcp_send_message(void *buf, int msglen, const char *csid, const char
 {
     int status;
     struct local_client *client;
+    struct tcp_conn *conn = NULL;
     char ourcsid[GULM_MAX_CSID_LEN];
 
     assert(csid);
@@ -378,16 +378,36 @@ static int tcp_send_message(void *buf, int msglen, const char *csid, const char
     if (memcmp(csid, ourcsid, GULM_MAX_CSID_LEN) == 0)
 	return msglen;
 
+    pthread_mutex_lock(&sock_hash_lock);
     client = dm_hash_lookup_binary(sock_hash, csid, GULM_MAX_CSID_LEN);
+    pthread_mutex_unlock(&sock_hash_lock);
     if (!client)
     {
 	status = gulm_connect_csid(csid, &client);
 	if (status)
 	    return -1;
     }
-    DEBUGLOG("tcp_send_message, fd = %d\n", client->fd);
 
-    return write(client->fd, buf, msglen);
+    /* Hold the connection in case the main thread drops it meanwhile */
+    pthread_mutex_lock(&sock_hash_lock);
+    client = dm_hash_lookup_binary(sock_hash, csid, GULM_MAX_CSID_LEN);
+    if (client)
+    {
+	conn = client->bits.net.private;
+	tcp_conn_get(conn);
+	DEBUGLOG("tcp_send_message, fd = %d\n", client->fd);
+    }
+    pthread_mutex_unlock(&sock_hash_lock);
+    if (!client)
+    {
+	errno = ENOTCONN;
+	return -1;
+    }
+
+    status = tcp_conn_send(conn, buf, msglen);
+    tcp_conn_put(conn);
+
+    return status;
 }
 
 
@@ -0,0 +1,439 @@
+/*
+ * Copyright (C) 2010 Red Hat, Inc. All rights reserved.
+ *
+ * This file is part of LVM2.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU Lesser General Public License v.2.1.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Framing, send queueing and receive buffering for tcp-comms.
+ *
+ * A sender that finds nobody writing to the peer writes its message
+ * directly and then keeps sending whatever other senders queued
+ * meanwhile with writev() until the queue is empty, so a burst of
+ * replies or a broadcast from several threads leaves in a few large
+ * writes instead of one write() per message.  Nagle is turned off as we coalesce ourselves;
+ * TCP_CORK holds back partial segments only while more messages keep
+ * arriving during a write.
+ *
+ * Received data goes into a ring buffer with one readv() per wakeup and
+ * all complete frames in it are handed out before the next read.
+ *
+ * Until the peer has sent TCP_CAP_FRAMING, messages are written bare
+ * as older clvmds expect them.
+ */
+
+#include "clvmd-common.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "clvm.h"
+#include "tcp-transport.h"
+
+#define TCP_FRAME_HDR sizeof(uint32_t)
+#define TCP_RING_SIZE (4 * (TCP_MAX_FRAME + TCP_FRAME_HDR))
+#define TCP_MAX_IOV 64
+#define TCP_HELLO_ARGS 4	/* Version numbers, then capabilities */
+
+struct tcp_msg {
+	struct dm_list list;
+	int len;		/* Including the frame header */
+	char frame[0];
+};
+
+struct tcp_conn {
+	int fd;
+	int refs;
+
+	pthread_mutex_t mutex;	/* Protects everything above the ring */
+	struct dm_list send_queue;
+	int writing;		/* A sender is emptying send_queue */
+	int error;		/* Sticky errno after a failed write */
+	int framed;		/* The peer reads frames */
+
+	/* Receive ring: only touched by the polling thread */
+	unsigned ring_start;
+	unsigned ring_used;
+	char ring[TCP_RING_SIZE];
+};
+
+static void _free_msgs(struct dm_list *msgs)
+{
+	struct tcp_msg *msg, *tmp;
+
+	dm_list_iterate_items_safe(msg, tmp, msgs) {
+		dm_list_del(&msg->list);
+		free(msg);
+	}
+}
+
+/* Write out a whole iovec, however many writes it takes */
+static int _writev_all(int fd, struct iovec *iov, int n);
+
+/* Our opening VERSION, in the format every clvmd reads */
+static int _send_hello(int fd)
+{
+	char buf[sizeof(struct clvm_header) + TCP_HELLO_ARGS * sizeof(uint32_t)];
+	struct clvm_header *hdr = (struct clvm_header *) buf;
+	uint32_t args[TCP_HELLO_ARGS];
+	struct iovec iov;
+
+	memset(buf, 0, sizeof(buf));
+	hdr->cmd = CLVMD_CMD_VERSION;
+	hdr->arglen = htonl(sizeof(args));
+
+	args[0] = htonl(CLVMD_MAJOR_VERSION);
+	args[1] = htonl(CLVMD_MINOR_VERSION);
+	args[2] = htonl(CLVMD_PATCH_VERSION);
+	args[3] = htonl(TCP_CAP_FRAMING);
+	memcpy(hdr->args, args, sizeof(args));
+
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(buf);
+
+	return _writev_all(fd, &iov, 1);
+}
+
+struct tcp_conn *tcp_conn_create(int fd)
+{
+	struct tcp_conn *conn;
+	int one = 1;
+
+	if (!(conn = malloc(sizeof(*conn))))
+		return NULL;
+
+	memset(conn, 0, offsetof(struct tcp_conn, ring));
+	conn->fd = fd;
+	conn->refs = 1;
+	pthread_mutex_init(&conn->mutex, NULL);
+	dm_list_init(&conn->send_queue);
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if (_send_hello(fd))
+		conn->error = errno;
+
+	return conn;
+}
+
+void tcp_conn_get(struct tcp_conn *conn)
+{
+	pthread_mutex_lock(&conn->mutex);
+	conn->refs++;
+	pthread_mutex_unlock(&conn->mutex);
+}
+
+void tcp_conn_set_framed(struct tcp_conn *conn)
+{
+	pthread_mutex_lock(&conn->mutex);
+	conn->framed = 1;
+	pthread_mutex_unlock(&conn->mutex);
+}
+
+int tcp_conn_framed(struct tcp_conn *conn)
+{
+	int framed;
+
+	pthread_mutex_lock(&conn->mutex);
+	framed = conn->framed;
+	pthread_mutex_unlock(&conn->mutex);
+
+	return framed;
+}
+
+void tcp_conn_put(struct tcp_conn *conn)
+{
+	int refs;
+
+	pthread_mutex_lock(&conn->mutex);
+	refs = --conn->refs;
+	pthread_mutex_unlock(&conn->mutex);
+
+	if (refs)
+		return;
+
+	_free_msgs(&conn->send_queue);
+	pthread_mutex_destroy(&conn->mutex);
+	free(conn);
+}
+
+/* Write out a whole iovec, however many writes it takes */
+static int _writev_all(int fd, struct iovec *iov, int n)
+{
+	ssize_t len;
+
+	while (n) {
+		if ((len = writev(fd, iov, n)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		/* Step over whatever went, then finish the rest */
+		while (n && len >= (ssize_t) iov->iov_len) {
+			len -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n) {
+			iov->iov_base = (char *) iov->iov_base + len;
+			iov->iov_len -= len;
+		}
+	}
+
+	return 0;
+}
+
+/* Write out a list of messages, freeing them as they go */
+static int _write_msgs(int fd, struct dm_list *msgs)
+{
+	struct iovec iov[TCP_MAX_IOV];
+	struct tcp_msg *msg, *tmp;
+	int n;
+
+	while (!dm_list_empty(msgs)) {
+		n = 0;
+		dm_list_iterate_items(msg, msgs) {
+			iov[n].iov_base = msg->frame;
+			iov[n].iov_len = msg->len;
+			if (++n == TCP_MAX_IOV)
+				break;
+		}
+
+		if (_writev_all(fd, iov, n))
+			return -1;
+
+		dm_list_iterate_items_safe(msg, tmp, msgs) {
+			if (!n--)
+				break;
+			dm_list_del(&msg->list);
+			free(msg);
+		}
+	}
+
+	return 0;
+}
+
+/* Called and returns with conn->mutex held */
+static void _flush_queue(struct tcp_conn *conn)
+{
+	struct dm_list msgs;
+	int cork, corked = 0, error;
+
+	while (!conn->error && !dm_list_empty(&conn->send_queue)) {
+		dm_list_init(&msgs);
+		dm_list_splice(&msgs, &conn->send_queue);
+
+		pthread_mutex_unlock(&conn->mutex);
+		error = _write_msgs(conn->fd, &msgs) ? errno : 0;
+		_free_msgs(&msgs);
+		pthread_mutex_lock(&conn->mutex);
+		conn->error = error;
+
+		/* More came in meanwhile: send only full segments until done */
+		if (!corked && !dm_list_empty(&conn->send_queue)) {
+			cork = 1;
+			setsockopt(conn->fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+			corked = 1;
+		}
+	}
+
+	if (corked) {
+		cork = 0;
+		setsockopt(conn->fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+	}
+
+	if (conn->error)
+		_free_msgs(&conn->send_queue);
+}
+
+int tcp_conn_send(struct tcp_conn *conn, const void *buf, int len)
+{
+	struct tcp_msg *msg = NULL;
+	char frame[TCP_FRAME_HDR + TCP_MAX_FRAME];
+	struct iovec iov;
+	uint32_t frame_len = htonl(len);
+	unsigned hdr_len;
+	int error;
+
+	if (len <= 0 || len > TCP_MAX_FRAME) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	pthread_mutex_lock(&conn->mutex);
+
+	/* Bare messages for a peer that has not said it reads frames */
+	hdr_len = conn->framed ? TCP_FRAME_HDR : 0;
+
+	/* Nobody else sending: write it straight out from the stack */
+	if (!conn->error && !conn->writing) {
+		conn->writing = 1;
+		pthread_mutex_unlock(&conn->mutex);
+
+		memcpy(frame, &frame_len, hdr_len);
+		memcpy(frame + hdr_len, buf, len);
+		iov.iov_base = frame;
+		iov.iov_len = hdr_len + len;
+		error = _writev_all(conn->fd, &iov, 1) ? errno : 0;
+
+		pthread_mutex_lock(&conn->mutex);
+		conn->error = error;
+		_flush_queue(conn);
+		conn->writing = 0;
+		goto out;
+	}
+
+	/* Otherwise the thread already writing will pick it up */
+	pthread_mutex_unlock(&conn->mutex);
+
+	if (!(msg = malloc(sizeof(*msg) + hdr_len + len)))
+		return -1;
+
+	msg->len = hdr_len + len;
+	memcpy(msg->frame, &frame_len, hdr_len);
+	memcpy(msg->frame + hdr_len, buf, len);
+
+	pthread_mutex_lock(&conn->mutex);
+	if (!conn->error) {
+		dm_list_add(&conn->send_queue, &msg->list);
+		msg = NULL;
+
+		/* It may have finished while we were copying */
+		if (!conn->writing) {
+			conn->writing = 1;
+			_flush_queue(conn);
+			conn->writing = 0;
+		}
+	}
+out:
+	error = conn->error;
+	pthread_mutex_unlock(&conn->mutex);
+
+	free(msg);
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+
+	return len;
+}
+
+int tcp_conn_fill(struct tcp_conn *conn)
+{
+	struct iovec iov[2];
+	unsigned tail = (conn->ring_start + conn->ring_used) % TCP_RING_SIZE;
+	unsigned space = TCP_RING_SIZE - conn->ring_used;
+	int n = 1;
+	ssize_t len;
+
+	/* Frames never exceed the ring, so it is only full if corrupt */
+	if (!space) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	iov[0].iov_base = conn->ring + tail;
+	iov[0].iov_len = TCP_RING_SIZE - tail;
+	if (iov[0].iov_len > space)
+		iov[0].iov_len = space;
+	else if (iov[0].iov_len < space) {
+		iov[1].iov_base = conn->ring;
+		iov[1].iov_len = space - iov[0].iov_len;
+		n = 2;
+	}
+
+	if ((len = readv(conn->fd, iov, n)) > 0)
+		conn->ring_used += len;
+
+	return len;
+}
+
+/* Copy len bytes starting offset bytes into the ring */
+static void _ring_copy(struct tcp_conn *conn, unsigned offset, char *buf,
+		       unsigned len)
+{
+	unsigned start = (conn->ring_start + offset) % TCP_RING_SIZE;
+	unsigned first = TCP_RING_SIZE - start;
+
+	if (first > len)
+		first = len;
+
+	memcpy(buf, conn->ring + start, first);
+	memcpy(buf + first, conn->ring, len - first);
+}
+
+/* Take in the peer's opening VERSION if that is what msg is */
+static int _recv_hello(struct tcp_conn *conn, const char *msg, unsigned len)
+{
+	const struct clvm_header *hdr = (const struct clvm_header *) msg;
+	uint32_t args[TCP_HELLO_ARGS];
+
+	if (len < sizeof(*hdr) + sizeof(args) || hdr->cmd != CLVMD_CMD_VERSION ||
+	    ntohl(hdr->arglen) < sizeof(args))
+		return 0;
+
+	/* An older clvmd's VERSION has no capabilities: pass it on */
+	memcpy(args, hdr->args, sizeof(args));
+	if (!(ntohl(args[3]) & TCP_CAP_FRAMING))
+		return 0;
+
+	tcp_conn_set_framed(conn);
+
+	return 1;
+}
+
+int tcp_conn_next_frame(struct tcp_conn *conn, char *buf, int buflen)
+{
+	struct clvm_header hdr;
+	uint32_t frame_len;
+	unsigned hdr_len;
+
+	while (conn->ring_used >= TCP_FRAME_HDR) {
+		_ring_copy(conn, 0, (char *) &frame_len, TCP_FRAME_HDR);
+
+		if (*(char *) &frame_len) {
+			/* A bare message is as long as its header says */
+			if (conn->ring_used < sizeof(hdr))
+				return 0;
+			_ring_copy(conn, 0, (char *) &hdr, sizeof(hdr));
+			hdr_len = 0;
+			frame_len = ntohl(hdr.arglen);
+			frame_len = (frame_len > TCP_MAX_FRAME - sizeof(hdr)) ?
+				    TCP_MAX_FRAME + 1 : sizeof(hdr) + frame_len;
+		} else {
+			hdr_len = TCP_FRAME_HDR;
+			frame_len = ntohl(frame_len);
+		}
+
+		if (!frame_len || frame_len > TCP_MAX_FRAME || frame_len > (unsigned) buflen) {
+			errno = EPROTO;
+			return -1;
+		}
+
+		if (conn->ring_used < hdr_len + frame_len)
+			return 0;
+
+		_ring_copy(conn, hdr_len, buf, frame_len);
+		conn->ring_start = (conn->ring_start + hdr_len + frame_len) % TCP_RING_SIZE;
+		conn->ring_used -= hdr_len + frame_len;
+
+		if (hdr_len || !_recv_hello(conn, buf, frame_len))
+			return frame_len;
+	}
+
+	return 0;
+}
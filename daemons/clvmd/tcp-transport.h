@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2010 Red Hat, Inc. All rights reserved.
+ *
+ * This file is part of LVM2.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU Lesser General Public License v.2.1.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _CLVMD_TCP_TRANSPORT_H
+#define _CLVMD_TCP_TRANSPORT_H
+
+/*
+ * Message transport over one TCP connection to a peer clvmd.
+ *
+ * A framed message goes out as its length as a 32-bit network-order
+ * integer, then the message itself.  Older clvmds instead send the
+ * bare clvm_header and read only arglen bytes after it, so framing is
+ * only used once the peer has said it reads frames:
+ *
+ * Each side starts a connection with a VERSION message in the old
+ * format that carries TCP_CAP_FRAMING after the version numbers.  An
+ * older clvmd only looks at the version numbers.  Until the peer's
+ * VERSION with TCP_CAP_FRAMING arrives, messages go out unframed.
+ * Received messages are told apart by their first byte, which is zero
+ * for a frame and the command for an unframed message.
+ */
+
+/* Largest message a frame may carry */
+#define TCP_MAX_FRAME 4096
+
+/* Capability bits after the version numbers of the opening VERSION */
+#define TCP_CAP_FRAMING 0x00000001
+
+struct tcp_conn;
+
+/*
+ * Takes over fd (but does not close it), holds one reference and sends
+ * our opening VERSION message.
+ */
+struct tcp_conn *tcp_conn_create(int fd);
+
+void tcp_conn_get(struct tcp_conn *conn);
+void tcp_conn_put(struct tcp_conn *conn);
+
+/* Frame messages from now on without waiting for the peer's VERSION */
+void tcp_conn_set_framed(struct tcp_conn *conn);
+int tcp_conn_framed(struct tcp_conn *conn);
+
+/*
+ * Queue a message for the peer, safe from any thread.  Messages queued
+ * while another thread is writing are sent by that thread in the same
+ * writev(), so this can return before the data is on the wire.
+ * Returns len, or -1 with errno set if the connection has failed.
+ */
+int tcp_conn_send(struct tcp_conn *conn, const void *buf, int len);
+
+/*
+ * Receiving side, for the thread that polls the connection only.
+ * tcp_conn_fill() reads whatever has arrived with one readv() and
+ * returns as read(2) does.  tcp_conn_next_frame() then copies out the
+ * next complete message, framed or not: it returns its length, 0 if
+ * none is complete yet, or -1 with errno EPROTO if the stream is
+ * corrupt.  The peer's opening VERSION is taken in here and not
+ * returned.
+ */
+int tcp_conn_fill(struct tcp_conn *conn);
+int tcp_conn_next_frame(struct tcp_conn *conn, char *buf, int buflen);
+
+#endif
@@ -0,0 +1,297 @@
+/*
+ * Copyright (C) 2010 Red Hat, Inc. All rights reserved.
+ *
+ * This file is part of LVM2.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v.2.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Exercise the tcp-comms transport over loopback.  A number of sender
+ * threads each broadcast messages to every peer connection, as clvmd
+ * does when it distributes a command, while the main thread receives
+ * them, checks that each sender's messages arrive complete and in
+ * order, and reports throughput and the write/read syscalls used.
+ * With -w every message is written with its own write() instead, as
+ * tcp-comms used to do.
+ *
+ * Usage: tcp_bench [-p peers] [-t threads] [-n messages] [-s size] [-w]
+ */
+#include "clvmd-common.h"
+
+#include "tcp-transport.h"
+
+#include <pthread.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <time.h>
+
+struct bench_msg {
+	uint32_t thread;
+	uint32_t seq;
+};
+
+struct bench_peer {
+	int send_fd;
+	struct tcp_conn *send_conn;
+	pthread_mutex_t write_mutex;	/* For -w */
+	int recv_fd;
+	struct tcp_conn *recv_conn;
+	uint32_t *next_seq;		/* Per sender thread */
+};
+
+static struct bench_peer *_peers;
+static int _npeers = 4, _nthreads = 4, _nmsgs = 10000, _size = 200;
+static int _plain_write;
+
+static double _elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Read and write syscall counts of this process */
+static void _syscalls(unsigned long long *reads, unsigned long long *writes)
+{
+	char line[64];
+	FILE *fp;
+
+	*reads = *writes = 0;
+	if (!(fp = fopen("/proc/self/io", "r")))
+		return;
+
+	while (fgets(line, sizeof(line), fp)) {
+		sscanf(line, "syscr: %llu", reads);
+		sscanf(line, "syscw: %llu", writes);
+	}
+	fclose(fp);
+}
+
+/* The old way: the frame goes out with one write() of its own */
+static int _write_frame(struct bench_peer *peer, const char *buf, int len)
+{
+	char frame[sizeof(uint32_t) + TCP_MAX_FRAME];
+	uint32_t frame_len = htonl(len);
+	int r;
+
+	memcpy(frame, &frame_len, sizeof(frame_len));
+	memcpy(frame + sizeof(frame_len), buf, len);
+
+	pthread_mutex_lock(&peer->write_mutex);
+	r = write(peer->send_fd, frame, sizeof(frame_len) + len);
+	pthread_mutex_unlock(&peer->write_mutex);
+
+	return (r == (int) (sizeof(frame_len) + len)) ? len : -1;
+}
+
+static void *_sender(void *arg)
+{
+	char buf[TCP_MAX_FRAME];
+	struct bench_msg *msg = (struct bench_msg *) buf;
+	int i, p, r;
+
+	memset(buf, 0, sizeof(buf));
+	msg->thread = (uint32_t) (long) arg;
+
+	for (i = 0; i < _nmsgs; i++) {
+		msg->seq = i;
+		for (p = 0; p < _npeers; p++) {
+			r = _plain_write ? _write_frame(&_peers[p], buf, _size) :
+			    tcp_conn_send(_peers[p].send_conn, buf, _size);
+			if (r != _size) {
+				fprintf(stderr, "Send failed: %s\n", strerror(errno));
+				exit(1);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/* Connect a pair of loopback sockets through the listening socket */
+static int _connect_peer(int listen_fd, struct sockaddr_in *addr,
+			 struct bench_peer *peer)
+{
+	if ((peer->send_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+	    connect(peer->send_fd, (struct sockaddr *) addr, sizeof(*addr)) ||
+	    (peer->recv_fd = accept(listen_fd, NULL, NULL)) < 0) {
+		fprintf(stderr, "Loopback connection failed: %s\n",
+			strerror(errno));
+		return 0;
+	}
+
+	if (!(peer->send_conn = tcp_conn_create(peer->send_fd)) ||
+	    !(peer->recv_conn = tcp_conn_create(peer->recv_fd)) ||
+	    !(peer->next_seq = calloc(_nthreads, sizeof(*peer->next_seq)))) {
+		fprintf(stderr, "Out of memory\n");
+		return 0;
+	}
+	pthread_mutex_init(&peer->write_mutex, NULL);
+
+	/* Nothing reads the receiving end's VERSION back */
+	tcp_conn_set_framed(peer->send_conn);
+
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	struct timespec start;
+	struct pollfd *pfd;
+	pthread_t *threads;
+	char buf[TCP_MAX_FRAME];
+	struct bench_msg *msg = (struct bench_msg *) buf;
+	unsigned long long reads0, writes0, reads, writes;
+	long long received = 0, total;
+	int c, i, len, listen_fd, one = 1;
+	double secs;
+
+	while ((c = getopt(argc, argv, "p:t:n:s:w")) != -1) {
+		switch (c) {
+		case 'p':
+			_npeers = atoi(optarg);
+			break;
+		case 't':
+			_nthreads = atoi(optarg);
+			break;
+		case 'n':
+			_nmsgs = atoi(optarg);
+			break;
+		case 's':
+			_size = atoi(optarg);
+			break;
+		case 'w':
+			_plain_write = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-p peers] [-t threads] "
+				"[-n messages] [-s size] [-w]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if ((_npeers < 1) || (_nthreads < 1) || (_nmsgs < 1) ||
+	    (_size < (int) sizeof(*msg)) || (_size > TCP_MAX_FRAME)) {
+		fprintf(stderr, "Invalid arguments\n");
+		return 1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if ((listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+	    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+	    bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+	    listen(listen_fd, _npeers) ||
+	    getsockname(listen_fd, (struct sockaddr *) &addr, &addrlen)) {
+		fprintf(stderr, "Loopback listen failed: %s\n", strerror(errno));
+		return 1;
+	}
+
+	if (!(_peers = calloc(_npeers, sizeof(*_peers))) ||
+	    !(pfd = calloc(_npeers, sizeof(*pfd))) ||
+	    !(threads = calloc(_nthreads, sizeof(*threads)))) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	for (i = 0; i < _npeers; i++) {
+		if (!_connect_peer(listen_fd, &addr, &_peers[i]))
+			return 1;
+		pfd[i].fd = _peers[i].recv_fd;
+		pfd[i].events = POLLIN;
+	}
+
+	total = (long long) _npeers * _nthreads * _nmsgs;
+	_syscalls(&reads0, &writes0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < _nthreads; i++)
+		if (pthread_create(&threads[i], NULL, _sender, (void *) (long) i)) {
+			fprintf(stderr, "pthread_create failed\n");
+			return 1;
+		}
+
+	while (received < total) {
+		if (poll(pfd, _npeers, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "poll failed: %s\n", strerror(errno));
+			return 1;
+		}
+
+		for (i = 0; i < _npeers; i++) {
+			if (!pfd[i].revents)
+				continue;
+
+			if ((len = tcp_conn_fill(_peers[i].recv_conn)) <= 0) {
+				if (len < 0 && errno == EINTR)
+					continue;
+				fprintf(stderr, "Receive failed: %s\n",
+					len ? strerror(errno) : "EOF");
+				return 1;
+			}
+
+			while ((len = tcp_conn_next_frame(_peers[i].recv_conn,
+							  buf, sizeof(buf))) > 0) {
+				if (len != _size || msg->thread >= (uint32_t) _nthreads ||
+				    msg->seq != _peers[i].next_seq[msg->thread]++) {
+					fprintf(stderr, "Message %d of %d bytes from thread "
+						"%d out of sequence on peer %d\n",
+						msg->seq, len, msg->thread, i);
+					return 1;
+				}
+				received++;
+			}
+
+			if (len < 0) {
+				fprintf(stderr, "Corrupt stream on peer %d\n", i);
+				return 1;
+			}
+		}
+	}
+
+	for (i = 0; i < _nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	secs = _elapsed(&start);
+	_syscalls(&reads, &writes);
+
+	printf("received %lld messages of %d bytes from %d threads over "
+	       "%d peers: %.3fs, %.0f messages/s\n", received, _size,
+	       _nthreads, _npeers, secs, secs > 0 ? received / secs : 0);
+	printf("syscalls: %llu writes, %llu reads (%.1f messages per write)\n",
+	       writes - writes0, reads - reads0, (writes > writes0) ?
+	       (double) received / (writes - writes0) : 0);
+
+	for (i = 0; i < _npeers; i++) {
+		tcp_conn_put(_peers[i].send_conn);
+		tcp_conn_put(_peers[i].recv_conn);
+		close(_peers[i].send_fd);
+		close(_peers[i].recv_fd);
+		pthread_mutex_destroy(&_peers[i].write_mutex);
+		free(_peers[i].next_seq);
+	}
+	close(listen_fd);
+
+	free(threads);
+	free(pfd);
+	free(_peers);
+
+	return 0;
+}
@@ -0,0 +1,365 @@
+/*
+ * Copyright (C) 2010 Red Hat, Inc. All rights reserved.
+ *
+ * This file is part of LVM2.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v.2.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Run the tcp-comms of one clvmd over loopback against two peer
+ * clvmds: one with the framing transport, connecting from 127.0.0.2,
+ * and one that speaks the old unframed format, from 127.0.0.3.
+ * Checks what each side receives, byte for byte.
+ *
+ * Only one tcp-comms can listen on the clvmd port of a host, so the
+ * peers are played by the test: the new one through tcp-transport as
+ * its tcp-comms would, the old one with plain reads and writes.
+ *
+ * Usage: tcp_comms_test
+ */
+#include "clvmd-common.h"
+
+#include "clvm.h"
+#include "clvmd-comms.h"
+#include "clvmd.h"
+#include "clvmd-gulm.h"
+#include "tcp-transport.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+#define NEW_PEER_IP "127.0.0.2"
+#define OLD_PEER_IP "127.0.0.3"
+#define MAX_RECEIVED 8
+
+/* Messages tcp-comms passed up to clvmd */
+static char _received[MAX_RECEIVED][TCP_MAX_FRAME];
+static int _received_len[MAX_RECEIVED];
+static int _nr_received;
+
+static unsigned short _port;
+
+/*
+ * Stand-ins for the clvmd and gulm functions tcp-comms calls.
+ */
+void debuglog(const char *fmt __attribute__((unused)), ...)
+{
+}
+
+int gulm_name_from_csid(const char *csid __attribute__((unused)), char *name)
+{
+	strcpy(name, "peer");
+
+	return 0;
+}
+
+void gulm_add_up_node(const char *csid __attribute__((unused)))
+{
+}
+
+void add_down_node(char *csid __attribute__((unused)))
+{
+}
+
+int get_next_node_csid(void **context __attribute__((unused)),
+		       char *csid __attribute__((unused)))
+{
+	return 0;
+}
+
+int add_client(struct local_client *new_client __attribute__((unused)))
+{
+	return 0;
+}
+
+void remove_client(struct local_client *client __attribute__((unused)))
+{
+}
+
+void process_message(struct local_client *client __attribute__((unused)),
+		     const char *buf, int len,
+		     const char *csid __attribute__((unused)))
+{
+	if (_nr_received == MAX_RECEIVED || len > TCP_MAX_FRAME)
+		return;
+
+	memcpy(_received[_nr_received], buf, len);
+	_received_len[_nr_received++] = len;
+}
+
+/* A port nothing is listening on, for init_comms() */
+static int _free_port(void)
+{
+	struct sockaddr_in6 addr;
+	socklen_t addrlen = sizeof(addr);
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin6_family = AF_INET6;
+
+	if ((fd = socket(AF_INET6, SOCK_STREAM, 0)) < 0)
+		return 0;
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+	    getsockname(fd, (struct sockaddr *) &addr, &addrlen)) {
+		close(fd);
+		return 0;
+	}
+
+	close(fd);
+	_port = ntohs(addr.sin6_port);
+
+	return 1;
+}
+
+/* The csid tcp-comms gives a peer: its IPv4 address mapped to IPv6 */
+static void _peer_csid(const char *ip, char *csid)
+{
+	char mapped[64];
+
+	sprintf(mapped, "::ffff:%s", ip);
+	inet_pton(AF_INET6, mapped, csid);
+}
+
+/* Connect from ip, and let tcp-comms accept the connection */
+static int _connect_peer(const char *ip, struct local_client **client)
+{
+	struct sockaddr_in addr;
+	char buf[TCP_MAX_FRAME];
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	inet_pton(AF_INET, ip, &addr.sin_addr);
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+	    bind(fd, (struct sockaddr *) &addr, sizeof(addr)))
+		return -1;
+
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(_port);
+
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+	    cluster_fd_gulm_callback(NULL, buf, sizeof(buf), NULL, client) < 0 ||
+	    !*client) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Let tcp-comms read what the peer sent */
+static int _pump(struct local_client *client)
+{
+	struct pollfd pfd = { .fd = client->fd, .events = POLLIN };
+	struct local_client *new_client;
+	char buf[TCP_MAX_FRAME];
+	char csid[GULM_MAX_CSID_LEN] = { 0 };
+
+	if (poll(&pfd, 1, 1000) != 1)
+		return 0;
+
+	return client->callback(client, buf, sizeof(buf), csid, &new_client) > 0;
+}
+
+static int _read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t r;
+
+	while (len) {
+		if ((r = read(fd, p, len)) <= 0)
+			return 0;
+		p += r;
+		len -= r;
+	}
+
+	return 1;
+}
+
+/* A message directed at a node, whose name is not counted in arglen */
+static int _make_msg(char *buf, uint8_t cmd, const char *node, const char *args)
+{
+	struct clvm_header *hdr = (struct clvm_header *) buf;
+	char *p = buf + offsetof(struct clvm_header, node);
+	int len = sizeof(*hdr) + strlen(node) + strlen(args);
+
+	memset(buf, 0, len);
+	hdr->cmd = cmd;
+	hdr->xid = htons(7);
+	hdr->arglen = htonl(strlen(args));
+	strcpy(p, node);
+	strcpy(p + strlen(node) + 1, args);
+
+	return len;
+}
+
+static int _check_received(int idx, const char *msg, int len)
+{
+	if (idx >= _nr_received) {
+		fprintf(stderr, "  message %d not passed on\n", idx);
+		return 0;
+	}
+
+	if (_received_len[idx] != len || memcmp(_received[idx], msg, len)) {
+		fprintf(stderr, "  message %d: %d bytes received, %d sent\n",
+			idx, _received_len[idx], len);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Both ends frame once they have each other's VERSION, so a directed
+ * message arrives whole although arglen does not cover the node name.
+ */
+static int _test_new_peer(void)
+{
+	struct local_client *client;
+	struct tcp_conn *conn;
+	char msg[TCP_MAX_FRAME], buf[TCP_MAX_FRAME], csid[GULM_MAX_CSID_LEN];
+	uint32_t frame_len;
+	int fd, len;
+
+	_nr_received = 0;
+
+	if ((fd = _connect_peer(NEW_PEER_IP, &client)) < 0 ||
+	    !(conn = tcp_conn_create(fd)))
+		return 0;
+
+	/* Each takes in the other's VERSION without passing it on */
+	if (!_pump(client) || _nr_received ||
+	    !tcp_conn_framed(client->bits.net.private)) {
+		fprintf(stderr, "  our VERSION not taken in\n");
+		return 0;
+	}
+
+	if (tcp_conn_fill(conn) <= 0 ||
+	    tcp_conn_next_frame(conn, buf, sizeof(buf)) != 0 ||
+	    !tcp_conn_framed(conn)) {
+		fprintf(stderr, "  tcp-comms VERSION not taken in\n");
+		return 0;
+	}
+
+	len = _make_msg(msg, CLVMD_CMD_LOCK_LV, "node2", "lvid");
+	if (tcp_conn_send(conn, msg, len) != len || !_pump(client) ||
+	    !_check_received(0, msg, len))
+		return 0;
+
+	/* And tcp-comms frames what it sends to the peer */
+	_peer_csid(NEW_PEER_IP, csid);
+	len = _make_msg(msg, CLVMD_CMD_REPLY, "node1", "status");
+	if (gulm_cluster_send_message(msg, len, csid, "") != len ||
+	    !_read_all(fd, &frame_len, sizeof(frame_len)) ||
+	    ntohl(frame_len) != (uint32_t) len ||
+	    !_read_all(fd, buf, len) || memcmp(buf, msg, len)) {
+		fprintf(stderr, "  reply not framed\n");
+		return 0;
+	}
+
+	tcp_conn_put(conn);
+	close(fd);
+
+	return 1;
+}
+
+/*
+ * An old peer never sends TCP_CAP_FRAMING: it gets and sends bare
+ * messages, and its own VERSION is passed on to clvmd as before.
+ */
+static int _test_old_peer(void)
+{
+	struct local_client *client;
+	struct clvm_header *hdr;
+	char msg[TCP_MAX_FRAME], buf[TCP_MAX_FRAME], csid[GULM_MAX_CSID_LEN];
+	uint32_t version[3];
+	int fd, len, len2;
+
+	_nr_received = 0;
+
+	if ((fd = _connect_peer(OLD_PEER_IP, &client)) < 0)
+		return 0;
+
+	/* Read tcp-comms' VERSION the way an old clvmd does */
+	hdr = (struct clvm_header *) buf;
+	if (!_read_all(fd, buf, sizeof(*hdr)) ||
+	    hdr->cmd != CLVMD_CMD_VERSION ||
+	    ntohl(hdr->arglen) < sizeof(version) ||
+	    !_read_all(fd, buf + sizeof(*hdr), ntohl(hdr->arglen))) {
+		fprintf(stderr, "  no VERSION in the old format\n");
+		return 0;
+	}
+	memcpy(version, hdr->args, sizeof(version));
+	if (ntohl(version[0]) != CLVMD_MAJOR_VERSION) {
+		fprintf(stderr, "  wrong major version\n");
+		return 0;
+	}
+
+	/* Its own VERSION and a command, written together */
+	hdr = (struct clvm_header *) msg;
+	memset(msg, 0, sizeof(*hdr) + sizeof(version));
+	hdr->cmd = CLVMD_CMD_VERSION;
+	hdr->arglen = htonl(sizeof(version));
+	memcpy(hdr->args, version, sizeof(version));
+	len = sizeof(*hdr) + sizeof(version);
+	len2 = _make_msg(msg + len, CLVMD_CMD_LOCK_VG, "", "V_vg");
+
+	if (write(fd, msg, len + len2) != len + len2 || !_pump(client) ||
+	    !_check_received(0, msg, len) ||
+	    !_check_received(1, msg + len, len2))
+		return 0;
+
+	if (tcp_conn_framed(client->bits.net.private)) {
+		fprintf(stderr, "  framing an old peer\n");
+		return 0;
+	}
+
+	/* tcp-comms sends it bare */
+	_peer_csid(OLD_PEER_IP, csid);
+	len = _make_msg(msg, CLVMD_CMD_REPLY, "", "status");
+	if (gulm_cluster_send_message(msg, len, csid, "") != len ||
+	    !_read_all(fd, buf, len) || memcmp(buf, msg, len)) {
+		fprintf(stderr, "  reply not sent bare\n");
+		return 0;
+	}
+
+	close(fd);
+
+	return 1;
+}
+
+int main(void)
+{
+	int failed = 0;
+
+	if (!_free_port() || init_comms(_port)) {
+		fprintf(stderr, "Failed to listen on loopback\n");
+		return 1;
+	}
+
+	if (!_test_new_peer()) {
+		fprintf(stderr, "FAIL: framing peer\n");
+		failed++;
+	}
+
+	if (!_test_old_peer()) {
+		fprintf(stderr, "FAIL: unframed peer\n");
+		failed++;
+	}
+
+	printf("%s\n", failed ? "FAILED" : "PASSED");
+
+	return failed ? 1 : 0;
+}
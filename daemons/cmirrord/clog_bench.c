@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2010 Red Hat, Inc. All rights reserved.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU Lesser General Public License v.2.1.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Replay synthetic request streams through do_request() to measure
+ * log lookup and mark tracking costs without a cluster.  Each node
+ * keeps a queue of marked regions per log, clearing the oldest when
+ * the queue is full, as the kernel does for in-flight writes.
+ *
+ * Usage: clog_bench [-l logs] [-r regions] [-n nodes] [-q depth] [-c requests]
+ */
+#include "logging.h"
+#include "common.h"
+#include "functions.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_UUID_FMT "LVM-clogbench%08d"
+
+/* Only the log half of the daemon is linked, so stub the cluster */
+int create_cluster_cpg(char *uuid __attribute__((unused)),
+		       uint64_t luid __attribute__((unused)))
+{
+	return 0;
+}
+
+int destroy_cluster_cpg(char *uuid __attribute__((unused)))
+{
+	return 0;
+}
+
+int cluster_peers_support(const char *uuid __attribute__((unused)),
+			  uint32_t tfr_version __attribute__((unused)))
+{
+	return 1;
+}
+
+static struct clog_request *_rq;
+
+static int _request(int type, int log, uint32_t nodeid,
+		    const void *data, size_t data_size)
+{
+	memset(_rq, 0, sizeof(*_rq));
+	_rq->originator = nodeid;
+	_rq->u_rq.request_type = type;
+	_rq->u_rq.luid = (uint64_t)log + 1;
+	snprintf(_rq->u_rq.uuid, DM_UUID_LEN, BENCH_UUID_FMT, log);
+	if (data_size)
+		memcpy(_rq->u_rq.data, data, data_size);
+	_rq->u_rq.data_size = data_size;
+
+	do_request(_rq, 1);
+
+	if (_rq->u_rq.error) {
+		fprintf(stderr, "Request %s for log %d failed: %d\n",
+			RQ_TYPE(type), log, _rq->u_rq.error);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int _create_log(int log, uint64_t regions)
+{
+	char ctr[64];
+	int len;
+
+	len = snprintf(ctr, sizeof(ctr), "%" PRIu64 " clustered-core 1 nosync",
+		       regions);
+	if (!_request(DM_ULOG_CTR, log, 1, ctr, len + 1))
+		return 0;
+
+	/* local_resume moves the log to the official list */
+	_rq->u_rq.request_type = DM_ULOG_RESUME;
+	if (local_resume(&_rq->u_rq))
+		return 0;
+
+	return _request(DM_ULOG_RESUME, log, 1, NULL, 0);
+}
+
+static double _elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	int logs = 256, nodes = 4, depth = 64, requests = 1000000;
+	uint64_t regions = 65536, region, *queue;
+	int c, i, log, node, slot, *queued;
+	struct timespec start;
+	double secs;
+
+	while ((c = getopt(argc, argv, "l:r:n:q:c:")) != -1) {
+		switch (c) {
+		case 'l':
+			logs = atoi(optarg);
+			break;
+		case 'r':
+			regions = strtoull(optarg, NULL, 0);
+			break;
+		case 'n':
+			nodes = atoi(optarg);
+			break;
+		case 'q':
+			depth = atoi(optarg);
+			break;
+		case 'c':
+			requests = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-l logs] [-r regions] "
+				"[-n nodes] [-q depth] [-c requests]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	if ((logs < 1) || (nodes < 1) || (depth < 1) || !regions) {
+		fprintf(stderr, "Invalid arguments\n");
+		return 1;
+	}
+
+	if (!(_rq = malloc(DM_ULOG_REQUEST_SIZE)) ||
+	    !(queue = calloc((size_t)logs * nodes * depth, sizeof(*queue))) ||
+	    !(queued = calloc((size_t)logs * nodes, sizeof(*queued)))) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (log = 0; log < logs; log++)
+		if (!_create_log(log, regions))
+			return 1;
+	printf("created %d logs of %" PRIu64 " regions: %.3fs\n",
+	       logs, regions, _elapsed(&start));
+
+	srandom(1);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < requests; i++) {
+		log = random() % logs;
+		node = random() % nodes;
+		slot = log * nodes + node;
+
+		/* Retire the oldest write once the queue is full */
+		if (queued[slot] == depth) {
+			region = queue[slot * depth];
+			memmove(queue + slot * depth, queue + slot * depth + 1,
+				(depth - 1) * sizeof(*queue));
+			queued[slot]--;
+			if (!_request(DM_ULOG_CLEAR_REGION, log, node + 1,
+				      &region, sizeof(region)))
+				return 1;
+			continue;
+		}
+
+		region = random() % regions;
+		queue[slot * depth + queued[slot]++] = region;
+		if (!_request(DM_ULOG_MARK_REGION, log, node + 1,
+			      &region, sizeof(region)) ||
+		    !_request(DM_ULOG_IS_CLEAN, log, node + 1,
+			      &region, sizeof(region)))
+			return 1;
+	}
+	secs = _elapsed(&start);
+	printf("replayed %d mark/clear streams: %.3fs, %.0f requests/s\n",
+	       requests, secs, secs > 0 ? requests / secs : 0);
+
+	for (log = 0; log < logs; log++)
+		if (!_request(DM_ULOG_POSTSUSPEND, log, 1, NULL, 0) ||
+		    cluster_postsuspend(_rq->u_rq.uuid, _rq->u_rq.luid) ||
+		    !_request(DM_ULOG_DTR, log, 1, NULL, 0))
+			return 1;
+
+	free(queued);
+	free(queue);
+	free(_rq);
+
+	return 0;
+}
@@ -0,0 +1,702 @@
+/*
+ * Copyright (C) 2010 Red Hat, Inc. All rights reserved.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU Lesser General Public License v.2.1.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Drive the cluster half of the daemon against a loopback stand-in
+ * for CPG and checkpoints, and check what it multicasts.
+ *
+ * Usage: clog_cpg_test
+ */
+#include "logging.h"
+#include "cluster.h"
+#include "common.h"
+#include "compat.h"
+#include "functions.h"
+#include "xlate.h"
+
+#include <corosync/cpg.h>
+#include <errno.h>
+#include <openais/saAis.h>
+#include <openais/saCkpt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TEST_UUID "LVM-clogcpgtest00000000"
+#define TEST_NODEID 1
+#define MAX_SENT 64
+
+/*
+ * Loopback CPG: one group, with this process as its first member.
+ * Multicast requests are recorded, and delivered back on dispatch.
+ * The other members exist only as the messages the tests deliver.
+ */
+static cpg_callbacks_t *_callbacks;
+static struct cpg_name _group;
+static struct clog_request *_sent[MAX_SENT];
+static size_t _sent_len[MAX_SENT];
+static int _nr_sent;
+static int _nr_delivered;
+static int (*_cluster_work)(void *data);
+
+/* Names of the checkpoint sections written, space separated */
+static char _sections[256];
+
+cs_error_t cpg_initialize(cpg_handle_t *handle, cpg_callbacks_t *callbacks)
+{
+	_callbacks = callbacks;
+	*handle = 1;
+
+	return CS_OK;
+}
+
+cs_error_t cpg_finalize(cpg_handle_t handle __attribute__((unused)))
+{
+	return CS_OK;
+}
+
+cs_error_t cpg_fd_get(cpg_handle_t handle __attribute__((unused)), int *fd)
+{
+	*fd = -1;
+
+	return CS_OK;
+}
+
+static void _deliver(uint32_t nodeid, const void *msg, size_t msg_len)
+{
+	char buf[DM_ULOG_REQUEST_SIZE];
+
+	/* The callback converts the message in place */
+	memcpy(buf, msg, msg_len);
+	_callbacks->cpg_deliver_fn(1, &_group, nodeid, 0, buf, msg_len);
+}
+
+cs_error_t cpg_dispatch(cpg_handle_t handle __attribute__((unused)),
+			cs_dispatch_flags_t dispatch_types __attribute__((unused)))
+{
+	int i;
+
+	while (_nr_delivered < _nr_sent) {
+		i = _nr_delivered++;
+		_deliver(TEST_NODEID, _sent[i], _sent_len[i]);
+	}
+
+	return CS_OK;
+}
+
+cs_error_t cpg_join(cpg_handle_t handle __attribute__((unused)),
+		    const struct cpg_name *group)
+{
+	_group = *group;
+
+	return CS_OK;
+}
+
+cs_error_t cpg_leave(cpg_handle_t handle __attribute__((unused)),
+		     const struct cpg_name *group __attribute__((unused)))
+{
+	return CS_OK;
+}
+
+cs_error_t cpg_mcast_joined(cpg_handle_t handle __attribute__((unused)),
+			    cpg_guarantee_t guarantee __attribute__((unused)),
+			    const struct iovec *iovec, unsigned int iov_len)
+{
+	if ((iov_len != 1) || (_nr_sent == MAX_SENT))
+		return CS_OK + 1;
+
+	if (!(_sent[_nr_sent] = malloc(iovec->iov_len)))
+		return CS_OK + 1;
+
+	memcpy(_sent[_nr_sent], iovec->iov_base, iovec->iov_len);
+	_sent_len[_nr_sent++] = iovec->iov_len;
+
+	return CS_OK;
+}
+
+/* Checkpoints can be written, but none can be read */
+SaAisErrorT saCkptInitialize(SaCkptHandleT *handle,
+			     const SaCkptCallbacksT *callbacks __attribute__((unused)),
+			     SaVersionT *version __attribute__((unused)))
+{
+	*handle = 1;
+
+	return SA_AIS_OK;
+}
+
+SaAisErrorT saCkptFinalize(SaCkptHandleT handle __attribute__((unused)))
+{
+	return SA_AIS_OK;
+}
+
+SaAisErrorT saCkptCheckpointOpen(SaCkptHandleT handle __attribute__((unused)),
+				 const SaNameT *name __attribute__((unused)),
+				 const SaCkptCheckpointCreationAttributesT *attr __attribute__((unused)),
+				 SaCkptCheckpointOpenFlagsT flags,
+				 SaTimeT timeout __attribute__((unused)),
+				 SaCkptCheckpointHandleT *h)
+{
+	if (!(flags & SA_CKPT_CHECKPOINT_CREATE))
+		return SA_AIS_ERR_NOT_EXIST;
+
+	*h = 1;
+
+	return SA_AIS_OK;
+}
+
+SaAisErrorT saCkptCheckpointClose(SaCkptCheckpointHandleT h __attribute__((unused)))
+{
+	return SA_AIS_OK;
+}
+
+SaAisErrorT saCkptCheckpointUnlink(SaCkptHandleT handle __attribute__((unused)),
+				   const SaNameT *name __attribute__((unused)))
+{
+	return SA_AIS_ERR_NOT_EXIST;
+}
+
+SaAisErrorT saCkptSectionCreate(SaCkptCheckpointHandleT h __attribute__((unused)),
+				const SaCkptSectionCreationAttributesT *attr,
+				const void *data __attribute__((unused)),
+				SaSizeT size __attribute__((unused)))
+{
+	size_t len = strlen(_sections);
+
+	snprintf(_sections + len, sizeof(_sections) - len, "%s%.*s",
+		 len ? " " : "", (int)attr->sectionId->idLen,
+		 (const char *)attr->sectionId->id);
+
+	return SA_AIS_OK;
+}
+
+SaAisErrorT saCkptSectionIterationInitialize(SaCkptCheckpointHandleT h __attribute__((unused)),
+					     SaCkptSectionsChosenT chosen __attribute__((unused)),
+					     SaTimeT expiration __attribute__((unused)),
+					     SaCkptSectionIterationHandleT *itr __attribute__((unused)))
+{
+	return SA_AIS_ERR_NOT_SUPPORTED;
+}
+
+SaAisErrorT saCkptSectionIterationNext(SaCkptSectionIterationHandleT itr __attribute__((unused)),
+				       SaCkptSectionDescriptorT *desc __attribute__((unused)))
+{
+	return SA_AIS_ERR_NO_SECTIONS;
+}
+
+SaAisErrorT saCkptSectionIterationFinalize(SaCkptSectionIterationHandleT itr __attribute__((unused)))
+{
+	return SA_AIS_OK;
+}
+
+SaAisErrorT saCkptCheckpointRead(SaCkptCheckpointHandleT h __attribute__((unused)),
+				 SaCkptIOVectorElementT *iov __attribute__((unused)),
+				 SaUint32T nr __attribute__((unused)),
+				 SaUint32T *bad __attribute__((unused)))
+{
+	return SA_AIS_ERR_NOT_SUPPORTED;
+}
+
+/* The cluster work is run directly rather than on a ready fd */
+int links_register(int fd __attribute__((unused)),
+		   const char *name __attribute__((unused)),
+		   int (*callback)(void *data),
+		   void *data __attribute__((unused)))
+{
+	_cluster_work = callback;
+
+	return 0;
+}
+
+int links_unregister(int fd __attribute__((unused)))
+{
+	_cluster_work = NULL;
+
+	return 0;
+}
+
+/* Nothing is sent back to the kernel */
+int kernel_send(struct dm_ulog_request *u_rq __attribute__((unused)))
+{
+	return 0;
+}
+
+/*
+ * Node 'nodeid' joins; the members are this node and nodes
+ * 2..nodeid.
+ */
+static void _join(uint32_t nodeid)
+{
+	struct cpg_address members[MAX_SENT];
+	uint32_t i;
+
+	for (i = 0; i < nodeid; i++) {
+		members[i].nodeid = i + 1;
+		members[i].pid = (i + 1 == TEST_NODEID) ? (uint32_t)getpid() : 1;
+		members[i].reason = 0;
+	}
+
+	_callbacks->cpg_confchg_fn(1, &_group, members, nodeid, NULL, 0,
+				   members + nodeid - 1, 1);
+}
+
+/* Node 'nodeid' leaves, 'remaining' being the nodeids of the members */
+static void _leave(uint32_t nodeid, const uint32_t *remaining, size_t count)
+{
+	struct cpg_address members[MAX_SENT], left = { .nodeid = nodeid };
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		members[i].nodeid = remaining[i];
+		members[i].pid = (remaining[i] == TEST_NODEID) ? (uint32_t)getpid() : 1;
+		members[i].reason = 0;
+	}
+
+	_callbacks->cpg_confchg_fn(1, &_group, members, count, &left, 1,
+				   NULL, 0);
+}
+
+static void _reset_sent(void)
+{
+	while (_nr_sent)
+		free(_sent[--_nr_sent]);
+	_nr_delivered = 0;
+	_sections[0] = '\0';
+}
+
+static void _init_rq(struct clog_request *rq, uint32_t type, uint32_t seq)
+{
+	memset(rq, 0, DM_ULOG_REQUEST_SIZE);
+	strncpy(rq->u_rq.uuid, TEST_UUID, DM_UUID_LEN);
+	rq->u_rq.luid = 1;
+	rq->u_rq.request_type = type;
+	rq->u_rq.seq = seq;
+}
+
+/* Create and resume the log, as the first member of its group */
+static int _create_log(void)
+{
+	char buf[DM_ULOG_REQUEST_SIZE];
+	struct clog_request *rq = (struct clog_request *)buf;
+	const char ctr[] = "1024 clustered-core 1";
+
+	_init_rq(rq, DM_ULOG_CTR, 0);
+	strcpy(rq->u_rq.data, ctr);
+	rq->u_rq.data_size = sizeof(ctr);
+	if (do_request(rq, 0) || rq->u_rq.error)
+		return 0;
+
+	_init_rq(rq, DM_ULOG_RESUME, 0);
+	if (local_resume(&rq->u_rq) || !_cluster_work)
+		return 0;
+	_join(TEST_NODEID);
+
+	if (cluster_send(rq))
+		return 0;
+	_cluster_work(NULL);
+	_reset_sent();
+
+	return 1;
+}
+
+/* Deliver a request from 'nodeid' */
+static void _request_from(uint32_t nodeid, uint32_t type, uint32_t seq,
+			  const void *data, size_t data_size)
+{
+	char buf[DM_ULOG_REQUEST_SIZE];
+	struct clog_request *rq = (struct clog_request *)buf;
+
+	_init_rq(rq, type, seq);
+	rq->u.version[0] = xlate64(CLOG_TFR_VERSION);
+	rq->u.version[1] = CLOG_TFR_VERSION;
+	if (data_size)
+		memcpy(rq->u_rq.data, data, data_size);
+	rq->u_rq.data_size = data_size;
+
+	_deliver(nodeid, rq, sizeof(*rq) + data_size);
+}
+
+/* Deliver a RESUME from 'nodeid', advertising 'tfr_version' if set */
+static void _resume_from(uint32_t nodeid, uint64_t tfr_version)
+{
+	_request_from(nodeid, DM_ULOG_RESUME, 0, &tfr_version,
+		      tfr_version ? sizeof(tfr_version) : 0);
+}
+
+/*
+ * Ask for resync work as 'nodeid'.
+ *
+ * Returns: the region handed out, or -1 if none
+ */
+static uint64_t _resync_work(uint32_t nodeid, uint32_t seq)
+{
+	struct clog_request *rq;
+	struct {
+		int64_t i;
+		uint64_t r;
+	} *pkg;
+
+	_request_from(nodeid, DM_ULOG_GET_RESYNC_WORK, seq, NULL, 0);
+
+	rq = _nr_sent ? _sent[_nr_sent - 1] : NULL;
+	if (!rq || (rq->u_rq.request_type !=
+		    (DM_ULOG_GET_RESYNC_WORK | DM_ULOG_RESPONSE)) ||
+	    (rq->u_rq.seq != seq)) {
+		fprintf(stderr, "No response to GET_RESYNC_WORK #%u\n", seq);
+		return (uint64_t)-2;
+	}
+
+	pkg = (void *)rq->u_rq.data;
+
+	return pkg->i ? pkg->r : (uint64_t)-1;
+}
+
+static int _send(uint32_t type, uint32_t seq, uint64_t region)
+{
+	char buf[DM_ULOG_REQUEST_SIZE];
+	struct clog_request *rq = (struct clog_request *)buf;
+
+	_init_rq(rq, type, seq);
+	memcpy(rq->u_rq.data, &region, sizeof(region));
+	rq->u_rq.data_size = sizeof(region);
+
+	return cluster_send(rq);
+}
+
+/*
+ * Check that sent request 'idx' is of 'type' and carries the regions
+ * first, first + 1, ..., first + count - 1.
+ */
+static int _check_sent(int idx, uint32_t type, uint64_t first, unsigned count)
+{
+	struct clog_request *rq;
+	uint64_t *regions;
+	unsigned i;
+
+	if (idx >= _nr_sent) {
+		fprintf(stderr, "Request %d was not sent\n", idx);
+		return 0;
+	}
+
+	rq = _sent[idx];
+	regions = (uint64_t *)rq->u_rq.data;
+	if (rq->u_rq.request_type != type) {
+		fprintf(stderr, "Request %d is %s, expected %s\n", idx,
+			RQ_TYPE(rq->u_rq.request_type), RQ_TYPE(type));
+		return 0;
+	}
+
+	if (rq->u_rq.data_size != count * sizeof(uint64_t)) {
+		fprintf(stderr, "Request %d carries %llu bytes, expected %u\n",
+			idx, (unsigned long long)rq->u_rq.data_size,
+			(unsigned)(count * sizeof(uint64_t)));
+		return 0;
+	}
+
+	for (i = 0; i < count; i++)
+		if (regions[i] != first + i) {
+			fprintf(stderr, "Request %d region %u is %llu, "
+				"expected %llu\n", idx, i,
+				(unsigned long long)regions[i],
+				(unsigned long long)(first + i));
+			return 0;
+		}
+
+	return 1;
+}
+
+/* Clears are held back and sent in order ahead of the next request */
+static int _test_flush_on_request(void)
+{
+	uint64_t region;
+
+	for (region = 0; region < 3; region++)
+		if (_send(DM_ULOG_CLEAR_REGION, (uint32_t)region + 1, region))
+			return 0;
+
+	if (_nr_sent) {
+		fprintf(stderr, "Clear requests were not batched\n");
+		return 0;
+	}
+
+	if (_send(DM_ULOG_MARK_REGION, 4, 7))
+		return 0;
+
+	if (_nr_sent != 2) {
+		fprintf(stderr, "%d requests sent, expected 2\n", _nr_sent);
+		return 0;
+	}
+
+	return _check_sent(0, DM_ULOG_CLEAR_REGION, 0, 3) &&
+		_check_sent(1, DM_ULOG_MARK_REGION, 7, 1);
+}
+
+/* A batch is sent as soon as another region would not fit */
+static int _test_split_at_limit(void)
+{
+	unsigned per_batch = (DM_ULOG_REQUEST_SIZE - sizeof(struct clog_request)) /
+		sizeof(uint64_t);
+	uint64_t region;
+
+	for (region = 0; region < per_batch + 5; region++)
+		if (_send(DM_ULOG_CLEAR_REGION, (uint32_t)region + 1, region))
+			return 0;
+
+	if (_nr_sent != 1) {
+		fprintf(stderr, "%d requests sent at the limit, expected 1\n",
+			_nr_sent);
+		return 0;
+	}
+
+	/* The remainder waits for its window */
+	if (cluster_batch_timeout() < 0) {
+		fprintf(stderr, "No timeout for the pending batch\n");
+		return 0;
+	}
+
+	usleep(20000);
+	if (cluster_batch_timeout()) {
+		fprintf(stderr, "Pending batch is not due\n");
+		return 0;
+	}
+	cluster_flush_batches();
+
+	if (cluster_batch_timeout() >= 0) {
+		fprintf(stderr, "Batch still pending after flush\n");
+		return 0;
+	}
+
+	return _check_sent(0, DM_ULOG_CLEAR_REGION, 0, per_batch) &&
+		_check_sent(1, DM_ULOG_CLEAR_REGION, per_batch, 5);
+}
+
+/* Read the clean and sync bits of 'region' from the log */
+static int _region_bits(uint64_t region, int64_t *clean, int64_t *in_sync)
+{
+	char buf[DM_ULOG_REQUEST_SIZE];
+	struct clog_request *rq = (struct clog_request *)buf;
+
+	_init_rq(rq, DM_ULOG_IS_CLEAN, 0);
+	memcpy(rq->u_rq.data, &region, sizeof(region));
+	rq->u_rq.data_size = sizeof(region);
+	if (do_request(rq, 0) || rq->u_rq.error)
+		return 0;
+	memcpy(clean, rq->u_rq.data, sizeof(*clean));
+
+	_init_rq(rq, DM_ULOG_IN_SYNC, 0);
+	memcpy(rq->u_rq.data, &region, sizeof(region));
+	rq->u_rq.data_size = sizeof(region);
+	if (do_request(rq, 0) || rq->u_rq.error)
+		return 0;
+	memcpy(in_sync, rq->u_rq.data, sizeof(*in_sync));
+
+	return 1;
+}
+
+static int _check_region_bits(uint64_t region, int64_t clean)
+{
+	int64_t is_clean, in_sync;
+
+	if (!_region_bits(region, &is_clean, &in_sync)) {
+		fprintf(stderr, "Failed to read the bits of region %llu\n",
+			(unsigned long long)region);
+		return 0;
+	}
+
+	if (!in_sync || (is_clean != clean)) {
+		fprintf(stderr, "Region %llu is %sclean and %sin sync, "
+			"expected %sclean and in sync\n",
+			(unsigned long long)region, is_clean ? "" : "not ",
+			in_sync ? "" : "not ", clean ? "" : "not ");
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Delivering a batch clears every region in it */
+static int _test_batch_applied(void)
+{
+	struct {
+		uint64_t region;
+		int64_t in_sync;
+	} sync = { 0, 1 };
+	uint64_t region;
+
+	for (region = 100; region < 103; region++) {
+		sync.region = region;
+		_request_from(TEST_NODEID, DM_ULOG_SET_REGION_SYNC,
+			      (uint32_t)region, &sync, sizeof(sync));
+		if (_send(DM_ULOG_MARK_REGION, (uint32_t)region, region))
+			return 0;
+	}
+	_cluster_work(NULL);
+
+	for (region = 100; region < 103; region++)
+		if (!_check_region_bits(region, 0))
+			return 0;
+	_reset_sent();
+
+	for (region = 100; region < 103; region++)
+		if (_send(DM_ULOG_CLEAR_REGION, (uint32_t)region + 3, region))
+			return 0;
+	usleep(20000);
+	cluster_flush_batches();
+
+	if ((_nr_sent != 1) || !_check_sent(0, DM_ULOG_CLEAR_REGION, 100, 3))
+		return 0;
+	_cluster_work(NULL);
+
+	for (region = 100; region < 103; region++)
+		if (!_check_region_bits(region, 1))
+			return 0;
+
+	return 1;
+}
+
+static int _check_sections(const char *expected)
+{
+	if (strcmp(_sections, expected)) {
+		fprintf(stderr, "Checkpoint sections \"%s\", expected \"%s\"\n",
+			_sections, expected);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * A joiner's checkpoint waits for the version in its RESUME, and is
+ * only encoded while every member reads the encoding.
+ */
+static int _test_version_exchange(void)
+{
+	struct clog_request *rq;
+	uint64_t *versions;
+
+	_join(2);
+
+	/* Other traffic does not release the checkpoint */
+	if (_send(DM_ULOG_MARK_REGION, 1, 7))
+		return 0;
+	_cluster_work(NULL);
+	if (!_check_sections(""))
+		return 0;
+
+	_resume_from(2, CLOG_TFR_VERSION_MAX);
+	_cluster_work(NULL);
+	if (!_check_sections("sync_bits_rle clean_bits_rle recovering_region"))
+		return 0;
+
+	/* The joiner learns the versions of the members */
+	rq = _sent[_nr_sent - 1];
+	versions = (uint64_t *)rq->u_rq.data;
+	if ((rq->u_rq.request_type != DM_ULOG_CHECKPOINT_READY) ||
+	    (rq->u_rq.data_size != 2 * sizeof(uint64_t)) ||
+	    (versions[0] != (((uint64_t)TEST_NODEID << 32) | CLOG_TFR_VERSION_MAX)) ||
+	    (versions[1] != ((2ULL << 32) | CLOG_TFR_VERSION_MAX))) {
+		fprintf(stderr, "CHECKPOINT_READY does not list the versions\n");
+		return 0;
+	}
+	_reset_sent();
+
+	/* An older node gets, and makes everyone use, the plain format */
+	_join(3);
+	_resume_from(3, 0);
+	_cluster_work(NULL);
+
+	return _check_sections("sync_bits clean_bits recovering_region");
+}
+
+static int _check_work(uint64_t work, uint64_t expected)
+{
+	if (work != expected) {
+		fprintf(stderr, "Resync work %lld, expected %lld\n",
+			(long long)work, (long long)expected);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Several regions recover at once only while every member tracks
+ * them, and a departed node's region is handed out again.  Follows
+ * _test_version_exchange, with nodes 1 to 3 as members and node 3
+ * an older one.
+ */
+static int _test_recovery_window(void)
+{
+	const uint32_t one_two[] = { TEST_NODEID, 2 };
+	const uint32_t one[] = { TEST_NODEID };
+	struct {
+		uint64_t region;
+		int64_t in_sync;
+	} sync = { 1, 1 };
+
+	if (!_check_work(_resync_work(2, 1), 0) ||
+	    !_check_work(_resync_work(TEST_NODEID, 2), (uint64_t)-1))
+		return 0;
+
+	_leave(3, one_two, 2);
+	if (!_check_work(_resync_work(TEST_NODEID, 3), 1))
+		return 0;
+
+	_request_from(TEST_NODEID, DM_ULOG_SET_REGION_SYNC, 4,
+		      &sync, sizeof(sync));
+	_leave(2, one, 1);
+
+	return _check_work(_resync_work(TEST_NODEID, 5), 0);
+}
+
+int main(void)
+{
+	int failed = 0;
+
+	if (init_cluster() || !_create_log()) {
+		fprintf(stderr, "Failed to set up the log\n");
+		return 1;
+	}
+
+	if (!_test_flush_on_request()) {
+		fprintf(stderr, "FAIL: flush on request\n");
+		failed++;
+	}
+	_reset_sent();
+
+	if (!_test_split_at_limit()) {
+		fprintf(stderr, "FAIL: split at size limit\n");
+		failed++;
+	}
+	_reset_sent();
+
+	if (!_test_batch_applied()) {
+		fprintf(stderr, "FAIL: batch applied\n");
+		failed++;
+	}
+	_reset_sent();
+
+	if (!_test_version_exchange()) {
+		fprintf(stderr, "FAIL: version exchange\n");
+		failed++;
+	}
+	_reset_sent();
+
+	if (!_test_recovery_window()) {
+		fprintf(stderr, "FAIL: recovery window\n");
+		failed++;
+	}
+	_reset_sent();
+
+	printf("%s\n", failed ? "FAILED" : "PASSED");
+
+	return failed ? 1 : 0;
+}
@@ -10,6 +10,7 @@
  * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 #include "logging.h"
+#include "cluster.h"
 #include "common.h"
 #include "functions.h"
 #include "link_mon.h"
@@ -46,10 +47,12 @@ int main(int argc __attribute__((unused)), char *argv[] __attribute__((unused)))
 	LOG_DBG(" Compiled with debugging.");
 
 	while (!exit_now) {
-		links_monitor();
+		links_monitor(cluster_batch_timeout());
 
 		links_issue_callbacks();
 
+		cluster_flush_batches();
+
 		process_signals();
 	}
 	exit(EXIT_SUCCESS);
@@ -23,6 +23,7 @@
 #include <openais/saAis.h>
 #include <openais/saCkpt.h>
 #include <signal.h>
+#include <sys/time.h>
 #include <unistd.h>
 
 /* Open AIS error codes */
@@ -77,6 +78,15 @@ static SaVersionT version = { 'B', 1, 1 };
 
 static int log_resp_rec = 0;
 
+/*
+ * CLEAR_REGION requests are acknowledged to the kernel immediately
+ * and get no cluster response, so they are held back for a short
+ * window and sent as one multi-region request.  Any other request
+ * for the same log sends the pending batch first to keep ordering.
+ */
+#define CLEAR_BATCH_WINDOW_MS 5
+#define CLEAR_BATCH_BYTES (DM_ULOG_REQUEST_SIZE - sizeof(struct clog_request))
+
 struct checkpoint_data {
 	uint32_t requester;
 	char uuid[CPG_MAX_NAME_LENGTH];
@@ -85,14 +95,40 @@ struct checkpoint_data {
 	char *sync_bits;
 	char *clean_bits;
 	char *recovering_region;
+
+	/* Section sizes, which differ from bitmap_size once encoded */
+	int sync_size;
+	int clean_size;
+	int sync_rle;
+	int clean_rle;
+
 	struct checkpoint_data *next;
 };	
 
+/*
+ * Word aligned run-length encoding of checkpoint bitmaps, used when
+ * the requester understands CLOG_TFR_VERSION_RLE.  A bitmap that is
+ * mostly in sync then costs words in proportion to the number of
+ * out-of-sync areas rather than the size of the mirror.
+ *
+ * All words are 32-bit little endian:
+ *   size of the raw bitmap in bytes
+ *   runs, each starting with a header word:
+ *     RLE_LITERAL | n: n raw bitmap words follow
+ *     RLE_ONES | n:    n words of all ones
+ *     n:               n words of all zeros
+ */
+#define RLE_LITERAL 0x80000000U
+#define RLE_ONES    0x40000000U
+#define RLE_COUNT   0x3FFFFFFFU
+#define RLE_SECTION_SUFFIX "_rle"
+
 #define INVALID 0
 #define VALID   1
 #define LEAVING 2
 
 #define MAX_CHECKPOINT_REQUESTERS 10
+#define MAX_CLUSTER_PEERS 32
 struct clog_cpg {
 	struct dm_list list;
 
@@ -113,37 +149,50 @@ struct clog_cpg {
 	int checkpoints_needed;
 	uint32_t checkpoint_requesters[MAX_CHECKPOINT_REQUESTERS];
 	struct checkpoint_data *checkpoint_list;
+
+	/*
+	 * Transfer versions of the CPG members, 0 until known.  A
+	 * joining node advertises its version in its RESUME; the
+	 * versions of the members already there come with the
+	 * CHECKPOINT_READY that brings the joiner its state.
+	 */
+	struct {
+		uint32_t nodeid;
+		uint32_t tfr_version;
+	} peers[MAX_CLUSTER_PEERS];
+	int untracked_peers;	/* members without a slot in 'peers' */
+
+	struct clog_request *clear_batch;
+	uint64_t clear_batch_deadline;	/* in ms */
+	uint64_t clear_batch_merged;	/* requests saved by batching */
+
 	int idx;
 	char debugging[DEBUGGING_HISTORY][128];
 };
 
 static struct dm_list clog_cpg_list;
 
+static uint64_t now_ms(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
 /*
- * cluster_send
+ * _cluster_send
+ * @entry
  * @rq
  *
  * Returns: 0 on success, -Exxx on error
  */
-int cluster_send(struct clog_request *rq)
+static int _cluster_send(struct clog_cpg *entry, struct clog_request *rq)
 {
 	int r;
 	int count=0;
-	int found = 0;
 	struct iovec iov;
-	struct clog_cpg *entry;
-
-	dm_list_iterate_items(entry, &clog_cpg_list)
-		if (!strncmp(entry->name.value, rq->u_rq.uuid,
-			     CPG_MAX_NAME_LENGTH)) {
-			found = 1;
-			break;
-		}
-
-	if (!found) {
-		rq->u_rq.error = -ENOENT;
-		return -ENOENT;
-	}
 
 	/*
 	 * Once the request heads for the cluster, the luid looses
@@ -200,6 +249,142 @@ int cluster_send(struct clog_request *rq)
 	return -EBADE;
 }
 
+static int flush_clear_batch(struct clog_cpg *entry)
+{
+	struct clog_request *batch = entry->clear_batch;
+	int r;
+
+	if (!batch)
+		return 0;
+
+	entry->clear_batch = NULL;
+
+	r = _cluster_send(entry, batch);
+	if (r)
+		LOG_ERROR("[%s] Failed to send batched clear requests: %s",
+			  SHORT_UUID(entry->name.value), strerror(-r));
+	free(batch);
+
+	return r;
+}
+
+/*
+ * batch_clear_region
+ * @entry
+ * @rq: CLEAR_REGION request from the kernel
+ *
+ * Add the regions of 'rq' to the pending clear batch of the log.
+ *
+ * Returns: 0 on success, -Exxx on error
+ */
+static int batch_clear_region(struct clog_cpg *entry, struct clog_request *rq)
+{
+	struct clog_request *batch = entry->clear_batch;
+
+	if (batch &&
+	    (batch->u_rq.data_size + rq->u_rq.data_size > CLEAR_BATCH_BYTES)) {
+		flush_clear_batch(entry);
+		batch = NULL;
+	}
+
+	if (!batch) {
+		if (!(batch = malloc(DM_ULOG_REQUEST_SIZE)))
+			/* Send it on its own */
+			return _cluster_send(entry, rq);
+
+		memcpy(batch, rq, sizeof(*batch));
+		batch->u_rq.data_size = 0;
+		entry->clear_batch = batch;
+		entry->clear_batch_deadline = now_ms() + CLEAR_BATCH_WINDOW_MS;
+	} else
+		entry->clear_batch_merged++;
+
+	memcpy(batch->u_rq.data + batch->u_rq.data_size, rq->u_rq.data,
+	       rq->u_rq.data_size);
+	batch->u_rq.data_size += rq->u_rq.data_size;
+
+	if (batch->u_rq.data_size + sizeof(uint64_t) > CLEAR_BATCH_BYTES)
+		return flush_clear_batch(entry);
+
+	return 0;
+}
+
+/*
+ * cluster_send
+ * @rq
+ *
+ * Returns: 0 on success, -Exxx on error
+ */
+int cluster_send(struct clog_request *rq)
+{
+	int found = 0;
+	struct clog_cpg *entry;
+
+	dm_list_iterate_items(entry, &clog_cpg_list)
+		if (!strncmp(entry->name.value, rq->u_rq.uuid,
+			     CPG_MAX_NAME_LENGTH)) {
+			found = 1;
+			break;
+		}
+
+	if (!found) {
+		rq->u_rq.error = -ENOENT;
+		return -ENOENT;
+	}
+
+	if (rq->u_rq.request_type == DM_ULOG_CLEAR_REGION)
+		return batch_clear_region(entry, rq);
+
+	/* Tell the other nodes which checkpoint formats we can read */
+	if ((rq->u_rq.request_type == DM_ULOG_RESUME) && !rq->u_rq.data_size) {
+		*(uint64_t *)rq->u_rq.data = CLOG_TFR_VERSION_MAX;
+		rq->u_rq.data_size = sizeof(uint64_t);
+	}
+
+	flush_clear_batch(entry);
+
+	return _cluster_send(entry, rq);
+}
+
+/*
+ * cluster_batch_timeout
+ *
+ * Returns: ms until the next pending clear batch is due, or -1 if none
+ */
+int cluster_batch_timeout(void)
+{
+	struct clog_cpg *entry;
+	uint64_t now = now_ms();
+	int timeout = -1;
+
+	dm_list_iterate_items(entry, &clog_cpg_list) {
+		if (!entry->clear_batch)
+			continue;
+		if (entry->clear_batch_deadline <= now)
+			return 0;
+		if ((timeout < 0) ||
+		    (entry->clear_batch_deadline - now < (uint64_t)timeout))
+			timeout = (int)(entry->clear_batch_deadline - now);
+	}
+
+	return timeout;
+}
+
+/*
+ * cluster_flush_batches
+ *
+ * Send the pending clear batches whose window has passed.
+ */
+void cluster_flush_batches(void)
+{
+	struct clog_cpg *entry;
+	uint64_t now = now_ms();
+
+	dm_list_iterate_items(entry, &clog_cpg_list)
+		if (entry->clear_batch && (entry->clear_batch_deadline <= now))
+			flush_clear_batch(entry);
+}
+
 static struct clog_request *get_matching_rq(struct clog_request *rq,
 					    struct dm_list *l)
 {
@@ -238,6 +423,8 @@ static int handle_cluster_request(struct clog_cpg *entry __attribute__((unused))
 	 */
 	if (tmp->u_rq.request_type == DM_ULOG_RESUME) {
 		if (tmp->originator == my_cluster_id) {
+			/* The advertised version is not for the kernel */
+			tmp->u_rq.data_size = 0;
 			r = do_request(tmp, server);
 
 			r = kernel_send(&tmp->u_rq);
@@ -321,6 +508,237 @@ static int handle_cluster_response(struct clog_cpg *entry,
 	return r;
 }
 
+static void add_peer(struct clog_cpg *entry, uint32_t nodeid)
+{
+	int i, free_slot = -1;
+
+	for (i = 0; i < MAX_CLUSTER_PEERS; i++) {
+		if (entry->peers[i].nodeid == nodeid)
+			return;
+		if ((free_slot < 0) && !entry->peers[i].nodeid)
+			free_slot = i;
+	}
+
+	/* Without a slot the node just gets the original format */
+	if (free_slot < 0) {
+		entry->untracked_peers++;
+		return;
+	}
+
+	entry->peers[free_slot].nodeid = nodeid;
+	entry->peers[free_slot].tfr_version = 0;
+}
+
+/*
+ * set_peer_version
+ * @nodeid
+ * @tfr_version
+ * @only_unknown: leave a version that is already known alone
+ */
+static void set_peer_version(struct clog_cpg *entry, uint32_t nodeid,
+			     uint32_t tfr_version, int only_unknown)
+{
+	int i;
+
+	for (i = 0; i < MAX_CLUSTER_PEERS; i++)
+		if (entry->peers[i].nodeid == nodeid) {
+			if (!only_unknown || !entry->peers[i].tfr_version)
+				entry->peers[i].tfr_version = tfr_version;
+			return;
+		}
+}
+
+/*
+ * get_peer_version
+ *
+ * Returns: transfer version of 'nodeid', 0 while it is not yet known
+ */
+static uint32_t get_peer_version(struct clog_cpg *entry, uint32_t nodeid)
+{
+	int i;
+
+	for (i = 0; i < MAX_CLUSTER_PEERS; i++)
+		if (entry->peers[i].nodeid == nodeid)
+			return entry->peers[i].tfr_version;
+
+	return CLOG_TFR_VERSION;
+}
+
+static void clear_peer_version(struct clog_cpg *entry, uint32_t nodeid)
+{
+	int i;
+
+	for (i = 0; i < MAX_CLUSTER_PEERS; i++)
+		if (entry->peers[i].nodeid == nodeid) {
+			entry->peers[i].nodeid = 0;
+			return;
+		}
+
+	if (entry->untracked_peers)
+		entry->untracked_peers--;
+}
+
+/*
+ * peers_support
+ * @tfr_version
+ *
+ * Returns: 1 if every member is known to understand 'tfr_version'
+ */
+static int peers_support(struct clog_cpg *entry, uint32_t tfr_version)
+{
+	int i;
+
+	if (entry->untracked_peers)
+		return 0;
+
+	for (i = 0; i < MAX_CLUSTER_PEERS; i++)
+		if (entry->peers[i].nodeid &&
+		    (entry->peers[i].tfr_version < tfr_version))
+			return 0;
+
+	return 1;
+}
+
+/*
+ * cluster_peers_support
+ * @uuid
+ * @tfr_version
+ *
+ * Returns: 1 if every member of the log's CPG understands 'tfr_version'
+ */
+int cluster_peers_support(const char *uuid, uint32_t tfr_version)
+{
+	struct clog_cpg *entry;
+
+	dm_list_iterate_items(entry, &clog_cpg_list)
+		if (!strncmp(entry->name.value, uuid, CPG_MAX_NAME_LENGTH))
+			return peers_support(entry, tfr_version);
+
+	return 0;
+}
+
+/*
+ * rle_encode
+ * @raw: bitmap of 'size' bytes, a multiple of 4
+ * @rle: set to the newly allocated encoding
+ *
+ * Returns: size of the encoding, or 0 if it would be no smaller
+ */
+static int rle_encode(const char *raw, int size, char **rle)
+{
+	const uint32_t *in = (const uint32_t *)raw;
+	int words = size / (int)sizeof(uint32_t);
+	int i = 0, n, out_words = 1;
+	uint32_t *out, w;
+
+	/* Give up as soon as the encoding is not shorter */
+	if (!(out = malloc(size + 2 * sizeof(uint32_t))))
+		return 0;
+
+	out[0] = xlate32((uint32_t)size);
+
+	while (i < words) {
+		if (out_words + 2 >= words)
+			goto no_gain;
+
+		w = in[i];
+		if (!w || (w == 0xFFFFFFFFU)) {
+			for (n = 1; (i + n < words) && (in[i + n] == w) &&
+			     (n < (int)RLE_COUNT); n++)
+				;
+			out[out_words++] = xlate32((w ? RLE_ONES : 0) | n);
+			i += n;
+			continue;
+		}
+
+		/* Literal words up to the next fill word */
+		for (n = 1; (i + n < words) && in[i + n] &&
+		     (in[i + n] != 0xFFFFFFFFU) && (n < (int)RLE_COUNT); n++)
+			;
+		if (out_words + 1 + n >= words)
+			goto no_gain;
+		out[out_words++] = xlate32(RLE_LITERAL | n);
+		for (; n; n--)
+			out[out_words++] = xlate32(in[i++]);
+	}
+
+	*rle = (char *)out;
+	return out_words * (int)sizeof(uint32_t);
+
+no_gain:
+	free(out);
+	return 0;
+}
+
+/*
+ * rle_decode
+ * @rle: encoding of 'size' bytes
+ * @raw: set to the newly allocated bitmap
+ *
+ * Returns: size of the bitmap, or -Exxx on error
+ */
+static int rle_decode(const char *rle, int size, char **raw)
+{
+	const uint32_t *in = (const uint32_t *)rle;
+	int in_words = size / (int)sizeof(uint32_t);
+	int i = 1, o = 0, raw_words;
+	uint32_t hdr, n, *out;
+
+	if (in_words < 1)
+		return -EINVAL;
+
+	raw_words = (int)(xlate32(in[0]) / sizeof(uint32_t));
+	if (!(out = malloc(raw_words * sizeof(uint32_t) + 1)))
+		return -ENOMEM;
+
+	while (i < in_words) {
+		hdr = xlate32(in[i++]);
+		n = hdr & RLE_COUNT;
+		if ((int)n > raw_words - o)
+			goto bad;
+
+		if (hdr & RLE_LITERAL) {
+			if ((int)n > in_words - i)
+				goto bad;
+			for (; n; n--)
+				out[o++] = xlate32(in[i++]);
+		} else
+			for (; n; n--)
+				out[o++] = (hdr & RLE_ONES) ? 0xFFFFFFFFU : 0;
+	}
+
+	if (o != raw_words)
+		goto bad;
+
+	*raw = (char *)out;
+	return raw_words * (int)sizeof(uint32_t);
+
+bad:
+	LOG_ERROR("Invalid run-length encoded checkpoint section");
+	free(out);
+	return -EINVAL;
+}
+
+/*
+ * encode_checkpoint_bitmap
+ *
+ * Swap *bitmap for its encoding if that is smaller.
+ */
+static void encode_checkpoint_bitmap(char **bitmap, int *size, int *rle)
+{
+	char *encoded;
+	int encoded_size;
+
+	*rle = 0;
+	if (!(encoded_size = rle_encode(*bitmap, *size, &encoded)))
+		return;
+
+	free(*bitmap);
+	*bitmap = encoded;
+	*size = encoded_size;
+	*rle = 1;
+}
+
 static struct clog_cpg *find_clog_cpg(cpg_handle_t handle)
 {
 	struct clog_cpg *match;
@@ -399,9 +817,19 @@ static struct checkpoint_data *prepare_checkpoint(struct clog_cpg *entry,
 		free(new);
 		return NULL;
 	}
+	new->sync_size = new->clean_size = new->bitmap_size;
+	if (peers_support(entry, CLOG_TFR_VERSION_RLE)) {
+		encode_checkpoint_bitmap(&new->sync_bits, &new->sync_size,
+					 &new->sync_rle);
+		encode_checkpoint_bitmap(&new->clean_bits, &new->clean_size,
+					 &new->clean_rle);
+	}
+
 	LOG_DBG("[%s] Checkpoint prepared for node %u:",
 		SHORT_UUID(new->uuid), new->requester);
-	LOG_DBG("  bitmap_size = %d", new->bitmap_size);
+	LOG_DBG("  bitmap_size = %d (sync %d%s, clean %d%s)", new->bitmap_size,
+		new->sync_size, new->sync_rle ? " rle" : "",
+		new->clean_size, new->clean_rle ? " rle" : "");
 
 	return new;
 }
@@ -419,7 +847,7 @@ static void free_checkpoint(struct checkpoint_data *cp)
 	free(cp);
 }
 
-static int export_checkpoint(struct checkpoint_data *cp)
+static int export_checkpoint(struct clog_cpg *entry, struct checkpoint_data *cp)
 {
 	SaCkptCheckpointCreationAttributesT attr;
 	SaCkptCheckpointHandleT h;
@@ -429,7 +857,8 @@ static int export_checkpoint(struct checkpoint_data *cp)
 	SaNameT name;
 	SaAisErrorT rv;
 	struct clog_request *rq;
-	int len, r = 0;
+	uint64_t *versions;
+	int i, len, r = 0;
 	char buf[32];
 
 	LOG_DBG("Sending checkpointed data to %u", cp->requester);
@@ -441,12 +870,15 @@ static int export_checkpoint(struct checkpoint_data *cp)
 	len = (int)strlen(cp->recovering_region) + 1;
 
 	attr.creationFlags = SA_CKPT_WR_ALL_REPLICAS;
-	attr.checkpointSize = cp->bitmap_size * 2 + len;
+	attr.checkpointSize = cp->sync_size + cp->clean_size + len;
 
 	attr.retentionDuration = SA_TIME_MAX;
 	attr.maxSections = 4;      /* don't know why we need +1 */
 
-	attr.maxSectionSize = (cp->bitmap_size > len) ?	cp->bitmap_size : len;
+	attr.maxSectionSize = (cp->sync_size > cp->clean_size) ?
+		cp->sync_size : cp->clean_size;
+	if (attr.maxSectionSize < (SaSizeT)len)
+		attr.maxSectionSize = len;
 	attr.maxSectionIdSize = 22;
 
 	flags = SA_CKPT_CHECKPOINT_READ |
@@ -476,14 +908,15 @@ open_retry:
 	/*
 	 * Add section for sync_bits
 	 */
-	section_id.idLen = (SaUint16T)snprintf(buf, 32, "sync_bits");
+	section_id.idLen = (SaUint16T)snprintf(buf, 32, "sync_bits%s",
+					       cp->sync_rle ? RLE_SECTION_SUFFIX : "");
 	section_id.id = (unsigned char *)buf;
 	section_attr.sectionId = &section_id;
 	section_attr.expirationTime = SA_TIME_END;
 
 sync_create_retry:
 	rv = saCkptSectionCreate(h, &section_attr,
-				 cp->sync_bits, cp->bitmap_size);
+				 cp->sync_bits, cp->sync_size);
 	if (rv == SA_AIS_ERR_TRY_AGAIN) {
 		LOG_ERROR("Sync checkpoint section create retry");
 		usleep(1000);
@@ -506,13 +939,14 @@ sync_create_retry:
 	/*
 	 * Add section for clean_bits
 	 */
-	section_id.idLen = snprintf(buf, 32, "clean_bits");
+	section_id.idLen = snprintf(buf, 32, "clean_bits%s",
+				    cp->clean_rle ? RLE_SECTION_SUFFIX : "");
 	section_id.id = (unsigned char *)buf;
 	section_attr.sectionId = &section_id;
 	section_attr.expirationTime = SA_TIME_END;
 
 clean_create_retry:
-	rv = saCkptSectionCreate(h, &section_attr, cp->clean_bits, cp->bitmap_size);
+	rv = saCkptSectionCreate(h, &section_attr, cp->clean_bits, cp->clean_size);
 	if (rv == SA_AIS_ERR_TRY_AGAIN) {
 		LOG_ERROR("Clean checkpoint section create retry");
 		usleep(1000);
@@ -578,6 +1012,14 @@ rr_create_retry:
 	strncpy(rq->u_rq.uuid, cp->uuid, CPG_MAX_NAME_LENGTH);
 	rq->u_rq.seq = my_cluster_id;
 
+	/* Pass on the transfer versions of the members, for the joiner */
+	versions = (uint64_t *)rq->u_rq.data;
+	for (i = 0; i < MAX_CLUSTER_PEERS; i++)
+		if (entry->peers[i].nodeid && entry->peers[i].tfr_version)
+			*versions++ = ((uint64_t)entry->peers[i].nodeid << 32) |
+				entry->peers[i].tfr_version;
+	rq->u_rq.data_size = (char *)versions - rq->u_rq.data;
+
 	r = cluster_send(rq);
 	if (r)
 		LOG_ERROR("Failed to send checkpoint ready notice: %s",
@@ -597,6 +1039,9 @@ static int import_checkpoint(struct clog_cpg *entry, int no_read)
 	SaNameT name;
 	SaAisErrorT rv;
 	char *bitmap = NULL;
+	char *decoded;
+	char section[32];
+	size_t section_len;
 	int len;
 
 	bitmap = malloc(1024*1024);
@@ -717,9 +1162,30 @@ init_retry:
 		}
 
 		if (iov.readSize) {
-			if (pull_state(entry->name.value, entry->luid,
-				       (char *)desc.sectionId.id, bitmap,
-				       iov.readSize)) {
+			section_len = desc.sectionId.idLen;
+			if (section_len >= sizeof(section))
+				section_len = sizeof(section) - 1;
+			memcpy(section, desc.sectionId.id, section_len);
+			section[section_len] = '\0';
+
+			/* Decode run-length encoded bitmaps */
+			len = sizeof(RLE_SECTION_SUFFIX) - 1;
+			if ((section_len > (size_t)len) &&
+			    !strcmp(section + section_len - len,
+				    RLE_SECTION_SUFFIX)) {
+				section[section_len - len] = '\0';
+				len = rle_decode(bitmap, (int)iov.readSize, &decoded);
+				if (len < 0) {
+					rtn = -EIO;
+					goto fail;
+				}
+				len = pull_state(entry->name.value, entry->luid,
+						 section, decoded, len);
+				free(decoded);
+			} else
+				len = pull_state(entry->name.value, entry->luid,
+						 section, bitmap, iov.readSize);
+			if (len) {
 				LOG_ERROR("Error loading state");
 				rtn = -EIO;
 				goto fail;
@@ -750,7 +1216,7 @@ static void do_checkpoints(struct clog_cpg *entry, int leaving)
 		 * notice in rq in export_checkpoint function
 		 * by setting rq->error
 		 */
-		switch (export_checkpoint(cp)) {
+		switch (export_checkpoint(entry, cp)) {
 		case -EEXIST:
 			LOG_SPRINT(entry, "[%s] Checkpoint for %u already handled%s",
 				   SHORT_UUID(entry->name.value), cp->requester,
@@ -866,6 +1332,7 @@ static int do_cluster_work(void *data __attribute__((unused)))
 			LOG_ERROR("cpg_dispatch failed: %s", str_ais_error(r));
 
 		if (entry->free_me) {
+			free(entry->clear_batch);
 			free(entry);
 			continue;
 		}
@@ -888,6 +1355,15 @@ static int flush_startup_list(struct clog_cpg *entry)
 		dm_list_del(&rq->u.list);
 
 		if (rq->u_rq.request_type == DM_ULOG_MEMBER_JOIN) {
+			/* Wait for the joiner's RESUME to pick the format */
+			if (!get_peer_version(entry, rq->originator) &&
+			    (entry->checkpoints_needed < MAX_CHECKPOINT_REQUESTERS)) {
+				entry->checkpoint_requesters[entry->checkpoints_needed++] =
+					rq->originator;
+				free(rq);
+				continue;
+			}
+
 			new = prepare_checkpoint(entry, rq->originator);
 			if (!new) {
 				/*
@@ -949,6 +1425,22 @@ static void cpg_message_callback(cpg_handle_t handle, const struct cpg_name *gna
 		return;
 	}
 
+	if (rq->u_rq.request_type == DM_ULOG_RESUME)
+		set_peer_version(match, nodeid,
+				 (rq->u_rq.data_size >= sizeof(uint64_t)) ?
+				 (uint32_t)*(uint64_t *)rq->u_rq.data :
+				 CLOG_TFR_VERSION, 0);
+	else if (rq->u_rq.request_type == DM_ULOG_CHECKPOINT_READY) {
+		for (i = 0; i < (int)(rq->u_rq.data_size / sizeof(uint64_t)); i++) {
+			uint64_t v = ((uint64_t *)rq->u_rq.data)[i];
+
+			set_peer_version(match, (uint32_t)(v >> 32),
+					 (uint32_t)v, 1);
+		}
+		/* Older nodes send no versions, not even their own */
+		set_peer_version(match, nodeid, CLOG_TFR_VERSION, 1);
+	}
+
 	if ((nodeid == my_cluster_id) &&
 	    !(rq->u_rq.request_type & DM_ULOG_RESPONSE) &&
 	    (rq->u_rq.request_type != DM_ULOG_RESUME) &&
@@ -1094,6 +1586,15 @@ static void cpg_message_callback(cpg_handle_t handle, const struct cpg_name *gna
 		}
 
 		i--;
+
+		/* The format depends on what the joiner reads */
+		if (!get_peer_version(match, match->checkpoint_requesters[i])) {
+			LOG_DBG("[%s] Withholding checkpoint until %u has resumed",
+				SHORT_UUID(rq->u_rq.uuid),
+				match->checkpoint_requesters[i]);
+			continue;
+		}
+
 		new = prepare_checkpoint(match, match->checkpoint_requesters[i]);
 		if (!new) {
 			/* FIXME: Need better error handling */
@@ -1107,6 +1608,10 @@ static void cpg_message_callback(cpg_handle_t handle, const struct cpg_name *gna
 		LOG_COND(log_checkpoint, "[%s] Checkpoint prepared for %u*",
 			 SHORT_UUID(rq->u_rq.uuid), match->checkpoint_requesters[i]);
 		match->checkpoints_needed--;
+		memmove(match->checkpoint_requesters + i,
+			match->checkpoint_requesters + i + 1,
+			(match->checkpoints_needed - i) *
+			sizeof(*match->checkpoint_requesters));
 
 		new->next = match->checkpoint_list;
 		match->checkpoint_list = new;
@@ -1167,6 +1672,11 @@ static void cpg_join_callback(struct clog_cpg *match,
 	if ((my_cluster_id == 0xDEAD) && (joined->pid == my_pid))
 		my_cluster_id = joined->nodeid;
 
+	for (i = 0; i < member_list_entries; i++)
+		add_peer(match, member_list[i].nodeid);
+	if (joined->nodeid == my_cluster_id)
+		set_peer_version(match, my_cluster_id, CLOG_TFR_VERSION_MAX, 0);
+
 	/* Am I the very first to join? */
 	if (member_list_entries == 1) {
 		match->lowest_id = joined->nodeid;
@@ -1245,6 +1755,12 @@ static void cpg_leave_callback(struct clog_cpg *match,
 	LOG_SPRINT(match, "---  UUID=%s  %u left  ---",
 		   SHORT_UUID(match->name.value), left->nodeid);
 
+	clear_peer_version(match, left->nodeid);
+
+	/* Regions the node was recovering are up for grabs again */
+	if (my_cluster_id != left->nodeid)
+		cluster_node_left(match->name.value, match->luid, left->nodeid);
+
 	/* Am I leaving? */
 	if (my_cluster_id == left->nodeid) {
 		LOG_DBG("Finalizing leave...");
@@ -1559,6 +2075,8 @@ static int _destroy_cluster_cpg(struct clog_cpg *del)
 	*/
 	do_checkpoints(del, 1);
 
+	flush_clear_batch(del);
+
 	state = del->state;
 
 	del->cpg_state = INVALID;
@@ -1631,6 +2149,7 @@ void cluster_debug(void)
 		LOG_ERROR("  delay             : %d", entry->delay);
 		LOG_ERROR("  resend_requests   : %d", entry->resend_requests);
 		LOG_ERROR("  checkpoints_needed: %d", entry->checkpoints_needed);
+		LOG_ERROR("  clears batched    : %" PRIu64, entry->clear_batch_merged);
 		for (i = 0, cp = entry->checkpoint_list;
 		     i < MAX_CHECKPOINT_REQUESTERS; i++)
 			if (cp)
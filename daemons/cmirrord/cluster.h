@@ -72,5 +72,8 @@ int create_cluster_cpg(char *uuid, uint64_t luid);
 int destroy_cluster_cpg(char *uuid);
 
 int cluster_send(struct clog_request *rq);
+int cluster_peers_support(const char *uuid, uint32_t tfr_version);
+int cluster_batch_timeout(void);
+void cluster_flush_batches(void);
 
 #endif /* _LVM_CLOG_CLUSTER_H */
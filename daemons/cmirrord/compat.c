@@ -21,7 +21,7 @@
  */
 #define COMPAT_OFFSET 256
 
-static void v5_data_endian_switch(struct clog_request *rq, int to_network __attribute__((unused)))
+static void v5_data_endian_switch(struct clog_request *rq, int to_network)
 {
 	int i, end;
 	int64_t *pi64;
@@ -79,14 +79,12 @@ static void v5_data_endian_switch(struct clog_request *rq, int to_network __attr
 
 		case DM_ULOG_PRESUSPEND:
 		case DM_ULOG_POSTSUSPEND:
-		case DM_ULOG_RESUME:
 		case DM_ULOG_GET_REGION_SIZE:
 		case DM_ULOG_FLUSH:
 		case DM_ULOG_GET_RESYNC_WORK:
 		case DM_ULOG_GET_SYNC_COUNT:
 		case DM_ULOG_STATUS_INFO:
 		case DM_ULOG_STATUS_TABLE:
-		case DM_ULOG_CHECKPOINT_READY:
 		case DM_ULOG_MEMBER_JOIN:
 			/* No incoming data */
 			break;
@@ -96,6 +94,23 @@ static void v5_data_endian_switch(struct clog_request *rq, int to_network __attr
 			pu64 = (uint64_t *)rq->u_rq.data;
 			*pu64 = xlate64(*pu64);
 			break;
+		case DM_ULOG_RESUME:
+			/* Optional advertised transfer version */
+			if ((to_network ? xlate64(rq->u_rq.data_size) :
+			     rq->u_rq.data_size) < sizeof(uint64_t))
+				break;
+			pu64 = (uint64_t *)rq->u_rq.data;
+			*pu64 = xlate64(*pu64);
+			break;
+		case DM_ULOG_CHECKPOINT_READY:
+			/* Optional transfer versions of the members */
+			end = (to_network ? xlate64(rq->u_rq.data_size) :
+			       rq->u_rq.data_size) / sizeof(uint64_t);
+
+			pu64 = (uint64_t *)rq->u_rq.data;
+			for (i = 0; i < end; i++)
+				pu64[i] = xlate64(pu64[i]);
+			break;
 		case DM_ULOG_MARK_REGION:
 		case DM_ULOG_CLEAR_REGION:
 			end = rq->u_rq.data_size/sizeof(uint64_t);
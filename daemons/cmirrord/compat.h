@@ -16,8 +16,19 @@
  *	3: RHEL 5.3
  *	4: RHEL 5.4, RHEL 5.5
  *	5: RHEL 6, Current Upstream Format
+ *
+ * Later versions keep the version 5 request layout, which is still
+ * what is sent.  Instead, a node advertises the highest version it
+ * understands in the data of its cluster RESUME request, and the
+ * CHECKPOINT_READY for a joining node lists the versions of the
+ * members.  A format is only used once every member understands it:
+ *	6: Run-length encoded checkpoint bitmaps
+ *	7: Several regions recovering at once
  */
 #define CLOG_TFR_VERSION 5
+#define CLOG_TFR_VERSION_RLE 6
+#define CLOG_TFR_VERSION_RECOVERY 7
+#define CLOG_TFR_VERSION_MAX CLOG_TFR_VERSION_RECOVERY
 
 int clog_request_to_network(struct clog_request *rq);
 int clog_request_from_network(void *data, size_t data_len);
@@ -10,12 +10,16 @@
  * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 #include "logging.h"
+#include "cluster.h"
+#include "compat.h"
 #include "functions.h"
 
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
@@ -30,8 +34,22 @@
 #define MIRROR_MAGIC 0x4D695272
 #define MIRROR_DISK_VERSION 2
 #define LOG_OFFSET 2
+#define LOG_BITS_OFFSET (LOG_OFFSET << 9)	/* bytes */
+#define LOG_MIN_BLOCK_SIZE 512
 
 #define RESYNC_HISTORY 50
+#define LOG_HASH_SIZE 128
+#define MARK_HASH_SIZE 1024
+
+/*
+ * Regions that may be recovering at once, across the cluster.  The
+ * kernel recovers one region at a time, so each node holds at most
+ * one of them.  Older nodes track a single recovering region, so
+ * the window only opens once every member understands
+ * CLOG_TFR_VERSION_RECOVERY.
+ */
+#define RECOVERY_WINDOW 8
+
 //static char resync_history[RESYNC_HISTORY][128];
 //static int idx = 0;
 #define LOG_SPRINT(_lc, f, arg...) do {					\
@@ -48,6 +66,8 @@ struct log_header {
 
 struct log_c {
 	struct dm_list list;
+	struct log_c *uuid_next;	/* same uuid, other luid, in index */
+	int pending;			/* on log_pending_list */
 
 	char uuid[DM_UUID_LEN];
 	uint64_t luid;
@@ -61,8 +81,10 @@ struct log_c {
 
 	dm_bitset_t clean_bits;
 	dm_bitset_t sync_bits;
-	uint32_t recoverer;
-	uint64_t recovering_region; /* -1 means not recovering */
+	struct {
+		uint32_t nodeid;
+		uint64_t region; /* -1 means not recovering */
+	} recovering[RECOVERY_WINDOW];
 	uint64_t skip_bit_warning; /* used to warn if region skipped */
 	int sync_search;
 
@@ -77,7 +99,7 @@ struct log_c {
 
 	uint32_t state;         /* current operational state of the log */
 
-	struct dm_list mark_list;
+	struct dm_hash_table *mark_hash; /* region -> mark_entry chain */
 
 	uint32_t recovery_halted;
 	struct recovery_request *recovery_request_list;
@@ -87,12 +109,15 @@ struct log_c {
 	uint64_t disk_nr_regions;
 	size_t disk_size;       /* size of disk_buffer in bytes */
 	void *disk_buffer;      /* aligned memory for O_DIRECT */
+	size_t disk_block_size;	/* O_DIRECT write granularity */
+	dm_bitset_t disk_dirty;	/* disk_buffer blocks to write on flush */
+	uint64_t bytes_flushed;
 	int idx;
 	char resync_history[RESYNC_HISTORY][128];
 };
 
 struct mark_entry {
-	struct dm_list list;
+	struct mark_entry *next;	/* other nodes marking region */
 	uint32_t nodeid;
 	uint64_t region;
 };
@@ -105,60 +130,225 @@ struct recovery_request {
 static DM_LIST_INIT(log_list);
 static DM_LIST_INIT(log_pending_list);
 
+/* uuid -> chain of official and pending logs with that uuid */
+static struct dm_hash_table *log_hash;
+
 static int log_test_bit(dm_bitset_t bs, int bit)
 {
 	return dm_bit(bs, bit) ? 1 : 0;
 }
 
+/*
+ * Note the disk log block holding a clean_bits region needs writing
+ */
+static void log_mark_disk_dirty(struct log_c *lc, dm_bitset_t bs, int bit)
+{
+	if (lc->disk_dirty && (bs == lc->clean_bits))
+		dm_bit_set(lc->disk_dirty, (LOG_BITS_OFFSET + bit / 8) /
+			   lc->disk_block_size);
+}
+
+static void log_mark_disk_all_dirty(struct log_c *lc)
+{
+	if (lc->disk_dirty)
+		dm_bit_set_range(lc->disk_dirty, 0, *lc->disk_dirty);
+}
+
 static void log_set_bit(struct log_c *lc, dm_bitset_t bs, int bit)
 {
 	dm_bit_set(bs, bit);
+	log_mark_disk_dirty(lc, bs, bit);
 	lc->touched = 1;
 }
 
 static void log_clear_bit(struct log_c *lc, dm_bitset_t bs, int bit)
 {
 	dm_bit_clear(bs, bit);
+	log_mark_disk_dirty(lc, bs, bit);
 	lc->touched = 1;
 }
 
+/*
+ * Returns the size of the bitset if there is no clear bit
+ * at or after start.
+ */
 static uint64_t find_next_zero_bit(dm_bitset_t bs, unsigned start)
 {
-	for (; dm_bit(bs, start); start++)
-		if (start >= *bs)
-			return (uint64_t)-1;
+	int r = dm_bit_get_next_clear(bs, (int) start - 1);
 
-	return start;
+	return (r < 0) ? (uint64_t)*bs : (uint64_t)r;
 }
 
 static uint64_t count_bits32(dm_bitset_t bs)
 {
-	unsigned i, size = bs[0]/(unsigned)DM_BITS_PER_INT + 1;
-	unsigned count = 0;
+	return (uint64_t)dm_bit_count(bs);
+}
 
-	for (i = 1; i <= size; i++)
-		count += hweight32(bs[i]);
+static void recovery_reset(struct log_c *lc)
+{
+	int i;
 
-	return (uint64_t)count;
+	for (i = 0; i < RECOVERY_WINDOW; i++) {
+		lc->recovering[i].nodeid = (uint32_t)-1;
+		lc->recovering[i].region = (uint64_t)-1;
+	}
 }
 
 /*
- * get_log
+ * recovery_find
+ * @region: region to look for, or -1 to find a free slot
+ * @nodeid: node to look for, or -1 to match on region alone
  *
- * Returns: log if found, NULL otherwise
+ * Returns: index into lc->recovering or -1 if not found
  */
-static struct log_c *get_log(const char *uuid, uint64_t luid)
+static int recovery_find(struct log_c *lc, uint64_t region, uint32_t nodeid)
+{
+	int i;
+
+	for (i = 0; i < RECOVERY_WINDOW; i++)
+		if ((lc->recovering[i].region == region) &&
+		    ((nodeid == (uint32_t)-1) ||
+		     (lc->recovering[i].nodeid == nodeid)))
+			return i;
+
+	return -1;
+}
+
+static int recovery_find_node(struct log_c *lc, uint32_t nodeid)
+{
+	int i;
+
+	for (i = 0; i < RECOVERY_WINDOW; i++)
+		if ((lc->recovering[i].region != (uint64_t)-1) &&
+		    (lc->recovering[i].nodeid == nodeid))
+			return i;
+
+	return -1;
+}
+
+static int recovery_count(struct log_c *lc)
+{
+	int i, count = 0;
+
+	for (i = 0; i < RECOVERY_WINDOW; i++)
+		if (lc->recovering[i].region != (uint64_t)-1)
+			count++;
+
+	return count;
+}
+
+/*
+ * Returns: slot of the lowest region being recovered, or -1 if none
+ */
+static int recovery_lowest_slot(struct log_c *lc)
+{
+	uint64_t lowest = (uint64_t)-1;
+	int i, slot = -1;
+
+	for (i = 0; i < RECOVERY_WINDOW; i++)
+		if (lc->recovering[i].region < lowest) {
+			lowest = lc->recovering[i].region;
+			slot = i;
+		}
+
+	return slot;
+}
+
+/*
+ * Returns: lowest region being recovered, or -1 if none
+ */
+static uint64_t recovery_lowest(struct log_c *lc)
+{
+	int slot = recovery_lowest_slot(lc);
+
+	return (slot < 0) ? (uint64_t)-1 : lc->recovering[slot].region;
+}
+
+static struct log_c *log_index_find(const char *uuid, uint64_t luid,
+				    int pending)
 {
 	struct log_c *lc;
 
-	dm_list_iterate_items(lc, &log_list)
-		if (!strcmp(lc->uuid, uuid) &&
-		    (!luid || (luid == lc->luid)))
+	if (!log_hash)
+		return NULL;
+
+	for (lc = dm_hash_lookup(log_hash, uuid); lc; lc = lc->uuid_next)
+		if ((lc->pending == pending) && (!luid || (luid == lc->luid)))
 			return lc;
 
 	return NULL;
 }
 
+/*
+ * log_list_add
+ * @lc
+ *
+ * Index a new log and add it to the pending list.
+ *
+ * Returns: 0 on success, -ENOMEM on failure
+ */
+static int log_list_add(struct log_c *lc)
+{
+	if (!log_hash && !(log_hash = dm_hash_create(LOG_HASH_SIZE)))
+		return -ENOMEM;
+
+	lc->uuid_next = dm_hash_lookup(log_hash, lc->uuid);
+	if (!dm_hash_insert(log_hash, lc->uuid, lc))
+		return -ENOMEM;
+
+	lc->pending = 1;
+	dm_list_add(&log_pending_list, &lc->list);
+
+	return 0;
+}
+
+/*
+ * log_list_move
+ * @lc
+ * @pending: move to the pending rather than the official list
+ *
+ * The index covers both lists, so this cannot fail.
+ */
+static void log_list_move(struct log_c *lc, int pending)
+{
+	lc->pending = pending;
+	dm_list_del(&lc->list);
+	dm_list_add(pending ? &log_pending_list : &log_list, &lc->list);
+}
+
+static void log_list_del(struct log_c *lc)
+{
+	struct log_c *head = dm_hash_lookup(log_hash, lc->uuid);
+	struct log_c **prev;
+
+	dm_list_del(&lc->list);
+
+	if (head == lc) {
+		/* Replacing the data of an existing key never allocates */
+		if (lc->uuid_next)
+			dm_hash_insert(log_hash, lc->uuid, lc->uuid_next);
+		else
+			dm_hash_remove(log_hash, lc->uuid);
+		return;
+	}
+
+	for (prev = &head->uuid_next; *prev; prev = &(*prev)->uuid_next)
+		if (*prev == lc) {
+			*prev = lc->uuid_next;
+			return;
+		}
+}
+
+/*
+ * get_log
+ *
+ * Returns: log if found, NULL otherwise
+ */
+static struct log_c *get_log(const char *uuid, uint64_t luid)
+{
+	return log_index_find(uuid, luid, 0);
+}
+
 /*
  * get_pending_log
  *
@@ -169,14 +359,7 @@ static struct log_c *get_log(const char *uuid, uint64_t luid)
  */
 static struct log_c *get_pending_log(const char *uuid, uint64_t luid)
 {
-	struct log_c *lc;
-
-	dm_list_iterate_items(lc, &log_pending_list)
-		if (!strcmp(lc->uuid, uuid) &&
-		    (!luid || (luid == lc->luid)))
-			return lc;
-
-	return NULL;
+	return log_index_find(uuid, luid, 1);
 }
 
 static void header_to_disk(struct log_header *mem, struct log_header *disk)
@@ -189,35 +372,39 @@ static void header_from_disk(struct log_header *mem, struct log_header *disk)
 	memcpy(mem, disk, sizeof(struct log_header));
 }
 
-static int rw_log(struct log_c *lc, int do_write)
+/*
+ * rw_log
+ * @lc
+ * @do_write
+ * @offset: byte offset into the log, a multiple of disk_block_size
+ * @size: bytes to transfer, a multiple of disk_block_size
+ *
+ * The same range of disk_buffer is used, keeping O_DIRECT alignment.
+ */
+static int rw_log(struct log_c *lc, int do_write, size_t offset, size_t size)
 {
-	int r;
-
-	r = (int)lseek(lc->disk_fd, 0, SEEK_SET);
-	if (r < 0) {
-		LOG_ERROR("[%s] rw_log:  lseek failure: %s",
-			  SHORT_UUID(lc->uuid), strerror(errno));
-		return -errno;
-	}
+	char *buf = (char *)lc->disk_buffer + offset;
+	ssize_t r;
 
 	if (do_write) {
 		/* FIXME Cope with full set of non-error conditions */
-		r = write(lc->disk_fd, lc->disk_buffer, lc->disk_size);
+		r = pwrite(lc->disk_fd, buf, size, (off_t)offset);
 		if (r < 0) {
 			LOG_ERROR("[%s] rw_log:  write failure: %s",
 				  SHORT_UUID(lc->uuid), strerror(errno));
 			return -EIO; /* Failed disk write */
 		}
+		lc->bytes_flushed += size;
 		return 0;
 	}
 
 	/* Read */
 	/* FIXME Cope with full set of non-error conditions */
-	r = read(lc->disk_fd, lc->disk_buffer, lc->disk_size);
+	r = pread(lc->disk_fd, buf, size, (off_t)offset);
 	if (r < 0)
 		LOG_ERROR("[%s] rw_log:  read failure: %s",
 			  SHORT_UUID(lc->uuid), strerror(errno));
-	if (r != lc->disk_size)
+	if (r != (ssize_t)size)
 		return -EIO; /* Failed disk read */
 	return 0;
 }
@@ -240,7 +427,7 @@ static int read_log(struct log_c *lc)
 
 	memset(&lh, 0, sizeof(struct log_header));
 
-	if (rw_log(lc, 0))
+	if (rw_log(lc, 0, 0, lc->disk_size))
 		return -EIO; /* Failed disk read */
 
 	header_from_disk(&lh, lc->disk_buffer);
@@ -254,7 +441,8 @@ static int read_log(struct log_c *lc)
 	bitset_size += (lc->region_count % 8) ? 1 : 0;
 
 	/* 'lc->clean_bits + 1' becasue dm_bitset_t leads with a uint32_t */
-	memcpy(lc->clean_bits + 1, (char *)lc->disk_buffer + 1024, bitset_size);
+	memcpy(lc->clean_bits + 1, (char *)lc->disk_buffer + LOG_BITS_OFFSET,
+	       bitset_size);
 
 	return 0;
 }
@@ -263,30 +451,60 @@ static int read_log(struct log_c *lc)
  * write_log
  * @lc
  *
+ * Only the blocks of the log marked in lc->disk_dirty since the
+ * last successful write are copied from clean_bits and written.
+ * disk_buffer otherwise holds what is already on disk.
+ *
  * Returns: 0 on success, -EIO on failure
  */
 static int write_log(struct log_c *lc)
 {
 	struct log_header lh;
-	size_t bitset_size;
+	size_t bitset_size, start, end;
+	unsigned len;
+	int block;
 
 	lh.magic = MIRROR_MAGIC;
 	lh.version = MIRROR_DISK_VERSION;
 	lh.nr_regions = lc->region_count;
 
-	header_to_disk(&lh, lc->disk_buffer);
+	/* Rewrite the header only when it changes */
+	if (memcmp(&lh, lc->disk_buffer, sizeof(lh))) {
+		header_to_disk(&lh, lc->disk_buffer);
+		dm_bit_set(lc->disk_dirty, 0);
+	}
 
-	/* Write disk bits from clean_bits */
 	bitset_size = lc->region_count / 8;
 	bitset_size += (lc->region_count % 8) ? 1 : 0;
 
-	/* 'lc->clean_bits + 1' becasue dm_bitset_t leads with a uint32_t */
-	memcpy((char *)lc->disk_buffer + 1024, lc->clean_bits + 1, bitset_size);
+	for (block = dm_bit_get_next_run(lc->disk_dirty, 0, &len); block >= 0;
+	     block = dm_bit_get_next_run(lc->disk_dirty, block + len, &len)) {
+		start = block * lc->disk_block_size;
+		end = start + len * lc->disk_block_size;
+
+		/* Write disk bits from clean_bits */
+		if (end > LOG_BITS_OFFSET) {
+			size_t from = (start > LOG_BITS_OFFSET) ?
+				start - LOG_BITS_OFFSET : 0;
+			size_t to = end - LOG_BITS_OFFSET;
 
-	if (rw_log(lc, 1)) {
-		lc->log_dev_failed = 1;
-		return -EIO; /* Failed disk write */
+			if (to > bitset_size)
+				to = bitset_size;
+
+			/* 'lc->clean_bits + 1' becasue dm_bitset_t leads with a uint32_t */
+			if (from < to)
+				memcpy((char *)lc->disk_buffer + LOG_BITS_OFFSET + from,
+				       (char *)(lc->clean_bits + 1) + from, to - from);
+		}
+
+		if (rw_log(lc, 1, start, end - start)) {
+			lc->log_dev_failed = 1;
+			return -EIO; /* Failed disk write */
+		}
+
+		dm_bit_clear_range(lc->disk_dirty, block, len);
 	}
+
 	return 0;
 }
 
@@ -374,6 +592,7 @@ static int _clog_ctr(char *uuid, uint64_t luid,
 	int unlink_path = 0;
 	size_t page_size;
 	int pages;
+	int block_size;
 
 	/* If core log request, then argv[0] will be region_size */
 	if (!strtoll(argv[0], &p, 0) || *p) {
@@ -440,7 +659,7 @@ static int _clog_ctr(char *uuid, uint64_t luid,
 	lc->sync = log_sync;
 	lc->block_on_error = block_on_error;
 	lc->sync_search = 0;
-	lc->recovering_region = (uint64_t)-1;
+	recovery_reset(lc);
 	lc->skip_bit_warning = region_count;
 	lc->disk_fd = -1;
 	lc->log_dev_failed = 0;
@@ -455,7 +674,12 @@ static int _clog_ctr(char *uuid, uint64_t luid,
 		return -EINVAL;
 	}
 
-	dm_list_init(&lc->mark_list);
+	lc->mark_hash = dm_hash_create(MARK_HASH_SIZE);
+	if (!lc->mark_hash) {
+		LOG_ERROR("Unable to allocate mark hash table");
+		r = -ENOMEM;
+		goto fail;
+	}
 
 	lc->clean_bits = dm_bitset_create(NULL, region_count);
 	if (!lc->clean_bits) {
@@ -494,6 +718,20 @@ static int _clog_ctr(char *uuid, uint64_t luid,
 		lc->disk_fd = r;
 		lc->disk_size = pages * page_size;
 
+		if (ioctl(lc->disk_fd, BLKSSZGET, &block_size) ||
+		    (block_size < LOG_MIN_BLOCK_SIZE) ||
+		    (lc->disk_size % block_size))
+			block_size = LOG_MIN_BLOCK_SIZE;
+		lc->disk_block_size = block_size;
+
+		lc->disk_dirty = dm_bitset_create(NULL, lc->disk_size /
+						  lc->disk_block_size);
+		if (!lc->disk_dirty) {
+			LOG_ERROR("Unable to allocate disk log dirty bitset");
+			r = -ENOMEM;
+			goto fail;
+		}
+
 		r = posix_memalign(&(lc->disk_buffer), page_size,
 				   lc->disk_size);
 		if (r) {
@@ -504,7 +742,10 @@ static int _clog_ctr(char *uuid, uint64_t luid,
 		LOG_DBG("Disk log ready");
 	}
 
-	dm_list_add(&log_pending_list, &lc->list);
+	if ((r = log_list_add(lc))) {
+		LOG_ERROR("Unable to index log");
+		goto fail;
+	}
 
 	return 0;
 fail:
@@ -512,7 +753,10 @@ fail:
 		if (lc->disk_fd >= 0 && close(lc->disk_fd))
 			LOG_ERROR("Close device error, %s: %s",
 				  disk_path, strerror(errno));
+		if (lc->mark_hash)
+			dm_hash_destroy(lc->mark_hash);
 		free(lc->disk_buffer);
+		dm_free(lc->disk_dirty);
 		dm_free(lc->sync_bits);
 		dm_free(lc->clean_bits);
 		dm_free(lc);
@@ -601,6 +845,22 @@ static int clog_ctr(struct dm_ulog_request *rq)
 	return r;
 }
 
+static void free_mark_chain(void *data)
+{
+	struct mark_entry *m = data, *next;
+
+	for (; m; m = next) {
+		next = m->next;
+		free(m);
+	}
+}
+
+static void free_marks(struct log_c *lc)
+{
+	dm_hash_iter(lc->mark_hash, free_mark_chain);
+	dm_hash_wipe(lc->mark_hash);
+}
+
 /*
  * clog_dtr
  * @rq
@@ -625,11 +885,14 @@ static int clog_dtr(struct dm_ulog_request *rq)
 
 	LOG_DBG("[%s] Cluster log removed", SHORT_UUID(lc->uuid));
 
-	dm_list_del(&lc->list);
+	log_list_del(lc);
+	free_marks(lc);
+	dm_hash_destroy(lc->mark_hash);
 	if (lc->disk_fd != -1)
 		close(lc->disk_fd);
 	if (lc->disk_buffer)
 		free(lc->disk_buffer);
+	dm_free(lc->disk_dirty);
 	dm_free(lc->clean_bits);
 	dm_free(lc->sync_bits);
 	dm_free(lc);
@@ -673,8 +936,7 @@ static int clog_postsuspend(struct dm_ulog_request *rq)
 	destroy_cluster_cpg(rq->uuid);
 
 	lc->state = LOG_SUSPENDED;
-	lc->recovering_region = (uint64_t)-1;
-	lc->recoverer = (uint32_t)-1;
+	recovery_reset(lc);
 	lc->delay = time(NULL);
 
 	return 0;
@@ -696,12 +958,40 @@ int cluster_postsuspend(char *uuid, uint64_t luid)
 	lc->resume_override = 0;
 
 	/* move log to pending list */
-	dm_list_del(&lc->list);
-	dm_list_add(&log_pending_list, &lc->list);
+	log_list_move(lc, 1);
 
 	return 0;
 }
 
+/*
+ * cluster_node_left
+ * @uuid
+ * @luid
+ * @nodeid: node that left the log's CPG
+ *
+ * Frees the recovery slot of a departed node, so that its region
+ * is handed out again.
+ */
+void cluster_node_left(char *uuid, uint64_t luid, uint32_t nodeid)
+{
+	struct log_c *lc = get_log(uuid, luid);
+	int slot;
+
+	if (!lc)
+		return;
+
+	while ((slot = recovery_find_node(lc, nodeid)) >= 0) {
+		LOG_SPRINT(lc, "LEAVE - UUID=%s, nodeid = %u:: "
+			   "Dropping recovery of region %llu",
+			   SHORT_UUID(lc->uuid), nodeid,
+			   (unsigned long long)lc->recovering[slot].region);
+		if (lc->recovering[slot].region < (uint64_t)lc->sync_search)
+			lc->sync_search = (int)lc->recovering[slot].region;
+		lc->recovering[slot].region = (uint64_t)-1;
+		lc->recovering[slot].nodeid = (uint32_t)-1;
+	}
+}
+
 /*
  * clog_resume
  * @rq
@@ -784,12 +1074,15 @@ static int clog_resume(struct dm_ulog_request *rq)
 
 no_disk:
 	/* If mirror has grown, set bits appropriately */
-	if (lc->sync == NOSYNC)
-		for (i = lc->disk_nr_regions; i < lc->region_count; i++)
-			log_set_bit(lc, lc->clean_bits, i);
-	else
-		for (i = lc->disk_nr_regions; i < lc->region_count; i++)
-			log_clear_bit(lc, lc->clean_bits, i);
+	if (lc->disk_nr_regions < lc->region_count) {
+		if (lc->sync == NOSYNC)
+			dm_bit_set_range(lc->clean_bits, lc->disk_nr_regions,
+					 lc->region_count - lc->disk_nr_regions);
+		else
+			dm_bit_clear_range(lc->clean_bits, lc->disk_nr_regions,
+					   lc->region_count - lc->disk_nr_regions);
+		lc->touched = 1;
+	}
 
 	/* Clear any old bits if device has shrunk */
 	for (i = lc->region_count; i % 32; i++)
@@ -798,6 +1091,9 @@ no_disk:
 	/* copy clean across to sync */
 	dm_bit_copy(lc->sync_bits, lc->clean_bits);
 
+	/* The whole log is written by the first flush after resume */
+	log_mark_disk_all_dirty(lc);
+
 	if (commit_log && (lc->disk_fd >= 0)) {
 		rq->error = write_log(lc);
 		if (rq->error)
@@ -885,8 +1181,7 @@ int local_resume(struct dm_ulog_request *rq)
 		}
 
 		/* move log to official list */
-		dm_list_del(&lc->list);
-		dm_list_add(&log_list, &lc->list);
+		log_list_move(lc, 0);
 	}
 
 	return 0;
@@ -1035,7 +1330,8 @@ static int clog_flush(struct dm_ulog_request *rq, int server)
 			LOG_ERROR("[%s] Error writing to disk log",
 				  SHORT_UUID(lc->uuid));
 		else 
-			LOG_DBG("[%s] Disk log written", SHORT_UUID(lc->uuid));
+			LOG_DBG("[%s] Disk log written (%" PRIu64 " bytes flushed)",
+				SHORT_UUID(lc->uuid), lc->bytes_flushed);
 	}
 
 	lc->touched = 0;
@@ -1056,17 +1352,15 @@ static int clog_flush(struct dm_ulog_request *rq, int server)
  */
 static int mark_region(struct log_c *lc, uint64_t region, uint32_t who)
 {
-	int found = 0;
-	struct mark_entry *m;
-
-	dm_list_iterate_items(m, &lc->mark_list)
-		if (m->region == region) {
-			found = 1;
-			if (m->nodeid == who)
-				return 0;
-		}
+	struct mark_entry *head, *m;
+
+	head = dm_hash_lookup_binary(lc->mark_hash, (const char *)&region,
+				     sizeof(region));
+	for (m = head; m; m = m->next)
+		if (m->nodeid == who)
+			return 0;
 
-	if (!found)
+	if (!head)
 		log_clear_bit(lc, lc->clean_bits, region);
 
 	/*
@@ -1082,7 +1376,14 @@ static int mark_region(struct log_c *lc, uint64_t region, uint32_t who)
 
 	m->nodeid = who;
 	m->region = region;
-	dm_list_add(&lc->mark_list, &m->list);
+	m->next = head;
+	if (!dm_hash_insert_binary(lc->mark_hash, (const char *)&region,
+				   sizeof(region), m)) {
+		LOG_ERROR("Unable to index mark_entry: %llu/%u",
+			  (unsigned long long)region, who);
+		free(m);
+		return -ENOMEM;
+	}
 
 	return 0;
 }
@@ -1128,17 +1429,27 @@ static int clog_mark_region(struct dm_ulog_request *rq, uint32_t originator)
 static int clear_region(struct log_c *lc, uint64_t region, uint32_t who)
 {
 	int other_matches = 0;
-	struct mark_entry *m, *n;
-
-	dm_list_iterate_items_safe(m, n, &lc->mark_list)
-		if (m->region == region) {
-			if (m->nodeid == who) {
-				dm_list_del(&m->list);
-				free(m);
-			} else
-				other_matches = 1;
+	struct mark_entry *head, **prev, *m;
+
+	head = dm_hash_lookup_binary(lc->mark_hash, (const char *)&region,
+				     sizeof(region));
+	for (prev = &head; (m = *prev); )
+		if (m->nodeid == who) {
+			*prev = m->next;
+			free(m);
+		} else {
+			other_matches = 1;
+			prev = &m->next;
 		}
 
+	/* Replacing the data of an existing key never allocates */
+	if (head)
+		dm_hash_insert_binary(lc->mark_hash, (const char *)&region,
+				      sizeof(region), head);
+	else
+		dm_hash_remove_binary(lc->mark_hash, (const char *)&region,
+				      sizeof(region));
+
 	/*
 	 * Clear region if:
 	 *  1) It is in-sync
@@ -1192,6 +1503,8 @@ static int clog_clear_region(struct dm_ulog_request *rq, uint32_t originator)
  * clog_get_resync_work
  * @rq
  *
+ * Hands out one region to each asking node, up to RECOVERY_WINDOW
+ * regions at a time, so several nodes can recover in parallel.
  */
 static int clog_get_resync_work(struct dm_ulog_request *rq, uint32_t originator)
 {
@@ -1200,6 +1513,7 @@ static int clog_get_resync_work(struct dm_ulog_request *rq, uint32_t originator)
 		uint64_t r;
 	} *pkg = (void *)rq->data;
 	struct log_c *lc = get_log(rq->uuid, rq->luid);
+	int slot, window;
 
 	if (!lc)
 		return -EINVAL;
@@ -1218,22 +1532,26 @@ static int clog_get_resync_work(struct dm_ulog_request *rq, uint32_t originator)
 		return 0;
 	}
 
-	if (lc->recovering_region != (uint64_t)-1) {
-		if (lc->recoverer == originator) {
-			LOG_SPRINT(lc, "GET - SEQ#=%u, UUID=%s, nodeid = %u:: "
-				   "Re-requesting work (%llu)",
-				   rq->seq, SHORT_UUID(lc->uuid), originator,
-				   (unsigned long long)lc->recovering_region);
-			pkg->r = lc->recovering_region;
-			pkg->i = 1;
-			LOG_COND(log_resend_requests, "***** RE-REQUEST *****");
-		} else {
-			LOG_SPRINT(lc, "GET - SEQ#=%u, UUID=%s, nodeid = %u:: "
-				   "Someone already recovering (%llu)",
-				   rq->seq, SHORT_UUID(lc->uuid), originator,
-				   (unsigned long long)lc->recovering_region);
-		}
+	if ((slot = recovery_find_node(lc, originator)) >= 0) {
+		LOG_SPRINT(lc, "GET - SEQ#=%u, UUID=%s, nodeid = %u:: "
+			   "Re-requesting work (%llu)",
+			   rq->seq, SHORT_UUID(lc->uuid), originator,
+			   (unsigned long long)lc->recovering[slot].region);
+		pkg->r = lc->recovering[slot].region;
+		pkg->i = 1;
+		LOG_COND(log_resend_requests, "***** RE-REQUEST *****");
+		return 0;
+	}
 
+	/* Older members track only one recovering region */
+	window = cluster_peers_support(lc->uuid, CLOG_TFR_VERSION_RECOVERY) ?
+		RECOVERY_WINDOW : 1;
+	if ((recovery_count(lc) >= window) ||
+	    ((slot = recovery_find(lc, (uint64_t)-1, (uint32_t)-1)) < 0)) {
+		LOG_SPRINT(lc, "GET - SEQ#=%u, UUID=%s, nodeid = %u:: "
+			   "Recovery window full (%llu)",
+			   rq->seq, SHORT_UUID(lc->uuid), originator,
+			   (unsigned long long)recovery_lowest(lc));
 		return 0;
 	}
 
@@ -1246,19 +1564,24 @@ static int clog_get_resync_work(struct dm_ulog_request *rq, uint32_t originator)
 		pkg->r = del->region;
 		free(del);
 
-		if (!log_test_bit(lc->sync_bits, pkg->r)) {
+		if (!log_test_bit(lc->sync_bits, pkg->r) &&
+		    (recovery_find(lc, pkg->r, (uint32_t)-1) < 0)) {
 			LOG_SPRINT(lc, "GET - SEQ#=%u, UUID=%s, nodeid = %u:: "
 				   "Assigning priority resync work (%llu)",
 				   rq->seq, SHORT_UUID(lc->uuid), originator,
 				   (unsigned long long)pkg->r);
 			pkg->i = 1;
-			lc->recovering_region = pkg->r;
-			lc->recoverer = originator;
+			lc->recovering[slot].region = pkg->r;
+			lc->recovering[slot].nodeid = originator;
 			return 0;
 		}
 	}
 
+	/* Skip regions handed out ahead of sync_search by priority */
 	pkg->r = find_next_zero_bit(lc->sync_bits, lc->sync_search);
+	while ((pkg->r < lc->region_count) &&
+	       (recovery_find(lc, pkg->r, (uint32_t)-1) >= 0))
+		pkg->r = find_next_zero_bit(lc->sync_bits, pkg->r + 1);
 
 	if (pkg->r >= lc->region_count) {
 		LOG_SPRINT(lc, "GET - SEQ#=%u, UUID=%s, nodeid = %u:: "
@@ -1275,8 +1598,8 @@ static int clog_get_resync_work(struct dm_ulog_request *rq, uint32_t originator)
 		   rq->seq, SHORT_UUID(lc->uuid), originator,
 		   (unsigned long long)pkg->r);
 	pkg->i = 1;
-	lc->recovering_region = pkg->r;
-	lc->recoverer = originator;
+	lc->recovering[slot].region = pkg->r;
+	lc->recovering[slot].nodeid = originator;
 
 	return 0;
 }
@@ -1292,11 +1615,14 @@ static int clog_set_region_sync(struct dm_ulog_request *rq, uint32_t originator)
 		int64_t in_sync;
 	} *pkg = (void *)rq->data;
 	struct log_c *lc = get_log(rq->uuid, rq->luid);
+	int slot;
 
 	if (!lc)
 		return -EINVAL;
 
-	lc->recovering_region = (uint64_t)-1;
+	/* Recovery of the region is over, successful or not */
+	while ((slot = recovery_find(lc, pkg->region, (uint32_t)-1)) >= 0)
+		lc->recovering[slot].region = (uint64_t)-1;
 
 	if (pkg->in_sync) {
 		if (log_test_bit(lc->sync_bits, pkg->region)) {
@@ -1563,20 +1889,23 @@ static int clog_is_remote_recovering(struct dm_ulog_request *rq)
 
 		/*
 		 * Remember, 'lc->sync_search' is 1 plus the region
-		 * currently being recovered.  So, we must take off 1
-		 * to account for that; but only if 'sync_search > 1'.
+		 * last handed out.  So, we must take off 1 to account
+		 * for that; but only if 'sync_search > 1'.  Regions
+		 * below that may still be recovering in the window.
 		 */
 		pkg->in_sync_hint = lc->sync_search ? (lc->sync_search - 1) : 0;
+		if (recovery_lowest(lc) < pkg->in_sync_hint)
+			pkg->in_sync_hint = recovery_lowest(lc);
 		LOG_DBG("[%s] Region is %s: %llu",
 			SHORT_UUID(lc->uuid),
-			(region == lc->recovering_region) ?
+			(recovery_find(lc, region, (uint32_t)-1) >= 0) ?
 			"currently remote recovering" :
 			(pkg->is_recovering) ? "pending remote recovery" :
 			"not remote recovering", (unsigned long long)region);
 	}
 
 	if (pkg->is_recovering &&
-	    (region != lc->recovering_region)) {
+	    (recovery_find(lc, region, (uint32_t)-1) < 0)) {
 		struct recovery_request *rr;
 
 		/* Already in the list? */
@@ -1739,6 +2068,7 @@ int push_state(const char *uuid, uint64_t luid,
 	       const char *which, char **buf, uint32_t debug_who)
 {
 	int bitset_size;
+	int i, len;
 	struct log_c *lc;
 
 	if (*buf)
@@ -1751,19 +2081,35 @@ int push_state(const char *uuid, uint64_t luid,
 	}
 
 	if (!strcmp(which, "recovering_region")) {
-		*buf = malloc(64); /* easily handles the 2 written numbers */
+		*buf = malloc(RECOVERY_WINDOW * 32);
 		if (!*buf)
 			return -ENOMEM;
-		sprintf(*buf, "%llu %u", (unsigned long long)lc->recovering_region,
-			lc->recoverer);
+
+		/*
+		 * "<region> <recoverer>" for each slot in the window,
+		 * or just for the lowest region while older nodes,
+		 * which read one pair, are members.
+		 */
+		if (cluster_peers_support(uuid, CLOG_TFR_VERSION_RECOVERY))
+			for (i = 0, len = 0; i < RECOVERY_WINDOW; i++)
+				len += sprintf(*buf + len, "%s%llu %u", i ? " " : "",
+					       (unsigned long long)lc->recovering[i].region,
+					       lc->recovering[i].nodeid);
+		else if ((i = recovery_lowest_slot(lc)) >= 0)
+			sprintf(*buf, "%llu %u",
+				(unsigned long long)lc->recovering[i].region,
+				lc->recovering[i].nodeid);
+		else
+			sprintf(*buf, "%llu %u", (unsigned long long)-1,
+				(uint32_t)-1);
 
 		LOG_SPRINT(lc, "CKPT SEND - SEQ#=X, UUID=%s, nodeid = %u:: "
 			   "recovering_region=%llu, recoverer=%u, sync_count=%llu",
 			   SHORT_UUID(lc->uuid), debug_who,
-			   (unsigned long long)lc->recovering_region,
-			   lc->recoverer,
+			   (unsigned long long)lc->recovering[0].region,
+			   lc->recovering[0].nodeid,
 			   (unsigned long long)count_bits32(lc->sync_bits));
-		return 64;
+		return RECOVERY_WINDOW * 32;
 	}
 
 	/* Size in 'int's */
@@ -1803,6 +2149,9 @@ int pull_state(const char *uuid, uint64_t luid,
 	       const char *which, char *buf, int size)
 {
 	int bitset_size;
+	int i, len;
+	unsigned long long region;
+	uint32_t nodeid;
 	struct log_c *lc;
 
 	if (!buf) {
@@ -1817,12 +2166,18 @@ int pull_state(const char *uuid, uint64_t luid,
 	}
 
 	if (!strncmp(which, "recovering_region", 17)) {
-		sscanf(buf, "%llu %u", (unsigned long long *)&lc->recovering_region,
-		       &lc->recoverer);
+		recovery_reset(lc);
+		for (i = 0; i < RECOVERY_WINDOW; i++, buf += len) {
+			if (sscanf(buf, "%llu %u%n", &region, &nodeid, &len) != 2)
+				break;
+			lc->recovering[i].region = region;
+			lc->recovering[i].nodeid = nodeid;
+		}
 		LOG_SPRINT(lc, "CKPT INIT - SEQ#=X, UUID=%s, nodeid = X:: "
 			   "recovering_region=%llu, recoverer=%u",
 			   SHORT_UUID(lc->uuid),
-			   (unsigned long long)lc->recovering_region, lc->recoverer);
+			   (unsigned long long)lc->recovering[0].region,
+			   lc->recovering[0].nodeid);
 		return 0;
 	}
 
@@ -1850,6 +2205,7 @@ int pull_state(const char *uuid, uint64_t luid,
 	} else if (!strncmp(which, "clean_bits", 9)) {
 		lc->resume_override += 2;
 		memcpy(lc->clean_bits + 1, buf, bitset_size);
+		log_mark_disk_all_dirty(lc);
 
 		LOG_DBG("[%s] loading clean_bits:", SHORT_UUID(lc->uuid));
 
@@ -1904,10 +2260,15 @@ void log_debug(void)
 
 	dm_list_iterate_items(lc, &log_list) {
 		LOG_ERROR("%s", lc->uuid);
-		LOG_ERROR("  recoverer        : %" PRIu32, lc->recoverer);
-		LOG_ERROR("  recovering_region: %" PRIu64, lc->recovering_region);
+		for (i = 0; i < RECOVERY_WINDOW; i++)
+			if (lc->recovering[i].region != (uint64_t)-1)
+				LOG_ERROR("  recovering_region: %" PRIu64
+					  " (recoverer %" PRIu32 ")",
+					  lc->recovering[i].region,
+					  lc->recovering[i].nodeid);
 		LOG_ERROR("  recovery_halted  : %s", (lc->recovery_halted) ?
 			  "YES" : "NO");
+		LOG_ERROR("  bytes_flushed    : %" PRIu64, lc->bytes_flushed);
 		LOG_ERROR("sync_bits:");
 		print_bits(lc->sync_bits, 1);
 		LOG_ERROR("clean_bits:");
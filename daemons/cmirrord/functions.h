@@ -20,6 +20,7 @@
 
 int local_resume(struct dm_ulog_request *rq);
 int cluster_postsuspend(char *, uint64_t);
+void cluster_node_left(char *uuid, uint64_t luid, uint32_t nodeid);
 
 int do_request(struct clog_request *rq, int server);
 int push_state(const char *uuid, uint64_t luid,
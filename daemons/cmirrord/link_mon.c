@@ -107,7 +107,7 @@ int links_unregister(int fd)
 	return 0;
 }
 
-int links_monitor(void)
+int links_monitor(int timeout_ms)
 {
 	unsigned i;
 	int r;
@@ -116,7 +116,7 @@ int links_monitor(void)
 		pfds[i].revents = 0;
 	}
 
-	r = poll(pfds, used_pfds, -1);
+	r = poll(pfds, used_pfds, timeout_ms);
 	if (r <= 0)
 		return r;
 
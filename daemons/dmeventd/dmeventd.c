@@ -28,9 +28,12 @@
 
 #include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <sys/file.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <sys/time.h>
 #include <sys/resource.h>
@@ -40,6 +43,8 @@
 
 #ifdef linux
 #  include <malloc.h>
+#  include <poll.h>
+#  include <linux/netlink.h>
 
 #  define OOM_ADJ_FILE "/proc/self/oom_adj"
 
@@ -95,11 +100,28 @@ static pthread_mutex_t _global_mutex;
 
 #define THREAD_STACK_SIZE (300*1024)
 
+/*
+  Event loop monitoring (-e).
+
+  Instead of one thread per device blocked in DM_DEVICE_WAITEVENT,
+  a single event loop thread notices events from changes in each
+  device's event_nr.  It checks a device as soon as the kernel sends
+  a change uevent for it, and sweeps the monitored devices every
+  EVENT_SWEEP_INTERVAL seconds since not every dm event sends one.
+  The events are processed by a pool of EVENT_WORKERS threads, at
+  most DSO_MAX_BUSY_WORKERS of them in any one DSO at a time.
+*/
+#define EVENT_SWEEP_INTERVAL 1
+#define EVENT_WORKERS 8
+#define DSO_MAX_BUSY_WORKERS 4
+#define UEVENT_BUFFER_SIZE 8192
+
 #define DEBUGLOG(fmt, args...) _debuglog(fmt, ## args)
 
 int dmeventd_debug = 0;
 static int _foreground = 0;
 static int _restart = 0;
+static int _event_loop = 0;
 static char **_initial_registrations = 0;
 
 /* Data kept about a DSO. */
@@ -110,6 +132,7 @@ struct dso_data {
 
 	void *dso_handle;	/* Opaque handle as returned from dlopen(). */
 	unsigned int ref_count;	/* Library reference count. */
+	unsigned int busy_workers; /* Event loop workers in the DSO. */
 
 	/*
 	 * Event processing.
@@ -145,6 +168,23 @@ struct dso_data {
 	 */
 	int (*unregister_device)(const char *device, const char *uuid,
 				 int major, int minor, void **user);
+
+	/*
+	 * Optional timeout scheduling.
+	 *
+	 * Called after each process_event().  Returns the number of
+	 * seconds until the DSO wants its next timeout event for the
+	 * device, or 0 to keep the registered timeout period.
+	 */
+	uint32_t (*next_timeout)(void **user);
+
+	/*
+	 * Optional status.
+	 *
+	 * Fills buf with a short DSO specific description of the
+	 * device state for DM_EVENT_CMD_GET_STATUS.  Must not use ';'.
+	 */
+	int (*get_status)(char *buf, size_t size, void **user);
 };
 static DM_LIST_INIT(_dso_registry);
 
@@ -161,6 +201,7 @@ struct message_data {
 		char *str;
 		uint32_t secs;
 	} timeout;
+	char *devices;		/* Bulk requests: uuids separated by spaces. */
 	struct dm_event_daemon_message *msg;	/* Pointer to message buffer. */
 };
 
@@ -192,14 +233,38 @@ struct thread_status {
 	struct dm_task *current_task;
 	time_t next_time;
 	uint32_t timeout;
-	struct dm_list timeout_list;
+	unsigned timeout_idx;	/* Slot in _timeout_heap, 0 if none */
 	void *dso_private; /* dso per-thread status variable */
+
+	/* Event loop monitoring, see EVENT_SWEEP_INTERVAL. */
+	int checking;		/* Held by event loop, under _global_mutex */
+	int queued;		/* On _work_queue, under _work_mutex */
+	enum dm_event_mask pending_events;	/* under _work_mutex */
+	struct dm_list work_list;
 };
 static DM_LIST_INIT(_thread_registry);
 static DM_LIST_INIT(_thread_registry_unused);
 
+/*
+  Event loop work queue.  Lock order is _global_mutex, _timeout_mutex,
+  _work_mutex.  With the event loop, thread_status's processing field
+  is also under _work_mutex.
+*/
+static int _event_loop_running;
+static int _uevent_fd = -1;
+static DM_LIST_INIT(_work_queue);
+static pthread_mutex_t _work_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _work_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+  Threads registered for timeouts are kept in a binary min-heap
+  ordered by next_time.  Slot 0 is unused so that the children of
+  slot i are 2i and 2i+1.
+*/
 static int _timeout_running;
-static DM_LIST_INIT(_timeout_registry);
+static struct thread_status **_timeout_heap;
+static unsigned _timeout_heap_size;	/* Used slots, including slot 0 */
+static unsigned _timeout_heap_alloc;
 static pthread_mutex_t _timeout_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t _timeout_cond = PTHREAD_COND_INITIALIZER;
 
@@ -241,7 +306,7 @@ static struct thread_status *_alloc_thread_status(struct message_data *data,
 	ret->dso_data = dso_data;
 	ret->events = data->events.field;
 	ret->timeout = data->timeout.secs;
-	dm_list_init(&ret->timeout_list);
+	dm_list_init(&ret->work_list);
 
 	return ret;
 }
@@ -314,7 +379,9 @@ static int _fetch_string(char **ptr, char **src, const int delimiter)
 			*ptr = NULL;
 		}
 
-		(*src)++;
+		/* Stay on the terminating NUL after the last field */
+		if (p)
+			(*src)++;
 		ret = 1;
 	}
 
@@ -331,7 +398,7 @@ static void _free_message(struct message_data *message_data)
 	dm_free(message_data->dso_name);
 
 	dm_free(message_data->device_uuid);
-
+	dm_free(message_data->devices);
 }
 
 /* Parse a register message from the client. */
@@ -370,7 +437,8 @@ static int _parse_message(struct message_data *message_data)
 			    DM_EVENT_DEFAULT_TIMEOUT;
 		}
 
-		ret = 1;
+		/* Anything left is the device list of a bulk request. */
+		ret = !*p || (message_data->devices = dm_strdup(p));
 	}
 
 	dm_free(msg->data);
@@ -456,6 +524,7 @@ static int _get_status(struct message_data *message_data)
 	int size = 0, current = 0;
 	char *buffers[count];
 	char *message;
+	char dso_status[128];
 
 	dm_free(msg->data);
 
@@ -465,10 +534,19 @@ static int _get_status(struct message_data *message_data)
 	i = 0;
 	_lock_mutex();
 	dm_list_iterate_items(thread, &_thread_registry) {
-		if ((current = dm_asprintf(buffers + i, "0:%d %s %s %u %" PRIu32 ";",
+		dso_status[0] = dso_status[1] = 0;
+		if (thread->dso_data->get_status &&
+		    !thread->dso_data->get_status(dso_status + 1,
+						  sizeof(dso_status) - 1,
+						  &thread->dso_private))
+			dso_status[1] = 0;
+		if (dso_status[1])
+			*dso_status = ' ';
+
+		if ((current = dm_asprintf(buffers + i, "0:%d %s %s %u %" PRIu32 "%s;",
 					   i, thread->dso_data->dso_name,
 					   thread->device.uuid, thread->events,
-					   thread->timeout)) < 0) {
+					   thread->timeout, dso_status)) < 0) {
 			_unlock_mutex();
 			goto out;
 		}
@@ -508,38 +586,154 @@ static void _exit_dm_lib(void)
 	dm_lib_exit();
 }
 
+static void _queue_event(struct thread_status *thread,
+			 enum dm_event_mask events);
+
 static void _exit_timeout(void *unused __attribute__((unused)))
 {
 	_timeout_running = 0;
 	pthread_mutex_unlock(&_timeout_mutex);
 }
 
-/* Wake up monitor threads every so often. */
+static void _timeout_heap_set(unsigned idx, struct thread_status *thread)
+{
+	_timeout_heap[idx] = thread;
+	thread->timeout_idx = idx;
+}
+
+static void _timeout_heap_up(unsigned idx)
+{
+	struct thread_status *thread = _timeout_heap[idx];
+
+	while (idx > 1 &&
+	       _timeout_heap[idx / 2]->next_time > thread->next_time) {
+		_timeout_heap_set(idx, _timeout_heap[idx / 2]);
+		idx /= 2;
+	}
+
+	_timeout_heap_set(idx, thread);
+}
+
+static void _timeout_heap_down(unsigned idx)
+{
+	struct thread_status *thread = _timeout_heap[idx];
+	unsigned child;
+
+	while ((child = idx * 2) < _timeout_heap_size) {
+		if (child + 1 < _timeout_heap_size &&
+		    _timeout_heap[child + 1]->next_time <
+		    _timeout_heap[child]->next_time)
+			child++;
+		if (_timeout_heap[child]->next_time >= thread->next_time)
+			break;
+		_timeout_heap_set(idx, _timeout_heap[child]);
+		idx = child;
+	}
+
+	_timeout_heap_set(idx, thread);
+}
+
+/* Restore heap order after the next_time in slot idx changed. */
+static void _timeout_heap_fix(unsigned idx)
+{
+	if (idx > 1 &&
+	    _timeout_heap[idx / 2]->next_time > _timeout_heap[idx]->next_time)
+		_timeout_heap_up(idx);
+	else
+		_timeout_heap_down(idx);
+}
+
+static int _timeout_heap_insert(struct thread_status *thread)
+{
+	struct thread_status **heap;
+	unsigned alloc;
+
+	if (_timeout_heap_size < 1)
+		_timeout_heap_size = 1;
+
+	if (_timeout_heap_size == _timeout_heap_alloc) {
+		alloc = _timeout_heap_alloc ? _timeout_heap_alloc * 2 : 64;
+		if (!(heap = dm_realloc(_timeout_heap, alloc * sizeof(*heap))))
+			return 0;
+		_timeout_heap = heap;
+		_timeout_heap_alloc = alloc;
+	}
+
+	_timeout_heap[_timeout_heap_size] = thread;
+	_timeout_heap_up(_timeout_heap_size++);
+
+	return 1;
+}
+
+static void _timeout_heap_remove(struct thread_status *thread)
+{
+	unsigned idx = thread->timeout_idx;
+	struct thread_status *last = _timeout_heap[--_timeout_heap_size];
+
+	thread->timeout_idx = 0;
+	if (last == thread)
+		return;
+
+	_timeout_heap_set(idx, last);
+	_timeout_heap_fix(idx);
+}
+
+/*
+ * Timeouts are at least a second apart: with next_time in the past
+ * the timeout thread would otherwise never leave its loop.
+ */
+static time_t _timeout_secs(uint32_t secs)
+{
+	return secs ? (time_t) secs : 1;
+}
+
+/*
+ * Delay before a device's first timeout: somewhere in 1..timeout
+ * seconds depending on its uuid, so that devices registered together
+ * do not all time out in the same second from then on.
+ */
+static time_t _first_timeout(struct thread_status *thread)
+{
+	const unsigned char *p = (const unsigned char *) thread->device.uuid;
+	unsigned h = 0;
+
+	if (thread->timeout < 2)
+		return _timeout_secs(thread->timeout);
+
+	while (*p)
+		h = h * 31 + *p++;
+
+	return (time_t) (1 + h % thread->timeout);
+}
+
+/*
+ * Wake up monitor threads every so often.  Only threads whose
+ * next_time has passed are touched, earliest first from the heap.
+ */
 static void *_timeout_thread(void *unused __attribute__((unused)))
 {
 	struct timespec timeout;
+	struct thread_status *thread;
 	time_t curr_time;
 
 	timeout.tv_nsec = 0;
 	pthread_cleanup_push(_exit_timeout, NULL);
 	pthread_mutex_lock(&_timeout_mutex);
 
-	while (!dm_list_empty(&_timeout_registry)) {
-		struct thread_status *thread;
-
-		timeout.tv_sec = 0;
+	while (_timeout_heap_size > 1) {
 		curr_time = time(NULL);
 
-		dm_list_iterate_items_gen(thread, &_timeout_registry, timeout_list) {
-			if (thread->next_time <= curr_time) {
-				thread->next_time = curr_time + thread->timeout;
+		while ((thread = _timeout_heap[1])->next_time <= curr_time) {
+			thread->next_time = curr_time +
+				_timeout_secs(thread->timeout);
+			_timeout_heap_down(1);
+			if (_event_loop)
+				_queue_event(thread, DM_EVENT_TIMEOUT);
+			else
 				pthread_kill(thread->thread, SIGALRM);
-			}
-
-			if (thread->next_time < timeout.tv_sec || !timeout.tv_sec)
-				timeout.tv_sec = thread->next_time;
 		}
 
+		timeout.tv_sec = thread->next_time;
 		pthread_cond_timedwait(&_timeout_cond, &_timeout_mutex,
 				       &timeout);
 	}
@@ -555,13 +749,17 @@ static int _register_for_timeout(struct thread_status *thread)
 
 	pthread_mutex_lock(&_timeout_mutex);
 
-	thread->next_time = time(NULL) + thread->timeout;
+	thread->next_time = time(NULL) + _first_timeout(thread);
 
-	if (dm_list_empty(&thread->timeout_list)) {
-		dm_list_add(&_timeout_registry, &thread->timeout_list);
+	if (!thread->timeout_idx) {
+		if (!_timeout_heap_insert(thread)) {
+			ret = -ENOMEM;
+			goto out;
+		}
 		if (_timeout_running)
 			pthread_cond_signal(&_timeout_cond);
-	}
+	} else
+		_timeout_heap_fix(thread->timeout_idx);
 
 	if (!_timeout_running) {
 		pthread_t timeout_id;
@@ -569,7 +767,7 @@ static int _register_for_timeout(struct thread_status *thread)
 		if (!(ret = -_pthread_create_smallstack(&timeout_id, _timeout_thread, NULL)))
 			_timeout_running = 1;
 	}
-
+out:
 	pthread_mutex_unlock(&_timeout_mutex);
 
 	return ret;
@@ -578,9 +776,19 @@ static int _register_for_timeout(struct thread_status *thread)
 static void _unregister_for_timeout(struct thread_status *thread)
 {
 	pthread_mutex_lock(&_timeout_mutex);
-	if (!dm_list_empty(&thread->timeout_list)) {
-		dm_list_del(&thread->timeout_list);
-		dm_list_init(&thread->timeout_list);
+	if (thread->timeout_idx)
+		_timeout_heap_remove(thread);
+	pthread_mutex_unlock(&_timeout_mutex);
+}
+
+/* Move the next timeout of a registered thread to secs from now. */
+static void _reschedule_timeout(struct thread_status *thread, uint32_t secs)
+{
+	pthread_mutex_lock(&_timeout_mutex);
+	if (thread->timeout_idx) {
+		thread->next_time = time(NULL) + _timeout_secs(secs);
+		_timeout_heap_fix(thread->timeout_idx);
+		pthread_cond_signal(&_timeout_cond);
 	}
 	pthread_mutex_unlock(&_timeout_mutex);
 }
@@ -704,10 +912,22 @@ static int _do_unregister_device(struct thread_status *thread)
 						   &(thread->dso_private));
 }
 
+/* Let the DSO pick when its next timeout event comes. */
+static void _do_next_timeout(struct thread_status *thread)
+{
+	uint32_t secs;
+
+	if (thread->dso_data->next_timeout &&
+	    (thread->events & DM_EVENT_TIMEOUT) &&
+	    (secs = thread->dso_data->next_timeout(&thread->dso_private)))
+		_reschedule_timeout(thread, secs);
+}
+
 /* Process an event in the DSO. */
 static void _do_process_event(struct thread_status *thread, struct dm_task *task)
 {
 	thread->dso_data->process_event(task, thread->current_events, &(thread->dso_private));
+	_do_next_timeout(thread);
 }
 
 /* Thread cleanup handler to unregister device. */
@@ -854,6 +1074,277 @@ static int _terminate_thread(struct thread_status *thread)
 	return pthread_kill(thread->thread, SIGALRM);
 }
 
+/* Hand events to the event loop workers. */
+static void _queue_event(struct thread_status *thread,
+			 enum dm_event_mask events)
+{
+	pthread_mutex_lock(&_work_mutex);
+	thread->pending_events |= events;
+	if (!thread->queued && !thread->processing) {
+		thread->queued = 1;
+		dm_list_add(&_work_queue, &thread->work_list);
+		pthread_cond_signal(&_work_cond);
+	}
+	pthread_mutex_unlock(&_work_mutex);
+}
+
+/* Is an event loop worker still going to touch the thread? */
+static int _event_busy(struct thread_status *thread)
+{
+	int r;
+
+	pthread_mutex_lock(&_work_mutex);
+	r = thread->queued || thread->processing;
+	pthread_mutex_unlock(&_work_mutex);
+
+	return r;
+}
+
+/* Next queued device whose DSO has a worker to spare.  _work_mutex held. */
+static struct thread_status *_next_work(void)
+{
+	struct thread_status *thread;
+
+	dm_list_iterate_items_gen(thread, &_work_queue, work_list)
+		if (thread->dso_data->busy_workers < DSO_MAX_BUSY_WORKERS)
+			return thread;
+
+	return NULL;
+}
+
+static void *_event_worker(void *unused __attribute__((unused)))
+{
+	struct thread_status *thread;
+	enum dm_event_mask events;
+	struct dm_task *task;
+
+	pthread_mutex_lock(&_work_mutex);
+	while (1) {
+		if (!(thread = _next_work())) {
+			pthread_cond_wait(&_work_cond, &_work_mutex);
+			continue;
+		}
+
+		dm_list_del(&thread->work_list);
+		thread->queued = 0;
+		thread->processing = 1;
+		thread->dso_data->busy_workers++;
+		events = thread->pending_events;
+		thread->pending_events = 0;
+		pthread_mutex_unlock(&_work_mutex);
+
+		/* Status stands in for the result of DM_DEVICE_WAITEVENT */
+		if ((thread->events & events) &&
+		    (task = _get_device_status(thread))) {
+			thread->dso_data->process_event(task, events,
+							&thread->dso_private);
+			_do_next_timeout(thread);
+			dm_task_destroy(task);
+		}
+
+		pthread_mutex_lock(&_work_mutex);
+		thread->processing = 0;
+		thread->dso_data->busy_workers--;
+		if (thread->pending_events) {
+			thread->queued = 1;
+			dm_list_add(&_work_queue, &thread->work_list);
+		}
+		/* Work held back by the DSO limit may run now */
+		pthread_cond_broadcast(&_work_cond);
+	}
+
+	return NULL;
+}
+
+/* Stop monitoring a device that has gone away. */
+static void _device_gone(struct thread_status *thread)
+{
+	struct thread_status *thread_iter;
+
+	syslog(LOG_ERR, "%s disappeared, detaching", thread->device.name);
+
+	_lock_mutex();
+	thread->status = DM_THREAD_DONE;
+	dm_list_iterate_items(thread_iter, &_thread_registry_unused)
+		if (thread_iter == thread) {
+			_unlock_mutex();
+			return;
+		}
+	UNLINK_THREAD(thread);
+	LINK(thread, &_thread_registry_unused);
+	_unlock_mutex();
+}
+
+/* Queue an event if the device's event_nr moved on. */
+static void _check_device(struct thread_status *thread)
+{
+	struct dm_task *dmt;
+	struct dm_info info;
+
+	if (!(dmt = dm_task_create(DM_DEVICE_INFO)))
+		return;
+
+	if (!dm_task_set_uuid(dmt, thread->device.uuid) ||
+	    !dm_task_run(dmt) || !dm_task_get_info(dmt, &info))
+		goto out;
+
+	if (!info.exists)
+		_device_gone(thread);
+	else if (info.event_nr != thread->event_nr) {
+		thread->event_nr = info.event_nr;
+		_queue_event(thread, DM_EVENT_DEVICE_ERROR);
+	}
+out:
+	dm_task_destroy(dmt);
+}
+
+/*
+ * Check the monitored devices numbered major:minor, or all of them
+ * if major is negative.
+ */
+static void _check_devices(int major, int minor)
+{
+	struct thread_status *thread, **threads;
+	unsigned count = 0, n, i;
+
+	_lock_mutex();
+	if (!(n = dm_list_size(&_thread_registry)) ||
+	    !(threads = dm_malloc(n * sizeof(*threads)))) {
+		_unlock_mutex();
+		return;
+	}
+
+	/* Held threads stay allocated while the mutex is dropped */
+	dm_list_iterate_items(thread, &_thread_registry)
+		if ((major < 0) || ((thread->device.major == major) &&
+				    (thread->device.minor == minor))) {
+			thread->checking++;
+			threads[count++] = thread;
+		}
+	_unlock_mutex();
+
+	for (i = 0; i < count; i++)
+		_check_device(threads[i]);
+
+	_lock_mutex();
+	for (i = 0; i < count; i++)
+		threads[i]->checking--;
+	_unlock_mutex();
+
+	dm_free(threads);
+}
+
+#ifdef linux
+static int _open_uevent_socket(void)
+{
+	struct sockaddr_nl nl;
+	int fd;
+
+	if ((fd = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT)) < 0)
+		return -1;
+
+	memset(&nl, 0, sizeof(nl));
+	nl.nl_family = AF_NETLINK;
+	nl.nl_groups = 1;	/* kernel uevents */
+	if (bind(fd, (struct sockaddr *) &nl, sizeof(nl))) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Returns 1 for a change uevent of a block device. */
+static int _parse_uevent(const char *buf, size_t len, int *major, int *minor)
+{
+	const char *p;
+	int change = 0, block = 0;
+
+	*major = *minor = -1;
+
+	for (p = buf; p < buf + len; p += strlen(p) + 1) {
+		if (!strcmp(p, "ACTION=change"))
+			change = 1;
+		else if (!strcmp(p, "SUBSYSTEM=block"))
+			block = 1;
+		else if (!strncmp(p, "MAJOR=", 6))
+			*major = atoi(p + 6);
+		else if (!strncmp(p, "MINOR=", 6))
+			*minor = atoi(p + 6);
+	}
+
+	return change && block && (*major >= 0) && (*minor >= 0);
+}
+#endif
+
+static void *_event_loop_thread(void *unused __attribute__((unused)))
+{
+	time_t now, next_sweep = 0;
+#ifdef linux
+	char buf[UEVENT_BUFFER_SIZE];
+	struct pollfd pfd;
+	ssize_t len;
+	int major, minor;
+#endif
+
+	while (1) {
+		now = time(NULL);
+		if (now >= next_sweep) {
+			_check_devices(-1, -1);
+			next_sweep = now + EVENT_SWEEP_INTERVAL;
+		}
+
+#ifdef linux
+		if (_uevent_fd >= 0) {
+			pfd.fd = _uevent_fd;
+			pfd.events = POLLIN;
+			if (poll(&pfd, 1, (next_sweep - now) * 1000) <= 0)
+				continue;
+
+			if ((len = recv(_uevent_fd, buf, sizeof(buf) - 1,
+					MSG_DONTWAIT)) <= 0)
+				continue;
+
+			buf[len] = '\0';
+			if (_parse_uevent(buf, len, &major, &minor))
+				_check_devices(major, minor);
+			continue;
+		}
+#endif
+		sleep(next_sweep - now);
+	}
+
+	return NULL;
+}
+
+/* Start the event loop and its workers.  Call with _global_mutex held. */
+static int _start_event_loop(void)
+{
+	pthread_t t;
+	int i, r;
+
+	if (_event_loop_running)
+		return 0;
+
+#ifdef linux
+	if ((_uevent_fd = _open_uevent_socket()) < 0)
+		syslog(LOG_WARNING, "Unable to listen for uevents, "
+		       "checking devices every %d seconds.",
+		       EVENT_SWEEP_INTERVAL);
+#endif
+
+	for (i = 0; i < EVENT_WORKERS; i++)
+		if ((r = _pthread_create_smallstack(&t, _event_worker, NULL)))
+			return -r;
+
+	if ((r = _pthread_create_smallstack(&t, _event_loop_thread, NULL)))
+		return -r;
+
+	_event_loop_running = 1;
+
+	return 0;
+}
+
 /* DSO reference counting. Call with _global_mutex locked! */
 static void _lib_get(struct dso_data *data)
 {
@@ -895,6 +1386,10 @@ static int _lookup_symbol(void *dl, void **symbol, const char *name)
 
 static int lookup_symbols(void *dl, struct dso_data *data)
 {
+	/* Optional */
+	_lookup_symbol(dl, (void *) &data->next_timeout, "next_timeout");
+	_lookup_symbol(dl, (void *) &data->get_status, "get_status");
+
 	return _lookup_symbol(dl, (void *) &data->process_event,
 			     "process_event") &&
 	    _lookup_symbol(dl, (void *) &data->register_device,
@@ -1013,7 +1508,8 @@ static int _register_for_event(struct message_data *message_data)
 
 		/* Try to create the monitoring thread for this device. */
 		_lock_mutex();
-		if ((ret = -_create_thread(thread))) {
+		if ((ret = _event_loop ? _start_event_loop() :
+		     -_create_thread(thread))) {
 			_unlock_mutex();
 			_do_unregister_device(thread);
 			_free_thread_status(thread);
@@ -1085,6 +1581,64 @@ static int _unregister_for_event(struct message_data *message_data)
 	return ret;
 }
 
+/*
+ * Apply a (un)registration to each uuid of a bulk request.
+ *
+ * The reply lists the result of each device in turn.  The request
+ * itself returns the first failure.
+ */
+static int _for_each_device(struct message_data *message_data,
+			    int (*f)(struct message_data *))
+{
+	struct dm_event_daemon_message *msg = message_data->msg;
+	char *uuid = message_data->device_uuid;
+	char *devices, *p, *reply;
+	int count = 1, ret = 0, r, len;
+	size_t size;
+
+	if (!(devices = message_data->devices))
+		return -EINVAL;
+
+	for (p = devices; (p = strchr(p, ' ')); p++)
+		count++;
+
+	size = strlen(message_data->id) + 12 * count + 1;
+	if (!(reply = dm_malloc(size)))
+		return -ENOMEM;
+
+	len = sprintf(reply, "%s", message_data->id);
+
+	for (p = devices; p; p = devices) {
+		if ((devices = strchr(p, ' ')))
+			*devices++ = '\0';
+		if (!*p)
+			continue;
+
+		message_data->device_uuid = p;
+		if ((r = f(message_data)) && !ret)
+			ret = r;
+		len += sprintf(reply + len, " %d", r);
+	}
+
+	message_data->device_uuid = uuid;
+
+	dm_free(msg->data);
+	msg->data = reply;
+	msg->size = len;
+
+	return ret;
+}
+
+static int _bulk_register_for_event(struct message_data *message_data)
+{
+	return _for_each_device(message_data, _register_for_event);
+}
+
+static int _bulk_unregister_for_event(struct message_data *message_data)
+{
+	return _for_each_device(message_data, _unregister_for_event);
+}
+
 /*
  * Get registered device.
  *
@@ -1418,9 +1972,13 @@ static int _handle_request(struct dm_event_daemon_message *msg,
 		{ DM_EVENT_CMD_GET_TIMEOUT, _get_timeout},
 		{ DM_EVENT_CMD_ACTIVE, _active},
 		{ DM_EVENT_CMD_GET_STATUS, _get_status},
+		{ DM_EVENT_CMD_BULK_REGISTER_FOR_EVENT,
+			_bulk_register_for_event},
+		{ DM_EVENT_CMD_BULK_UNREGISTER_FOR_EVENT,
+			_bulk_unregister_for_event},
 	}, *req;
 
-	for (req = requests; req < requests + sizeof(requests); req++)
+	for (req = requests; req < requests + sizeof(requests) / sizeof(*requests); req++)
 		if (req->cmd == msg->cmd)
 			return req->f(message_data);
 
@@ -1493,6 +2051,287 @@ static void _process_request(struct dm_event_fifos *fifos)
 	dm_free(msg.data);
 }
 
+/*
+ * Clients connected to DM_EVENT_SOCKET.  Any number may be connected
+ * at once.  Requests on a connection are answered in order, so a
+ * client may send several before reading the replies.
+ *
+ * Client sockets are non-blocking.  A reply the client is not reading
+ * waits in its output buffer, and no further requests are taken from
+ * that client until the buffer is sent.
+ */
+#define SOCKET_BACKLOG 16
+#define SOCKET_MAX_MESSAGE (16 * 1024 * 1024)
+
+struct socket_client {
+	struct dm_list list;
+	int fd;
+	char *buf;		/* Received bytes not yet processed */
+	size_t size;
+	size_t used;
+	char *out;		/* Reply bytes not yet sent */
+	size_t out_size;
+	size_t out_used;
+};
+
+static int _socket_fd = -1;
+static DM_LIST_INIT(_socket_clients);
+
+/* Listen on DM_EVENT_SOCKET.  Fifos keep working without it. */
+static int _open_socket(void)
+{
+	struct sockaddr_un sa;
+	mode_t old_umask;
+	int fd, r;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strncpy(sa.sun_path, DM_EVENT_SOCKET, sizeof(sa.sun_path) - 1);
+
+	if ((fd = socket(PF_UNIX, SOCK_STREAM, 0)) < 0) {
+		syslog(LOG_ERR, "%s: Failed to create socket: %s\n",
+		       __func__, strerror(errno));
+		return 0;
+	}
+
+	/* Left behind by a previous instance; the pidfile keeps us unique */
+	if (unlink(DM_EVENT_SOCKET) && errno != ENOENT)
+		syslog(LOG_WARNING, "Failed to remove stale %s: %s",
+		       DM_EVENT_SOCKET, strerror(errno));
+
+	(void) dm_prepare_selinux_context(DM_EVENT_SOCKET, S_IFSOCK);
+	old_umask = umask(0077);
+	r = bind(fd, (struct sockaddr *) &sa, sizeof(sa));
+	umask(old_umask);
+	(void) dm_prepare_selinux_context(NULL, 0);
+
+	if (r || listen(fd, SOCKET_BACKLOG)) {
+		syslog(LOG_ERR, "%s: Failed to listen on %s: %s\n",
+		       __func__, DM_EVENT_SOCKET, strerror(errno));
+		close(fd);
+		return 0;
+	}
+
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) ||
+	    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK))
+		syslog(LOG_WARNING, "Failed to set flags on %s", DM_EVENT_SOCKET);
+
+	_socket_fd = fd;
+
+	return 1;
+}
+
+static void _close_socket(void)
+{
+	if (_socket_fd < 0)
+		return;
+
+	close(_socket_fd);
+	_socket_fd = -1;
+	if (unlink(DM_EVENT_SOCKET))
+		syslog(LOG_WARNING, "Failed to remove %s: %s", DM_EVENT_SOCKET,
+		       strerror(errno));
+}
+
+static void _accept_client(void)
+{
+	struct socket_client *client;
+	int fd;
+
+	if ((fd = accept(_socket_fd, NULL, NULL)) < 0)
+		return;
+
+	if (fd >= FD_SETSIZE || !(client = dm_zalloc(sizeof(*client)))) {
+		syslog(LOG_ERR, "Refusing client connection.");
+		close(fd);
+		return;
+	}
+
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) ||
+	    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK)) {
+		syslog(LOG_ERR, "Failed to set flags on client socket.");
+		dm_free(client);
+		close(fd);
+		return;
+	}
+
+	client->fd = fd;
+	dm_list_add(&_socket_clients, &client->list);
+}
+
+static void _drop_client(struct socket_client *client)
+{
+	dm_list_del(&client->list);
+	close(client->fd);
+	dm_free(client->buf);
+	dm_free(client->out);
+	dm_free(client);
+}
+
+/* Send what the socket takes now.  Returns 0 if the client is gone. */
+static int _flush_client(struct socket_client *client)
+{
+	ssize_t r;
+
+	while (client->out_used) {
+		if ((r = send(client->fd, client->out, client->out_used,
+			      MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+		client->out_used -= r;
+		memmove(client->out, client->out + r, client->out_used);
+	}
+
+	return 1;
+}
+
+static int _queue_reply(struct socket_client *client,
+			struct dm_event_daemon_message *msg)
+{
+	uint32_t header[2];
+	size_t size = client->out_used + sizeof(header) + msg->size;
+	char *out;
+
+	if (size > client->out_size) {
+		if (!(out = dm_realloc(client->out, size)))
+			return 0;
+		client->out = out;
+		client->out_size = size;
+	}
+
+	header[0] = htonl(msg->cmd);
+	header[1] = htonl(msg->size);
+	memcpy(client->out + client->out_used, header, sizeof(header));
+	client->out_used += sizeof(header);
+	if (msg->size)
+		memcpy(client->out + client->out_used, msg->data, msg->size);
+	client->out_used += msg->size;
+
+	return _flush_client(client);
+}
+
+/*
+ * Answer the complete requests received from the client, stopping
+ * while a reply is still waiting to be sent.
+ * Returns 0 when the client is to be dropped.
+ */
+static int _answer_client(struct socket_client *client)
+{
+	struct dm_event_daemon_message msg;
+	uint32_t header[2];
+	size_t msg_size;
+	int die, r;
+
+	while (!client->out_used && client->used >= sizeof(header)) {
+		memcpy(header, client->buf, sizeof(header));
+		if ((msg_size = ntohl(header[1])) > SOCKET_MAX_MESSAGE) {
+			syslog(LOG_ERR, "Dropping client sending %lu byte message.",
+			       (unsigned long) msg_size);
+			return 0;
+		}
+
+		if (client->used < sizeof(header) + msg_size)
+			break;
+
+		msg.cmd = ntohl(header[0]);
+		msg.size = msg_size;
+		if (!(msg.data = dm_malloc(msg_size + 1)))
+			return 0;
+		memcpy(msg.data, client->buf + sizeof(header), msg_size);
+		msg.data[msg_size] = '\0';
+
+		client->used -= sizeof(header) + msg_size;
+		memmove(client->buf, client->buf + sizeof(header) + msg_size,
+			client->used);
+
+		die = (msg.cmd == DM_EVENT_CMD_DIE);
+		_do_process_request(&msg);
+		r = _queue_reply(client, &msg);
+		dm_free(msg.data);
+
+		if (die)
+			raise(9);
+
+		if (!r)
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Read what the client sent and answer each complete request.
+ * Returns 0 when the client is to be dropped.
+ */
+static int _process_client(struct socket_client *client)
+{
+	char *buf;
+	ssize_t r;
+
+	if (client->size - client->used < 4096) {
+		if (!(buf = dm_realloc(client->buf, client->size + 4096 +
+					client->size)))
+			return 0;
+		client->buf = buf;
+		client->size += 4096 + client->size;
+	}
+
+	if ((r = read(client->fd, client->buf + client->used,
+		      client->size - client->used)) < 0)
+		return errno == EINTR || errno == EAGAIN;
+	if (!r)
+		return 0;	/* Client closed the connection */
+	client->used += r;
+
+	return _answer_client(client);
+}
+
+/* Wait up to a second for requests on the fifos or socket. */
+static void _process_requests(struct dm_event_fifos *fifos)
+{
+	struct socket_client *client, *tmp;
+	struct timeval t = { 1, 0 };
+	int max_fd = fifos->client;
+	fd_set fds, wfds;
+
+	FD_ZERO(&fds);
+	FD_ZERO(&wfds);
+	FD_SET(fifos->client, &fds);
+
+	if (_socket_fd >= 0) {
+		FD_SET(_socket_fd, &fds);
+		if (_socket_fd > max_fd)
+			max_fd = _socket_fd;
+	}
+
+	/* A client with a reply pending is not read until it is sent */
+	dm_list_iterate_items(client, &_socket_clients) {
+		FD_SET(client->fd, client->out_used ? &wfds : &fds);
+		if (client->fd > max_fd)
+			max_fd = client->fd;
+	}
+
+	if (select(max_fd + 1, &fds, &wfds, NULL, &t) <= 0)
+		return;
+
+	if (FD_ISSET(fifos->client, &fds))
+		_process_request(fifos);
+
+	dm_list_iterate_items_safe(client, tmp, &_socket_clients) {
+		if (FD_ISSET(client->fd, &wfds)) {
+			if (!_flush_client(client) || !_answer_client(client))
+				_drop_client(client);
+		} else if (FD_ISSET(client->fd, &fds) &&
+			   !_process_client(client))
+			_drop_client(client);
+	}
+
+	if (_socket_fd >= 0 && FD_ISSET(_socket_fd, &fds))
+		_accept_client();
+}
+
 static void _process_initial_registrations(void)
 {
 	int i = 0;
@@ -1517,6 +2356,23 @@ static void _cleanup_unused_threads(void)
 	_lock_mutex();
 	while ((l = dm_list_first(&_thread_registry_unused))) {
 		thread = dm_list_item(l, struct thread_status);
+
+		if (_event_loop) {
+			/* No new timeout events once off the timeout list */
+			_unregister_for_timeout(thread);
+			if (thread->checking || _event_busy(thread))
+				break;	/* cleanup on the next round */
+
+			dm_list_del(l);
+			_unlock_mutex();
+			if (!_do_unregister_device(thread))
+				syslog(LOG_ERR, "%s: %s unregister failed\n",
+				       __func__, thread->device.name);
+			_lock_mutex();
+			_free_thread_status(thread);
+			continue;
+		}
+
 		if (thread->processing)
 			break;	/* cleanup on the next round */
 
@@ -1767,10 +2623,11 @@ static void restart(void)
 static void usage(char *prog, FILE *file)
 {
 	fprintf(file, "Usage:\n"
-		"%s [-V] [-h] [-d] [-d] [-d] [-f]\n\n"
+		"%s [-V] [-h] [-d] [-d] [-d] [-e] [-f]\n\n"
 		"   -V       Show version of dmeventd\n"
 		"   -h       Show this help information\n"
 		"   -d       Log debug messages to syslog (-d, -dd, -ddd)\n"
+		"   -e       Monitor devices from an event loop, not a thread each\n"
 		"   -f       Don't fork, run in the foreground\n\n", prog);
 }
 
@@ -1783,7 +2640,7 @@ int main(int argc, char *argv[])
 	opterr = 0;
 	optind = 0;
 
-	while ((opt = getopt(argc, argv, "?fhVdR")) != EOF) {
+	while ((opt = getopt(argc, argv, "?efhVdR")) != EOF) {
 		switch (opt) {
 		case 'h':
 			usage(argv[0], stdout);
@@ -1794,6 +2651,9 @@ int main(int argc, char *argv[])
 		case 'R':
 			_restart++;
 			break;
+		case 'e':
+			_event_loop++;
+			break;
 		case 'f':
 			_foreground++;
 			break;
@@ -1854,6 +2714,9 @@ int main(int argc, char *argv[])
 	if (_open_fifos(&fifos))
 		exit(EXIT_FIFO_FAILURE);
 
+	/* Clients fall back to the fifos without it */
+	(void) _open_socket();
+
 	/* Signal parent, letting them know we are ready to go. */
 	if (!_foreground)
 		kill(getppid(), SIGTERM);
@@ -1863,7 +2726,7 @@ int main(int argc, char *argv[])
 		_process_initial_registrations();
 
 	while (!_exit_now) {
-		_process_request(&fifos);
+		_process_requests(&fifos);
 		_cleanup_unused_threads();
 		if (!dm_list_empty(&_thread_registry)
 		    || !dm_list_empty(&_thread_registry_unused))
@@ -1872,6 +2735,7 @@ int main(int argc, char *argv[])
 			_thread_registries_empty = 1;
 	}
 
+	_close_socket();
 	_exit_dm_lib();
 
 	pthread_mutex_destroy(&_global_mutex);
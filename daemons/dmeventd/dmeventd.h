@@ -21,6 +21,7 @@
 #define DM_EVENT_LOCKFILE	"/var/lock/dmeventd"
 #define	DM_EVENT_FIFO_CLIENT	"/var/run/dmeventd-client"
 #define	DM_EVENT_FIFO_SERVER	"/var/run/dmeventd-server"
+#define	DM_EVENT_SOCKET		"/var/run/dmeventd-socket"
 #define DM_EVENT_PIDFILE	"/var/run/dmeventd.pid"
 
 #define DM_EVENT_DEFAULT_TIMEOUT 10
@@ -37,6 +38,8 @@ enum dm_event_command {
 	DM_EVENT_CMD_HELLO,
 	DM_EVENT_CMD_DIE,
 	DM_EVENT_CMD_GET_STATUS,
+	DM_EVENT_CMD_BULK_REGISTER_FOR_EVENT,
+	DM_EVENT_CMD_BULK_UNREGISTER_FOR_EVENT,
 };
 
 /* Message passed between client and daemon. */
@@ -48,12 +51,16 @@ struct dm_event_daemon_message {
 
 /* FIXME Is this meant to be exported?  I can't see where the
    interface uses it. */
-/* Fifos for client/daemon communication. */
+/*
+ * Fifos for client/daemon communication.  When connected over
+ * DM_EVENT_SOCKET instead, client and server are the same socket.
+ */
 struct dm_event_fifos {
 	int client;
 	int server;
 	const char *client_path;
 	const char *server_path;
+	int socket;
 };
 
 /*      EXIT_SUCCESS             0 -- stdlib.h */
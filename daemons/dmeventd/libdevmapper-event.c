@@ -17,6 +17,7 @@
 //#include "libmultilog.h"
 #include "dmeventd.h"
 
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -24,14 +25,23 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/file.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <arpa/inet.h>		/* for htonl, ntohl */
 
 static int _sequence_nr = 0;
 
+/*
+ * Connection to DM_EVENT_SOCKET kept open between requests, so only
+ * the first request of a process pays for connecting and HELLO.
+ */
+static struct dm_event_fifos _socket_conn = { .client = -1, .server = -1 };
+static pid_t _socket_pid;
+
 struct dm_event_handler {
 	char *dso;
 
@@ -251,7 +261,7 @@ static int _daemon_read(struct dm_event_fifos *fifos,
 			return 0;
 		}
 
-		ret = read(fifos->server, buf + bytes, size);
+		ret = read(fifos->server, buf + bytes, size - bytes);
 		if (ret < 0) {
 			if ((errno == EINTR) || (errno == EAGAIN))
 				continue;
@@ -260,12 +270,21 @@ static int _daemon_read(struct dm_event_fifos *fifos,
 				return 0;
 			}
 		}
+		if (!ret) {
+			log_error("Event server closed the connection.");
+			return 0;
+		}
 
 		bytes += ret;
 		if (header && (bytes == 2 * sizeof(uint32_t))) {
 			msg->cmd = ntohl(header[0]);
 			msg->size = ntohl(header[1]);
-			buf = msg->data = dm_malloc(msg->size);
+			/* Terminated so that replies can be parsed as strings */
+			if (!(buf = msg->data = dm_malloc(msg->size + 1))) {
+				log_error("Unable to allocate reply from event server.");
+				return 0;
+			}
+			buf[msg->size] = '\0';
 			size = msg->size;
 			bytes = 0;
 			header = 0;
@@ -297,8 +316,8 @@ static int _daemon_write(struct dm_event_fifos *fifos,
 	header[1] = htonl(msg->size);
 	memcpy(buf + 2 * sizeof(uint32_t), msg->data, msg->size);
 
-	/* drain the answer fifo */
-	while (1) {
+	/* drain the answer fifo; a socket carries only our own replies */
+	while (!fifos->socket) {
 		FD_ZERO(&fds);
 		FD_SET(fifos->server, &fds);
 		tval.tv_usec = 100;
@@ -324,7 +343,10 @@ static int _daemon_write(struct dm_event_fifos *fifos,
 			}
 		} while (ret < 1);
 
-		ret = write(fifos->client, buf + bytes, size - bytes);
+		/* Fail rather than take SIGPIPE if the daemon went away */
+		ret = fifos->socket ?
+			send(fifos->client, buf + bytes, size - bytes, MSG_NOSIGNAL) :
+			write(fifos->client, buf + bytes, size - bytes);
 		if (ret < 0) {
 			if ((errno == EINTR) || (errno == EAGAIN))
 				continue;
@@ -358,6 +380,10 @@ int daemon_talk(struct dm_event_fifos *fifos,
 	msg->cmd = cmd;
 	if (cmd == DM_EVENT_CMD_HELLO)
 		fmt = "%d:%d HELLO";
+	else if (cmd == DM_EVENT_CMD_BULK_REGISTER_FOR_EVENT ||
+		 cmd == DM_EVENT_CMD_BULK_UNREGISTER_FOR_EVENT)
+		/* dev_name is a space separated uuid list, so it goes last */
+		fmt = "%1$d:%2$d %3$s - %5$u %6$" PRIu32 " %4$s";
 	if ((msg_size = dm_asprintf(&(msg->data), fmt, getpid(), _sequence_nr,
 				    dso, dev, evmask, timeout)) < 0) {
 		log_error("_daemon_talk: message allocation failed");
@@ -520,6 +546,13 @@ static int _init_client(char *dmeventd_path, struct dm_event_fifos *fifos)
 
 void fini_fifos(struct dm_event_fifos *fifos)
 {
+	if (fifos->socket) {
+		close(fifos->server);
+		fifos->client = fifos->server = -1;
+		fifos->socket = 0;
+		return;
+	}
+
 	if (flock(fifos->server, LOCK_UN))
 		log_error("flock unlock %s", fifos->server_path);
 
@@ -570,6 +603,54 @@ failed:
 	return NULL;
 }
 
+/*
+ * Connect to DM_EVENT_SOCKET and say HELLO, unless already connected.
+ * Returns 0 if the daemon is not running or predates the socket.
+ */
+static int _init_socket(void)
+{
+	struct dm_event_daemon_message msg = { 0, 0, NULL };
+	struct sockaddr_un sa;
+	int fd;
+
+	/* A forked child must not share its parent's connection */
+	if (_socket_conn.socket && _socket_pid != getpid())
+		fini_fifos(&_socket_conn);
+
+	if (_socket_conn.socket)
+		return 1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strncpy(sa.sun_path, DM_EVENT_SOCKET, sizeof(sa.sun_path) - 1);
+
+	if ((fd = socket(PF_UNIX, SOCK_STREAM, 0)) < 0)
+		return 0;
+
+	if (connect(fd, (struct sockaddr *) &sa, sizeof(sa))) {
+		close(fd);
+		return 0;
+	}
+
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC))
+		log_sys_error("fcntl", DM_EVENT_SOCKET);
+
+	_socket_conn.client = _socket_conn.server = fd;
+	_socket_conn.client_path = _socket_conn.server_path = DM_EVENT_SOCKET;
+	_socket_conn.socket = 1;
+	_socket_pid = getpid();
+
+	if (daemon_talk(&_socket_conn, &msg, DM_EVENT_CMD_HELLO, NULL, NULL, 0, 0)) {
+		fini_fifos(&_socket_conn);
+		dm_free(msg.data);
+		return 0;
+	}
+
+	dm_free(msg.data);
+
+	return 1;
+}
+
 /* Handle the event (de)registration call and return negative error codes. */
 static int _do_event(int cmd, char *dmeventd_path, struct dm_event_daemon_message *msg,
 		     const char *dso_name, const char *dev_name,
@@ -578,6 +659,17 @@ static int _do_event(int cmd, char *dmeventd_path, struct dm_event_daemon_messag
 	int ret;
 	struct dm_event_fifos fifos;
 
+	if (_init_socket()) {
+		if ((ret = daemon_talk(&_socket_conn, msg, cmd, dso_name,
+				       dev_name, evmask, timeout)) != -EIO)
+			return ret;
+
+		/* The daemon went away; try again through the fifos */
+		fini_fifos(&_socket_conn);
+		dm_free(msg->data);
+		msg->data = NULL;
+	}
+
 	if (!_init_client(dmeventd_path, &fifos)) {
 		stack;
 		return -ESRCH;
@@ -656,6 +748,99 @@ int dm_event_unregister_handler(const struct dm_event_handler *dmevh)
 	return ret;
 }
 
+/*
+ * (Un)register each of uuids in a single request.  Daemons without
+ * bulk requests get one request per device instead.
+ */
+static int _do_bulk_event(int cmd, const struct dm_event_handler *dmevh,
+			  const char *const *uuids, unsigned count)
+{
+	struct dm_event_daemon_message msg = { 0, 0, NULL };
+	struct dm_event_handler single;
+	const char *what = (cmd == DM_EVENT_CMD_BULK_REGISTER_FOR_EVENT) ?
+		"registration" : "deregistration";
+	size_t len = 1;
+	char *list, *p;
+	unsigned i;
+	int ret = 1, err;
+
+	if (!count)
+		return 1;
+
+	for (i = 0; i < count; i++)
+		len += strlen(uuids[i]) + 1;
+
+	if (!(list = dm_malloc(len))) {
+		log_error("Failed to allocate device list for event %s.", what);
+		return 0;
+	}
+
+	for (i = 0, p = list; i < count; i++)
+		p += sprintf(p, "%s%s", i ? " " : "", uuids[i]);
+
+	err = _do_event(cmd, dmevh->dmeventd_path, &msg, dmevh->dso, list,
+			dmevh->mask, dmevh->timeout);
+	dm_free(list);
+
+	/* Reply is the message id followed by a result per device */
+	p = msg.data ? strchr(msg.data, ' ') : NULL;
+
+	if (err == -EINVAL && p && !isdigit(p[1]) && p[1] != '-') {
+		/* An error string instead of results: old daemon */
+		dm_free(msg.data);
+		single = *dmevh;
+		single.dev_name = NULL;
+		single.major = single.minor = 0;
+		for (i = 0; i < count; i++) {
+			single.uuid = (char *) uuids[i];
+			if (!((cmd == DM_EVENT_CMD_BULK_REGISTER_FOR_EVENT) ?
+			      dm_event_register_handler(&single) :
+			      dm_event_unregister_handler(&single)))
+				ret = 0;
+		}
+		return ret;
+	}
+
+	if (!msg.data) {
+		log_error("Bulk event %s failed: %s", what, strerror(-err));
+		return 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (!p) {
+			log_error("Bulk event %s failed: %s", what,
+				  err < 0 ? strerror(-err) : "short reply");
+			ret = 0;
+			break;
+		}
+		if ((err = strtol(p, &p, 10)) < 0) {
+			log_error("%s: event %s failed: %s", uuids[i], what,
+				  strerror(-err));
+			ret = 0;
+		}
+		if (*p != ' ')
+			p = NULL;
+	}
+
+	dm_free(msg.data);
+
+	return ret;
+}
+
+int dm_event_register_handlers(const struct dm_event_handler *dmevh,
+			       const char *const *uuids, unsigned count)
+{
+	return _do_bulk_event(DM_EVENT_CMD_BULK_REGISTER_FOR_EVENT, dmevh,
+			      uuids, count);
+}
+
+int dm_event_unregister_handlers(const struct dm_event_handler *dmevh,
+				 const char *const *uuids, unsigned count)
+{
+	return _do_bulk_event(DM_EVENT_CMD_BULK_UNREGISTER_FOR_EVENT, dmevh,
+			      uuids, count);
+}
+
 /* Fetch a string off src and duplicate it into *dest. */
 /* FIXME: move to separate module to share with the daemon. */
 static char *_fetch_string(char **src, const int delimiter)
@@ -101,11 +101,23 @@ int dm_event_get_registered_device(struct dm_event_handler *dmevh, int next);
 int dm_event_register_handler(const struct dm_event_handler *dmevh);
 int dm_event_unregister_handler(const struct dm_event_handler *dmevh);
 
+/*
+ * Initiate or stop monitoring of many devices, given by uuid, in one
+ * request using the dso, event mask and timeout of dmevh.
+ */
+int dm_event_register_handlers(const struct dm_event_handler *dmevh,
+			       const char *const *uuids, unsigned count);
+int dm_event_unregister_handlers(const struct dm_event_handler *dmevh,
+				 const char *const *uuids, unsigned count);
+
 /* Prototypes for DSO interface, see dmeventd.c, struct dso_data for
    detailed descriptions. */
 void process_event(struct dm_task *dmt, enum dm_event_mask evmask, void **user);
 int register_device(const char *device_name, const char *uuid, int major, int minor, void **user);
 int unregister_device(const char *device_name, const char *uuid, int major,
 		      int minor, void **user);
+/* Optional DSO entry points. */
+uint32_t next_timeout(void **user);
+int get_status(char *buf, size_t size, void **user);
 
 #endif
@@ -22,6 +22,7 @@
 
 #include <pthread.h>
 #include <syslog.h>
+#include <sys/time.h>
 
 extern int dmeventd_debug;
 
@@ -39,9 +40,35 @@ static struct dm_pool *_mem_pool = NULL;
 static void *_lvm_handle = NULL;
 
 /*
- * Currently only one event can be processed at a time.
+ * Events are serialised per VG.  The thread handling an event holds
+ * the vg_lock of the device's VG, so events for different VGs are
+ * processed in parallel.
+ *
+ * liblvm2cmd is not thread-safe, so the commands themselves still run
+ * one at a time under _command_mutex, in this memory-locked process:
+ * a repair must not need to page anything in from disk while I/O to a
+ * failed device is blocked.
+ *
+ * _event_mutex protects _vg_locks.
  */
+
+struct vg_lock {
+	struct dm_list list;
+	char *vgname;
+	unsigned users;		/* Threads holding or waiting */
+	int held;
+	pthread_cond_t cond;
+	struct dm_pool *mem;	/* Holder's allocations, see dmeventd_lvm2_pool */
+};
+
 static pthread_mutex_t _event_mutex = PTHREAD_MUTEX_INITIALIZER;
+static DM_LIST_INIT(_vg_locks);
+/* Used for devices whose VG cannot be determined. */
+static struct vg_lock _fallback_lock = { .cond = PTHREAD_COND_INITIALIZER };
+static pthread_key_t _held_lock_key;
+static pthread_once_t _held_lock_key_once = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t _command_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 /*
  * FIXME Do not pass things directly to syslog, rather use the existing logging
@@ -80,16 +107,119 @@ static void _temporary_log_fn(int level,
 	}
 }
 
-void dmeventd_lvm2_lock(void)
+static void _create_held_lock_key(void)
 {
-	if (pthread_mutex_trylock(&_event_mutex)) {
-		syslog(LOG_NOTICE, "Another thread is handling an event. Waiting...");
-		pthread_mutex_lock(&_event_mutex);
+	if (pthread_key_create(&_held_lock_key, NULL))
+		syslog(LOG_ERR, "Failed to create VG lock key.");
+}
+
+static struct vg_lock *_get_vg_lock(const char *device)
+{
+	struct vg_lock *lock;
+	char *vgname, *lv, *layer;
+
+	if (!(vgname = dm_strdup(device)))
+		return &_fallback_lock;
+
+	if (!dm_split_lvm_name(NULL, device, &vgname, &lv, &layer)) {
+		dm_free(vgname);
+		return &_fallback_lock;
 	}
+
+	dm_list_iterate_items(lock, &_vg_locks)
+		if (!strcmp(lock->vgname, vgname)) {
+			dm_free(vgname);
+			return lock;
+		}
+
+	if (!(lock = dm_zalloc(sizeof(*lock)))) {
+		dm_free(vgname);
+		return &_fallback_lock;
+	}
+
+	if (!(lock->mem = dm_pool_create("vg_lock", 1024))) {
+		dm_free(lock);
+		dm_free(vgname);
+		return &_fallback_lock;
+	}
+
+	lock->vgname = vgname;
+	pthread_cond_init(&lock->cond, NULL);
+	dm_list_add(&_vg_locks, &lock->list);
+
+	return lock;
+}
+
+void dmeventd_lvm2_lock(const char *device)
+{
+	struct vg_lock *lock;
+
+	pthread_mutex_lock(&_event_mutex);
+
+	lock = _get_vg_lock(device);
+	lock->users++;
+	if (lock->held) {
+		syslog(LOG_NOTICE, "Another thread is handling an event for %s. Waiting...",
+		       lock->vgname ? lock->vgname : "this device");
+		while (lock->held)
+			pthread_cond_wait(&lock->cond, &_event_mutex);
+	}
+	lock->held = 1;
+	if (lock == &_fallback_lock)
+		lock->mem = _mem_pool;
+
+	pthread_mutex_unlock(&_event_mutex);
+
+	pthread_setspecific(_held_lock_key, lock);
+}
+
+int dmeventd_lvm2_trylock(const char *device)
+{
+	struct vg_lock *lock;
+
+	pthread_mutex_lock(&_event_mutex);
+
+	lock = _get_vg_lock(device);
+	if (lock->held) {
+		pthread_mutex_unlock(&_event_mutex);
+		return 0;
+	}
+	lock->users++;
+	lock->held = 1;
+	if (lock == &_fallback_lock)
+		lock->mem = _mem_pool;
+
+	pthread_mutex_unlock(&_event_mutex);
+
+	pthread_setspecific(_held_lock_key, lock);
+
+	return 1;
 }
 
 void dmeventd_lvm2_unlock(void)
 {
+	struct vg_lock *lock = pthread_getspecific(_held_lock_key);
+
+	if (!lock) {
+		syslog(LOG_ERR, "Internal error: VG lock not held.");
+		return;
+	}
+
+	pthread_setspecific(_held_lock_key, NULL);
+
+	pthread_mutex_lock(&_event_mutex);
+
+	dm_pool_empty(lock->mem);
+	lock->held = 0;
+	if (!--lock->users && lock != &_fallback_lock) {
+		dm_list_del(&lock->list);
+		pthread_cond_destroy(&lock->cond);
+		dm_pool_destroy(lock->mem);
+		dm_free(lock->vgname);
+		dm_free(lock);
+	} else
+		pthread_cond_signal(&lock->cond);
+
 	pthread_mutex_unlock(&_event_mutex);
 }
 
@@ -97,6 +227,8 @@ int dmeventd_lvm2_init(void)
 {
 	int r = 0;
 
+	pthread_once(&_held_lock_key_once, _create_held_lock_key);
+
 	pthread_mutex_lock(&_register_mutex);
 
 	/*
@@ -142,11 +274,28 @@ void dmeventd_lvm2_exit(void)
 
 struct dm_pool *dmeventd_lvm2_pool(void)
 {
-	return _mem_pool;
+	struct vg_lock *lock = pthread_getspecific(_held_lock_key);
+
+	return lock ? lock->mem : _mem_pool;
 }
 
 int dmeventd_lvm2_run(const char *cmdline)
 {
-	return lvm2_run(_lvm_handle, cmdline);
+	struct timeval start, end;
+	long msecs;
+	int r;
+
+	pthread_mutex_lock(&_command_mutex);
+	gettimeofday(&start, NULL);
+	r = lvm2_run(_lvm_handle, cmdline);
+	gettimeofday(&end, NULL);
+	pthread_mutex_unlock(&_command_mutex);
+
+	msecs = (end.tv_sec - start.tv_sec) * 1000 +
+		(end.tv_usec - start.tv_usec) / 1000;
+	syslog(LOG_INFO, "%s took %ld.%03lds.", cmdline, msecs / 1000,
+	       msecs % 1000);
+
+	return r;
 }
 
@@ -16,7 +16,8 @@
  * Wrappers around liblvm2cmd functions for dmeventd plug-ins.
  *
  * liblvm2cmd is not thread-safe so the locking in this library helps dmeventd
- * threads to co-operate in sharing a single instance.
+ * threads to co-operate in sharing a single instance.  Events are serialised
+ * per VG and commands run one at a time.
  *
  * FIXME Either support this properly as a generic liblvm2cmd wrapper or make
  * liblvm2cmd thread-safe so this can go away.
@@ -31,9 +32,13 @@ int dmeventd_lvm2_init(void);
 void dmeventd_lvm2_exit(void);
 int dmeventd_lvm2_run(const char *cmdline);
 
-void dmeventd_lvm2_lock(void);
+/* Serialise event processing for the VG of the named device. */
+void dmeventd_lvm2_lock(const char *device);
+/* Returns 0 without waiting if another thread holds the VG lock. */
+int dmeventd_lvm2_trylock(const char *device);
 void dmeventd_lvm2_unlock(void);
 
+/* Emptied by dmeventd_lvm2_unlock(). */
 struct dm_pool *dmeventd_lvm2_pool(void);
 
 #endif /* _DMEVENTD_LVMWRAP_H */
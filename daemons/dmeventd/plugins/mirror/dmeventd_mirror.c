@@ -174,7 +174,7 @@ void process_event(struct dm_task *dmt,
 	char *params;
 	const char *device = dm_task_get_name(dmt);
 
-	dmeventd_lvm2_lock();
+	dmeventd_lvm2_lock(device);
 
 	do {
 		next = dm_get_next_target(dmt, next, &start, &length,
@@ -22,6 +22,7 @@
 #include "lvm-string.h"
 
 #include <sys/wait.h>
+#include <time.h>
 #include <syslog.h> /* FIXME Replace syslog with multilog */
 /* FIXME Missing openlog? */
 
@@ -31,6 +32,10 @@
 #define CHECK_STEP 5
 /* Do not bother checking snapshots less than 50% full. */
 #define CHECK_MINIMUM 50
+/* Longest wait between checks of a snapshot that is not filling. */
+#define CHECK_MAX_INTERVAL 60
+/* Assumed lvextend duration in seconds until one has been timed. */
+#define EXTEND_LATENCY_DEFAULT 2
 
 #define UMOUNT_COMMAND "/bin/umount"
 
@@ -40,6 +45,23 @@ struct snap_status {
 	int max;
 };
 
+/*
+ * Per-snapshot state kept in the dmeventd private pointer.
+ *
+ * The fill rate is a moving average of the used sectors per second
+ * seen between checks.  It decides when the next check is due and
+ * whether to extend ahead of the percentage steps.
+ */
+struct snap_state {
+	char *device;		/* For the VG lock in get_status() */
+	int percent_check;	/* Next step to act on, 0 once invalid */
+	int used;		/* Sectors used at the last check */
+	time_t last_check;
+	uint64_t rate;		/* Sectors per second */
+	time_t extend_latency;	/* Seconds the last lvextend took */
+	uint32_t next_check;	/* Seconds, for next_timeout() */
+};
+
 /* FIXME possibly reconcile this with target_percent when we gain
    access to regular LVM library here. */
 static void _parse_snapshot_params(char *params, struct snap_status *status)
@@ -175,6 +197,50 @@ static void _umount(const char *device, int major, int minor)
 		syslog(LOG_ERR, "Failed to close /proc/mounts.\n");
 }
 
+/* Fold the usage seen now into the fill rate estimate. */
+static void _update_rate(struct snap_state *state, int used, time_t now)
+{
+	uint64_t sample;
+
+	if (state->last_check && now > state->last_check) {
+		if (used < state->used)
+			state->rate = 0;	/* Merged or recreated */
+		else {
+			sample = (uint64_t) (used - state->used) /
+				 (uint64_t) (now - state->last_check);
+			state->rate = state->rate ?
+				(3 * state->rate + sample) / 4 : sample;
+		}
+	}
+
+	state->used = used;
+	state->last_check = now;
+}
+
+/*
+ * Seconds until the usage is predicted to reach the next percentage
+ * step, less the time an lvextend takes, within 1..CHECK_MAX_INTERVAL.
+ */
+static uint32_t _predict_next_check(const struct snap_state *state, int max)
+{
+	uint64_t target = (uint64_t) max * state->percent_check / 100;
+	uint64_t secs;
+
+	if (!state->rate)
+		return CHECK_MAX_INTERVAL;
+
+	if (target <= (uint64_t) state->used)
+		return 1;
+
+	secs = (target - state->used) / state->rate;
+	if (secs <= (uint64_t) state->extend_latency)
+		return 1;
+
+	secs -= state->extend_latency;
+
+	return secs > CHECK_MAX_INTERVAL ? CHECK_MAX_INTERVAL : (uint32_t) secs;
+}
+
 void process_event(struct dm_task *dmt,
 		   enum dm_event_mask event __attribute__((unused)),
 		   void **private)
@@ -185,13 +251,15 @@ void process_event(struct dm_task *dmt,
 	char *params;
 	struct snap_status status = { 0 };
 	const char *device = dm_task_get_name(dmt);
-	int percent, *percent_check = (int*)private;
+	struct snap_state *state = *private;
+	time_t now, extend_start;
+	int percent, pre_extend;
 
 	/* No longer monitoring, waiting for remove */
-	if (!*percent_check)
+	if (!state->percent_check)
 		return;
 
-	dmeventd_lvm2_lock();
+	dmeventd_lvm2_lock(device);
 
 	dm_get_next_target(dmt, next, &start, &length, &target_type, &params);
 	if (!target_type)
@@ -215,48 +283,123 @@ void process_event(struct dm_task *dmt,
 	 */
 	if (status.invalid || !status.max) {
 		syslog(LOG_ERR, "Snapshot %s changed state to: %s\n", device, params);
-		*percent_check = 0;
+		state->percent_check = 0;
+		state->next_check = 0;
 		goto out;
 	}
 
+	now = time(NULL);
+	_update_rate(state, status.used, now);
+
+	/*
+	 * Extend early if the snapshot is predicted to fill up before
+	 * another lvextend could complete.
+	 */
+	pre_extend = state->rate &&
+		(uint64_t) (status.max - status.used) / state->rate <=
+		(uint64_t) state->extend_latency;
+
 	percent = 100 * status.used / status.max;
-	if (percent >= *percent_check) {
-		/* Usage has raised more than CHECK_STEP since the last
-		   time. Run actions. */
-		*percent_check = (percent / CHECK_STEP) * CHECK_STEP + CHECK_STEP;
+	if (percent >= state->percent_check || pre_extend) {
+		if (percent >= state->percent_check)
+			/* Usage has raised more than CHECK_STEP since the
+			   last time. Run actions. */
+			state->percent_check = (percent / CHECK_STEP) * CHECK_STEP + CHECK_STEP;
+		else
+			syslog(LOG_WARNING, "Snapshot %s is %i%% full and filling "
+			       "at %" PRIu64 " sectors/s. Extending early.\n",
+			       device, percent, state->rate);
 		if (percent >= WARNING_THRESH) /* Print a warning to syslog. */
 			syslog(LOG_WARNING, "Snapshot %s is now %i%% full.\n", device, percent);
 		/* Try to extend the snapshot, in accord with user-set policies */
+		extend_start = time(NULL);
 		if (!_extend(device))
 			syslog(LOG_ERR, "Failed to extend snapshot %s.", device);
+		else if ((state->extend_latency = time(NULL) - extend_start) < 1)
+			state->extend_latency = 1;
 	}
+
+	state->next_check = _predict_next_check(state, status.max);
 out:
 	dmeventd_lvm2_unlock();
 }
 
+uint32_t next_timeout(void **private)
+{
+	struct snap_state *state = *private;
+
+	return state->next_check;
+}
+
+/*
+ * The state is updated under the VG lock by process_event().  Do not
+ * wait for it here: the event may be running lvextend, which talks
+ * back to dmeventd.
+ */
+int get_status(char *buf, size_t size, void **private)
+{
+	struct snap_state *state = *private;
+	int r;
+
+	if (!dmeventd_lvm2_trylock(state->device))
+		return dm_snprintf(buf, size, "busy") >= 0;
+
+	r = dm_snprintf(buf, size, "rate:%" PRIu64 " next:%" PRIu32,
+			state->rate, state->next_check) >= 0;
+
+	dmeventd_lvm2_unlock();
+
+	return r;
+}
+
 int register_device(const char *device,
 		    const char *uuid __attribute__((unused)),
 		    int major __attribute__((unused)),
 		    int minor __attribute__((unused)),
 		    void **private)
 {
-	int *percent_check = (int*)private;
-	int r = dmeventd_lvm2_init();
+	struct snap_state *state;
 
-	*percent_check = CHECK_MINIMUM;
+	if (!(state = dm_zalloc(sizeof(*state)))) {
+		syslog(LOG_ERR, "Failed to allocate state for snapshot %s.\n",
+		       device);
+		return 0;
+	}
+
+	if (!(state->device = dm_strdup(device))) {
+		syslog(LOG_ERR, "Failed to allocate state for snapshot %s.\n",
+		       device);
+		dm_free(state);
+		return 0;
+	}
+
+	if (!dmeventd_lvm2_init()) {
+		dm_free(state->device);
+		dm_free(state);
+		return 0;
+	}
+
+	state->percent_check = CHECK_MINIMUM;
+	state->extend_latency = EXTEND_LATENCY_DEFAULT;
+	*private = state;
 
 	syslog(LOG_INFO, "Monitoring snapshot %s\n", device);
-	return r;
+	return 1;
 }
 
 int unregister_device(const char *device,
 		      const char *uuid __attribute__((unused)),
 		      int major __attribute__((unused)),
 		      int minor __attribute__((unused)),
-		      void **unused __attribute__((unused)))
+		      void **private)
 {
+	struct snap_state *state = *private;
+
 	syslog(LOG_INFO, "No longer monitoring snapshot %s\n",
 	       device);
+	dm_free(state->device);
+	dm_free(state);
+	*private = NULL;
 	dmeventd_lvm2_exit();
 	return 1;
 }
@@ -227,6 +227,21 @@ void activation_release(void)
 	return;
 }
 
+void activation_drop_deps_cache(void)
+{
+	return;
+}
+
+void activation_cache_device_state(int with_status __attribute__((unused)))
+{
+	return;
+}
+
+void activation_drop_device_state(void)
+{
+	return;
+}
+
 void activation_exit(void)
 {
 	return;
@@ -808,6 +823,81 @@ int target_registered_with_dmeventd(struct cmd_context *cmd, const char *dso,
 	return evmask;
 }
 
+/*
+ * Devices queued by target_register_events() between
+ * monitor_batch_begin() and monitor_batch_end(), grouped by
+ * dso and settings so that each group takes one dmeventd request.
+ */
+struct monitor_batch {
+	struct dm_list list;
+	const char *dso;
+	int set;
+	int timeout;
+	unsigned count;
+	struct dm_list uuids;	/* str_list */
+};
+
+static struct dm_list *_monitor_batches = NULL;
+
+static int _queue_monitor_batch(struct cmd_context *cmd, const char *dso,
+				const char *uuid, int set, int timeout)
+{
+	struct monitor_batch *batch;
+
+	dm_list_iterate_items(batch, _monitor_batches)
+		if (batch->set == set && batch->timeout == timeout &&
+		    !strcmp(batch->dso, dso))
+			goto add;
+
+	if (!(batch = dm_pool_zalloc(cmd->mem, sizeof(*batch))) ||
+	    !(batch->dso = dm_pool_strdup(cmd->mem, dso)))
+		return_0;
+
+	batch->set = set;
+	batch->timeout = timeout;
+	dm_list_init(&batch->uuids);
+	dm_list_add(_monitor_batches, &batch->list);
+add:
+	if (!str_list_add(cmd->mem, &batch->uuids, uuid))
+		return_0;
+	batch->count++;
+
+	return 1;
+}
+
+static int _send_monitor_batch(struct cmd_context *cmd,
+			       struct monitor_batch *batch)
+{
+	struct dm_event_handler *dmevh;
+	struct str_list *sl;
+	const char **uuids;
+	unsigned i = 0;
+	int r;
+
+	if (!(uuids = dm_pool_alloc(cmd->mem, sizeof(*uuids) * batch->count)))
+		return_0;
+
+	dm_list_iterate_items(sl, &batch->uuids)
+		uuids[i++] = sl->str;
+
+	if (!(dmevh = _create_dm_event_handler(cmd, uuids[0], batch->dso, batch->timeout,
+					       DM_EVENT_ALL_ERRORS | (batch->timeout ? DM_EVENT_TIMEOUT : 0))))
+		return_0;
+
+	r = batch->set ? dm_event_register_handlers(dmevh, uuids, batch->count) :
+			 dm_event_unregister_handlers(dmevh, uuids, batch->count);
+
+	dm_event_handler_destroy(dmevh);
+
+	if (!r)
+		return_0;
+
+	log_info("%s %u device(s) for events", batch->set ? "Monitored" : "Unmonitored",
+		 batch->count);
+
+	return 1;
+}
+
 int target_register_events(struct cmd_context *cmd, const char *dso, struct logical_volume *lv,
 			    int evmask __attribute__((unused)), int set, int timeout)
 {
@@ -822,6 +912,9 @@ int target_register_events(struct cmd_context *cmd, const char *dso, struct logi
 	if (!(uuid = build_dm_uuid(cmd->mem, lv->lvid.s, lv_is_origin(lv) ? "real" : NULL)))
 		return_0;
 
+	if (_monitor_batches)
+		return _queue_monitor_batch(cmd, dso, uuid, set, timeout);
+
 	if (!(dmevh = _create_dm_event_handler(cmd, uuid, dso, timeout,
 					       DM_EVENT_ALL_ERRORS | (timeout ? DM_EVENT_TIMEOUT : 0))))
 		return_0;
@@ -956,6 +1049,10 @@ int monitor_dev_for_events(struct cmd_context *cmd, struct logical_volume *lv,
 			return 0;
 		}
 
+		/* Queued: monitor_batch_end() reports the result */
+		if (_monitor_batches)
+			continue;
+
 		/* Check [un]monitor results */
 		/* Try a couple times if pending, but not forever... */
 		for (i = 0; i < 10; i++) {
@@ -981,6 +1078,49 @@ int monitor_dev_for_events(struct cmd_context *cmd, struct logical_volume *lv,
 #endif
 }
 
+/*
+ * Until monitor_batch_end(), monitor_dev_for_events() queues the
+ * devices instead of registering each one with dmeventd.
+ */
+int monitor_batch_begin(struct cmd_context *cmd)
+{
+#ifdef DMEVENTD
+	if (_monitor_batches) {
+		log_error(INTERNAL_ERROR "Nested monitor batch.");
+		return 0;
+	}
+
+	if (!(_monitor_batches = dm_pool_alloc(cmd->mem, sizeof(*_monitor_batches))))
+		return_0;
+
+	dm_list_init(_monitor_batches);
+#endif
+	return 1;
+}
+
+/* Returns 0 if any queued device failed to be (un)monitored. */
+int monitor_batch_end(struct cmd_context *cmd)
+{
+#ifdef DMEVENTD
+	struct dm_list *batches = _monitor_batches;
+	struct monitor_batch *batch;
+	int r = 1;
+
+	if (!batches)
+		return 1;
+
+	_monitor_batches = NULL;
+
+	dm_list_iterate_items(batch, batches)
+		if (!_send_monitor_batch(cmd, batch))
+			r = 0;
+
+	return r;
+#else
+	return 1;
+#endif
+}
+
 static int _lv_suspend(struct cmd_context *cmd, const char *lvid_s,
 		       unsigned origin_only, int error_if_not_suspended)
 {
@@ -1378,6 +1518,21 @@ void activation_release(void)
 	dev_manager_release();
 }
 
+void activation_drop_deps_cache(void)
+{
+	dev_manager_drop_deps_cache();
+}
+
+void activation_cache_device_state(int with_status)
+{
+	dev_manager_cache_state(with_status);
+}
+
+void activation_drop_device_state(void)
+{
+	dev_manager_drop_state();
+}
+
 void activation_exit(void)
 {
 	dev_manager_exit();
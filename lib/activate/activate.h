@@ -51,6 +51,15 @@ int list_lv_modules(struct dm_pool *mem, const struct logical_volume *lv,
 		    struct dm_list *modules);
 
 void activation_release(void);
+void activation_drop_deps_cache(void);
+
+/*
+ * For reports: until dropped, lv_info() and the percent queries read
+ * the state of all the mapped devices of each VG at once and answer
+ * from that snapshot.
+ */
+void activation_cache_device_state(int with_status);
+void activation_drop_device_state(void);
 void activation_exit(void);
 
 /* int lv_suspend(struct cmd_context *cmd, const char *lvid_s); */
@@ -100,6 +109,9 @@ int lv_has_target_type(struct dm_pool *mem, struct logical_volume *lv,
 
 int monitor_dev_for_events(struct cmd_context *cmd, struct logical_volume *lv,
 			   unsigned origin_only, int do_reg);
+/* Send the devices monitored in between with one request per dso. */
+int monitor_batch_begin(struct cmd_context *cmd);
+int monitor_batch_end(struct cmd_context *cmd);
 
 #ifdef DMEVENTD
 #  include "libdevmapper-event.h"
@@ -26,6 +26,7 @@
 #include "config.h"
 #include "filter.h"
 #include "activate.h"
+#include "lvmcache.h"
 
 #include <limits.h>
 #include <dirent.h>
@@ -58,6 +59,33 @@ struct lv_layer {
 	const char *old_name;
 };
 
+/*
+ * Dependencies of mapped devices seen while a VG lock is held. Shared
+ * by all the trees built under the lock so unchanged devices are only
+ * queried once. libdevmapper revalidates the entries of devices we
+ * change ourselves; the lock keeps other processes off the devices of
+ * the VG, so the cache is dropped whenever a VG is unlocked.
+ */
+static struct dm_deps_cache *_deps_cache = NULL;
+
+static struct dm_tree *_dtree_create(void)
+{
+	struct dm_tree *dtree;
+
+	if (!(dtree = dm_tree_create()))
+		return_NULL;
+
+	if (!vgs_locked())
+		return dtree;
+
+	if (!_deps_cache && !(_deps_cache = dm_deps_cache_create()))
+		log_debug("Failed to create deps cache. Not caching dependencies.");
+	else
+		dm_tree_set_deps_cache(dtree, _deps_cache);
+
+	return dtree;
+}
+
 static int _read_only_lv(struct logical_volume *lv)
 {
 	return (!(lv->vg->status & LVM_WRITE) || !(lv->status & LVM_WRITE));
@@ -253,6 +281,225 @@ static int _info_by_dev(uint32_t major, uint32_t minor, struct dm_info *info)
 	return _info_run(NULL, NULL, info, NULL, 0, 0, 0, major, minor);
 }
 
+/*
+ * Device state cache for reports.  While enabled, the first query about
+ * an LV of a VG lists the mapped devices once and reads the info, or the
+ * status too, of each device belonging to that VG.  Queries about LVs of
+ * the same VG are then answered from those tasks without further ioctls.
+ * Devices not found there are still looked up in the kernel.  Moving on to
+ * another VG replaces the cache.  Other processes may change the devices
+ * meanwhile, so this is only a snapshot and must not be used for
+ * anything that acts on the answers.
+ */
+struct device_state {
+	struct dm_list list;
+	struct dm_task *dmt;
+};
+
+static struct {
+	int enabled;
+	int with_status;
+	struct dm_pool *mem;
+	const char *vgname;	/* NULL if reading the devices failed */
+	char *failed_vgname;	/* Not worth trying again */
+	struct dm_hash_table *by_uuid;
+	struct dm_hash_table *by_name;
+	struct dm_list tasks;
+} _state;
+
+static void _drop_state(void)
+{
+	struct device_state *cs;
+
+	if (!_state.mem)
+		return;
+
+	dm_list_iterate_items(cs, &_state.tasks)
+		dm_task_destroy(cs->dmt);
+
+	if (_state.by_uuid) {
+		dm_hash_destroy(_state.by_uuid);
+		_state.by_uuid = NULL;
+	}
+
+	if (_state.by_name) {
+		dm_hash_destroy(_state.by_name);
+		_state.by_name = NULL;
+	}
+
+	dm_pool_destroy(_state.mem);
+	_state.mem = NULL;
+	_state.vgname = NULL;
+}
+
+static int _state_add_device(const struct dm_names *names)
+{
+	struct device_state *cs;
+	struct dm_task *dmt;
+	struct dm_info info;
+	const char *uuid;
+
+	if (!(dmt = _setup_task(NULL, NULL, NULL,
+				_state.with_status ? DM_DEVICE_STATUS : DM_DEVICE_INFO,
+				MAJOR(names->dev), MINOR(names->dev))))
+		return_0;
+
+	if (!dm_task_run(dmt) || !dm_task_get_info(dmt, &info))
+		goto_bad;
+
+	/* Gone since the list was taken */
+	if (!info.exists) {
+		dm_task_destroy(dmt);
+		return 1;
+	}
+
+	if (!(cs = dm_pool_alloc(_state.mem, sizeof(*cs))))
+		goto_bad;
+
+	cs->dmt = dmt;
+	dm_list_add(&_state.tasks, &cs->list);
+
+	if (!dm_hash_insert(_state.by_name, dm_task_get_name(dmt), dmt) ||
+	    ((uuid = dm_task_get_uuid(dmt)) && *uuid &&
+	     !dm_hash_insert(_state.by_uuid, uuid, dmt)))
+		return_0;
+
+	return 1;
+
+      bad:
+	dm_task_destroy(dmt);
+	return 0;
+}
+
+/* Read the state of every mapped device belonging to vgname */
+static int _read_vg_state(const char *vgname)
+{
+	struct dm_task *dmt;
+	struct dm_names *names;
+	unsigned next = 0;
+	char *vg, *lv, *layer;
+	int r = 0;
+
+	_drop_state();
+
+	if (!(_state.mem = dm_pool_create("device_state", 1024)))
+		return_0;
+
+	dm_list_init(&_state.tasks);
+	if (!(_state.by_uuid = dm_hash_create(128)) ||
+	    !(_state.by_name = dm_hash_create(128)))
+		goto_bad;
+
+	log_debug("Reading state of mapped devices in VG %s", vgname);
+
+	if (!(dmt = dm_task_create(DM_DEVICE_LIST)))
+		goto_bad;
+
+	if (!dm_task_run(dmt) || !(names = dm_task_get_names(dmt)))
+		goto_out;
+
+	if (names->dev)
+		do {
+			names = (struct dm_names *)((char *) names + next);
+			next = names->next;
+
+			if (!dm_split_lvm_name(_state.mem, names->name,
+					       &vg, &lv, &layer))
+				goto_out;
+
+			if (strcmp(vg, vgname))
+				continue;
+
+			if (!_state_add_device(names))
+				goto_out;
+		} while (next);
+
+	if (!(_state.vgname = dm_pool_strdup(_state.mem, vgname)))
+		goto_out;
+
+	r = 1;
+
+      out:
+	dm_task_destroy(dmt);
+	if (r)
+		return 1;
+      bad:
+	_drop_state();
+	return 0;
+}
+
+/*
+ * Returns the cached task for the device, or NULL if the cache has
+ * none.  A device missing from the cache may have appeared since the
+ * VG was read, so only the kernel can say it does not exist.
+ */
+static struct dm_task *_state_task(const char *vgname, const char *name,
+				   const char *dlid, int need_status)
+{
+	struct dm_task *dmt;
+
+	if (!_state.enabled || (need_status && !_state.with_status))
+		return NULL;
+
+	if (_state.failed_vgname && !strcmp(_state.failed_vgname, vgname))
+		return NULL;
+
+	if ((!_state.vgname || strcmp(_state.vgname, vgname)) &&
+	    !_read_vg_state(vgname)) {
+		log_debug("Failed to read mapped devices in VG %s. "
+			  "Querying them one at a time.", vgname);
+		dm_free(_state.failed_vgname);
+		_state.failed_vgname = dm_strdup(vgname);
+		return NULL;
+	}
+
+	if (dlid && *dlid &&
+	    ((dmt = dm_hash_lookup(_state.by_uuid, dlid)) ||
+	     (dmt = dm_hash_lookup(_state.by_uuid, dlid + sizeof(UUID_PREFIX) - 1))))
+		return dmt;
+
+	if (name)
+		return dm_hash_lookup(_state.by_name, name);
+
+	return NULL;
+}
+
+static int _state_info(const char *vgname, const char *dlid,
+			int with_read_ahead, struct dm_info *info,
+			uint32_t *read_ahead)
+{
+	struct dm_task *dmt;
+
+	if (!(dmt = _state_task(vgname, NULL, dlid, 0)))
+		return 0;
+
+	if (!dm_task_get_info(dmt, info))
+		return_0;
+
+	if (with_read_ahead) {
+		if (!dm_task_get_read_ahead(dmt, read_ahead))
+			return_0;
+	} else if (read_ahead)
+		*read_ahead = DM_READ_AHEAD_NONE;
+
+	return 1;
+}
+
+void dev_manager_cache_state(int with_status)
+{
+	dev_manager_drop_state();
+	_state.enabled = 1;
+	_state.with_status = with_status;
+}
+
+void dev_manager_drop_state(void)
+{
+	_drop_state();
+	dm_free(_state.failed_vgname);
+	_state.failed_vgname = NULL;
+	_state.enabled = 0;
+}
+
 int dev_manager_info(struct dm_pool *mem, const struct logical_volume *lv,
 		     const char *layer,
 		     int with_open_count, int with_read_ahead,
@@ -271,8 +518,13 @@ int dev_manager_info(struct dm_pool *mem, const struct logical_volume *lv,
 		return 0;
 	}
 
-	log_debug("Getting device info for %s [%s]", name, dlid);
-	r = _info(dlid, with_open_count, with_read_ahead, info, read_ahead);
+	if (_state_info(lv->vg->name, dlid, with_read_ahead, info, read_ahead))
+		r = 1;
+	else {
+		log_debug("Getting device info for %s [%s]", name, dlid);
+		r = _info(dlid, with_open_count, with_read_ahead, info,
+			  read_ahead);
+	}
 
 	dm_pool_free(mem, name);
 	return r;
@@ -443,14 +695,13 @@ static percent_range_t _combine_percent(percent_t a, percent_t b,
 	return make_percent(numerator, denominator);
 }
 
-static int _percent_run(struct dev_manager *dm, const char *name,
-			const char *dlid,
-			const char *target_type, int wait,
-			const struct logical_volume *lv, percent_t *overall_percent,
-			uint32_t *event_nr, int fail_if_percent_unsupported)
+/* Work out the percentage from the targets in a status or waitevent task */
+static int _percent_from_task(struct dev_manager *dm, struct dm_task *dmt,
+			      const char *target_type,
+			      const struct logical_volume *lv,
+			      percent_t *overall_percent, uint32_t *event_nr,
+			      int fail_if_percent_unsupported)
 {
-	int r = 0;
-	struct dm_task *dmt;
 	struct dm_info info;
 	void *next = NULL;
 	uint64_t start, length;
@@ -466,18 +717,8 @@ static int _percent_run(struct dev_manager *dm, const char *name,
 
 	*overall_percent = PERCENT_INVALID;
 
-	if (!(dmt = _setup_task(name, dlid, event_nr,
-				wait ? DM_DEVICE_WAITEVENT : DM_DEVICE_STATUS, 0, 0)))
-		return_0;
-
-	if (!dm_task_no_open_count(dmt))
-		log_error("Failed to disable open_count");
-
-	if (!dm_task_run(dmt))
-		goto_out;
-
 	if (!dm_task_get_info(dmt, &info) || !info.exists)
-		goto_out;
+		return_0;
 
 	if (event_nr)
 		*event_nr = info.event_nr;
@@ -489,7 +730,7 @@ static int _percent_run(struct dev_manager *dm, const char *name,
 			if (!(segh = dm_list_next(&lv->segments, segh))) {
 				log_error("Number of segments in active LV %s "
 					  "does not match metadata", lv->name);
-				goto out;
+				return 0;
 			}
 			seg = dm_list_item(segh, struct lv_segment);
 		}
@@ -515,7 +756,7 @@ static int _percent_run(struct dev_manager *dm, const char *name,
 						  dm->cmd, seg, params,
 						  &total_numerator,
 						  &total_denominator))
-			goto_out;
+			return_0;
 
 		if (first_time) {
 			*overall_percent = percent;
@@ -529,7 +770,7 @@ static int _percent_run(struct dev_manager *dm, const char *name,
 	if (lv && dm_list_next(&lv->segments, segh)) {
 		log_error("Number of segments in active LV %s does not "
 			  "match metadata", lv->name);
-		goto out;
+		return 0;
 	}
 
 	if (first_time) {
@@ -537,11 +778,35 @@ static int _percent_run(struct dev_manager *dm, const char *name,
 		/* FIXME why return PERCENT_100 et. al. in this case? */
 		*overall_percent = PERCENT_100;
 		if (fail_if_percent_unsupported)
-			goto_out;
+			return_0;
 	}
 
 	log_debug("LV percent: %f", percent_to_float(*overall_percent));
-	r = 1;
+
+	return 1;
+}
+
+static int _percent_run(struct dev_manager *dm, const char *name,
+			const char *dlid,
+			const char *target_type, int wait,
+			const struct logical_volume *lv, percent_t *overall_percent,
+			uint32_t *event_nr, int fail_if_percent_unsupported)
+{
+	int r = 0;
+	struct dm_task *dmt;
+
+	if (!(dmt = _setup_task(name, dlid, event_nr,
+				wait ? DM_DEVICE_WAITEVENT : DM_DEVICE_STATUS, 0, 0)))
+		return_0;
+
+	if (!dm_task_no_open_count(dmt))
+		log_error("Failed to disable open_count");
+
+	if (!dm_task_run(dmt))
+		goto_out;
+
+	r = _percent_from_task(dm, dmt, target_type, lv, overall_percent,
+			       event_nr, fail_if_percent_unsupported);
 
       out:
 	dm_task_destroy(dmt);
@@ -553,6 +818,12 @@ static int _percent(struct dev_manager *dm, const char *name, const char *dlid,
 		    const struct logical_volume *lv, percent_t *percent,
 		    uint32_t *event_nr, int fail_if_percent_unsupported)
 {
+	struct dm_task *dmt;
+
+	if (!wait && (dmt = _state_task(dm->vg_name, name, dlid, 1)))
+		return _percent_from_task(dm, dmt, target_type, lv, percent,
+					  event_nr, fail_if_percent_unsupported);
+
 	if (dlid && *dlid) {
 		if (_percent_run(dm, NULL, dlid, target_type, wait, lv, percent,
 				 event_nr, fail_if_percent_unsupported))
@@ -670,13 +941,21 @@ void dev_manager_destroy(struct dev_manager *dm)
 	dm_pool_destroy(dm->mem);
 }
 
+void dev_manager_drop_deps_cache(void)
+{
+	dm_deps_cache_destroy(_deps_cache);
+	_deps_cache = NULL;
+}
+
 void dev_manager_release(void)
 {
+	dev_manager_drop_deps_cache();
 	dm_lib_release();
 }
 
 void dev_manager_exit(void)
 {
+	dev_manager_drop_deps_cache();
 	dm_lib_exit();
 }
 
@@ -1065,7 +1344,7 @@ static struct dm_tree *_create_partial_dtree(struct dev_manager *dm, struct logi
 	struct lv_segment *seg;
 	uint32_t s;
 
-	if (!(dtree = dm_tree_create())) {
+	if (!(dtree = _dtree_create())) {
 		log_error("Partial dtree creation failed for %s.", lv->name);
 		return NULL;
 	}
@@ -1617,7 +1896,9 @@ static int _clean_tree(struct dev_manager *dm, struct dm_tree_node *root, char *
 	struct dm_tree_node *child;
 	char *vgname, *lvname, *layer;
 	const char *name, *uuid;
-	int r;
+	uint32_t *cookies = NULL, *new_cookies, cookie;
+	unsigned num_cookies = 0, max_cookies = 0;
+	int r = 1;
 
 	while ((child = dm_tree_next_child(&handle, root, 0))) {
 		if (!(name = dm_tree_node_get_name(child)))
@@ -1628,7 +1909,8 @@ static int _clean_tree(struct dev_manager *dm, struct dm_tree_node *root, char *
 
 		if (!dm_split_lvm_name(dm->mem, name, &vgname, &lvname, &layer)) {
 			log_error("_clean_tree: Couldn't split up device name %s.", name);
-			return 0;
+			r = 0;
+			break;
 		}
 
 		/* Not meant to be top level? */
@@ -1640,14 +1922,37 @@ static int _clean_tree(struct dev_manager *dm, struct dm_tree_node *root, char *
 			continue;
 
 		dm_tree_set_cookie(root, 0);
-		r = dm_tree_deactivate_children(root, uuid, strlen(uuid));
-		if (!dm_udev_wait(dm_tree_get_cookie(root)))
-			stack;
+		if (!dm_tree_deactivate_children(root, uuid, strlen(uuid)))
+			r = 0;
+
+		/* The layers are unrelated: udev may process them all at once */
+		if ((cookie = dm_tree_get_cookie(root))) {
+			if (num_cookies == max_cookies) {
+				max_cookies = max_cookies ? max_cookies * 2 : 8;
+				if (!(new_cookies = dm_realloc(cookies, max_cookies * sizeof(*cookies)))) {
+					log_error("_clean_tree: Cookie list allocation failed.");
+					if (!dm_udev_wait(cookie))
+						stack;
+					r = 0;
+					break;
+				}
+				cookies = new_cookies;
+			}
+			cookies[num_cookies++] = cookie;
+		}
 
 		if (!r)
-			return_0;
+			break;
 	}
 
+	if (num_cookies && !dm_udev_wait_multiple(cookies, num_cookies, -1))
+		stack;
+
+	dm_free(cookies);
+
+	if (!r)
+		return_0;
+
 	return 1;
 }
 
@@ -1794,7 +2099,7 @@ int dev_manager_device_uses_vg(struct device *dev,
 	char dlid[sizeof(UUID_PREFIX) + sizeof(struct id) - 1] __attribute__((aligned(8)));
 	int r = 1;
 
-	if (!(dtree = dm_tree_create())) {
+	if (!(dtree = _dtree_create())) {
 		log_error("partial dtree creation failed");
 		return r;
 	}
@@ -32,6 +32,14 @@ struct dev_manager *dev_manager_create(struct cmd_context *cmd,
 				       const char *vg_name);
 void dev_manager_destroy(struct dev_manager *dm);
 void dev_manager_release(void);
+void dev_manager_drop_deps_cache(void);
+
+/*
+ * Answer info and, with_status, percent queries from the state of all
+ * the mapped devices of a VG read in one sweep.  For reports only.
+ */
+void dev_manager_cache_state(int with_status);
+void dev_manager_drop_state(void);
 void dev_manager_exit(void);
 
 /*
@@ -208,6 +208,28 @@ void lvmcache_commit_metadata(const char *vgname)
 	}
 }
 
+/*
+ * Queue background reads of the metadata areas the VG was last seen
+ * on.  Nothing is locked: vg_read only uses what was read if it still
+ * matches the metadata area header it finds once it holds the lock.
+ */
+void lvmcache_prefetch_vg(const char *vgname, const char *vgid)
+{
+	struct lvmcache_vginfo *vginfo;
+	struct lvmcache_info *info;
+	struct metadata_area *mda;
+
+	if (!(vginfo = vgid ? vginfo_from_vgid(vgid) :
+			      vginfo_from_vgname(vgname, NULL)) ||
+	    is_orphan_vg(vginfo->vgname))
+		return;
+
+	dm_list_iterate_items(info, &vginfo->infos)
+		dm_list_iterate_items(mda, &info->mdas)
+			if (mda->ops->mda_prefetch && !mda_is_ignored(mda))
+				mda->ops->mda_prefetch(mda);
+}
+
 void lvmcache_drop_metadata(const char *vgname, int drop_precommitted)
 {
 	/* For VG_ORPHANS, we need to invalidate all labels on orphan PVs. */
@@ -121,4 +121,7 @@ struct volume_group *lvmcache_get_vg(const char *vgid, unsigned precommitted);
 void lvmcache_drop_metadata(const char *vgname, int drop_precommitted);
 void lvmcache_commit_metadata(const char *vgname);
 
+/* Start reading VG metadata in the background for a vg_read soon after */
+void lvmcache_prefetch_vg(const char *vgname, const char *vgid);
+
 #endif
@@ -205,6 +205,7 @@ static int _process_config(struct cmd_context *cmd)
 	struct stat st;
 	const struct config_node *cn;
 	const struct config_value *cv;
+	int prefetch;
 
 	/* umask */
 	cmd->default_settings.umask = find_config_tree_int(cmd,
@@ -244,6 +245,7 @@ static int _process_config(struct cmd_context *cmd)
 	/* FIXME Use global value of sysfs_dir everywhere instead cmd->sysfs_dir. */
 	_get_sysfs_dir(cmd);
 	set_sysfs_dir_path(cmd->sysfs_dir);
+	dm_set_sysfs_dir(cmd->sysfs_dir);
 
 	/* activation? */
 	cmd->default_settings.activation = find_config_tree_int(cmd,
@@ -282,6 +284,10 @@ static int _process_config(struct cmd_context *cmd)
 								"activation/udev_sync",
 								DEFAULT_UDEV_SYNC);
 
+	dm_udev_set_uevent_sync(find_config_tree_int(cmd,
+						     "activation/udev_uevent_sync",
+						     DEFAULT_UDEV_UEVENT_SYNC));
+
 	cmd->stripe_filler = find_config_tree_str(cmd,
 						  "activation/missing_stripe_filler",
 						  DEFAULT_STRIPE_FILLER);
@@ -318,6 +324,13 @@ static int _process_config(struct cmd_context *cmd)
 	cmd->metadata_read_only = find_config_tree_int(cmd, "global/metadata_read_only",
 						       DEFAULT_METADATA_READ_ONLY);
 
+	if ((prefetch = find_config_tree_int(cmd, "global/metadata_prefetch",
+					     DEFAULT_METADATA_PREFETCH)) < 0) {
+		log_error("Negative global/metadata_prefetch ignored.");
+		prefetch = 0;
+	}
+	cmd->metadata_prefetch = (unsigned) prefetch;
+
 	return 1;
 }
 
@@ -77,6 +77,7 @@ struct cmd_context {
 	unsigned partial_activation:1;
 	unsigned si_unit_consistency:1;
 	unsigned metadata_read_only:1;
+	unsigned metadata_prefetch;	/* VGs to read ahead in process_each_* */
 
 	unsigned independent_metadata_areas:1;	/* Active formats have MDAs outside PVs */
 
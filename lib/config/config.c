@@ -231,7 +231,11 @@ int read_config_fd(struct config_tree *cft, struct device *dev,
 	} else {
 		if (!(buf = dm_malloc(size + size2)))
 			return_0;
-		if (!dev_read_circular(dev, (uint64_t) offset, size,
+		if ((!checksum_fn ||
+		     !dev_read_prefetched(dev, (uint64_t) offset, size,
+					  (uint64_t) offset2, size2, checksum,
+					  size + size2, buf)) &&
+		    !dev_read_circular(dev, (uint64_t) offset, size,
 				       (uint64_t) offset2, size2, buf)) {
 			goto out;
 		}
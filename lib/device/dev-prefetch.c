@@ -0,0 +1,293 @@
+/*
+ * Copyright (C) 2010 Red Hat, Inc. All rights reserved.
+ *
+ * This file is part of LVM2.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU Lesser General Public License v.2.1.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Background reads of device areas for commands that work through many
+ * VGs in turn.  Worker threads only ever pread() on a descriptor of
+ * their own and hand back what they read: they never log, take locks or
+ * touch the library's memory pools or caches, none of which are thread
+ * safe.  Everything else happens in the thread calling these functions.
+ *
+ * Memory shared with the workers comes from malloc() rather than
+ * dm_malloc(), whose debugging variant keeps unlocked global state.
+ */
+
+#include "lib.h"
+#include "device.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+#define MAX_PREFETCH_THREADS 64
+
+struct prefetch_job {
+	struct dm_list list;
+	struct device *dev;
+	int fd;
+	dev_prefetch_fn_t fn;
+	char context[0];
+};
+
+struct prefetched {
+	struct dm_list list;
+	struct device *dev;
+	uint64_t offset;
+	size_t size;
+	uint64_t offset2;
+	size_t size2;
+	uint32_t checksum;
+	int used;		/* Read in full at least once */
+	char *buf;
+};
+
+static pthread_mutex_t _prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _queued_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t _done_cond = PTHREAD_COND_INITIALIZER;
+static DM_LIST_INIT(_queue);
+static DM_LIST_INIT(_running);
+static DM_LIST_INIT(_results);
+static unsigned _threads;
+static pid_t _pid;
+
+static void *_prefetch_thread(void *arg __attribute__((unused)))
+{
+	struct prefetch_job *job;
+
+	pthread_mutex_lock(&_prefetch_mutex);
+	for (;;) {
+		while (dm_list_empty(&_queue))
+			pthread_cond_wait(&_queued_cond, &_prefetch_mutex);
+
+		job = dm_list_item(dm_list_first(&_queue), struct prefetch_job);
+		dm_list_move(&_running, &job->list);
+		pthread_mutex_unlock(&_prefetch_mutex);
+
+		job->fn(job->dev, job->fd, job->context);
+		close(job->fd);
+
+		pthread_mutex_lock(&_prefetch_mutex);
+		dm_list_del(&job->list);
+		free(job);
+		pthread_cond_broadcast(&_done_cond);
+	}
+
+	return NULL;
+}
+
+int dev_prefetch_start(unsigned threads)
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+	sigset_t all, old;
+	int r = 1;
+
+	if (threads > MAX_PREFETCH_THREADS)
+		threads = MAX_PREFETCH_THREADS;
+
+	/* Workers started before a fork() did not come with us */
+	if (_pid != getpid()) {
+		_pid = getpid();
+		_threads = 0;
+		pthread_mutex_init(&_prefetch_mutex, NULL);
+		pthread_cond_init(&_queued_cond, NULL);
+		pthread_cond_init(&_done_cond, NULL);
+		dm_list_init(&_queue);
+		dm_list_init(&_running);
+		dm_list_init(&_results);
+	}
+
+	if (_threads >= threads)
+		return 1;
+
+	/* Signals stay with the thread running the command */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize(&attr, 128 * 1024);
+
+	while (_threads < threads) {
+		if (pthread_create(&thread, &attr, _prefetch_thread, NULL)) {
+			log_sys_debug("pthread_create", "metadata prefetch");
+			r = _threads ? 1 : 0;
+			break;
+		}
+		_threads++;
+	}
+
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	return r;
+}
+
+int dev_prefetch_queue(struct device *dev, dev_prefetch_fn_t fn,
+		       const void *context, size_t context_size)
+{
+	struct prefetch_job *job;
+	const char *name;
+
+	if (!_threads || _pid != getpid())
+		return 0;
+
+	if (!(name = dev_name_confirmed(dev, 1)))
+		return 0;
+
+	if (!(job = malloc(sizeof(*job) + context_size))) {
+		log_error("Failed to allocate prefetch job.");
+		return 0;
+	}
+
+	/* Buffered, unlike dev_open(), so the workers need no alignment */
+	if ((job->fd = open(name, O_RDONLY)) < 0) {
+		log_sys_debug("open", name);
+		free(job);
+		return 0;
+	}
+
+	job->dev = dev;
+	job->fn = fn;
+	memcpy(job->context, context, context_size);
+
+	pthread_mutex_lock(&_prefetch_mutex);
+	dm_list_add(&_queue, &job->list);
+	pthread_cond_signal(&_queued_cond);
+	pthread_mutex_unlock(&_prefetch_mutex);
+
+	return 1;
+}
+
+/* Called from the workers */
+void dev_prefetch_store(struct device *dev, uint64_t offset, size_t size,
+			uint64_t offset2, size_t size2, uint32_t checksum,
+			char *buf)
+{
+	struct prefetched *p;
+
+	if (!(p = malloc(sizeof(*p)))) {
+		free(buf);
+		return;
+	}
+
+	p->dev = dev;
+	p->offset = offset;
+	p->size = size;
+	p->offset2 = offset2;
+	p->size2 = size2;
+	p->checksum = checksum;
+	p->used = 0;
+	p->buf = buf;
+
+	pthread_mutex_lock(&_prefetch_mutex);
+	dm_list_add(&_results, &p->list);
+	pthread_mutex_unlock(&_prefetch_mutex);
+}
+
+static void _free_prefetched(struct prefetched *p)
+{
+	dm_list_del(&p->list);
+	free(p->buf);
+	free(p);
+}
+
+/*
+ * Reads of dev not yet started are not worth waiting for: whoever
+ * wants the data now can read it as quickly itself.  Reads under way
+ * are waited for.  Called and returns with _prefetch_mutex held.
+ */
+static void _settle(struct device *dev)
+{
+	struct prefetch_job *job, *tmp;
+	int running;
+
+	dm_list_iterate_items_safe(job, tmp, &_queue) {
+		if (dev && job->dev != dev)
+			continue;
+		dm_list_del(&job->list);
+		close(job->fd);
+		free(job);
+	}
+
+	do {
+		running = 0;
+		dm_list_iterate_items(job, &_running)
+			if (!dev || job->dev == dev)
+				running = 1;
+		if (running)
+			pthread_cond_wait(&_done_cond, &_prefetch_mutex);
+	} while (running);
+}
+
+int dev_read_prefetched(struct device *dev, uint64_t offset, size_t size,
+			uint64_t offset2, size_t size2, uint32_t checksum,
+			size_t len, void *buf)
+{
+	struct prefetched *p;
+	int r = 0;
+
+	if (!_threads || _pid != getpid() || len > size + size2)
+		return 0;
+
+	pthread_mutex_lock(&_prefetch_mutex);
+	_settle(dev);
+
+	dm_list_iterate_items(p, &_results) {
+		if (p->dev != dev || p->offset != offset || p->size != size ||
+		    p->offset2 != offset2 || p->size2 != size2 ||
+		    p->checksum != checksum)
+			continue;
+
+		memcpy(buf, p->buf, len);
+		if (len == size + size2)
+			p->used = 1;
+		r = 1;
+		break;
+	}
+	pthread_mutex_unlock(&_prefetch_mutex);
+
+	if (r)
+		log_debug("Using prefetched metadata from %s at %" PRIu64,
+			  dev_name(dev), offset);
+
+	return r;
+}
+
+void dev_prefetch_release(void)
+{
+	struct prefetched *p, *tmp;
+
+	if (!_threads || _pid != getpid())
+		return;
+
+	pthread_mutex_lock(&_prefetch_mutex);
+	dm_list_iterate_items_safe(p, tmp, &_results)
+		if (p->used)
+			_free_prefetched(p);
+	pthread_mutex_unlock(&_prefetch_mutex);
+}
+
+void dev_prefetch_drop(void)
+{
+	struct prefetched *p, *tmp;
+
+	if (!_threads || _pid != getpid())
+		return;
+
+	pthread_mutex_lock(&_prefetch_mutex);
+	_settle(NULL);
+	dm_list_iterate_items_safe(p, tmp, &_results)
+		_free_prefetched(p);
+	pthread_mutex_unlock(&_prefetch_mutex);
+}
@@ -89,6 +89,30 @@ int dev_append(struct device *dev, size_t len, void *buffer);
 int dev_set(struct device *dev, uint64_t offset, size_t len, int value);
 void dev_flush(struct device *dev);
 
+/*
+ * Background reads.  dev_prefetch_queue() opens dev and has a worker
+ * thread call fn with the descriptor and a copy of context; fn reads
+ * what it wants with pread() and passes any region worth keeping, in a
+ * malloc()ed buffer, to dev_prefetch_store().  dev_read_prefetched()
+ * copies out the first len bytes of a stored region only if it has the
+ * layout and checksum the caller now expects.  dev_prefetch_release()
+ * frees the regions that have since been read whole, and
+ * dev_prefetch_drop() waits for the workers and frees everything.
+ */
+typedef void (*dev_prefetch_fn_t) (struct device *dev, int fd, void *context);
+
+int dev_prefetch_start(unsigned threads);
+int dev_prefetch_queue(struct device *dev, dev_prefetch_fn_t fn,
+		       const void *context, size_t context_size);
+void dev_prefetch_store(struct device *dev, uint64_t offset, size_t size,
+			uint64_t offset2, size_t size2, uint32_t checksum,
+			char *buf);
+int dev_read_prefetched(struct device *dev, uint64_t offset, size_t size,
+			uint64_t offset2, size_t size2, uint32_t checksum,
+			size_t len, void *buf);
+void dev_prefetch_release(void);
+void dev_prefetch_drop(void);
+
 struct device *dev_create_file(const char *filename, struct device *dev,
 			       struct str_list *alias, int use_malloc);
 
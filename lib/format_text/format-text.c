@@ -370,6 +370,69 @@ bad:
 	return NULL;
 }
 
+/*
+ * Runs in a prefetch thread: read the header and the committed metadata
+ * it points at, as _vg_read_raw_area() will, and keep the text if its
+ * checksum holds.  Whatever is wrong is left for vg_read to report.
+ */
+static void _prefetch_raw_area(struct device *dev, int fd, void *context)
+{
+	uint64_t start = *(uint64_t *) context;
+	char hdr[MDA_HEADER_SIZE] __attribute__((aligned(8)));
+	struct mda_header *mdah = (struct mda_header *) hdr;
+	struct raw_locn *rlocn;
+	uint64_t wrap = 0;
+	size_t size;
+	char *buf;
+
+	if (pread(fd, hdr, MDA_HEADER_SIZE, (off_t) start) != MDA_HEADER_SIZE)
+		return;
+
+	if (mdah->checksum_xl != xlate32(calc_crc(INITIAL_CRC, (uint8_t *)mdah->magic,
+						  MDA_HEADER_SIZE -
+						  sizeof(mdah->checksum_xl))))
+		return;
+
+	_xlate_mdah(mdah);
+
+	if (strncmp((char *)mdah->magic, FMTT_MAGIC, sizeof(mdah->magic)) ||
+	    mdah->version != FMTT_VERSION || mdah->start != start)
+		return;
+
+	rlocn = mdah->raw_locns;
+	if (!rlocn->offset || !rlocn->size || rlocn->size > mdah->size)
+		return;
+
+	if (rlocn->offset + rlocn->size > mdah->size)
+		wrap = rlocn->offset + rlocn->size - mdah->size;
+
+	if (wrap > rlocn->offset)
+		return;
+
+	size = rlocn->size - wrap;
+	if (!(buf = malloc(rlocn->size)))
+		return;
+
+	if (pread(fd, buf, size, (off_t) (start + rlocn->offset)) != (ssize_t) size ||
+	    (wrap && pread(fd, buf + size, wrap, (off_t) (start + MDA_HEADER_SIZE)) != (ssize_t) wrap) ||
+	    calc_crc(calc_crc(INITIAL_CRC, (uint8_t *)buf, size),
+		     (uint8_t *)(buf + size), wrap) != rlocn->checksum) {
+		free(buf);
+		return;
+	}
+
+	dev_prefetch_store(dev, start + rlocn->offset, size,
+			   start + MDA_HEADER_SIZE, wrap, rlocn->checksum, buf);
+}
+
+static int _mda_prefetch_raw(struct metadata_area *mda)
+{
+	struct mda_context *mdac = (struct mda_context *) mda->metadata_locn;
+
+	return dev_prefetch_queue(mdac->area.dev, _prefetch_raw_area,
+				  &mdac->area.start, sizeof(mdac->area.start));
+}
+
 static int _raw_write_mda_header(const struct format_type *fmt,
 				 struct device *dev,
 				 uint64_t start_byte, struct mda_header *mdah)
@@ -395,6 +458,7 @@ static struct raw_locn *_find_vg_rlocn(struct device_area *dev_area,
 				       int *precommitted)
 {
 	size_t len;
+	uint64_t wrap = 0;
 	char vgnamebuf[NAME_LEN + 2] __attribute__((aligned(8)));
 	struct raw_locn *rlocn, *rlocn_precommitted;
 	struct lvmcache_info *info;
@@ -420,9 +484,18 @@ static struct raw_locn *_find_vg_rlocn(struct device_area *dev_area,
 	if (!*vgname)
 		return rlocn;
 
+	if (rlocn->offset + rlocn->size > mdah->size)
+		wrap = rlocn->offset + rlocn->size - mdah->size;
+
 	/* FIXME Loop through rlocns two-at-a-time.  List null-terminated. */
 	/* FIXME Ignore if checksum incorrect!!! */
-	if (!dev_read(dev_area->dev, dev_area->start + rlocn->offset,
+	if ((rlocn->size - wrap < sizeof(vgnamebuf) ||
+	     !dev_read_prefetched(dev_area->dev, dev_area->start + rlocn->offset,
+				  rlocn->size - wrap,
+				  dev_area->start + MDA_HEADER_SIZE, wrap,
+				  rlocn->checksum, sizeof(vgnamebuf),
+				  vgnamebuf)) &&
+	    !dev_read(dev_area->dev, dev_area->start + rlocn->offset,
 		      sizeof(vgnamebuf), vgnamebuf))
 		goto_bad;
 
@@ -1760,7 +1833,8 @@ static struct metadata_area_ops _metadata_text_raw_ops = {
 	.mda_total_sectors = _mda_total_sectors_raw,
 	.mda_in_vg = _mda_in_vg_raw,
 	.pv_analyze_mda = _pv_analyze_mda_raw,
-	.mda_locns_match = _mda_locns_match_raw
+	.mda_locns_match = _mda_locns_match_raw,
+	.mda_prefetch = _mda_prefetch_raw
 };
 
 /* pvmetadatasize in sectors */
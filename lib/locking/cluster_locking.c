@@ -156,7 +156,10 @@ static int _send_request(char *inbuf, int inlen, char **retbuf)
 		/* Only return an error here if there are no node-specific
 		   errors present in the message that might have more detail */
 		if (!(outheader->flags & CLVMD_FLAG_NODEERRS)) {
-			log_error("cluster request failed: %s", strerror(errno));
+			/* clvmd without LOCK_LVS: the caller falls back */
+			if (errno != EINVAL ||
+			    ((struct clvm_header *) inbuf)->cmd != CLVMD_CMD_LOCK_LVS)
+				log_error("cluster request failed: %s", strerror(errno));
 			return 0;
 		}
 
@@ -299,23 +302,12 @@ static int _cluster_free_request(lvm_response_t * response, int num)
 	return 1;
 }
 
-static int _lock_for_cluster(struct cmd_context *cmd, unsigned char clvmd_cmd,
-			     uint32_t flags, const char *name)
+/* Fill in the two flag bytes and resource name of a lock request */
+static void _build_lock_args(struct cmd_context *cmd, uint32_t flags,
+			     const char *name, char *args)
 {
-	int status;
-	int i;
-	char *args;
-	const char *node = "";
-	int len;
 	int dmeventd_mode;
-	int saved_errno;
-	lvm_response_t *response = NULL;
-	int num_responses;
-
-	assert(name);
 
-	len = strlen(name) + 3;
-	args = alloca(len);
 	strcpy(args + 2, name);
 
 	/* Mask off lock flags */
@@ -338,6 +330,25 @@ static int _lock_for_cluster(struct cmd_context *cmd, unsigned char clvmd_cmd,
 
 	if (cmd->partial_activation)
 		args[1] |= LCK_PARTIAL_MODE;
+}
+
+static int _lock_for_cluster(struct cmd_context *cmd, unsigned char clvmd_cmd,
+			     uint32_t flags, const char *name)
+{
+	int status;
+	int i;
+	char *args;
+	const char *node = "";
+	int len;
+	int saved_errno;
+	lvm_response_t *response = NULL;
+	int num_responses;
+
+	assert(name);
+
+	len = strlen(name) + 3;
+	args = alloca(len);
+	_build_lock_args(cmd, flags, name, args);
 
 	/*
 	 * VG locks are just that: locks, and have no side effects
@@ -479,6 +490,145 @@ int lock_resource(struct cmd_context *cmd, const char *resource, uint32_t flags)
 	return _lock_for_cluster(cmd, clvmd_cmd, flags, lockname);
 }
 
+#ifdef CLUSTER_LOCKING_INTERNAL
+/*
+ * Send one LOCK_LVS request covering count resources and fill in
+ * locked[] from the per-LV statuses in the replies.
+ * Returns 0 if clvmd (here or on another node) does not know LOCK_LVS.
+ */
+static int _lock_for_cluster_batch(struct cmd_context *cmd, uint32_t flags,
+				   const char **resources, unsigned count,
+				   char *args, int len, int *locked)
+{
+	lvm_response_t *response = NULL;
+	const char *node = "";
+	char *ptr, *end;
+	int num_responses, status, saved_errno, lv_status;
+	unsigned i, j;
+
+	/* As in _lock_for_cluster */
+	if ((flags & LCK_TYPE_MASK) == LCK_EXCL ||
+	    (flags & LCK_LOCAL) ||
+	    !(flags & LCK_CLUSTER_VG))
+		node = ".";
+
+	status = _cluster_request(CLVMD_CMD_LOCK_LVS, node, args, len,
+				  &response, &num_responses);
+
+	if (status != 1) {
+		if (errno == EINVAL)
+			return 0;
+		for (i = 0; i < count; i++)
+			locked[i] = 0;
+		return 1;
+	}
+
+	for (i = 0; i < count; i++)
+		locked[i] = 1;
+
+	for (i = 0; i < num_responses; i++) {
+		if (response[i].status == EHOSTDOWN) {
+			log_error("clvmd not running on node %s",
+				  response[i].node);
+			errno = response[i].status;
+			for (j = 0; j < count; j++)
+				locked[j] = 0;
+			continue;
+		}
+
+		if (response[i].status) {
+			log_error("Error locking on node %s: %s",
+				  response[i].node,
+				  response[i].response[0] ?
+				  	response[i].response :
+				  	strerror(response[i].status));
+			errno = response[i].status;
+			for (j = 0; j < count; j++)
+				locked[j] = 0;
+			continue;
+		}
+
+		/* An older clvmd answers an unknown command with nothing */
+		if (!response[i].response[0]) {
+			_cluster_free_request(response, num_responses);
+			return 0;
+		}
+
+		ptr = response[i].response;
+		for (j = 0; j < count; j++) {
+			lv_status = strtol(ptr, &end, 10);
+			if (end == ptr)
+				lv_status = EPROTO;	/* Short reply */
+			ptr = end;
+
+			if (lv_status) {
+				log_error("Error locking %s on node %s: %s",
+					  resources[j], response[i].node,
+					  strerror(lv_status));
+				errno = lv_status;
+				locked[j] = 0;
+			}
+		}
+	}
+
+	saved_errno = errno;
+	_cluster_free_request(response, num_responses);
+	errno = saved_errno;
+
+	return 1;
+}
+
+/*
+ * Lock several LVs with the same flags, packing as many of them into
+ * each LOCK_LVS request as fit.  A clvmd that predates LOCK_LVS gets
+ * them one at a time instead.
+ */
+static int _lock_resources(struct cmd_context *cmd, const char **resources,
+			   unsigned count, uint32_t flags, int *locked)
+{
+	static int _lock_lvs_unsupported = 0;
+	char args[CLVMD_MAX_LOCK_LVS_ARGS];
+	unsigned first, next, i;
+	int len = 0, entry_len, r = 1;
+
+	flags &= ~LCK_HOLD;	/* Mask off HOLD flag */
+
+	for (first = 0; first < count; first = next) {
+		next = first;
+
+		if (!_lock_lvs_unsupported && (flags & LCK_SCOPE_MASK) == LCK_LV)
+			for (len = 0; next < count; next++, len += entry_len) {
+				entry_len = strlen(resources[next]) + 3;
+				if (len + entry_len > (int) sizeof(args))
+					break;
+				_build_lock_args(cmd, flags, resources[next],
+						 args + len);
+			}
+
+		if (next > first) {
+			log_very_verbose("Locking %u LVs from %s (0x%x)",
+					 next - first, resources[first], flags);
+			if (_lock_for_cluster_batch(cmd, flags, resources + first,
+						    next - first, args, len,
+						    locked + first))
+				continue;
+			log_very_verbose("clvmd does not support LOCK_LVS.");
+			_lock_lvs_unsupported = 1;
+		} else
+			next++;
+
+		for (i = first; i < next; i++)
+			locked[i] = _lock_resource(cmd, resources[i], flags);
+	}
+
+	for (i = 0; i < count; i++)
+		if (!locked[i])
+			r = 0;
+
+	return r;
+}
+#endif
+
 static int decode_lock_type(const char *response)
 {
 	if (!response)
@@ -581,6 +731,8 @@ int init_cluster_locking(struct locking_type *locking, struct cmd_context *cmd)
 	if (_clvmd_sock == -1)
 		return 0;
 
+	locking->lock_resources = _lock_resources;
+
 	return 1;
 }
 #else
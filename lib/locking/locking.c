@@ -384,9 +384,11 @@ static int _lock_vol(struct cmd_context *cmd, const char *resource,
 	if ((ret = _locking.lock_resource(cmd, resource, flags))) {
 		if ((flags & LCK_SCOPE_MASK) == LCK_VG &&
 		    !(flags & LCK_CACHE)) {
-			if ((flags & LCK_TYPE_MASK) == LCK_UNLOCK)
+			if ((flags & LCK_TYPE_MASK) == LCK_UNLOCK) {
 				lvmcache_unlock_vgname(resource);
-			else
+				/* Others may now change the VG's devices */
+				activation_drop_deps_cache();
+			} else
 				lvmcache_lock_vgname(resource, (flags & LCK_TYPE_MASK)
 								== LCK_READ);
 			dev_reset_error_count(cmd);
@@ -534,6 +536,90 @@ int activate_lvs(struct cmd_context *cmd, struct dm_list *lvs, unsigned exclusiv
 	return 1;
 }
 
+/*
+ * Lock a list of LVs from one VG with the same flags, in as few
+ * requests as the locking type allows.  LVs that could not be
+ * locked are removed from the list.
+ */
+int lock_lvs(struct cmd_context *cmd, struct dm_list *lvs, uint32_t flags)
+{
+	struct lv_list *lvl, *tmp, **lvls;
+	const char **resources;
+	int *locked;
+	unsigned count = 0, i, n;
+	int r = 1;
+
+	/* Suspend and resume need their memory locking, so go one by one */
+	if (!_locking.lock_resources ||
+	    (flags & LCK_MASK) == LCK_LV_SUSPEND ||
+	    (flags & LCK_MASK) == LCK_LV_RESUME) {
+		dm_list_iterate_items_safe(lvl, tmp, lvs)
+			if (!lock_lv_vol(cmd, lvl->lv, flags)) {
+				stack;
+				dm_list_del(&lvl->list);
+				r = 0;
+			}
+		return r;
+	}
+
+	dm_list_iterate_items_safe(lvl, tmp, lvs) {
+		if (!find_replicator_vgs(lvl->lv)) {
+			stack;
+			dm_list_del(&lvl->list);
+			r = 0;
+			continue;
+		}
+		count++;
+	}
+
+	if (!count)
+		return r;
+
+	if (!(lvls = dm_pool_alloc(cmd->mem, count * sizeof(*lvls))) ||
+	    !(resources = dm_pool_alloc(cmd->mem, count * sizeof(*resources))) ||
+	    !(locked = dm_pool_alloc(cmd->mem, count * sizeof(*locked)))) {
+		log_error("Failed to allocate LV lock list.");
+		return 0;
+	}
+
+	i = 0;
+	dm_list_iterate_items(lvl, lvs) {
+		lvls[i] = lvl;
+		resources[i++] = lvl->lv->lvid.s;
+	}
+
+	/* As lock_lv_vol and lock_vol would set them */
+	flags |= LCK_NONBLOCK | LCK_LV_CLUSTERED(lvls[0]->lv);
+
+	_block_signals(flags);
+
+	if (!_locking.lock_resources(cmd, resources, count, flags, locked))
+		r = 0;
+
+	/* Drop the LVs that failed */
+	for (i = n = 0; i < count; i++)
+		if (locked[i]) {
+			lvls[n] = lvls[i];
+			resources[n++] = resources[i];
+		} else
+			dm_list_del(&lvls[i]->list);
+
+	/* Perform the immediate unlock lock_vol would, unless LCK_HOLD */
+	if (n && !(flags & LCK_HOLD) && ((flags & LCK_TYPE_MASK) != LCK_UNLOCK)) {
+		if (!_locking.lock_resources(cmd, resources, n,
+					     (flags & ~LCK_TYPE_MASK) | LCK_UNLOCK,
+					     locked))
+			r = 0;
+		for (i = 0; i < n; i++)
+			if (!locked[i])
+				dm_list_del(&lvls[i]->list);
+	}
+
+	_unblock_signals();
+
+	return r;
+}
+
 int vg_write_lock_held(void)
 {
 	return _vg_write_lock_held;
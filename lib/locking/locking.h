@@ -174,6 +174,7 @@ int check_lvm1_vg_inactive(struct cmd_context *cmd, const char *vgname);
 int suspend_lvs(struct cmd_context *cmd, struct dm_list *lvs);
 int resume_lvs(struct cmd_context *cmd, struct dm_list *lvs);
 int activate_lvs(struct cmd_context *cmd, struct dm_list *lvs, unsigned exclusive);
+int lock_lvs(struct cmd_context *cmd, struct dm_list *lvs, uint32_t flags);
 
 /* Interrupt handling */
 void sigint_clear(void);
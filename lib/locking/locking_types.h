@@ -19,6 +19,9 @@
 typedef int (*lock_resource_fn) (struct cmd_context * cmd, const char *resource,
 				 uint32_t flags);
 typedef int (*query_resource_fn) (const char *resource, int *mode);
+typedef int (*lock_resources_fn) (struct cmd_context * cmd,
+				  const char **resources, unsigned count,
+				  uint32_t flags, int *locked);
 
 typedef void (*fin_lock_fn) (void);
 typedef void (*reset_lock_fn) (void);
@@ -30,6 +33,7 @@ struct locking_type {
 	uint32_t flags;
 	lock_resource_fn lock_resource;
 	query_resource_fn query_resource;
+	lock_resources_fn lock_resources;	/* Optional: several LVs at once */
 
 	reset_lock_fn reset_locking;
 	fin_lock_fn fin_locking;
@@ -174,6 +174,12 @@ struct metadata_area_ops {
 	 */
 	unsigned (*mda_locns_match)(struct metadata_area *mda1,
 				    struct metadata_area *mda2);
+
+	/*
+	 * Start reading the metadata in the background so a vg_read
+	 * soon after need not wait for the device.
+	 */
+	int (*mda_prefetch) (struct metadata_area *mda);
 };
 
 #define MDA_IGNORED 0x00000001
@@ -324,6 +330,11 @@ struct lv_list *find_lv_in_lv_list(const struct dm_list *ll,
 /* or environment var */
 struct volume_group *find_vg_with_lv(const char *lv_name);
 
+/* Read the VG with the given vgid without taking its lock */
+struct volume_group *vg_read_by_vgid(struct cmd_context *cmd,
+				     const char *vgid,
+				     unsigned precommitted);
+
 /* Find LV with given lvid (used during activation) */
 struct logical_volume *lv_from_lvid(struct cmd_context *cmd,
 				    const char *lvid_s,
@@ -268,6 +268,8 @@ static int _memlock_maps(struct cmd_context *cmd, lvmlock_t lock, size_t *mstats
 /* Stop memory getting swapped out */
 static void _lock_mem(struct cmd_context *cmd)
 {
+	/* Pool high-water marks help with sizing reserved_memory */
+	dm_pools_dump_stats();
 	_allocate_memory();
 
 	/*
@@ -329,6 +331,7 @@ static void _unlock_mem(struct cmd_context *cmd)
 		log_error("setpriority %u failed: %s", _priority,
 			  strerror(errno));
 	_release_memory();
+	dm_pools_dump_stats();
 }
 
 static void _lock_mem_if_needed(struct cmd_context *cmd)
@@ -1003,6 +1003,94 @@ void *report_init(struct cmd_context *cmd, const char *format, const char *keys,
 	return rh;
 }
 
+/*
+ * LV fields that read device-mapper state rather than metadata.
+ */
+static const struct {
+	const char *id;
+	uint32_t state;
+} _lv_state_fields[] = {
+	{ "lv_attr", REPORT_LV_STATUS },
+	{ "lv_kernel_major", REPORT_LV_INFO },
+	{ "lv_kernel_minor", REPORT_LV_INFO },
+	{ "lv_kernel_read_ahead", REPORT_LV_INFO },
+	{ "snap_percent", REPORT_LV_STATUS },
+	{ "copy_percent", REPORT_LV_STATUS },
+	{ NULL, 0 }
+};
+
+static uint32_t _lv_state_of_field(const char *prefix, const char *name,
+				   size_t len)
+{
+	size_t prefix_len = strlen(prefix);
+	uint32_t state = 0;
+	int f;
+
+	/* Sort keys may be prefixed with + or - */
+	if (len && (*name == '+' || *name == '-')) {
+		name++;
+		len--;
+	}
+
+	/* All the LV fields */
+	if ((len == 3 && !strncasecmp(name, "all", 3) && !strcmp(prefix, "lv_")) ||
+	    (len == 6 && !strncasecmp(name, "lv_all", 6))) {
+		for (f = 0; _lv_state_fields[f].id; f++)
+			state |= _lv_state_fields[f].state;
+		return state;
+	}
+
+	/* Matched as dm_report_init() matches them, with or without prefix */
+	for (f = 0; _lv_state_fields[f].id; f++) {
+		if (strlen(_lv_state_fields[f].id) == len &&
+		    !strncasecmp(_lv_state_fields[f].id, name, len))
+			return _lv_state_fields[f].state;
+		if (strlen(_lv_state_fields[f].id) == prefix_len + len &&
+		    !strncasecmp(_lv_state_fields[f].id, prefix, prefix_len) &&
+		    !strncasecmp(_lv_state_fields[f].id + prefix_len, name, len))
+			return _lv_state_fields[f].state;
+	}
+
+	return 0;
+}
+
+static uint32_t _lv_state_of_fields(const char *prefix, const char *fields)
+{
+	const char *ws, *we = fields;
+	uint32_t state = 0;
+
+	while (*we) {
+		while (*we == ',')
+			we++;
+		ws = we;
+		while (*we && *we != ',')
+			we++;
+		state |= _lv_state_of_field(prefix, ws, (size_t) (we - ws));
+	}
+
+	return state;
+}
+
+/*
+ * Which device-mapper state the fields and sort keys selected for a
+ * report of report_type need: REPORT_LV_INFO and/or REPORT_LV_STATUS.
+ */
+uint32_t report_lv_state(report_type_t report_type, const char *format,
+			 const char *keys)
+{
+	const struct dm_report_object_type *t;
+	const char *prefix = "";
+
+	for (t = _report_types; t->data_fn; t++)
+		if (t->id == report_type) {
+			prefix = t->prefix;
+			break;
+		}
+
+	return _lv_state_of_fields(prefix, format ? : "") |
+	       _lv_state_of_fields(prefix, keys ? : "");
+}
+
 /*
  * Create a row of data for an object
  */
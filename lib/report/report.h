@@ -37,6 +37,13 @@ void *report_init(struct cmd_context *cmd, const char *format, const char *keys,
 		  report_type_t *report_type, const char *separator,
 		  int aligned, int buffered, int headings, int field_prefixes,
 		  int quoted, int columns_as_rows);
+
+/* Device-mapper state read by the LV fields of a report */
+#define REPORT_LV_INFO		0x00000001
+#define REPORT_LV_STATUS	0x00000002
+
+uint32_t report_lv_state(report_type_t report_type, const char *format,
+			 const char *keys);
 void report_free(void *handle);
 int report_object(void *handle, struct volume_group *vg,
 		  struct logical_volume *lv, struct physical_volume *pv,
@@ -44,13 +44,8 @@ void dm_bitset_destroy(dm_bitset_t bs)
 
 int dm_bitset_equal(dm_bitset_t in1, dm_bitset_t in2)
 {
-	int i;
-
-	for (i = (in1[0] / DM_BITS_PER_INT) + 1; i; i--)
-		if (in1[i] != in2[i])
-			return 0;
-
-	return 1;
+	return !memcmp(in1 + 1, in2 + 1,
+		       ((in1[0] / DM_BITS_PER_INT) + 1) * sizeof(int));
 }
 
 void dm_bit_and(dm_bitset_t out, dm_bitset_t in1, dm_bitset_t in2)
@@ -67,6 +62,93 @@ void dm_bit_union(dm_bitset_t out, dm_bitset_t in1, dm_bitset_t in2)
 		out[i] = in1[i] | in2[i];
 }
 
+void dm_bit_xor(dm_bitset_t out, dm_bitset_t in1, dm_bitset_t in2)
+{
+	int i;
+
+	for (i = (in1[0] / DM_BITS_PER_INT) + 1; i; i--)
+		out[i] = in1[i] ^ in2[i];
+}
+
+/*
+ * Mask of bits lo to hi - 1 within a word.
+ */
+static uint32_t _word_mask(unsigned lo, unsigned hi)
+{
+	uint32_t m = (hi < DM_BITS_PER_INT) ? (1u << hi) - 1 : ~0u;
+
+	return m & ~((1u << lo) - 1);
+}
+
+/*
+ * Sets or clears count bits from start a word at a time.
+ * Bits beyond the end of the bitset are ignored.
+ */
+static void _bit_range(dm_bitset_t bs, unsigned start, unsigned count, int set)
+{
+	unsigned end, word, last_word;
+	uint32_t mask;
+
+	if (start >= bs[0])
+		return;
+
+	end = (count > bs[0] - start) ? bs[0] : start + count;
+	if (start == end)
+		return;
+
+	word = start >> INT_SHIFT;
+	last_word = (end - 1) >> INT_SHIFT;
+
+	mask = _word_mask(start & (DM_BITS_PER_INT - 1),
+			  (word == last_word) ?
+			  ((end - 1) & (DM_BITS_PER_INT - 1)) + 1 :
+			  DM_BITS_PER_INT);
+	if (set)
+		bs[word + 1] |= mask;
+	else
+		bs[word + 1] &= ~mask;
+
+	if (word == last_word)
+		return;
+
+	/* Whole words in between */
+	if (++word < last_word)
+		memset(bs + word + 1, set ? -1 : 0,
+		       (last_word - word) * sizeof(*bs));
+
+	mask = _word_mask(0, ((end - 1) & (DM_BITS_PER_INT - 1)) + 1);
+	if (set)
+		bs[last_word + 1] |= mask;
+	else
+		bs[last_word + 1] &= ~mask;
+}
+
+void dm_bit_set_range(dm_bitset_t bs, unsigned start, unsigned count)
+{
+	_bit_range(bs, start, count, 1);
+}
+
+void dm_bit_clear_range(dm_bitset_t bs, unsigned start, unsigned count)
+{
+	_bit_range(bs, start, count, 0);
+}
+
+unsigned dm_bit_count(dm_bitset_t bs)
+{
+	unsigned i, words = bs[0] >> INT_SHIFT;
+	unsigned tail = bs[0] & (DM_BITS_PER_INT - 1);
+	unsigned count = 0;
+
+	for (i = 1; i <= words; i++)
+		if (bs[i])
+			count += hweight32(bs[i]);
+
+	if (tail)
+		count += hweight32(bs[words + 1] & _word_mask(0, tail));
+
+	return count;
+}
+
 static int _test_word(uint32_t test, int bit)
 {
 	uint32_t tb = test >> bit;
@@ -103,3 +185,46 @@ int dm_bit_get_first(dm_bitset_t bs)
 {
 	return dm_bit_get_next(bs, -1);
 }
+
+int dm_bit_get_next_clear(dm_bitset_t bs, int last_bit)
+{
+	int bit, word;
+
+	last_bit++;
+
+	while (last_bit < (int) bs[0]) {
+		word = last_bit >> INT_SHIFT;
+		bit = last_bit & (DM_BITS_PER_INT - 1);
+
+		/* Skip full words without looking at each bit */
+		if (~bs[word + 1] &&
+		    (bit = _test_word(~bs[word + 1], bit)) >= 0) {
+			bit += word * DM_BITS_PER_INT;
+			return (bit < (int) bs[0]) ? bit : -1;
+		}
+
+		last_bit = (word + 1) * DM_BITS_PER_INT;
+	}
+
+	return -1;
+}
+
+int dm_bit_get_first_clear(dm_bitset_t bs)
+{
+	return dm_bit_get_next_clear(bs, -1);
+}
+
+int dm_bit_get_next_run(dm_bitset_t bs, int start, unsigned *len)
+{
+	int first, end;
+
+	if ((first = dm_bit_get_next(bs, start - 1)) < 0)
+		return -1;
+
+	if ((end = dm_bit_get_next_clear(bs, first)) < 0)
+		end = bs[0];
+
+	*len = end - first;
+
+	return first;
+}
@@ -1999,6 +1999,24 @@ void dm_task_update_nodes(void)
 	update_devs();
 }
 
+static int _changes_device_state(int type)
+{
+	switch (type) {
+	case DM_DEVICE_INFO:
+	case DM_DEVICE_DEPS:
+	case DM_DEVICE_VERSION:
+	case DM_DEVICE_STATUS:
+	case DM_DEVICE_TABLE:
+	case DM_DEVICE_WAITEVENT:
+	case DM_DEVICE_LIST:
+	case DM_DEVICE_MKNODES:
+	case DM_DEVICE_LIST_VERSIONS:
+		return 0;
+	}
+
+	return 1;
+}
+
 int dm_task_run(struct dm_task *dmt)
 {
 	struct dm_ioctl *dmi;
@@ -2039,10 +2057,16 @@ int dm_task_run(struct dm_task *dmt)
 	/* FIXME Detect and warn if cookie set but should not be. */
 repeat_ioctl:
 	if (!(dmi = _do_dm_ioctl(dmt, command, _ioctl_buffer_double_factor))) {
+		if (_changes_device_state(dmt->type))
+			device_state_changed(0);
 		_udev_complete(dmt);
 		return 0;
 	}
 
+	/* Invalidate anything cached about the device, or all if unknown */
+	if (_changes_device_state(dmt->type))
+		device_state_changed(dmi->dev);
+
 	if (dmi->flags & DM_BUFFER_FULL_FLAG) {
 		switch (dmt->type) {
 		case DM_DEVICE_LIST_VERSIONS:
@@ -2126,15 +2150,18 @@ void dm_lib_release(void)
 }
 
 void dm_pools_check_leaks(void);
+void dm_pools_release_chunk_cache(void);
 
 void dm_lib_exit(void)
 {
 	dm_lib_release();
 	selinux_release();
+	udev_sync_release();
 	if (_dm_bitset)
 		dm_bitset_destroy(_dm_bitset);
 	_dm_bitset = NULL;
 	dm_pools_check_leaks();
+	dm_pools_release_chunk_cache();
 	dm_dump_memory();
 	_version_ok = 1;
 	_version_checked = 0;
@@ -236,6 +236,13 @@ void dm_task_update_nodes(void);
 int dm_set_dev_dir(const char *dir);
 const char *dm_dir(void);
 
+/*
+ * Configure the sysfs directory, /sys by default. An empty
+ * string stops libdevmapper reading anything from sysfs.
+ */
+int dm_set_sysfs_dir(const char *dir);
+const char *dm_sysfs_dir(void);
+
 /*
  * Determine whether a major number belongs to device-mapper or not.
  */
@@ -280,6 +287,31 @@ int dm_tree_add_dev(struct dm_tree *tree, uint32_t major, uint32_t minor);
 int dm_tree_add_dev_with_udev_flags(struct dm_tree *tree, uint32_t major,
 				    uint32_t minor, uint16_t udev_flags);
 
+/*
+ * Add nodes for every mapped device present in the system.
+ * Uses a single DM_DEVICE_LIST and reads the dependencies of all
+ * the devices from sysfs, falling back to DM_DEVICE_DEPS for any
+ * device sysfs can't describe.  Node info read from sysfs has no
+ * open_count, event_nr or inactive_table: query the device itself
+ * if those are needed.
+ */
+int dm_tree_add_all_devs(struct dm_tree *tree);
+
+/*
+ * A deps cache holds name, uuid, info and dependencies of devices
+ * so several trees built by the same process need not query the
+ * kernel for each node again. Entries are revalidated automatically
+ * once this process changes the state of any mapped device.
+ * Changes made by other processes are not detected, so the cache
+ * should only be kept while the devices concerned are locked.
+ * The cache must outlive any tree it is attached to.
+ */
+struct dm_deps_cache;
+
+struct dm_deps_cache *dm_deps_cache_create(void);
+void dm_deps_cache_destroy(struct dm_deps_cache *cache);
+void dm_tree_set_deps_cache(struct dm_tree *tree, struct dm_deps_cache *cache);
+
 /*
  * Add a new node to the tree if it doesn't already exist.
  */
@@ -643,6 +675,29 @@ char *dm_pool_strdup(struct dm_pool *p, const char *str);
 char *dm_pool_strndup(struct dm_pool *p, const char *str, size_t n);
 void *dm_pool_zalloc(struct dm_pool *p, size_t s);
 
+/*
+ * Statistics: bytes and chunks currently held by a pool from
+ * malloc, and the high-water mark of bytes held.
+ */
+struct dm_pool_stats {
+	const char *name;
+	size_t bytes;
+	size_t peak_bytes;
+	unsigned chunks;
+};
+
+void dm_pool_stats(const struct dm_pool *p, struct dm_pool_stats *stats);
+
+/* Log the statistics of every existing pool with log_debug. */
+void dm_pools_dump_stats(void);
+
+/*
+ * Keep up to max_bytes of chunks released by any pool on
+ * per-size-class free lists for reuse by other pools.
+ * Not thread-safe.  0 (the default) disables the cache.
+ */
+void dm_pools_set_chunk_cache(size_t max_bytes);
+
 /******************
  * bitset functions
  ******************/
@@ -656,9 +711,30 @@ int dm_bitset_equal(dm_bitset_t in1, dm_bitset_t in2);
 
 void dm_bit_and(dm_bitset_t out, dm_bitset_t in1, dm_bitset_t in2);
 void dm_bit_union(dm_bitset_t out, dm_bitset_t in1, dm_bitset_t in2);
+void dm_bit_xor(dm_bitset_t out, dm_bitset_t in1, dm_bitset_t in2);
 int dm_bit_get_first(dm_bitset_t bs);
 int dm_bit_get_next(dm_bitset_t bs, int last_bit);
 
+/* Returns -1 if there is no clear bit after last_bit */
+int dm_bit_get_first_clear(dm_bitset_t bs);
+int dm_bit_get_next_clear(dm_bitset_t bs, int last_bit);
+
+/*
+ * Finds the first run of set bits starting at or after start.
+ * Returns the first bit of the run and its length in *len,
+ * or -1 if no bits are set.  Iterate with
+ *   for (b = dm_bit_get_next_run(bs, 0, &len); b >= 0;
+ *        b = dm_bit_get_next_run(bs, b + len, &len))
+ */
+int dm_bit_get_next_run(dm_bitset_t bs, int start, unsigned *len);
+
+/* Range operations are clipped to the size of the bitset */
+void dm_bit_set_range(dm_bitset_t bs, unsigned start, unsigned count);
+void dm_bit_clear_range(dm_bitset_t bs, unsigned start, unsigned count);
+
+/* Returns number of set bits */
+unsigned dm_bit_count(dm_bitset_t bs);
+
 #define DM_BITS_PER_INT (sizeof(int) * CHAR_BIT)
 
 #define dm_bit(bs, i) \
@@ -1204,6 +1280,13 @@ void dm_report_field_set_value(struct dm_report_field *field, const void *value,
  * of the "watch" udev rule).
  */
 #define DM_UDEV_PRIMARY_SOURCE_FLAG 0x0040
+/*
+ * DM_UDEV_NOTIFY_BY_UEVENT_FLAG is set by libdevmapper when the waiting
+ * process detects the completion of udev rules by listening to uevents
+ * broadcast by udev instead of using a notification semaphore. The udev
+ * rules must not call "dmsetup udevcomplete" for such events then.
+ */
+#define DM_UDEV_NOTIFY_BY_UEVENT_FLAG 0x0080
 
 int dm_cookie_supported(void);
 
@@ -1218,6 +1301,25 @@ int dm_udev_create_cookie(uint32_t *cookie);
 int dm_udev_complete(uint32_t cookie);
 int dm_udev_wait(uint32_t cookie);
 
+/*
+ * Wait for udev rules to finish processing of all the given cookies.
+ * A negative timeout means wait forever. On timeout, all the cookies
+ * are released and 0 is returned.
+ */
+int dm_udev_wait_multiple(const uint32_t *cookies, unsigned num_cookies,
+			  int timeout_ms);
+
+/*
+ * Detect the completion of udev rules by listening to the uevents
+ * udev broadcasts once it has processed them instead of using
+ * a System V semaphore per cookie. This applies to cookies allocated
+ * by dm_task_set_cookie only, since cookies created by
+ * dm_udev_create_cookie may be shared with other processes.
+ * Semaphores are used automatically if uevents can't be monitored.
+ */
+void dm_udev_set_uevent_sync(int uevent_sync);
+int dm_udev_get_uevent_sync(void);
+
 #define DM_DEV_DIR_UMASK 0022
 
 #ifdef __cplusplus
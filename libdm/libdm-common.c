@@ -29,6 +29,8 @@
 #  include <sys/types.h>
 #  include <sys/ipc.h>
 #  include <sys/sem.h>
+#  include <sys/time.h>
+#  include <poll.h>
 #  define LIBUDEV_I_KNOW_THE_API_IS_SUBJECT_TO_CHANGE
 #  include <libudev.h>
 #endif
@@ -47,6 +49,9 @@
 #define DEV_DIR "/dev/"
 
 #ifdef UDEV_SYNC_SUPPORT
+#define UEVENT_RCVBUF_SIZE (8 * 1024 * 1024)
+#define UEVENT_IDLE_CHECK_MS 1000
+
 #ifdef _SEM_SEMUN_UNDEFINED
 union semun
 {
@@ -59,9 +64,17 @@ union semun
 #endif
 
 static char _dm_dir[PATH_MAX] = DEV_DIR DM_DIR;
+static char _sysfs_dir[PATH_MAX] = "/sys/";
 
 static int _verbose = 0;
 
+/* Incremented whenever this process may have changed any mapped device. */
+static unsigned _device_state_generation = 0;
+
+/* The devices behind the most recent generations, 0 if not known */
+#define DEVICE_CHANGES 64
+static uint64_t _device_changes[DEVICE_CHANGES];
+
 #ifdef HAVE_SELINUX_LABEL_H
 static struct selabel_handle *_selabel_handle = NULL;
 #endif
@@ -71,6 +84,23 @@ static int _semaphore_supported = -1;
 static int _udev_running = -1;
 static int _sync_with_udev = 1;
 static int _udev_checking = 1;
+static int _uevent_sync = 0;
+static int _uevent_monitor_failed = 0;
+static struct udev *_uevent_udev = NULL;
+static struct udev_monitor *_uevent_monitor = NULL;
+
+/*
+ * Cookies allocated by this process whose completion is detected
+ * by monitoring uevents. 'pending' counts the dm tasks with this
+ * cookie that generated a uevent not yet processed by udev.
+ */
+struct uevent_cookie {
+	struct dm_list list;
+	uint32_t cookie;
+	unsigned pending;
+};
+
+static DM_LIST_INIT(_uevent_cookies);
 #endif
 
 /*
@@ -464,6 +494,35 @@ int dm_set_selinux_context(const char *path, mode_t mode)
 	return 1;
 }
 
+void device_state_changed(uint64_t dev)
+{
+	_device_changes[++_device_state_generation % DEVICE_CHANGES] = dev;
+}
+
+/*
+ * Could dev have changed since generation?  Changes to other devices
+ * leave its name, uuid, tables and dependencies as they were.
+ */
+int device_state_changed_since(uint64_t dev, unsigned generation)
+{
+	unsigned g;
+
+	if (_device_state_generation - generation >= DEVICE_CHANGES)
+		return _device_state_generation != generation;
+
+	for (g = generation + 1; g != _device_state_generation + 1; g++)
+		if (!_device_changes[g % DEVICE_CHANGES] ||
+		    _device_changes[g % DEVICE_CHANGES] == dev)
+			return 1;
+
+	return 0;
+}
+
+unsigned device_state_generation(void)
+{
+	return _device_state_generation;
+}
+
 void selinux_release(void)
 {
 #ifdef HAVE_SELINUX_LABEL_H
@@ -907,6 +966,40 @@ const char *dm_dir(void)
 	return _dm_dir;
 }
 
+int dm_set_sysfs_dir(const char *sysfs_dir)
+{
+	size_t len;
+	const char *slash;
+
+	if (!sysfs_dir || !*sysfs_dir) {
+		_sysfs_dir[0] = '\0';
+		return 1;
+	}
+
+	if (*sysfs_dir != '/') {
+		log_debug("Invalid sysfs_dir value, %s: "
+			  "not an absolute name.", sysfs_dir);
+		return 0;
+	}
+
+	len = strlen(sysfs_dir);
+	slash = sysfs_dir[len-1] == '/' ? "" : "/";
+
+	if (snprintf(_sysfs_dir, sizeof _sysfs_dir, "%s%s", sysfs_dir, slash)
+	    >= sizeof _sysfs_dir) {
+		log_debug("Invalid sysfs_dir value, %s: name too long.",
+			  sysfs_dir);
+		return 0;
+	}
+
+	return 1;
+}
+
+const char *dm_sysfs_dir(void)
+{
+	return _sysfs_dir;
+}
+
 int dm_mknodes(const char *name)
 {
 	struct dm_task *dmt;
@@ -987,6 +1080,25 @@ int dm_udev_wait(uint32_t cookie)
 	return 1;
 }
 
+int dm_udev_wait_multiple(const uint32_t *cookies, unsigned num_cookies,
+			  int timeout_ms)
+{
+	return 1;
+}
+
+void dm_udev_set_uevent_sync(int uevent_sync)
+{
+}
+
+int dm_udev_get_uevent_sync(void)
+{
+	return 0;
+}
+
+void udev_sync_release(void)
+{
+}
+
 #else		/* UDEV_SYNC_SUPPORT */
 
 static int _check_semaphore_is_supported(void)
@@ -1250,6 +1362,266 @@ bad:
 	return 0;
 }
 
+void dm_udev_set_uevent_sync(int uevent_sync)
+{
+	_uevent_sync = uevent_sync;
+}
+
+int dm_udev_get_uevent_sync(void)
+{
+	return _uevent_sync && !_uevent_monitor_failed;
+}
+
+void udev_sync_release(void)
+{
+	struct uevent_cookie *uc, *tmp;
+
+	dm_list_iterate_items_safe(uc, tmp, &_uevent_cookies) {
+		dm_list_del(&uc->list);
+		dm_free(uc);
+	}
+
+	if (_uevent_monitor)
+		udev_monitor_unref(_uevent_monitor);
+	_uevent_monitor = NULL;
+
+	if (_uevent_udev)
+		udev_unref(_uevent_udev);
+	_uevent_udev = NULL;
+}
+
+static int _uevent_monitor_init(void)
+{
+	if (_uevent_monitor)
+		return 1;
+
+	if (_uevent_monitor_failed)
+		return 0;
+
+	/*
+	 * Listen to the "udev" group so we only see the events
+	 * after udev has finished running the rules for them.
+	 */
+	if (!(_uevent_udev = udev_new()) ||
+	    !(_uevent_monitor = udev_monitor_new_from_netlink(_uevent_udev,
+							      "udev")) ||
+	    udev_monitor_filter_add_match_subsystem_devtype(_uevent_monitor,
+							    "block", "disk") ||
+	    udev_monitor_enable_receiving(_uevent_monitor)) {
+		log_debug("Could not set up udev uevent monitor. "
+			  "Falling back to notification semaphores.");
+		udev_sync_release();
+		_uevent_monitor_failed = 1;
+		return 0;
+	}
+
+	/* Many devices may be activated within one transaction. */
+	(void) udev_monitor_set_receive_buffer_size(_uevent_monitor,
+						    UEVENT_RCVBUF_SIZE);
+
+	log_debug("Udev uevent monitor set up for cookie notification.");
+
+	return 1;
+}
+
+static struct uevent_cookie *_uevent_cookie_find(uint32_t cookie)
+{
+	struct uevent_cookie *uc;
+
+	cookie = (cookie & ~DM_UDEV_FLAGS_MASK) |
+		 (DM_COOKIE_MAGIC << DM_UDEV_FLAGS_SHIFT);
+
+	dm_list_iterate_items(uc, &_uevent_cookies)
+		if (uc->cookie == cookie)
+			return uc;
+
+	return NULL;
+}
+
+static struct uevent_cookie *_uevent_cookie_create(uint32_t *cookie)
+{
+	int fd;
+	uint16_t base_cookie;
+	uint32_t gen_cookie;
+	struct uevent_cookie *uc;
+
+	if (!_uevent_monitor_init())
+		return NULL;
+
+	if ((fd = open("/dev/urandom", O_RDONLY)) < 0) {
+		log_error("Failed to open /dev/urandom "
+			  "to create random cookie value");
+		return NULL;
+	}
+
+	/*
+	 * Generate random cookie value. Be sure it is unique and non-zero
+	 * and does not collide with any notification semaphore in use.
+	 */
+	do {
+		if (read(fd, &base_cookie, sizeof(base_cookie)) != sizeof(base_cookie)) {
+			log_error("Failed to initialize notification cookie");
+			if (close(fd))
+				stack;
+			return NULL;
+		}
+
+		gen_cookie = DM_COOKIE_MAGIC << 16 | base_cookie;
+
+		if (base_cookie &&
+		    (_uevent_cookie_find(gen_cookie) ||
+		     semget((key_t) gen_cookie, 1, 0) >= 0 || errno != ENOENT))
+			base_cookie = 0;
+	} while (!base_cookie);
+
+	if (close(fd))
+		stack;
+
+	if (!(uc = dm_zalloc(sizeof(*uc)))) {
+		log_error("Failed to allocate uevent cookie");
+		return NULL;
+	}
+
+	uc->cookie = gen_cookie;
+	dm_list_add(&_uevent_cookies, &uc->list);
+	*cookie = gen_cookie;
+
+	log_debug("Udev cookie 0x%" PRIx32 " (uevent) created", gen_cookie);
+
+	return uc;
+}
+
+/*
+ * Read one uevent from the monitor and account for it
+ * if it carries one of our cookies.
+ */
+static void _uevent_receive(void)
+{
+	struct udev_device *dev;
+	struct uevent_cookie *uc;
+	const char *str;
+	uint32_t value;
+	char *p;
+
+	if (!(dev = udev_monitor_receive_device(_uevent_monitor)))
+		return;
+
+	if (!(str = udev_device_get_property_value(dev, "DM_COOKIE")) ||
+	    !(value = (uint32_t) strtoul(str, &p, 0)) || *p ||
+	    !((value >> DM_UDEV_FLAGS_SHIFT) & DM_UDEV_NOTIFY_BY_UEVENT_FLAG))
+		goto out;
+
+	if ((uc = _uevent_cookie_find(value)) && uc->pending) {
+		uc->pending--;
+		log_debug("Udev cookie 0x%" PRIx32 " (uevent) decremented "
+			  "by %s event for %s", uc->cookie,
+			  udev_device_get_action(dev) ? : "unknown",
+			  udev_device_get_sysname(dev) ? : "unknown");
+	}
+out:
+	udev_device_unref(dev);
+}
+
+static int _udev_queue_is_empty(void)
+{
+	struct udev_queue *udev_queue;
+	int r;
+
+	if (!(udev_queue = udev_queue_new(_uevent_udev)))
+		return 0;
+
+	r = udev_queue_get_queue_is_empty(udev_queue);
+	udev_queue_unref(udev_queue);
+
+	return r;
+}
+
+static int _remaining_ms(const struct timeval *deadline)
+{
+	struct timeval now;
+	int64_t ms;
+
+	if (!deadline)
+		return -1;
+
+	if (gettimeofday(&now, NULL))
+		return 0;
+
+	ms = ((int64_t) deadline->tv_sec - now.tv_sec) * 1000 +
+	     ((int64_t) deadline->tv_usec - now.tv_usec) / 1000;
+
+	return ms > 0 ? (int) ms : 0;
+}
+
+static int _uevent_wait(const uint32_t *cookies, unsigned num_cookies,
+			const struct timeval *deadline)
+{
+	struct uevent_cookie *uc;
+	struct pollfd pfd;
+	unsigned i, pending;
+	int timeout, slice, r = 1;
+
+	if (!_uevent_monitor)
+		return 1;
+
+	pfd.fd = udev_monitor_get_fd(_uevent_monitor);
+	pfd.events = POLLIN;
+
+	for (;;) {
+		for (i = 0, pending = 0; i < num_cookies; i++)
+			if (cookies[i] && (uc = _uevent_cookie_find(cookies[i])))
+				pending += uc->pending;
+
+		if (!pending)
+			break;
+
+		if (!(timeout = _remaining_ms(deadline))) {
+			log_error("Timed out waiting for udev to process "
+				  "%u event(s).", pending);
+			r = 0;
+			break;
+		}
+
+		slice = (timeout < 0 || timeout > UEVENT_IDLE_CHECK_MS) ?
+			UEVENT_IDLE_CHECK_MS : timeout;
+
+		switch (poll(&pfd, 1, slice)) {
+		case -1:
+			if (errno == EINTR)
+				continue;
+			log_sys_error("poll", "udev uevent monitor");
+			r = 0;
+			goto out;
+		case 0:
+			/*
+			 * Nothing arrived for a while. If udev has no
+			 * queued events, ours must have been lost
+			 * (e.g. socket buffer overrun) so stop waiting.
+			 */
+			if (_udev_queue_is_empty()) {
+				log_debug("Udev queue is empty while %u "
+					  "uevent(s) still pending. Assuming "
+					  "they were processed.", pending);
+				goto out;
+			}
+			continue;
+		default:
+			_uevent_receive();
+		}
+	}
+
+out:
+	for (i = 0; i < num_cookies; i++)
+		if (cookies[i] && (uc = _uevent_cookie_find(cookies[i]))) {
+			log_debug("Udev cookie 0x%" PRIx32 " (uevent) "
+				  "released", uc->cookie);
+			dm_list_del(&uc->list);
+			dm_free(uc);
+		}
+
+	return r;
+}
+
 int dm_udev_create_cookie(uint32_t *cookie)
 {
 	int semid;
@@ -1264,6 +1636,7 @@ int dm_udev_create_cookie(uint32_t *cookie)
 
 int dm_task_set_cookie(struct dm_task *dmt, uint32_t *cookie, uint16_t flags)
 {
+	struct uevent_cookie *uc = NULL;
 	int semid;
 
 	if (dm_cookie_supported())
@@ -1274,6 +1647,25 @@ int dm_task_set_cookie(struct dm_task *dmt, uint32_t *cookie, uint16_t flags)
 		return 1;
 	}
 
+	if (*cookie)
+		uc = _uevent_cookie_find(*cookie);
+	else if (_uevent_sync)
+		uc = _uevent_cookie_create(cookie);
+
+	if (uc) {
+		uc->pending++;
+		dmt->event_nr |= (DM_UDEV_NOTIFY_BY_UEVENT_FLAG <<
+				  DM_UDEV_FLAGS_SHIFT) |
+				 (~DM_UDEV_FLAGS_MASK & *cookie);
+		dmt->cookie_set = 1;
+
+		log_debug("Udev cookie 0x%" PRIx32 " (uevent) assigned to "
+			  "dm_task type %d with flags 0x%" PRIx16,
+			  *cookie, dmt->type, flags);
+
+		return 1;
+	}
+
 	if (*cookie) {
 		if (!_get_cookie_sem(*cookie, &semid))
 			goto_bad;
@@ -1302,11 +1694,20 @@ bad:
 
 int dm_udev_complete(uint32_t cookie)
 {
+	struct uevent_cookie *uc;
 	int semid;
 
 	if (!cookie || !dm_udev_get_sync_support())
 		return 1;
 
+	if ((uc = _uevent_cookie_find(cookie))) {
+		if (uc->pending)
+			uc->pending--;
+		log_debug("Udev cookie 0x%" PRIx32 " (uevent) decremented",
+			  uc->cookie);
+		return 1;
+	}
+
 	if (!_get_cookie_sem(cookie, &semid))
 		return_0;
 
@@ -1320,13 +1721,11 @@ int dm_udev_complete(uint32_t cookie)
 	return 1;
 }
 
-int dm_udev_wait(uint32_t cookie)
+static int _udev_sem_wait(uint32_t cookie, const struct timeval *deadline)
 {
-	int semid;
+	int semid, timeout;
 	struct sembuf sb = {0, 0, 0};
-
-	if (!cookie || !dm_udev_get_sync_support())
-		return 1;
+	struct timespec ts;
 
 	if (!_get_cookie_sem(cookie, &semid))
 		return_0;
@@ -1344,11 +1743,23 @@ int dm_udev_wait(uint32_t cookie)
 		  cookie, semid);
 
 repeat_wait:
-	if (semop(semid, &sb, 1) < 0) {
+	if ((timeout = _remaining_ms(deadline)) >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000;
+	}
+
+	if (semtimedop(semid, &sb, 1, timeout >= 0 ? &ts : NULL) < 0) {
 		if (errno == EINTR)
 			goto repeat_wait;
 		else if (errno == EIDRM)
 			return 1;
+		else if (errno == EAGAIN) {
+			log_error("Timed out waiting for notification semaphore "
+				  "identified by cookie value %" PRIu32 " (0x%x)",
+				  cookie, cookie);
+			(void) _udev_notify_sem_destroy(cookie, semid);
+			return 0;
+		}
 
 		log_error("Could not set wait state for notification semaphore "
 			  "identified by cookie value %" PRIu32 " (0x%x): %s",
@@ -1360,4 +1771,50 @@ repeat_wait:
 	return _udev_notify_sem_destroy(cookie, semid);
 }
 
+int dm_udev_wait_multiple(const uint32_t *cookies, unsigned num_cookies,
+			  int timeout_ms)
+{
+	struct timeval deadline;
+	unsigned i;
+	int r = 1;
+
+	if (!dm_udev_get_sync_support())
+		return 1;
+
+	if (timeout_ms >= 0) {
+		if (gettimeofday(&deadline, NULL)) {
+			log_sys_error("gettimeofday", "");
+			return 0;
+		}
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_usec += (timeout_ms % 1000) * 1000;
+		if (deadline.tv_usec >= 1000000) {
+			deadline.tv_sec++;
+			deadline.tv_usec -= 1000000;
+		}
+	}
+
+	/*
+	 * Wait for the semaphore cookies first, one at a time, each
+	 * against the common deadline. Uevents are not read meanwhile:
+	 * they queue up on the monitor socket and _uevent_wait() takes
+	 * them from there afterwards, falling back to the udev queue
+	 * check if any were dropped.
+	 */
+	for (i = 0; i < num_cookies; i++)
+		if (cookies[i] && !_uevent_cookie_find(cookies[i]) &&
+		    !_udev_sem_wait(cookies[i], timeout_ms >= 0 ? &deadline : NULL))
+			r = 0;
+
+	if (!_uevent_wait(cookies, num_cookies, timeout_ms >= 0 ? &deadline : NULL))
+		r = 0;
+
+	return r;
+}
+
+int dm_udev_wait(uint32_t cookie)
+{
+	return dm_udev_wait_multiple(&cookie, 1, -1);
+}
+
 #endif		/* UDEV_SYNC_SUPPORT */
@@ -31,6 +31,10 @@ int get_dev_node_read_ahead(const char *dev_name, uint32_t *read_ahead);
 int set_dev_node_read_ahead(const char *dev_name, uint32_t read_ahead,
 			    uint32_t read_ahead_flags);
 void update_devs(void);
+void device_state_changed(uint64_t dev);
+int device_state_changed_since(uint64_t dev, unsigned generation);
+unsigned device_state_generation(void);
 void selinux_release(void);
+void udev_sync_release(void);
 
 #endif
@@ -19,6 +19,7 @@
 #include "dm-ioctl.h"
 
 #include <stdarg.h>
+#include <dirent.h>
 #include <sys/param.h>
 #include <sys/utsname.h>
 
@@ -191,6 +192,32 @@ struct dm_tree {
 	int skip_lockfs;		/* 1 skips lockfs (for non-snapshots) */
 	int no_flush;		/* 1 sets noflush (mirrors/multipath) */
 	uint32_t cookie;
+	struct dm_deps_cache *deps_cache;
+	int own_deps_cache;		/* 1 if deps_cache is freed with tree */
+	int sysfs_info;			/* 1 if node info may come from sysfs */
+};
+
+/* Cached result of DM_DEVICE_DEPS for one device */
+struct deps_cache_entry {
+	unsigned valid;
+	unsigned full;			/* 0 if info was read from sysfs */
+	unsigned generation;		/* device_state_generation() when read */
+	const char *name;
+	const char *uuid;
+	struct dm_info info;
+	struct dm_deps *deps;
+};
+
+struct dm_deps_cache {
+	struct dm_pool *mem;
+	struct dm_hash_table *devs;
+
+	/* Devices returned by the last DM_DEVICE_LIST */
+	int listed;
+	unsigned list_generation;
+	unsigned list_count;
+	uint64_t *list_devs;
+	const char **list_names;
 };
 
 struct dm_tree *dm_tree_create(void)
@@ -237,6 +264,8 @@ void dm_tree_free(struct dm_tree *dtree)
 	if (!dtree)
 		return;
 
+	if (dtree->own_deps_cache)
+		dm_deps_cache_destroy(dtree->deps_cache);
 	dm_hash_destroy(dtree->uuids);
 	dm_hash_destroy(dtree->devs);
 	dm_pool_destroy(dtree->mem);
@@ -497,6 +526,340 @@ failed:
 	return 0;
 }
 
+struct dm_deps_cache *dm_deps_cache_create(void)
+{
+	struct dm_pool *mem;
+	struct dm_deps_cache *cache;
+
+	if (!(mem = dm_pool_create("deps cache", 4096))) {
+		log_error("deps cache pool creation failed");
+		return NULL;
+	}
+
+	if (!(cache = dm_pool_zalloc(mem, sizeof(*cache)))) {
+		log_error("deps cache allocation failed");
+		dm_pool_destroy(mem);
+		return NULL;
+	}
+
+	cache->mem = mem;
+
+	if (!(cache->devs = dm_hash_create(128))) {
+		log_error("deps cache hash creation failed");
+		dm_pool_destroy(mem);
+		return NULL;
+	}
+
+	return cache;
+}
+
+void dm_deps_cache_destroy(struct dm_deps_cache *cache)
+{
+	if (!cache)
+		return;
+
+	dm_hash_destroy(cache->devs);
+	dm_pool_destroy(cache->mem);
+}
+
+void dm_tree_set_deps_cache(struct dm_tree *dtree, struct dm_deps_cache *cache)
+{
+	if (dtree->own_deps_cache)
+		dm_deps_cache_destroy(dtree->deps_cache);
+
+	dtree->deps_cache = cache;
+	dtree->own_deps_cache = 0;
+}
+
+/*
+ * Return cached dependencies of a device, reading them
+ * again if any device changed since they were cached.
+ */
+static struct deps_cache_entry *_deps_cache_lookup(struct dm_deps_cache *cache,
+						   uint32_t major, uint32_t minor,
+						   int sysfs_info)
+{
+	struct deps_cache_entry *entry;
+	struct dm_task *dmt = NULL;
+	struct dm_deps *deps;
+	uint64_t dev = MKDEV(major, minor);
+	unsigned generation = device_state_generation();
+	size_t size;
+
+	if ((entry = dm_hash_lookup_binary(cache->devs, (const char *) &dev,
+					   sizeof(dev)))) {
+		if (entry->valid && (entry->full || sysfs_info) &&
+		    !device_state_changed_since(dev, entry->generation))
+			return entry;
+	} else {
+		if (!(entry = dm_pool_zalloc(cache->mem, sizeof(*entry)))) {
+			log_error("deps cache entry allocation failed");
+			return NULL;
+		}
+
+		if (!dm_hash_insert_binary(cache->devs, (const char *) &dev,
+					   sizeof(dev), entry)) {
+			log_error("deps cache hash insertion failed");
+			return NULL;
+		}
+	}
+
+	entry->valid = 0;
+
+	if (!_deps(&dmt, cache->mem, major, minor, &entry->name, &entry->uuid,
+		   &entry->info, &deps))
+		return_NULL;
+
+	entry->deps = NULL;
+	if (deps) {
+		size = sizeof(*deps) + deps->count * sizeof(deps->device[0]);
+		if (!(entry->deps = dm_pool_alloc(cache->mem, size))) {
+			log_error("deps cache allocation failed");
+			dm_task_destroy(dmt);
+			return NULL;
+		}
+		memcpy(entry->deps, deps, size);
+	}
+
+	if (dmt)
+		dm_task_destroy(dmt);
+
+	entry->generation = generation;
+	entry->full = 1;
+	entry->valid = 1;
+
+	return entry;
+}
+
+static int _sysfs_read(const char *path, char *buf, size_t size)
+{
+	FILE *fp;
+	size_t len;
+	int r = 0;
+
+	if (!(fp = fopen(path, "r")))
+		return 0;
+
+	if (fgets(buf, (int) size, fp)) {
+		if ((len = strlen(buf)) && buf[len - 1] == '\n')
+			buf[len - 1] = '\0';
+		r = 1;
+	}
+
+	if (fclose(fp))
+		log_sys_debug("fclose", path);
+
+	return r;
+}
+
+/*
+ * Fill in the entry of a listed device from sysfs, with no ioctl.
+ * The kernel exports neither the open count nor the inactive table
+ * there, so such entries serve only dm_tree_add_all_devs().
+ */
+static int _sysfs_deps(struct dm_deps_cache *cache, const char *name,
+		       uint32_t major, uint32_t minor)
+{
+	struct deps_cache_entry *entry;
+	struct dm_deps *deps;
+	DIR *d;
+	struct dirent *dirent;
+	char dir[PATH_MAX], path[PATH_MAX], buf[DM_UUID_LEN + 1];
+	uint64_t dev = MKDEV(major, minor);
+	unsigned count = 0, dep_major, dep_minor;
+	int r = 0;
+
+	if (!*dm_sysfs_dir() ||
+	    dm_snprintf(dir, sizeof(dir), "%sdev/block/%" PRIu32 ":%" PRIu32,
+			dm_sysfs_dir(), major, minor) < 0)
+		return 0;
+
+	if ((entry = dm_hash_lookup_binary(cache->devs, (const char *) &dev,
+					   sizeof(dev)))) {
+		if (entry->valid &&
+		    !device_state_changed_since(dev, entry->generation))
+			return 1;
+	} else {
+		if (!(entry = dm_pool_zalloc(cache->mem, sizeof(*entry)))) {
+			log_error("deps cache entry allocation failed");
+			return 0;
+		}
+
+		if (!dm_hash_insert_binary(cache->devs, (const char *) &dev,
+					   sizeof(dev), entry)) {
+			log_error("deps cache hash insertion failed");
+			return 0;
+		}
+	}
+
+	entry->valid = 0;
+	memset(&entry->info, 0, sizeof(entry->info));
+	entry->info.exists = 1;
+	entry->info.live_table = 1;
+	entry->info.major = major;
+	entry->info.minor = minor;
+
+	/* dm/suspended came last, in 2.6.31 */
+	if (dm_snprintf(path, sizeof(path), "%s/dm/suspended", dir) < 0 ||
+	    !_sysfs_read(path, buf, sizeof(buf)))
+		return 0;
+	entry->info.suspended = (buf[0] == '1');
+
+	if (dm_snprintf(path, sizeof(path), "%s/ro", dir) < 0 ||
+	    !_sysfs_read(path, buf, sizeof(buf)))
+		return 0;
+	entry->info.read_only = (buf[0] == '1');
+
+	if (dm_snprintf(path, sizeof(path), "%s/dm/uuid", dir) < 0 ||
+	    !_sysfs_read(path, buf, sizeof(buf)))
+		buf[0] = '\0';
+
+	if (!(entry->name = dm_pool_strdup(cache->mem, name)) ||
+	    !(entry->uuid = dm_pool_strdup(cache->mem, buf))) {
+		log_error("deps cache name allocation failed");
+		return 0;
+	}
+
+	if (dm_snprintf(path, sizeof(path), "%s/slaves", dir) < 0 ||
+	    !(d = opendir(path)))
+		return 0;
+
+	while ((dirent = readdir(d)))
+		if (dirent->d_name[0] != '.')
+			count++;
+
+	if (!(deps = dm_pool_zalloc(cache->mem, sizeof(*deps) +
+				    count * sizeof(deps->device[0])))) {
+		log_error("deps cache allocation failed");
+		goto out;
+	}
+
+	rewinddir(d);
+	while ((dirent = readdir(d)) && deps->count < count) {
+		if (dirent->d_name[0] == '.')
+			continue;
+		if (dm_snprintf(path, sizeof(path), "%s/slaves/%s/dev", dir,
+				dirent->d_name) < 0 ||
+		    !_sysfs_read(path, buf, sizeof(buf)) ||
+		    sscanf(buf, "%u:%u", &dep_major, &dep_minor) != 2)
+			goto out;
+		deps->device[deps->count++] = MKDEV(dep_major, dep_minor);
+	}
+
+	entry->deps = deps;
+	entry->generation = device_state_generation();
+	entry->full = 0;
+	entry->valid = 1;
+	r = 1;
+out:
+	if (closedir(d))
+		log_sys_debug("closedir", path);
+
+	return r;
+}
+
+/*
+ * Read the list of all mapped devices unless it is still current
+ * and make sure the dependencies of all of them are cached.
+ */
+static int _deps_cache_list(struct dm_deps_cache *cache)
+{
+	struct dm_task *dmt;
+	struct dm_names *names;
+	unsigned next = 0, count = 0, i;
+	int r = 0;
+
+	if (cache->listed &&
+	    cache->list_generation == device_state_generation())
+		goto read_deps;
+
+	if (!(dmt = dm_task_create(DM_DEVICE_LIST)))
+		return_0;
+
+	if (!dm_task_run(dmt)) {
+		log_error("Failed to get list of mapped devices.");
+		goto out;
+	}
+
+	if (!(names = dm_task_get_names(dmt)))
+		goto_out;
+
+	if (names->dev)
+		do {
+			names = (struct dm_names *)((char *) names + next);
+			count++;
+		} while ((next = names->next));
+
+	if (count &&
+	    (!(cache->list_devs = dm_pool_alloc(cache->mem,
+					sizeof(*cache->list_devs) * count)) ||
+	     !(cache->list_names = dm_pool_alloc(cache->mem,
+					sizeof(*cache->list_names) * count)))) {
+		log_error("deps cache device list allocation failed");
+		goto out;
+	}
+
+	names = dm_task_get_names(dmt);
+	for (i = 0, next = 0; i < count; i++) {
+		names = (struct dm_names *)((char *) names + next);
+		cache->list_devs[i] = names->dev;
+		if (!(cache->list_names[i] = dm_pool_strdup(cache->mem,
+							    names->name))) {
+			log_error("deps cache device list allocation failed");
+			goto out;
+		}
+		next = names->next;
+	}
+
+	cache->list_count = count;
+	cache->list_generation = device_state_generation();
+	cache->listed = 1;
+	r = 1;
+out:
+	dm_task_destroy(dmt);
+
+	if (!r)
+		return 0;
+
+read_deps:
+	/* Sysfs spares an ioctl per device: fall back only where it fails */
+	for (i = 0; i < cache->list_count; i++)
+		if (!_sysfs_deps(cache, cache->list_names[i],
+				 MAJOR(cache->list_devs[i]),
+				 MINOR(cache->list_devs[i])) &&
+		    !_deps_cache_lookup(cache, MAJOR(cache->list_devs[i]),
+					MINOR(cache->list_devs[i]), 0))
+			return_0;
+
+	return 1;
+}
+
+static int _cached_deps(struct dm_tree *dtree, uint32_t major, uint32_t minor,
+			const char **name, const char **uuid,
+			struct dm_info *info, struct dm_deps **deps)
+{
+	struct deps_cache_entry *entry;
+
+	if (!(entry = _deps_cache_lookup(dtree->deps_cache, major, minor,
+					 dtree->sysfs_info)))
+		return_0;
+
+	if (!(*name = dm_pool_strdup(dtree->mem, entry->name))) {
+		log_error("name pool_strdup failed");
+		return 0;
+	}
+
+	if (!(*uuid = dm_pool_strdup(dtree->mem, entry->uuid))) {
+		log_error("uuid pool_strdup failed");
+		return 0;
+	}
+
+	*info = entry->info;
+	*deps = entry->deps;
+
+	return 1;
+}
+
 static struct dm_tree_node *_add_dev(struct dm_tree *dtree,
 				     struct dm_tree_node *parent,
 				     uint32_t major, uint32_t minor,
@@ -513,7 +876,12 @@ static struct dm_tree_node *_add_dev(struct dm_tree *dtree,
 
 	/* Already in tree? */
 	if (!(node = _find_dm_tree_node(dtree, major, minor))) {
-		if (!_deps(&dmt, dtree->mem, major, minor, &name, &uuid, &info, &deps))
+		if (dtree->deps_cache) {
+			if (!_cached_deps(dtree, major, minor, &name, &uuid,
+					  &info, &deps))
+				return_NULL;
+		} else if (!_deps(&dmt, dtree->mem, major, minor, &name, &uuid,
+				  &info, &deps))
 			return_NULL;
 
 		if (!(node = _create_dm_tree_node(dtree, name, uuid, &info,
@@ -712,6 +1080,34 @@ int dm_tree_add_dev_with_udev_flags(struct dm_tree *dtree, uint32_t major,
 	return _add_dev(dtree, &dtree->root, major, minor, udev_flags) ? 1 : 0;
 }
 
+int dm_tree_add_all_devs(struct dm_tree *dtree)
+{
+	struct dm_deps_cache *cache;
+	unsigned i;
+
+	if (!dtree->deps_cache) {
+		if (!(dtree->deps_cache = dm_deps_cache_create()))
+			return_0;
+		dtree->own_deps_cache = 1;
+	}
+
+	cache = dtree->deps_cache;
+
+	if (!_deps_cache_list(cache))
+		return_0;
+
+	dtree->sysfs_info = 1;
+	for (i = 0; i < cache->list_count; i++)
+		if (!_add_dev(dtree, &dtree->root, MAJOR(cache->list_devs[i]),
+			      MINOR(cache->list_devs[i]), 0)) {
+			dtree->sysfs_info = 0;
+			return_0;
+		}
+	dtree->sysfs_info = 0;
+
+	return 1;
+}
+
 const char *dm_tree_node_get_name(const struct dm_tree_node *node)
 {
 	return node->info.exists ? node->name : "";
@@ -82,7 +82,15 @@ struct row {
 	struct dm_list list;
 	struct dm_report *rh;
 	struct dm_list fields;			  /* Fields in display order */
-	struct dm_report_field *(*sort_fields)[]; /* Fields in sort order */
+
+	/*
+	 * All sort keys of the row encoded so that comparing two rows
+	 * is a memcmp(). sort_key_prefix holds the first 8 bytes of the
+	 * key in native byte order to decide most comparisons quickly.
+	 */
+	const unsigned char *sort_key;
+	size_t sort_key_len;
+	uint64_t sort_key_prefix;
 };
 
 static const struct dm_report_object_type *_find_type(struct dm_report *rh,
@@ -599,9 +607,6 @@ struct dm_report *dm_report_init(uint32_t *report_types,
 			rh->flags &= ~DM_REPORT_OUTPUT_ALIGNED;
 	}
 
-	if (output_flags & DM_REPORT_OUTPUT_BUFFERED)
-		rh->flags |= RH_SORT_REQUIRED;
-
 	dm_list_init(&rh->field_props);
 	dm_list_init(&rh->rows);
 
@@ -634,6 +639,9 @@ struct dm_report *dm_report_init(uint32_t *report_types,
 		return NULL;
 	}
 
+	if ((rh->flags & DM_REPORT_OUTPUT_BUFFERED) && rh->keys_count)
+		rh->flags |= RH_SORT_REQUIRED;
+
 	/* Return updated types value for further compatility check by caller */
 	if (report_types)
 		*report_types = rh->report_types;
@@ -686,11 +694,70 @@ static void * _report_get_field_data(struct dm_report *rh,
 	return ret + rh->fields[fp->field_num].offset;
 }
 
+/*
+ * Encode the sort keys of a row into one byte string ordered by memcmp().
+ * Numbers are stored big-endian, strings with a terminating NUL.
+ * Descending keys are stored with all bits inverted.
+ */
+static int _row_encode_sort_key(struct dm_report *rh, struct row *row,
+				struct dm_report_field **sort_fields)
+{
+	const struct dm_report_field *sf;
+	unsigned char *key, *k, *kstart;
+	size_t len = 0, slen;
+	uint64_t num;
+	uint32_t cnt;
+	int i;
+
+	for (cnt = 0; cnt < rh->keys_count; cnt++) {
+		sf = sort_fields[cnt];
+		if (sf->props->flags & DM_REPORT_FIELD_TYPE_NUMBER)
+			len += sizeof(uint64_t);
+		else	/* DM_REPORT_FIELD_TYPE_STRING */
+			len += strlen((const char *) sf->sort_value) + 1;
+	}
+
+	if (!(key = dm_pool_alloc(rh->mem, len ? len : 1))) {
+		log_error("dm_report_object: sort key allocation failed");
+		return 0;
+	}
+
+	for (cnt = 0, k = key; cnt < rh->keys_count; cnt++) {
+		sf = sort_fields[cnt];
+		kstart = k;
+		if (sf->props->flags & DM_REPORT_FIELD_TYPE_NUMBER) {
+			num = *(const uint64_t *) sf->sort_value;
+			for (i = sizeof(num) - 1; i >= 0; i--)
+				*k++ = (unsigned char) (num >> (i * 8));
+		} else {
+			slen = strlen((const char *) sf->sort_value) + 1;
+			memcpy(k, sf->sort_value, slen);
+			k += slen;
+		}
+
+		if (sf->props->flags & FLD_DESCENDING)
+			while (kstart < k) {
+				*kstart = ~*kstart;
+				kstart++;
+			}
+	}
+
+	row->sort_key = key;
+	row->sort_key_len = len;
+	row->sort_key_prefix = 0;
+	for (i = 0; i < (int) sizeof(row->sort_key_prefix); i++)
+		row->sort_key_prefix = (row->sort_key_prefix << 8) |
+				       ((size_t) i < len ? key[i] : 0);
+
+	return 1;
+}
+
 int dm_report_object(struct dm_report *rh, void *object)
 {
 	struct field_properties *fp;
 	struct row *row;
 	struct dm_report_field *field;
+	struct dm_report_field **sort_fields = NULL;
 	void *data = NULL;
 
 	if (!(row = dm_pool_zalloc(rh->mem, sizeof(*row)))) {
@@ -701,9 +768,7 @@ int dm_report_object(struct dm_report *rh, void *object)
 	row->rh = rh;
 
 	if ((rh->flags & RH_SORT_REQUIRED) &&
-	    !(row->sort_fields =
-		dm_pool_zalloc(rh->mem, sizeof(struct dm_report_field *) *
-			       rh->keys_count))) {
+	    !(sort_fields = dm_malloc(sizeof(*sort_fields) * rh->keys_count))) {
 		log_error("dm_report_object: "
 			  "row sort value structure allocation failed");
 		return 0;
@@ -723,7 +788,7 @@ int dm_report_object(struct dm_report *rh, void *object)
 
 		data = _report_get_field_data(rh, fp, object);
 		if (!data)
-			return 0;
+			goto_bad;
 
 		if (!rh->fields[fp->field_num].report_fn(rh, rh->mem,
 							 field, data,
@@ -731,7 +796,7 @@ int dm_report_object(struct dm_report *rh, void *object)
 			log_error("dm_report_object: "
 				  "report function failed for field %s",
 				  rh->fields[fp->field_num].id);
-			return 0;
+			goto bad;
 		}
 
 		if ((strlen(field->report_string) > field->props->width))
@@ -739,15 +804,31 @@ int dm_report_object(struct dm_report *rh, void *object)
 
 		if ((rh->flags & RH_SORT_REQUIRED) &&
 		    (field->props->flags & FLD_SORT_KEY)) {
-			(*row->sort_fields)[field->props->sort_posn] = field;
+			sort_fields[field->props->sort_posn] = field;
 		}
 		dm_list_add(&row->fields, &field->list);
 	}
 
-	if (!(rh->flags & DM_REPORT_OUTPUT_BUFFERED))
+	if (sort_fields) {
+		if (!_row_encode_sort_key(rh, row, sort_fields))
+			goto_bad;
+		dm_free(sort_fields);
+	}
+
+	/*
+	 * Without sorting or alignment there is nothing to wait
+	 * for so the row can go out straight away.
+	 */
+	if (!(rh->flags & DM_REPORT_OUTPUT_BUFFERED) ||
+	    !(rh->flags & (RH_SORT_REQUIRED | DM_REPORT_OUTPUT_ALIGNED |
+			   DM_REPORT_OUTPUT_COLUMNS_AS_ROWS)))
 		return dm_report_output(rh);
 
 	return 1;
+
+bad:
+	dm_free(sort_fields);
+	return 0;
 }
 
 /*
@@ -832,69 +913,74 @@ static int _report_headings(struct dm_report *rh)
 /*
  * Sort rows of data
  */
-static int _row_compare(const void *a, const void *b)
+static int _row_compare(const struct row *rowa, const struct row *rowb)
 {
-	const struct row *rowa = *(const struct row * const *) a;
-	const struct row *rowb = *(const struct row * const *) b;
-	const struct dm_report_field *sfa, *sfb;
-	uint32_t cnt;
+	int cmp;
 
-	for (cnt = 0; cnt < rowa->rh->keys_count; cnt++) {
-		sfa = (*rowa->sort_fields)[cnt];
-		sfb = (*rowb->sort_fields)[cnt];
-		if (sfa->props->flags & DM_REPORT_FIELD_TYPE_NUMBER) {
-			const uint64_t numa =
-			    *(const uint64_t *) sfa->sort_value;
-			const uint64_t numb =
-			    *(const uint64_t *) sfb->sort_value;
+	if (rowa->sort_key_prefix != rowb->sort_key_prefix)
+		return (rowa->sort_key_prefix > rowb->sort_key_prefix) ? 1 : -1;
 
-			if (numa == numb)
-				continue;
+	if ((cmp = memcmp(rowa->sort_key, rowb->sort_key,
+			  (rowa->sort_key_len < rowb->sort_key_len) ?
+			  rowa->sort_key_len : rowb->sort_key_len)))
+		return cmp;
 
-			if (sfa->props->flags & FLD_ASCENDING) {
-				return (numa > numb) ? 1 : -1;
-			} else {	/* FLD_DESCENDING */
-				return (numa < numb) ? 1 : -1;
-			}
-		} else {	/* DM_REPORT_FIELD_TYPE_STRING */
-			const char *stra = (const char *) sfa->sort_value;
-			const char *strb = (const char *) sfb->sort_value;
-			int cmp = strcmp(stra, strb);
+	if (rowa->sort_key_len == rowb->sort_key_len)
+		return 0;		/* Identical */
 
-			if (!cmp)
-				continue;
+	return (rowa->sort_key_len > rowb->sort_key_len) ? 1 : -1;
+}
 
-			if (sfa->props->flags & FLD_ASCENDING) {
-				return (cmp > 0) ? 1 : -1;
-			} else {	/* FLD_DESCENDING */
-				return (cmp < 0) ? 1 : -1;
-			}
-		}
-	}
+/*
+ * Stable merge sort of rows[0..count) using tmp as scratch space.
+ */
+static void _merge_sort_rows(struct row **rows, struct row **tmp, uint32_t count)
+{
+	uint32_t half = count / 2, i = 0, j = half, k = 0;
 
-	return 0;		/* Identical */
+	if (count < 2)
+		return;
+
+	_merge_sort_rows(rows, tmp, half);
+	_merge_sort_rows(rows + half, tmp, count - half);
+
+	/* Already in order? */
+	if (_row_compare(rows[half - 1], rows[half]) <= 0)
+		return;
+
+	while (i < half && j < count)
+		tmp[k++] = (_row_compare(rows[j], rows[i]) < 0) ?
+			   rows[j++] : rows[i++];
+
+	while (i < half)
+		tmp[k++] = rows[i++];
+
+	/* Anything left over from the second half is already in place. */
+	memcpy(rows, tmp, k * sizeof(*rows));
 }
 
 static int _sort_rows(struct dm_report *rh)
 {
-	struct row *(*rows)[];
+	struct row **rows, **tmp;
 	uint32_t count = 0;
 	struct row *row;
 
-	if (!(rows = dm_pool_alloc(rh->mem, sizeof(**rows) *
-				dm_list_size(&rh->rows)))) {
+	if (!(rows = dm_malloc(sizeof(*rows) * dm_list_size(&rh->rows) * 2))) {
 		log_error("dm_report: sort array allocation failed");
 		return 0;
 	}
+	tmp = rows + dm_list_size(&rh->rows);
 
 	dm_list_iterate_items(row, &rh->rows)
-		(*rows)[count++] = row;
+		rows[count++] = row;
 
-	qsort(rows, count, sizeof(**rows), _row_compare);
+	_merge_sort_rows(rows, tmp, count);
 
 	dm_list_init(&rh->rows);
 	while (count--)
-		dm_list_add_h(&rh->rows, &(*rows)[count]->list);
+		dm_list_add_h(&rh->rows, &rows[count]->list);
+
+	dm_free(rows);
 
 	return 1;
 }
@@ -1115,8 +1201,8 @@ int dm_report_output(struct dm_report *rh)
 	if (dm_list_empty(&rh->rows))
 		return 1;
 
-	if ((rh->flags & RH_SORT_REQUIRED))
-		_sort_rows(rh);
+	if ((rh->flags & RH_SORT_REQUIRED) && !_sort_rows(rh))
+		return_0;
 
 	if ((rh->flags & DM_REPORT_OUTPUT_COLUMNS_AS_ROWS))
 		return _output_as_rows(rh);
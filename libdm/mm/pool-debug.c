@@ -270,3 +270,25 @@ void dm_pool_abandon_object(struct dm_pool *p)
 	p->begun = 0;
 	p->object = NULL;
 }
+
+void dm_pool_stats(const struct dm_pool *p, struct dm_pool_stats *stats)
+{
+	stats->name = p->name;
+	stats->bytes = p->stats.bytes;
+	stats->peak_bytes = p->stats.maxbytes;
+	stats->chunks = p->stats.blocks_allocated;
+}
+
+/* Every block is malloced separately so there is nothing to cache. */
+void dm_pools_set_chunk_cache(size_t max_bytes)
+{
+}
+
+void dm_pools_release_chunk_cache(void)
+{
+}
+
+static size_t _chunk_cache_size(void)
+{
+	return 0;
+}
@@ -28,14 +28,34 @@ struct dm_pool {
 	struct dm_list list;
 	struct chunk *chunk, *spare_chunk;	/* spare_chunk is a one entry free
 						   list to stop 'bobbling' */
+	const char *name;
 	size_t chunk_size;
 	size_t object_len;
 	unsigned object_alignment;
+
+	size_t bytes, peak_bytes;	/* Memory held in chunks */
+	unsigned chunks;
 };
 
+/*
+ * Optional cache of released chunks shared by all pools.  Chunks
+ * are kept on free lists indexed by power-of-two size class so a
+ * short-lived pool can reuse memory released by an earlier one
+ * instead of going back to malloc.  Disabled by default because,
+ * like _dm_pools, it is not thread-safe.
+ */
+#define CHUNK_CLASS_MIN_SHIFT 10	/* 1KB, the smallest chunk_size */
+#define CHUNK_CLASS_COUNT 11		/* Up to 1MB */
+
+static struct chunk *_chunk_cache[CHUNK_CLASS_COUNT];
+static size_t _chunk_cache_max;
+static size_t _chunk_cache_bytes;
+
 static void _align_chunk(struct chunk *c, unsigned alignment);
 static struct chunk *_new_chunk(struct dm_pool *p, size_t s);
-static void _free_chunk(struct chunk *c);
+static void _free_chunk(struct dm_pool *p, struct chunk *c);
+static int _object_owns_chunk(struct dm_pool *p, struct chunk *c);
+static struct chunk *_grow_chunk(struct dm_pool *p, struct chunk *c, size_t s);
 
 /* by default things come out aligned for doubles */
 #define DEFAULT_ALIGNMENT __alignof__ (double)
@@ -56,6 +76,7 @@ struct dm_pool *dm_pool_create(const char *name, size_t chunk_hint)
 	while (new_size < p->chunk_size)
 		new_size <<= 1;
 	p->chunk_size = new_size;
+	p->name = name;
 	dm_list_add(&_dm_pools, &p->list);
 	return p;
 }
@@ -63,11 +84,11 @@ struct dm_pool *dm_pool_create(const char *name, size_t chunk_hint)
 void dm_pool_destroy(struct dm_pool *p)
 {
 	struct chunk *c, *pr;
-	_free_chunk(p->spare_chunk);
+	_free_chunk(p, p->spare_chunk);
 	c = p->chunk;
 	while (c) {
 		pr = c->prev;
-		_free_chunk(c);
+		_free_chunk(p, c);
 		c = pr;
 	}
 
@@ -138,7 +159,7 @@ void dm_pool_free(struct dm_pool *p, void *ptr)
 		}
 
 		if (p->spare_chunk)
-			_free_chunk(p->spare_chunk);
+			_free_chunk(p, p->spare_chunk);
 
 		c->begin = (char *) (c + 1);
 #ifdef VALGRIND_POOL
@@ -191,6 +212,18 @@ int dm_pool_grow_object(struct dm_pool *p, const void *extra, size_t delta)
 		delta = strlen(extra);
 
 	if (c->end - (c->begin + p->object_len) < delta) {
+		/*
+		 * A large object that already starts its chunk is
+		 * extended in place so repeated growth doesn't keep
+		 * copying it: realloc may be able to avoid the copy.
+		 */
+		if ((p->object_len + delta > (p->chunk_size / 2)) &&
+		    _object_owns_chunk(p, c)) {
+			if (!(c = _grow_chunk(p, c, (p->object_len + delta) * 2)))
+				return 0;
+			goto out;
+		}
+
 		/* move into a new chunk */
 		if (p->object_len + delta > (p->chunk_size / 2))
 			nc = _new_chunk(p, (p->object_len + delta) * 2);
@@ -215,6 +248,7 @@ int dm_pool_grow_object(struct dm_pool *p, const void *extra, size_t delta)
 		c = p->chunk;
 	}
 
+out:
 #ifdef VALGRIND_POOL
 	VALGRIND_MAKE_MEM_UNDEFINED(p->chunk->begin + p->object_len, delta);
 #endif
@@ -240,11 +274,118 @@ void dm_pool_abandon_object(struct dm_pool *p)
 	p->object_alignment = DEFAULT_ALIGNMENT;
 }
 
+void dm_pool_stats(const struct dm_pool *p, struct dm_pool_stats *stats)
+{
+	stats->name = p->name;
+	stats->bytes = p->bytes;
+	stats->peak_bytes = p->peak_bytes;
+	stats->chunks = p->chunks;
+}
+
+void dm_pools_set_chunk_cache(size_t max_bytes)
+{
+	if (max_bytes < _chunk_cache_bytes)
+		dm_pools_release_chunk_cache();
+
+	_chunk_cache_max = max_bytes;
+}
+
+void dm_pools_release_chunk_cache(void)
+{
+	struct chunk *c;
+	unsigned i;
+
+	for (i = 0; i < CHUNK_CLASS_COUNT; i++) {
+		while ((c = _chunk_cache[i])) {
+			_chunk_cache[i] = c->prev;
+			dm_free(c);
+		}
+	}
+
+	_chunk_cache_bytes = 0;
+}
+
+static size_t _chunk_cache_size(void)
+{
+	return _chunk_cache_bytes;
+}
+
 static void _align_chunk(struct chunk *c, unsigned alignment)
 {
 	c->begin += alignment - ((unsigned long) c->begin & (alignment - 1));
 }
 
+/*
+ * Returns the free list index for a chunk of exactly size s,
+ * or -1 if it is not a cacheable size.
+ */
+static int _chunk_class(size_t s)
+{
+	int i;
+
+	for (i = 0; i < CHUNK_CLASS_COUNT; i++)
+		if (s == ((size_t) 1 << (CHUNK_CLASS_MIN_SHIFT + i)))
+			return i;
+
+	return -1;
+}
+
+/*
+ * While the cache is enabled, round allocations up to their size
+ * class so the chunks can be recycled by any pool.
+ */
+static size_t _chunk_class_size(size_t s)
+{
+	size_t class_size = (size_t) 1 << CHUNK_CLASS_MIN_SHIFT;
+	int i;
+
+	if (!_chunk_cache_max)
+		return s;
+
+	for (i = 0; i < CHUNK_CLASS_COUNT; i++, class_size <<= 1)
+		if (class_size >= s)
+			return class_size;
+
+	return s;
+}
+
+static struct chunk *_chunk_cache_get(size_t s)
+{
+	struct chunk *c;
+	int i;
+
+	if ((i = _chunk_class(s)) < 0 || !(c = _chunk_cache[i]))
+		return NULL;
+
+	_chunk_cache[i] = c->prev;
+	_chunk_cache_bytes -= s;
+
+	return c;
+}
+
+static int _chunk_cache_put(struct chunk *c)
+{
+	size_t s = c->end - (char *) c;
+	int i;
+
+	if ((i = _chunk_class(s)) < 0 ||
+	    (_chunk_cache_bytes + s > _chunk_cache_max))
+		return 0;
+
+	c->prev = _chunk_cache[i];
+	_chunk_cache[i] = c;
+	_chunk_cache_bytes += s;
+
+	return 1;
+}
+
+static void _account_chunk(struct dm_pool *p, size_t old_size, size_t new_size)
+{
+	p->bytes += new_size - old_size;
+	if (p->bytes > p->peak_bytes)
+		p->peak_bytes = p->bytes;
+}
+
 static struct chunk *_new_chunk(struct dm_pool *p, size_t s)
 {
 	struct chunk *c;
@@ -255,7 +396,9 @@ static struct chunk *_new_chunk(struct dm_pool *p, size_t s)
 		c = p->spare_chunk;
 		p->spare_chunk = 0;
 	} else {
-		if (!(c = dm_malloc(s))) {
+		s = _chunk_class_size(s);
+
+		if (!(c = _chunk_cache_get(s)) && !(c = dm_malloc(s))) {
 			log_error("Out of memory.  Requested %" PRIsize_t
 				  " bytes.", s);
 			return NULL;
@@ -267,6 +410,8 @@ static struct chunk *_new_chunk(struct dm_pool *p, size_t s)
 #ifdef VALGRIND_POOL
 		VALGRIND_MAKE_MEM_NOACCESS(c->begin, c->end - c->begin);
 #endif
+		_account_chunk(p, 0, s);
+		p->chunks++;
 	}
 
 	c->prev = p->chunk;
@@ -274,13 +419,61 @@ static struct chunk *_new_chunk(struct dm_pool *p, size_t s)
 	return c;
 }
 
-static void _free_chunk(struct chunk *c)
+/*
+ * Does the object being built start at the beginning of chunk c?
+ */
+static int _object_owns_chunk(struct dm_pool *p, struct chunk *c)
+{
+	char *start = (char *) (c + 1);
+
+	start += p->object_alignment -
+		 ((unsigned long) start & (p->object_alignment - 1));
+
+	return c->begin == start;
+}
+
+/*
+ * Resize the head chunk c, which holds nothing but the object,
+ * so that s bytes of object fit in it.
+ */
+static struct chunk *_grow_chunk(struct dm_pool *p, struct chunk *c, size_t s)
+{
+	size_t old_size = c->end - (char *) c;
+	size_t offset = c->begin - (char *) c;
+	struct chunk *nc;
+
+	s = _chunk_class_size(s + offset);
+
+	if (!(nc = dm_realloc(c, s))) {
+		log_error("Out of memory.  Requested %" PRIsize_t
+			  " bytes.", s);
+		return NULL;
+	}
+
+	nc->begin = (char *) nc + offset;
+	nc->end = (char *) nc + s;
+
+#ifdef VALGRIND_POOL
+	VALGRIND_MAKE_MEM_NOACCESS(nc->begin + p->object_len,
+				   nc->end - nc->begin - p->object_len);
+#endif
+	_account_chunk(p, old_size, s);
+	p->chunk = nc;
+
+	return nc;
+}
+
+static void _free_chunk(struct dm_pool *p, struct chunk *c)
 {
 	if (c) {
+		p->bytes -= c->end - (char *) c;
+		p->chunks--;
+
 #ifdef VALGRIND_POOL
 		VALGRIND_MAKE_MEM_UNDEFINED(c, c->end - (char *) c);
 #endif
 
-		dm_free(c);
+		if (!_chunk_cache_put(c))
+			dm_free(c);
 	}
 }
@@ -18,6 +18,7 @@
 /* FIXME: thread unsafe */
 static DM_LIST_INIT(_dm_pools);
 void dm_pools_check_leaks(void);
+void dm_pools_release_chunk_cache(void);
 
 #ifdef DEBUG_POOL
 #include "pool-debug.c"
@@ -75,3 +76,23 @@ void dm_pools_check_leaks(void)
 #endif
 	}
 }
+
+void dm_pools_dump_stats(void)
+{
+	struct dm_pool *p;
+	struct dm_pool_stats stats;
+	size_t bytes = 0, peak_bytes = 0;
+
+	dm_list_iterate_items(p, &_dm_pools) {
+		dm_pool_stats(p, &stats);
+		log_debug("Mempool %s: %" PRIsize_t " bytes in %u chunks "
+			  "(peak %" PRIsize_t " bytes)", stats.name,
+			  stats.bytes, stats.chunks, stats.peak_bytes);
+		bytes += stats.bytes;
+		peak_bytes += stats.peak_bytes;
+	}
+
+	log_debug("Mempools: %" PRIsize_t " bytes held, sum of peaks %"
+		  PRIsize_t " bytes, %" PRIsize_t " bytes in chunk cache",
+		  bytes, peak_bytes, _chunk_cache_size());
+}
@@ -0,0 +1,50 @@
+#!/bin/bash
+# Copyright (C) 2011 Red Hat, Inc. All rights reserved.
+#
+# This copyrighted material is made available to anyone wishing to use,
+# modify, copy, or redistribute it subject to the terms and conditions
+# of the GNU General Public License v.2.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software Foundation,
+# Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+# A restarted clvmd takes locks for the active LVs of clustered VGs.
+# A device-mapper device whose LV is not in the VG metadata must not
+# stop the others in its VG from being locked.
+
+. ./test-utils.sh
+
+test -n "$LOCAL_CLVMD" || exit 200
+
+prepare_pvs 1
+vgcreate -c y $vg $devs
+
+lvcreate -l1 -n lv1 $vg
+lvcreate -l1 -n lv2 $vg
+
+vgid=$(vgs --noheadings -o vg_uuid $vg | tr -d ' -')
+lvid1=$vgid$(lvs --noheadings -o lv_uuid $vg/lv1 | tr -d ' -')
+lvid2=$vgid$(lvs --noheadings -o lv_uuid $vg/lv2 | tr -d ' -')
+
+# Sorts before the real LVs, so it is the first LV seen in the VG
+ghost=${vgid}00000000000000000000000000000000
+echo 0 1 zero | dmsetup create -u LVM-$ghost $vg-ghost
+
+kill "$LOCAL_CLVMD"
+while kill -0 "$LOCAL_CLVMD" 2>/dev/null; do sleep .1; done
+
+clvmd -Isinglenode -d 1 2> clvmd.log &
+LOCAL_CLVMD="$!"
+
+# The initial locks are taken before requests are served
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	vgs $vg && break
+	sleep .1
+done
+
+grep "getting initial lock for $lvid1" clvmd.log
+grep "getting initial lock for $lvid2" clvmd.log
+not grep "getting initial lock for $ghost" clvmd.log
+
+dmsetup remove $vg-ghost
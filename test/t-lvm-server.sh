@@ -0,0 +1,126 @@
+#!/bin/bash
+# Copyright (C) 2011 Red Hat, Inc. All rights reserved.
+#
+# This copyrighted material is made available to anyone wishing to use,
+# modify, copy, or redistribute it subject to the terms and conditions
+# of the GNU General Public License v.2.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software Foundation,
+# Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+# "lvm server" runs the commands sent over its socket and replies with
+# their exit status and captured output.
+
+. ./test-utils.sh
+
+which perl || exit 200
+
+# Sends each argument, split at spaces, as one request on a single
+# connection.  "@big" is a request longer than the server accepts.
+# Prints "<n> <status> <stdout length> <stderr length>" for the n-th
+# reply, with the output in n.out and n.err, or "<n> closed".
+cat > client.pl <<'EOF'
+use IO::Socket::UNIX;
+
+$SIG{PIPE} = 'IGNORE';
+$SIG{ALRM} = sub { die "no reply\n" };
+
+my $sock = IO::Socket::UNIX->new(Peer => shift @ARGV)
+	or die "connect: $!\n";
+my $n = 0;
+
+for my $r (@ARGV) {
+	my $req = $r eq '@big' ? 'x' x 16385
+			       : join('', map { "$_\0" } split(/ /, $r));
+	my ($hdr, $out, $err);
+
+	$n++;
+	alarm 30;
+	print $sock pack('N', length($req)), $req;
+	if (read($sock, $hdr, 12) != 12) {
+		print "$n closed\n";
+		exit 0;
+	}
+	my ($status, $out_len, $err_len) = unpack('NNN', $hdr);
+	read($sock, $out, $out_len) == $out_len or die "short stdout\n";
+	read($sock, $err, $err_len) == $err_len or die "short stderr\n";
+	alarm 0;
+
+	open(F, '>', "$n.out") and print F $out and close(F);
+	open(F, '>', "$n.err") and print F $err and close(F);
+	print "$n $status $out_len $err_len\n";
+}
+EOF
+
+request() {
+	rm -f [0-9]*.out [0-9]*.err
+	perl client.pl lvm.sock "$@" | tee reply
+}
+
+# Checks the reply to request n: check_reply n status [stdout [stderr]]
+# where status is a regex and stdout and stderr compare their lengths
+# with 0, e.g. -gt.
+FAILED="[1-9][0-9]*"
+check_reply() {
+	grep -E "^$1 $2 " reply
+	test "$(grep "^$1 " reply | cut -d' ' -f3)" -eq "$(wc -c < $1.out)"
+	test "$(grep "^$1 " reply | cut -d' ' -f4)" -eq "$(wc -c < $1.err)"
+	test -z "$3" || test "$(wc -c < $1.out)" "$3" 0
+	test -z "$4" || test "$(wc -c < $1.err)" "$4" 0
+}
+
+aux prepare_devs 2
+pvcreate $dev1
+vgcreate -c n $vg $dev1
+lvcreate -l1 -n $lv1 $vg
+
+lvm server lvm.sock &
+SERVER=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	test -S lvm.sock && break
+	sleep .1
+done
+test -S lvm.sock
+
+# Output and status of a command, and of one that fails
+request "vgs --noheadings -o vg_name $vg" "lvs $vg/nonexistent"
+check_reply 1 0 -gt
+grep $vg 1.out
+check_reply 2 "$FAILED"
+grep nonexistent 2.err
+
+# An unknown command fails without ending the connection
+request "nosuchcommand" "vgs $vg"
+check_reply 1 "$FAILED"
+grep "No such command" 1.err
+check_reply 2 0 -gt
+
+# A new PV is seen after a refresh
+pvcreate $dev2
+request "refresh" "pvs --noheadings -o pv_name $dev2"
+check_reply 1 0
+check_reply 2 0 -gt
+grep "$dev2" 2.out
+
+# A prompt is answered 'n' instead of waiting for a terminal
+request "lvremove $vg/$lv1" "lvremove -f $vg/$lv1"
+check_reply 1 "$FAILED"
+check_reply 2 0
+not lvs $vg/$lv1
+
+# quit closes the connection, and the server takes the next one
+request "quit" "vgs $vg"
+grep "^1 closed" reply
+request "vgs $vg"
+check_reply 1 0 -gt
+
+# So does a request that is too long
+request "@big" "vgs $vg"
+grep "^1 closed" reply
+request "vgs $vg"
+check_reply 1 0 -gt
+
+kill $SERVER
+wait $SERVER || true
+test ! -e lvm.sock
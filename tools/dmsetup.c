@@ -854,6 +854,7 @@ static int _udevflags(int args, char **argv, void *data __attribute__((unused)))
 					      "LOW_PRIORITY",
 					      "DISABLE_LIBRARY_FALLBACK",
 					      "PRIMARY_SOURCE",
+					      "NOTIFY_BY_UEVENT",
 					       0};
 
 	if (!(cookie = _get_cookie_value(argv[1])))
@@ -1931,6 +1932,30 @@ static void _out_prefix(unsigned depth)
 	}
 }
 
+/*
+ * The whole tree is read from sysfs where possible, which
+ * has no open count, so fetch it only when it is shown.
+ */
+static int32_t _tree_node_open_count(const struct dm_info *info)
+{
+	struct dm_task *dmt;
+	struct dm_info current;
+	int32_t open_count = info->open_count;
+
+	if (!(dmt = dm_task_create(DM_DEVICE_INFO)))
+		return open_count;
+
+	if (dm_task_set_major(dmt, info->major) &&
+	    dm_task_set_minor(dmt, info->minor) &&
+	    dm_task_run(dmt) && dm_task_get_info(dmt, &current) &&
+	    current.exists)
+		open_count = current.open_count;
+
+	dm_task_destroy(dmt);
+
+	return open_count;
+}
+
 /*
  * Display tree
  */
@@ -1958,7 +1983,7 @@ static void _display_tree_attributes(struct dm_tree_node *node)
 
 	if (_tree_switches[TR_OPENCOUNT]) {
 		_out_string(attr++ ? ", " : " [");
-		(void) _out_int((unsigned) info->open_count);
+		(void) _out_int((unsigned) _tree_node_open_count(info));
 	}
 
 	if (_tree_switches[TR_UUID]) {
@@ -2063,30 +2088,26 @@ static void _display_tree_walk_children(struct dm_tree_node *node,
 	}
 }
 
-static int _add_dep(int argc __attribute__((unused)), char **argv __attribute__((unused)), void *data)
-{
-	struct dm_names *names = (struct dm_names *) data;
-
-	if (!dm_tree_add_dev(_dtree, (unsigned) MAJOR(names->dev), (unsigned) MINOR(names->dev)))
-		return 0;
-
-	return 1;
-}
-
 /*
  * Create and walk dependency tree
  */
 static int _build_whole_deptree(void)
 {
+	struct dm_tree_node *root;
+
 	if (_dtree)
 		return 1;
 
 	if (!(_dtree = dm_tree_create()))
 		return 0;
 
-	if (!_process_all(0, NULL, 0, _add_dep))
+	if (!dm_tree_add_all_devs(_dtree))
 		return 0;
 
+	if ((root = dm_tree_find_node(_dtree, 0, 0)) &&
+	    !dm_tree_node_num_children(root, 0))
+		printf("No devices found\n");
+
 	return 1;
 }
 
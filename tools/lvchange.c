@@ -118,6 +118,11 @@ static int lvchange_background_polling(struct cmd_context *cmd,
 	return 1;
 }
 
+/*
+ * One LV at a time: unlike vgchange, this is not batched through
+ * lock_lvs() because the other changes made to the LV in
+ * lvchange_single() need its activation done first.
+ */
 static int lvchange_availability(struct cmd_context *cmd,
 				 struct logical_volume *lv)
 {
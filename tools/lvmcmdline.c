@@ -28,6 +28,9 @@
 #include <sys/stat.h>
 #include <time.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
 
 #ifdef HAVE_GETOPTLONG
 #  include <getopt.h>
@@ -42,6 +45,12 @@ extern char *optarg;
 #  define OPTIND_INIT 1
 #endif
 
+/* Released pool chunks kept for reuse by later pools */
+#define POOL_CHUNK_CACHE_SIZE (4 * 1024 * 1024)
+
+/* Largest request "lvm server" accepts */
+#define SERVER_MAX_REQUEST (MAX_ARGS * CMD_LEN)
+
 #ifdef UDEV_SYNC_SUPPORT
 #  define LIBUDEV_I_KNOW_THE_API_IS_SUBJECT_TO_CHANGE
 #  include <libudev.h>
@@ -1276,11 +1285,11 @@ static void _close_stray_fds(const char *command)
 				  parent_cmdline);
 }
 
-struct cmd_context *init_lvm(void)
+struct cmd_context *init_lvm(unsigned is_long_lived)
 {
 	struct cmd_context *cmd;
 
-	if (!(cmd = create_toolcontext(0, NULL)))
+	if (!(cmd = create_toolcontext(is_long_lived, NULL)))
 		return_NULL;
 
 	_cmdline.arg_props = &_arg_props[0];
@@ -1368,6 +1377,304 @@ static int _run_script(struct cmd_context *cmd, int argc, char **argv)
 	return ret;
 }
 
+/*
+ * "lvm server <socket>" keeps one command context, with its config,
+ * filters, device cache and lvmcache, for any number of commands sent
+ * over a Unix socket, so that management agents running many short
+ * commands do not pay to set all of that up every time.
+ *
+ * A request is a 32-bit length in network byte order followed by that
+ * many bytes of arguments, the command name first, each terminated by
+ * a NUL.  The reply is three 32-bit integers in network byte order,
+ * the exit status the command would have had and the lengths of its
+ * standard output and standard error, followed by the output and then
+ * the error text.  The request "refresh" rereads the config and
+ * rescans all devices.  Connections are served one at a time, each
+ * until the client closes it or sends "quit" or "exit".  SIGTERM stops
+ * the server once the current command is done.
+ *
+ * Commands read standard input from /dev/null, so any prompt is
+ * answered 'n': commands that would ask for confirmation need --force.
+ */
+struct server_files {
+	int in, out, err;		/* A command's stdin, stdout and stderr */
+	int saved_in, saved_out, saved_err;	/* Our own */
+};
+
+static volatile sig_atomic_t _server_quit = 0;
+
+static void _server_sigterm(int sig __attribute__((unused)))
+{
+	_server_quit = 1;
+}
+
+static int _read_all(int fd, void *buf, size_t len)
+{
+	ssize_t r;
+
+	while (len) {
+		if ((r = read(fd, buf, len)) <= 0) {
+			if (r < 0 && errno == EINTR && !_server_quit)
+				continue;
+			return 0;
+		}
+		buf = (char *) buf + r;
+		len -= r;
+	}
+
+	return 1;
+}
+
+static int _write_all(int fd, const void *buf, size_t len)
+{
+	ssize_t r;
+
+	while (len) {
+		if ((r = write(fd, buf, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		buf = (const char *) buf + r;
+		len -= r;
+	}
+
+	return 1;
+}
+
+/* Send the output captured in fd from the start, which is len bytes */
+static int _send_output(int sock, int fd, off_t len)
+{
+	char buf[4096];
+	off_t offset = 0;
+	ssize_t r;
+
+	while (offset < len) {
+		if ((r = pread(fd, buf, sizeof(buf), offset)) <= 0) {
+			if (r < 0 && errno == EINTR)
+				continue;
+			return 0;
+		}
+		if (!_write_all(sock, buf, r))
+			return 0;
+		offset += r;
+	}
+
+	return 1;
+}
+
+/* Like a long-lived clvmd asked to refresh */
+static int _server_refresh(struct cmd_context *cmd)
+{
+	if (!refresh_toolcontext(cmd))
+		return ECMD_FAILED;
+
+	init_full_scan_done(0);
+	if (!lvmcache_label_scan(cmd, 2))
+		return ECMD_FAILED;
+
+	return ECMD_PROCESSED;
+}
+
+/* Run one request with its output captured and return its exit status */
+static int _server_command(struct cmd_context *cmd, int argc, char **argv,
+			   struct server_files *files)
+{
+	int ret;
+
+	fflush(stdout);
+	fflush(stderr);
+	if (ftruncate(files->out, 0) || ftruncate(files->err, 0) ||
+	    lseek(files->out, 0, SEEK_SET) || lseek(files->err, 0, SEEK_SET) ||
+	    dup2(files->in, STDIN_FILENO) < 0 ||
+	    dup2(files->out, STDOUT_FILENO) < 0 ||
+	    dup2(files->err, STDERR_FILENO) < 0) {
+		log_sys_error("dup2", "server output");
+		ret = ECMD_FAILED;
+		goto out;
+	}
+
+	/*
+	 * Keep devices and labels from earlier commands, but let this one
+	 * do a full scan should it need one rather than trust an old scan.
+	 */
+	init_full_scan_done(0);
+
+	if (!strcmp(argv[0], "refresh"))
+		ret = _server_refresh(cmd);
+	else if ((ret = lvm_run_command(cmd, argc, argv)) == ENO_SUCH_CMD)
+		log_error("No such command '%s'.  Try 'help'.", argv[0]);
+
+	if ((ret != ECMD_PROCESSED) && !error_message_produced()) {
+		log_debug(INTERNAL_ERROR "Failed command did not use log_error");
+		log_error("Command failed with status code %d.", ret);
+	}
+
+out:
+	fflush(stdout);
+	fflush(stderr);
+	dup2(files->saved_in, STDIN_FILENO);
+	dup2(files->saved_out, STDOUT_FILENO);
+	dup2(files->saved_err, STDERR_FILENO);
+	clearerr(stdin);
+
+	return lvm_return_code(ret);
+}
+
+/* Serve one client until it goes away or asks us to */
+static void _server_connection(struct cmd_context *cmd, int sock,
+			       struct server_files *files)
+{
+	char buf[SERVER_MAX_REQUEST], *args[MAX_ARGS], *arg;
+	uint32_t len, reply[3];
+	off_t out_len, err_len;
+	int argc;
+
+	while (!_server_quit && _read_all(sock, &len, sizeof(len))) {
+		len = ntohl(len);
+		if (!len || len > sizeof(buf) || !_read_all(sock, buf, len) ||
+		    buf[len - 1]) {
+			log_error("Invalid request on lvm server connection.");
+			return;
+		}
+
+		for (argc = 0, arg = buf; arg < buf + len; arg += strlen(arg) + 1) {
+			if (argc == MAX_ARGS) {
+				log_error("Too many arguments.  Limit is %d.",
+					  MAX_ARGS);
+				return;
+			}
+			args[argc++] = arg;
+		}
+
+		if (!strcmp(args[0], "quit") || !strcmp(args[0], "exit"))
+			return;
+
+		cmd->argv = args;
+		reply[0] = htonl(_server_command(cmd, argc, args, files));
+
+		if ((out_len = lseek(files->out, 0, SEEK_END)) < 0 ||
+		    (err_len = lseek(files->err, 0, SEEK_END)) < 0) {
+			log_sys_error("lseek", "server output");
+			return;
+		}
+		reply[1] = htonl(out_len);
+		reply[2] = htonl(err_len);
+
+		if (!_write_all(sock, reply, sizeof(reply)) ||
+		    !_send_output(sock, files->out, out_len) ||
+		    !_send_output(sock, files->err, err_len))
+			return;
+	}
+}
+
+static int _run_server(struct cmd_context *cmd, const char *path)
+{
+	struct sockaddr_un sockaddr;
+	struct sigaction act;
+	struct server_files files;
+	FILE *out = NULL, *err = NULL;
+	mode_t old_umask;
+	int sock, client, r, bound = 0, ret = ECMD_FAILED;
+
+	files.in = files.saved_in = files.saved_out = files.saved_err = -1;
+
+	memset(&sockaddr, 0, sizeof(sockaddr));
+	sockaddr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sockaddr.sun_path)) {
+		log_error("Socket path %s is too long.", path);
+		return EINVALID_CMD_LINE;
+	}
+	strcpy(sockaddr.sun_path, path);
+
+	if ((sock = socket(PF_UNIX, SOCK_STREAM, 0)) < 0) {
+		log_sys_error("socket", path);
+		return ECMD_FAILED;
+	}
+
+	if (unlink(path) && errno != ENOENT) {
+		log_sys_error("unlink", path);
+		goto out;
+	}
+
+	/* Only our own user may connect, from the moment it exists */
+	old_umask = umask(0077);
+	r = bind(sock, (struct sockaddr *) &sockaddr, sizeof(sockaddr));
+	umask(old_umask);
+	if (r) {
+		log_sys_error("bind", path);
+		goto out;
+	}
+	bound = 1;
+
+	if (chmod(path, S_IRUSR | S_IWUSR) || listen(sock, 16)) {
+		log_sys_error("listen", path);
+		goto out;
+	}
+
+	if (!(out = tmpfile()) || !(err = tmpfile())) {
+		log_sys_error("tmpfile", "server output");
+		goto out;
+	}
+
+	if ((files.in = open("/dev/null", O_RDONLY)) < 0) {
+		log_sys_error("open", "/dev/null");
+		goto out;
+	}
+
+	files.out = fileno(out);
+	files.err = fileno(err);
+	if ((files.saved_in = dup(STDIN_FILENO)) < 0 ||
+	    (files.saved_out = dup(STDOUT_FILENO)) < 0 ||
+	    (files.saved_err = dup(STDERR_FILENO)) < 0) {
+		log_sys_error("dup", "server output");
+		goto out;
+	}
+
+	/* No SA_RESTART, so SIGTERM interrupts a wait for clients */
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = _server_sigterm;
+	sigaction(SIGTERM, &act, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	log_verbose("Serving commands on %s", path);
+
+	while (!_server_quit) {
+		if ((client = accept(sock, NULL, NULL)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			log_sys_error("accept", path);
+			goto out;
+		}
+
+		_server_connection(cmd, client, &files);
+
+		if (close(client))
+			stack;
+	}
+
+	ret = ECMD_PROCESSED;
+out:
+	if (files.in >= 0 && close(files.in))
+		stack;
+	if (files.saved_in >= 0 && close(files.saved_in))
+		stack;
+	if (files.saved_out >= 0 && close(files.saved_out))
+		stack;
+	if (files.saved_err >= 0 && close(files.saved_err))
+		stack;
+	if (out && fclose(out))
+		stack;
+	if (err && fclose(err))
+		stack;
+	if (bound && unlink(path))
+		log_sys_error("unlink", path);
+	if (close(sock))
+		stack;
+
+	return ret;
+}
+
 /*
  * Determine whether we should fall back and exec the equivalent LVM1 tool
  */
@@ -1413,7 +1720,7 @@ static void _nonroot_warning(void)
 int lvm2_main(int argc, char **argv)
 {
 	const char *base;
-	int ret, alias = 0;
+	int ret, alias = 0, server = 0;
 	struct cmd_context *cmd;
 
 	base = last_path_component(argv[0]);
@@ -1435,9 +1742,16 @@ int lvm2_main(int argc, char **argv)
 	if (!alias && argc > 1 && !strcmp(argv[1], "version"))
 		return lvm_return_code(version(NULL, argc, argv));
 
-	if (!(cmd = init_lvm()))
+	/* A server's caches outlive its commands */
+	if (!alias && argc == 3 && !strcmp(argv[1], "server"))
+		server = 1;
+
+	if (!(cmd = init_lvm(server)))
 		return -1;
 
+	/* Single-threaded, so pools may share released chunks */
+	dm_pools_set_chunk_cache(POOL_CHUNK_CACHE_SIZE);
+
 	cmd->argv = argv;
 	lvm_register_commands();
 
@@ -1457,6 +1771,12 @@ int lvm2_main(int argc, char **argv)
 		ret = ECMD_FAILED;
 		goto out;
 	}
+	if (server) {
+		_nonroot_warning();
+		ret = _run_server(cmd, argv[2]);
+		goto out;
+	}
+
 #ifdef READLINE_SUPPORT
 	if (!alias && argc == 1) {
 		_nonroot_warning();
@@ -236,6 +236,7 @@ static int _report(struct cmd_context *cmd, int argc, char **argv,
 	int aligned, buffered, headings, field_prefixes, quoted;
 	int columns_as_rows;
 	unsigned args_are_pvs;
+	uint32_t lv_state;
 
 	aligned = find_config_tree_int(cmd, "report/aligned",
 				  DEFAULT_REP_ALIGNED);
@@ -362,6 +363,9 @@ static int _report(struct cmd_context *cmd, int argc, char **argv,
 	if (arg_count(cmd, rows_ARG))
 		columns_as_rows = 1;
 
+	/* While report_type still gives the field prefix report_init() uses */
+	lv_state = report_lv_state(report_type, options, keys);
+
 	if (!(report_handle = report_init(cmd, options, keys, &report_type,
 					  separator, aligned, buffered,
 					  headings, field_prefixes, quoted,
@@ -396,6 +400,10 @@ static int _report(struct cmd_context *cmd, int argc, char **argv,
 	else if (report_type & LVS)
 		report_type = LVS;
 
+	/* One sweep of each VG's devices instead of several ioctls per LV */
+	if (lv_state)
+		activation_cache_device_state((lv_state & REPORT_LV_STATUS) ? 1 : 0);
+
 	switch (report_type) {
 	case LVS:
 		r = process_each_lv(cmd, argc, argv, 0, report_handle,
@@ -431,6 +439,9 @@ static int _report(struct cmd_context *cmd, int argc, char **argv,
 		break;
 	}
 
+	if (lv_state)
+		activation_drop_device_state();
+
 	dm_report_output(report_handle);
 
 	dm_report_free(report_handle);
@@ -182,6 +182,60 @@ int process_each_lv_in_vg(struct cmd_context *cmd,
 	return ret_max;
 }
 
+/*
+ * Commands that only read VGs can have the metadata of the next few VGs
+ * in the list read in the background while they process the current
+ * one.  VGs are still locked and read one at a time in list order.
+ */
+struct vg_prefetch {
+	struct dm_list *vgs;	/* struct str_list of VG names or vgids */
+	int by_vgid;
+	unsigned depth;
+	struct dm_list *next;	/* First VG not yet queued */
+	unsigned queued;	/* Index of next */
+};
+
+static void _prefetch_init(struct cmd_context *cmd, struct vg_prefetch *vp,
+			   struct dm_list *vgs, int by_vgid, uint32_t flags)
+{
+	vp->vgs = vgs;
+	vp->by_vgid = by_vgid;
+	vp->depth = (flags & READ_FOR_UPDATE) ? 0 : cmd->metadata_prefetch;
+	vp->next = dm_list_first(vgs);
+	vp->queued = 0;
+
+	if (vp->depth && !dev_prefetch_start(vp->depth))
+		vp->depth = 0;
+}
+
+/*
+ * Queue the VGs up to depth places after the one at index current,
+ * dropping what the previous VGs used.
+ */
+static void _prefetch_vgs(struct vg_prefetch *vp, unsigned current)
+{
+	struct str_list *sl;
+
+	if (vp->depth)
+		dev_prefetch_release();
+
+	while (vp->depth && vp->next && vp->queued <= current + vp->depth) {
+		if (vp->queued > current) {
+			sl = dm_list_item(vp->next, struct str_list);
+			lvmcache_prefetch_vg(vp->by_vgid ? NULL : sl->str,
+					     vp->by_vgid ? sl->str : NULL);
+		}
+		vp->next = dm_list_next(vp->vgs, vp->next);
+		vp->queued++;
+	}
+}
+
+static void _prefetch_end(struct vg_prefetch *vp)
+{
+	if (vp->depth)
+		dev_prefetch_drop();
+}
+
 int process_each_lv(struct cmd_context *cmd, int argc, char **argv,
 		    uint32_t flags, void *handle,
 		    process_single_lv_fn_t process_single_lv)
@@ -199,6 +253,8 @@ int process_each_lv(struct cmd_context *cmd, int argc, char **argv,
 	struct dm_list tags, lvnames;
 	struct dm_list arg_lvnames;	/* Cmdline vgname or vgname/lvname */
 	struct dm_list arg_vgnames;
+	struct vg_prefetch vp;
+	unsigned vg_count = 0;
 	char *vglv;
 	size_t vglv_sz;
 
@@ -301,13 +357,17 @@ int process_each_lv(struct cmd_context *cmd, int argc, char **argv,
 		}
 	}
 
+	_prefetch_init(cmd, &vp, vgnames, 0, flags);
+
 	dm_list_iterate_items(strl, vgnames) {
 		vgname = strl->str;
+		_prefetch_vgs(&vp, vg_count++);
 		dm_list_init(&cmd_vgs);
 		if (!(cvl_vg = cmd_vg_add(cmd->mem, &cmd_vgs,
 					  vgname, NULL, flags))) {
 			stack;
-			return ECMD_FAILED;
+			ret_max = ECMD_FAILED;
+			goto out;
 		}
 
 		if (!cmd_vg_read(cmd, &cmd_vgs)) {
@@ -338,7 +398,8 @@ int process_each_lv(struct cmd_context *cmd, int argc, char **argv,
 								 lv_name + 1))) {
 					log_error("strlist allocation failed");
 					free_cmd_vgs(&cmd_vgs);
-					return ECMD_FAILED;
+					ret_max = ECMD_FAILED;
+					goto out;
 				}
 			}
 		}
@@ -366,10 +427,15 @@ int process_each_lv(struct cmd_context *cmd, int argc, char **argv,
 
 		free_cmd_vgs(&cmd_vgs);
 		/* FIXME: logic for breaking command is not consistent */
-		if (sigint_caught())
-			return ECMD_FAILED;
+		if (sigint_caught()) {
+			ret_max = ECMD_FAILED;
+			goto out;
+		}
 	}
 
+out:
+	_prefetch_end(&vp);
+
 	return ret_max;
 }
 
@@ -516,6 +582,8 @@ int process_each_vg(struct cmd_context *cmd, int argc, char **argv,
 	struct str_list *sl;
 	struct dm_list *vgnames, *vgids;
 	struct dm_list arg_vgnames, tags;
+	struct vg_prefetch vp;
+	unsigned vg_count = 0;
 
 	const char *vg_name, *vgid;
 
@@ -568,8 +636,10 @@ int process_each_vg(struct cmd_context *cmd, int argc, char **argv,
 			log_error("No volume groups found");
 			return ret_max;
 		}
+		_prefetch_init(cmd, &vp, vgids, 1, flags);
 		dm_list_iterate_items(sl, vgids) {
 			vgid = sl->str;
+			_prefetch_vgs(&vp, vg_count++);
 			if (!(vgid) || !(vg_name = vgname_from_vgid(cmd->mem, vgid)))
 				continue;
 			ret_max = _process_one_vg(cmd, vg_name, vgid, &tags,
@@ -577,11 +647,13 @@ int process_each_vg(struct cmd_context *cmd, int argc, char **argv,
 						  flags, handle,
 					  	  ret_max, process_single_vg);
 			if (sigint_caught())
-				return ret_max;
+				break;
 		}
 	} else {
+		_prefetch_init(cmd, &vp, vgnames, 0, flags);
 		dm_list_iterate_items(sl, vgnames) {
 			vg_name = sl->str;
+			_prefetch_vgs(&vp, vg_count++);
 			if (is_orphan_vg(vg_name))
 				continue;	/* FIXME Unnecessary? */
 			ret_max = _process_one_vg(cmd, vg_name, NULL, &tags,
@@ -589,10 +661,12 @@ int process_each_vg(struct cmd_context *cmd, int argc, char **argv,
 						  flags, handle,
 					  	  ret_max, process_single_vg);
 			if (sigint_caught())
-				return ret_max;
+				break;
 		}
 	}
 
+	_prefetch_end(&vp);
+
 	return ret_max;
 }
 
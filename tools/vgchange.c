@@ -27,6 +27,9 @@ static int _monitor_lvs_in_vg(struct cmd_context *cmd,
 	int lv_active;
 	int r = 1;
 
+	if (!monitor_batch_begin(cmd))
+		return_0;
+
 	dm_list_iterate_items(lvl, &vg->lvs) {
 		lv = lvl->lv;
 
@@ -48,6 +51,9 @@ static int _monitor_lvs_in_vg(struct cmd_context *cmd,
 			(*count)++;
 	}
 
+	if (!monitor_batch_end(cmd))
+		r = 0;
+
 	return r;
 }
 
@@ -86,10 +92,30 @@ static int _poll_lvs_in_vg(struct cmd_context *cmd,
 static int _activate_lvs_in_vg(struct cmd_context *cmd,
 			       struct volume_group *vg, int activate)
 {
-	struct lv_list *lvl;
+	struct lv_list *lvl, *lvl_new;
 	struct logical_volume *lv;
+	struct dm_list lvs, excl_lvs;
+	uint32_t lock_flags;
 	int count = 0, expected_count = 0;
 
+	dm_list_init(&lvs);
+	dm_list_init(&excl_lvs);
+
+	switch (activate) {
+	case CHANGE_AN:
+		lock_flags = LCK_LV_DEACTIVATE;
+		break;
+	case CHANGE_ALN:
+		lock_flags = LCK_LV_DEACTIVATE | LCK_LOCAL;
+		break;
+	case CHANGE_ALY:
+		lock_flags = LCK_LV_ACTIVATE | LCK_HOLD | LCK_LOCAL;
+		break;
+	default:
+		lock_flags = LCK_LV_ACTIVATE | LCK_HOLD;
+	}
+
+	/* Collect the LVs first so clvmd can be asked about them in batches */
 	dm_list_iterate_items(lvl, &vg->lvs) {
 		lv = lvl->lv;
 
@@ -117,30 +143,34 @@ static int _activate_lvs_in_vg(struct cmd_context *cmd,
 
 		expected_count++;
 
-		if (activate == CHANGE_AN) {
-			if (!deactivate_lv(cmd, lv)) {
-				stack;
-				continue;
-			}
-		} else if (activate == CHANGE_ALN) {
-			if (!deactivate_lv_local(cmd, lv)) {
-				stack;
-				continue;
-			}
-		} else if (lv_is_origin(lv) || (activate == CHANGE_AE)) {
-			if (!activate_lv_excl(cmd, lv)) {
-				stack;
-				continue;
-			}
-		} else if (activate == CHANGE_ALY) {
-			if (!activate_lv_local(cmd, lv)) {
-				stack;
-				continue;
-			}
-		} else if (!activate_lv(cmd, lv)) {
-			stack;
-			continue;
+		if (!(lvl_new = dm_pool_alloc(cmd->mem, sizeof(*lvl_new)))) {
+			log_error("Failed to allocate LV list entry.");
+			return 0;
 		}
+		lvl_new->lv = lv;
+
+		if ((activate != CHANGE_AN) && (activate != CHANGE_ALN) &&
+		    (lv_is_origin(lv) || (activate == CHANGE_AE)))
+			dm_list_add(&excl_lvs, &lvl_new->list);
+		else
+			dm_list_add(&lvs, &lvl_new->list);
+	}
+
+	/*
+	 * LVs that fail are dropped from the lists.  The LVs activated
+	 * exclusively (origins and -aey) go in a second batch, after all
+	 * the others, rather than in VG metadata order.
+	 */
+	if (!lock_lvs(cmd, &lvs, lock_flags))
+		stack;
+
+	if (!lock_lvs(cmd, &excl_lvs, LCK_LV_EXCLUSIVE | LCK_HOLD))
+		stack;
+
+	dm_list_splice(&lvs, &excl_lvs);
+
+	dm_list_iterate_items(lvl, &lvs) {
+		lv = lvl->lv;
 
 		if (background_polling() &&
 		    activate != CHANGE_AN && activate != CHANGE_ALN &&
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2011 Red Hat, Inc. All rights reserved.
+ *
+ * This file is part of LVM2.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v.2.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "libdevmapper.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+/*
+ * Times the word based bitset operations against the bit by bit
+ * loops they replace, on a bitmap the size of a large mirror log.
+ *
+ *     $ ./bitset_bench [nr_bits]
+ */
+
+#define ROUNDS 20
+
+static double _now(void)
+{
+        struct timeval tv;
+
+        gettimeofday(&tv, NULL);
+
+        return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void _report(const char *what, double bitwise, double wordwise)
+{
+        printf("%-16s bit loop %8.3fms  word ops %8.3fms  (x%.1f)\n", what,
+               bitwise * 1000 / ROUNDS, wordwise * 1000 / ROUNDS,
+               wordwise > 0 ? bitwise / wordwise : 0);
+}
+
+int main(int argc, char **argv)
+{
+        unsigned nr_bits = (argc > 1) ? strtoul(argv[1], NULL, 0) : 1 << 24;
+        dm_bitset_t bs = dm_bitset_create(NULL, nr_bits);
+        unsigned i, r, count = 0;
+        double t, bitwise, wordwise;
+
+        assert(bs);
+
+        /* set range */
+        t = _now();
+        for (r = 0; r < ROUNDS; r++)
+                for (i = 0; i < nr_bits; i++)
+                        dm_bit_set(bs, i);
+        bitwise = _now() - t;
+
+        t = _now();
+        for (r = 0; r < ROUNDS; r++)
+                dm_bit_set_range(bs, 0, nr_bits);
+        wordwise = _now() - t;
+        _report("set range", bitwise, wordwise);
+
+        /* popcount */
+        t = _now();
+        for (r = 0; r < ROUNDS; r++)
+                for (count = 0, i = 0; i < nr_bits; i++)
+                        if (dm_bit(bs, i))
+                                count++;
+        bitwise = _now() - t;
+
+        t = _now();
+        for (r = 0; r < ROUNDS; r++)
+                assert(dm_bit_count(bs) == count);
+        wordwise = _now() - t;
+        _report("count", bitwise, wordwise);
+
+        /* next zero: a resync search across a nearly in-sync log */
+        dm_bit_clear(bs, nr_bits - 1);
+        t = _now();
+        for (r = 0; r < ROUNDS; r++) {
+                for (i = 0; dm_bit(bs, i); i++)
+                        ;
+                assert(i == nr_bits - 1);
+        }
+        bitwise = _now() - t;
+
+        t = _now();
+        for (r = 0; r < ROUNDS; r++)
+                assert(dm_bit_get_first_clear(bs) == (int) nr_bits - 1);
+        wordwise = _now() - t;
+        _report("next clear", bitwise, wordwise);
+
+        dm_bitset_destroy(bs);
+
+        return 0;
+}
@@ -111,13 +111,88 @@ static void test_and(struct dm_pool *mem)
                 assert(!dm_bit(bs3, i));
 }
 
+/* Compare every range operation against the single bit macros */
+static void test_range(struct dm_pool *mem)
+{
+        dm_bitset_t bs1 = dm_bitset_create(mem, NR_BITS);
+        dm_bitset_t bs2 = dm_bitset_create(mem, NR_BITS);
+        int start, count, i;
+
+        for (start = 0; start < NR_BITS; start += 7)
+                for (count = 0; count <= NR_BITS - start + 40; count += 5) {
+                        dm_bit_set_all(bs1);
+                        dm_bit_set_all(bs2);
+                        dm_bit_clear_range(bs1, start, count);
+                        for (i = start; i < NR_BITS && i < start + count; i++)
+                                dm_bit_clear(bs2, i);
+                        assert(dm_bitset_equal(bs1, bs2));
+
+                        dm_bit_clear_all(bs1);
+                        dm_bit_clear_all(bs2);
+                        dm_bit_set_range(bs1, start, count);
+                        for (i = start; i < NR_BITS && i < start + count; i++)
+                                dm_bit_set(bs2, i);
+                        assert(dm_bitset_equal(bs1, bs2));
+                        assert(dm_bit_count(bs1) ==
+                               ((start + count > NR_BITS) ?
+                                NR_BITS - start : count));
+                }
+}
+
+static void test_get_next_clear(struct dm_pool *mem)
+{
+        dm_bitset_t bs = dm_bitset_create(mem, NR_BITS);
+        int i, last;
+
+        dm_bit_set_all(bs);
+        assert(dm_bit_get_first_clear(bs) == -1);
+        assert(dm_bit_count(bs) == NR_BITS);
+
+        for (i = 3; i < NR_BITS; i += 11)
+                dm_bit_clear(bs, i);
+
+        for (i = 3, last = dm_bit_get_first_clear(bs); i < NR_BITS;
+             i += 11, last = dm_bit_get_next_clear(bs, last))
+                assert(last == i);
+
+        assert(last == -1);
+}
+
+static void test_runs(struct dm_pool *mem)
+{
+        dm_bitset_t bs1 = dm_bitset_create(mem, NR_BITS);
+        dm_bitset_t bs2 = dm_bitset_create(mem, NR_BITS);
+        unsigned len, total = 0;
+        int b;
+
+        dm_bit_set_range(bs1, 0, 5);
+        dm_bit_set_range(bs1, 30, 40);
+        dm_bit_set_range(bs1, 100, NR_BITS);
+
+        for (b = dm_bit_get_next_run(bs1, 0, &len); b >= 0;
+             b = dm_bit_get_next_run(bs1, b + len, &len)) {
+                dm_bit_set_range(bs2, b, len);
+                total += len;
+        }
+
+        assert(total == 5 + 40 + NR_BITS - 100);
+        assert(dm_bitset_equal(bs1, bs2));
+
+        dm_bit_xor(bs2, bs1, bs1);
+        assert(!dm_bit_count(bs2));
+        assert(dm_bit_get_next_run(bs2, 0, &len) == -1);
+}
+
 int main(int argc, char **argv)
 {
         typedef void (*test_fn)(struct dm_pool *);
         static test_fn tests[] = {
                 test_get_next,
                 test_equal,
-                test_and
+                test_and,
+                test_range,
+                test_get_next_clear,
+                test_runs
         };
 
         int i;
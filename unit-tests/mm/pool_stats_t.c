@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2011 Red Hat, Inc. All rights reserved.
+ *
+ * This file is part of LVM2.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v.2.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "libdevmapper.h"
+
+#include <assert.h>
+#include <string.h>
+
+/*
+ * Grows a large object a byte at a time and checks that
+ * the contents survive and the statistics follow.
+ */
+static void test_grow_object(void)
+{
+        struct dm_pool_stats stats;
+        struct dm_pool *p = dm_pool_create("grow", 1024);
+        unsigned char c;
+        unsigned char *obj;
+        int i;
+
+        assert(p);
+        dm_pool_stats(p, &stats);
+        assert(!strcmp(stats.name, "grow"));
+        assert(!stats.bytes && !stats.chunks);
+
+        /* leave something in front so the first move copies */
+        assert(dm_pool_alloc(p, 100));
+
+        assert(dm_pool_begin_object(p, 16));
+        for (i = 0; i < 100000; i++) {
+                c = i & 0xff;
+                assert(dm_pool_grow_object(p, &c, 1));
+        }
+        obj = dm_pool_end_object(p);
+
+        for (i = 0; i < 100000; i++)
+                assert(obj[i] == (i & 0xff));
+
+        dm_pool_stats(p, &stats);
+        assert(stats.chunks >= 2);
+        assert(stats.bytes >= 100000);
+        assert(stats.peak_bytes >= stats.bytes);
+
+        dm_pool_destroy(p);
+}
+
+/*
+ * Chunks released by one pool are reused by the next one.
+ */
+static void test_chunk_cache(void)
+{
+        struct dm_pool_stats stats;
+        struct dm_pool *p;
+        void *first, *second;
+
+        dm_pools_set_chunk_cache(1024 * 1024);
+
+        p = dm_pool_create("first", 1024);
+        assert((first = dm_pool_alloc(p, 64)));
+        dm_pool_destroy(p);
+
+        p = dm_pool_create("second", 1024);
+        assert((second = dm_pool_alloc(p, 64)));
+        dm_pool_stats(p, &stats);
+        assert(stats.chunks == 1);
+        assert(first == second);
+
+        dm_pool_empty(p);
+        dm_pool_stats(p, &stats);
+        assert(stats.peak_bytes >= stats.bytes);
+        dm_pool_destroy(p);
+
+        dm_pools_set_chunk_cache(0);
+}
+
+int main(int argc, char **argv)
+{
+        test_grow_object();
+        test_chunk_cache();
+        dm_pools_dump_stats();
+
+        return 0;
+}